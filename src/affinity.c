@@ -0,0 +1,329 @@
+/*
+ * affinity.c - CPU pinning and NUMA-local memory for the chat threads
+ *
+ * The topology comes from sysfs: /sys/devices/system/node/nodeN/cpulist
+ * for the nodes, /sys/class/net/<nic>/device/{numa_node,msi_irqs} and
+ * /proc/irq/N/effective_affinity_list for where a NIC's interrupts land.
+ * Node-local memory is an anonymous mapping with an MPOL_PREFERRED
+ * policy (mbind), so it still works when the node is full.
+ */
+
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <dirent.h>
+    #include <unistd.h>
+#endif
+#ifdef __linux__
+    #include <sched.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+#endif
+
+#define AFF_MPOL_PREFERRED 1            /* <linux/mempolicy.h> */
+
+typedef struct {
+    int set;
+    int spread;                         /* One CPU per thread; else the whole set */
+    int count;
+    int cpus[AFF_MAX_CPUS];
+} role_t;
+
+static const char *const role_env[AFF_ROLES] = {
+    "P2P_PIN_RX", "P2P_PIN_TX", "P2P_PIN_TIMER", "P2P_PIN_POOL", "P2P_PIN_SHARDS"
+};
+static const char *const role_name[AFF_ROLES] = { "rx", "tx", "timer", "pool", "shard" };
+
+static role_t roles[AFF_ROLES];
+static int any_pinned;
+static int init_state;                  /* 0: not yet, 1: loading, 2: done */
+static int node_total;
+#ifdef __linux__
+static cpu_set_t original;              /* The process's affinity before any pinning */
+#endif
+
+/* "0-3,8" into out[]; the number of CPUs, -1 on a syntax error */
+static int parse_list(const char *s, int *out, int max) {
+    int n = 0;
+    while (*s && *s != '\n') {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0) return -1;
+        s = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            if (end == s + 1 || hi < lo) return -1;
+            s = end;
+        }
+        for (long c = lo; c <= hi && c < AFF_MAX_CPUS; c++) {
+            if (n < max) out[n++] = (int)c;
+        }
+        if (*s == ',') s++;
+        else if (*s && *s != '\n') return -1;
+    }
+    return n;
+}
+
+#ifdef __linux__
+static int read_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    int ok = fgets(buf, (int)len, f) != NULL;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+static int read_list(const char *path, int *out, int max) {
+    char buf[4096];
+    if (read_line(path, buf, sizeof(buf)) != 0) return -1;
+    return parse_list(buf, out, max);
+}
+
+static int node_cpus(int node, int *out, int max) {
+    char path[96];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    return read_list(path, out, max);
+}
+
+static int nic_node(const char *nic) {
+    char path[256], buf[32];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", nic);
+    if (read_line(path, buf, sizeof(buf)) != 0) return 0;
+    int node = atoi(buf);
+    return node < 0 ? 0 : node;         /* -1: the platform doesn't say */
+}
+
+/* CPUs the NIC's MSI interrupts are routed to, deduplicated */
+static int nic_irq_cpus(const char *nic, int *out, int max) {
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", nic);
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    static unsigned char seen[AFF_MAX_CPUS];
+    static int cpus[AFF_MAX_CPUS];
+    memset(seen, 0, sizeof(seen));
+    int n = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] < '0' || de->d_name[0] > '9') continue;
+        snprintf(path, sizeof(path), "/proc/irq/%d/effective_affinity_list", atoi(de->d_name));
+        int k = read_list(path, cpus, AFF_MAX_CPUS);
+        if (k <= 0) {
+            snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", atoi(de->d_name));
+            k = read_list(path, cpus, AFF_MAX_CPUS);
+        }
+        for (int i = 0; i < k; i++) {
+            if (seen[cpus[i]] || n == max) continue;
+            seen[cpus[i]] = 1;
+            out[n++] = cpus[i];
+        }
+    }
+    closedir(d);
+    return n;
+}
+#endif
+
+/* Resolve one role's setting; 0 CPUs leaves it unpinned */
+static void load_role(role_t *r, const char *spec, const char *nic) {
+    r->spread = 1;
+    if (strcmp(spec, "nic") == 0 || strcmp(spec, "node") == 0) {
+#ifdef __linux__
+        if (!nic) {
+            fprintf(stderr, "[WARN] '%s' pinning needs P2P_NIC; not pinning.\n", spec);
+            return;
+        }
+        int node = nic_node(nic);
+        if (spec[1] == 'i') r->count = nic_irq_cpus(nic, r->cpus, AFF_MAX_CPUS);
+        if (r->count <= 0) {
+            r->spread = 0;              /* "node", or no IRQ routing to follow */
+            r->count = node_cpus(node, r->cpus, AFF_MAX_CPUS);
+        }
+#else
+        fprintf(stderr, "[WARN] '%s' pinning is Linux-only; not pinning.\n", spec);
+        (void)nic;
+        return;
+#endif
+    } else {
+        r->count = parse_list(spec, r->cpus, AFF_MAX_CPUS);
+        if (r->count < 0) {
+            fprintf(stderr, "[WARN] Bad CPU list '%s'; not pinning.\n", spec);
+            r->count = 0;
+        }
+    }
+    r->set = r->count > 0;
+}
+
+static void load(void) {
+#ifdef __linux__
+    sched_getaffinity(0, sizeof(original), &original);
+    DIR *d = opendir("/sys/devices/system/node");
+    if (d) {
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (strncmp(de->d_name, "node", 4) == 0 && de->d_name[4] >= '0' && de->d_name[4] <= '9') node_total++;
+        }
+        closedir(d);
+    }
+#endif
+    if (node_total < 1) node_total = 1;
+
+    const char *nic = getenv("P2P_NIC");
+    if (nic && !*nic) nic = NULL;
+    for (int i = 0; i < AFF_ROLES; i++) {
+        const char *spec = getenv(role_env[i]);
+        if (!spec || !*spec) spec = nic ? "node" : NULL;
+        if (!spec) continue;
+        load_role(&roles[i], spec, nic);
+#ifdef __linux__
+        /* Offline, or outside our cpuset: pinning there would just fail */
+        int kept = 0;
+        for (int k = 0; k < roles[i].count; k++) {
+            int c = roles[i].cpus[k];
+            if (c < CPU_SETSIZE && CPU_ISSET(c, &original)) roles[i].cpus[kept++] = c;
+            else fprintf(stderr, "[WARN] CPU %d is not available to this process; left out of %s.\n", c, role_env[i]);
+        }
+        roles[i].count = kept;
+        roles[i].set = kept > 0;
+#endif
+        if (!roles[i].set) continue;
+        any_pinned = 1;
+        char list[128];
+        int len = 0;
+        for (int k = 0; k < roles[i].count && len < (int)sizeof(list) - 16; k++)
+            len += snprintf(list + len, sizeof(list) - (size_t)len, k ? ",%d" : "%d", roles[i].cpus[k]);
+        if (len >= (int)sizeof(list) - 16) snprintf(list + len, sizeof(list) - (size_t)len, ",...");
+        printf("[INFO] Pinning %s threads to CPU%s %s (%s).\n", role_name[i], roles[i].count == 1 ? "" : "s",
+               list, roles[i].spread ? "one each" : "shared");
+    }
+}
+
+void aff_init(void) {
+    int expect = 0;
+    if (__atomic_compare_exchange_n(&init_state, &expect, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        load();
+        __atomic_store_n(&init_state, 2, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&init_state, __ATOMIC_ACQUIRE) != 2) {}   /* Someone else is loading */
+}
+
+int aff_pin_cpu(int cpu) {
+    if (cpu < 0) return -1;
+#ifdef __linux__
+    if (cpu >= CPU_SETSIZE) return -1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0 ? 0 : -1;
+#elif defined(_WIN32)
+    if (cpu >= (int)(sizeof(DWORD_PTR) * 8)) return -1;
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+int aff_pin(aff_role_t role, int index) {
+    aff_init();
+    const role_t *r = &roles[role];
+    if (!r->set) {
+#ifdef __linux__
+        /* Threads inherit their creator's mask: undo a pin we didn't ask for */
+        if (any_pinned) sched_setaffinity(0, sizeof(original), &original);
+#endif
+        return -1;
+    }
+    if (index < 0) index = 0;
+    if (r->spread) {
+        int cpu = r->cpus[index % r->count];
+        if (aff_pin_cpu(cpu) == 0) return cpu;
+        fprintf(stderr, "[WARN] Could not pin a %s thread to CPU %d.\n", role_name[role], cpu);
+        return -1;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < r->count; i++) {
+        if (r->cpus[i] < CPU_SETSIZE) CPU_SET(r->cpus[i], &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) == 0) return r->cpus[0];
+    fprintf(stderr, "[WARN] Could not pin a %s thread to its CPU set.\n", role_name[role]);
+    return -1;
+#else
+    return -1;                          /* "node" is Linux-only; never set elsewhere */
+#endif
+}
+
+int aff_cpu_node(int cpu) {
+#ifdef __linux__
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    int node = -1;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, "node", 4) == 0 && de->d_name[4] >= '0' && de->d_name[4] <= '9') {
+            node = atoi(de->d_name + 4);
+            break;
+        }
+    }
+    closedir(d);
+    return node;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+int aff_current_node(void) {
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) return (int)node;
+#endif
+    return -1;
+}
+
+int aff_node_count(void) {
+    aff_init();
+    return node_total;
+}
+
+void *aff_alloc_local(size_t size) {
+#if defined(__linux__) && defined(SYS_mbind)
+    if (aff_node_count() > 1) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return NULL;
+        int node = aff_current_node();
+        if (node >= 0 && node < (int)(sizeof(unsigned long) * 8)) {
+            unsigned long mask = 1UL << node;
+            /* Best effort: without it the first touch decides, usually the same node */
+            syscall(SYS_mbind, p, size, AFF_MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+        }
+        return p;
+    }
+#endif
+    return malloc(size);
+}
+
+void aff_free_local(void *p, size_t size) {
+    if (!p) return;
+#if defined(__linux__) && defined(SYS_mbind)
+    if (aff_node_count() > 1) {
+        munmap(p, size);
+        return;
+    }
+#endif
+    (void)size;
+    free(p);
+}
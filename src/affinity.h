@@ -0,0 +1,62 @@
+/*
+ * affinity.h - CPU pinning and NUMA-local memory for the chat threads
+ *
+ * Each kind of thread has a role, and each role a CPU set taken from the
+ * environment:
+ *   P2P_PIN_RX      receivers (TCP receiver, UDP receive shards)
+ *   P2P_PIN_TX      the sending thread
+ *   P2P_PIN_TIMER   housekeeping: stats, SLO checks, retransmissions
+ *   P2P_PIN_POOL    task pool workers (pool.h)
+ *   P2P_PIN_SHARDS  engine shards (shard.h)
+ * A value is a CPU list ("2", "0-3,8"), "nic" for the CPUs that take the
+ * interrupts of the NIC named by P2P_NIC, or "node" for every CPU on that
+ * NIC's NUMA node. With a list or "nic" the i-th thread of a role gets the
+ * i-th CPU of the set (wrapping); with "node" the threads float within it.
+ * Roles left unset are not pinned; if P2P_NIC is set they default to
+ * "node", so nothing strays to the far socket.
+ *
+ * Linux reads the topology from sysfs and needs no libnuma. Windows pins
+ * to CPU lists only; elsewhere pinning is a no-op.
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stddef.h>
+
+#define AFF_MAX_CPUS 1024
+
+typedef enum {
+    AFF_RX,
+    AFF_TX,
+    AFF_TIMER,
+    AFF_POOL,
+    AFF_SHARD,
+    AFF_ROLES
+} aff_role_t;
+
+/* Read the configuration and print what will be pinned where. Optional:
+ * the first aff_pin does it too, but call it from main before starting
+ * threads so the original affinity is recorded before anything changes. */
+void aff_init(void);
+
+/* Pin the calling thread as the index-th thread of role. Returns the first
+ * CPU it may run on, or -1 if the role isn't pinned (the thread gets the
+ * process's original affinity back, not its creator's) or pinning failed. */
+int aff_pin(aff_role_t role, int index);
+
+/* Pin the calling thread to one CPU; 0 on success */
+int aff_pin_cpu(int cpu);
+
+/* NUMA node of a CPU, of the CPU the caller is running on, and the number
+ * of nodes; -1, -1 and 1 where unknown */
+int aff_cpu_node(int cpu);
+int aff_current_node(void);
+int aff_node_count(void);
+
+/* Memory placed on the caller's node, or plain malloc on single-node
+ * machines. Free with aff_free_local and the same size. */
+void *aff_alloc_local(size_t size);
+void aff_free_local(void *p, size_t size);
+
+#endif /* AFFINITY_H */
@@ -0,0 +1,393 @@
+/*
+ * discovery.c - LAN peer discovery over IPv4 multicast
+ *
+ * Beacon wire format (big-endian, 47 bytes max):
+ *   "P2D1" | type u8 | proto u8 | port u16 | interval u16 (100 ms units)
+ *   | node_id u32 | name_len u8 | name
+ *
+ * Rate control: each announcer stretches its interval so that the whole
+ * table, beaconing together, stays near DISC_MAX_LAN_RATE packets/s. A
+ * LAN of 400 peers therefore beacons every 20 s rather than every 5 s.
+ * Queries are answered after a random delay, and never sooner than one
+ * second after the previous beacon, so a burst of clients cannot turn
+ * into a beacon storm.
+ */
+
+#include "discovery.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #include <windows.h>
+    typedef HANDLE thread_t;
+    typedef HANDLE mutex_t;
+    #define sock_invalid INVALID_SOCKET
+    #define close_socket(s) closesocket(s)
+#else
+    #include <unistd.h>
+    #include <pthread.h>
+    #include <sys/select.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    typedef pthread_t thread_t;
+    typedef pthread_mutex_t mutex_t;
+    #define sock_invalid -1
+    #define close_socket(s) close(s)
+#endif
+
+#define BEACON_MAGIC "P2D1"
+#define BEACON_HDR_LEN 15
+#define BEACON_ANNOUNCE 1
+#define BEACON_QUERY 2
+#define QUERY_REPLY_SPREAD_MS 500
+#define MIN_BEACON_GAP_MS 1000
+
+static sock_t disc_sock = sock_invalid;
+static volatile int disc_running = 0;
+static thread_t disc_thread;
+static mutex_t table_mutex;
+
+static struct sockaddr_in group_addr;
+static char my_name[DISC_NAME_LEN + 1];
+static int my_port = 0;
+static char my_proto = 'T';
+static uint32_t my_node_id = 0;
+static uint32_t rng_state = 0;
+
+static disc_peer_t peers[DISC_MAX_PEERS];
+static uint32_t peer_ids[DISC_MAX_PEERS];
+static int peer_count = 0;
+
+/* ---------- primitives ---------- */
+
+static void lock_table(void) {
+#ifdef _WIN32
+    WaitForSingleObject(table_mutex, INFINITE);
+#else
+    pthread_mutex_lock(&table_mutex);
+#endif
+}
+static void unlock_table(void) {
+#ifdef _WIN32
+    ReleaseMutex(table_mutex);
+#else
+    pthread_mutex_unlock(&table_mutex);
+#endif
+}
+
+/* xorshift32; only used for jitter, not security */
+static uint32_t next_rand(void) {
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rng_state = x;
+}
+
+/* ---------- peer table ---------- */
+
+static void expire_peers(uint64_t now) {
+    lock_table();
+    for (int i = 0; i < peer_count; ) {
+        uint64_t ttl = (uint64_t)peers[i].interval_ms * DISC_EXPIRY_INTERVALS;
+        if (now - peers[i].last_seen_ms > ttl) {
+            peers[i] = peers[peer_count - 1];
+            peer_ids[i] = peer_ids[peer_count - 1];
+            peer_count--;
+        } else {
+            i++;
+        }
+    }
+    unlock_table();
+}
+
+static void table_update(uint32_t node_id, const disc_peer_t *p) {
+    lock_table();
+    int slot = -1, oldest = 0;
+    for (int i = 0; i < peer_count; i++) {
+        if (peer_ids[i] == node_id) { slot = i; break; }
+        if (peers[i].last_seen_ms < peers[oldest].last_seen_ms) oldest = i;
+    }
+    if (slot < 0) {
+        if (peer_count < DISC_MAX_PEERS) {
+            slot = peer_count++;
+        } else {
+            slot = oldest; /* full: evict the peer heard from least recently */
+        }
+        printf("\n[DISCOVERY] Found peer '%s' at %s port %d (%s)\n", p->name, p->addr, p->port,
+               p->proto == 'U' ? "UDP" : "TCP");
+    }
+    peers[slot] = *p;
+    peer_ids[slot] = node_id;
+    unlock_table();
+}
+
+static int live_peer_count(void) {
+    lock_table();
+    int n = peer_count;
+    unlock_table();
+    return n;
+}
+
+/* ---------- beacons ---------- */
+
+static uint32_t current_interval_ms(void) {
+    uint32_t interval = DISC_BASE_INTERVAL_MS;
+    uint32_t scaled = (uint32_t)(live_peer_count() + 1) * 1000u / DISC_MAX_LAN_RATE;
+    if (scaled > interval) interval = scaled;
+    if (interval > 65535u * 100u) interval = 65535u * 100u;
+    return interval;
+}
+
+static void send_beacon(int type, uint32_t interval_ms) {
+    unsigned char pkt[BEACON_HDR_LEN + DISC_NAME_LEN];
+    size_t name_len = (type == BEACON_ANNOUNCE) ? strlen(my_name) : 0;
+    uint16_t port = (uint16_t)my_port;
+    uint16_t iv = (uint16_t)(interval_ms / 100);
+
+    memcpy(pkt, BEACON_MAGIC, 4);
+    pkt[4] = (unsigned char)type;
+    pkt[5] = (unsigned char)my_proto;
+    pkt[6] = (unsigned char)(port >> 8);
+    pkt[7] = (unsigned char)port;
+    pkt[8] = (unsigned char)(iv >> 8);
+    pkt[9] = (unsigned char)iv;
+    pkt[10] = (unsigned char)(my_node_id >> 24);
+    pkt[11] = (unsigned char)(my_node_id >> 16);
+    pkt[12] = (unsigned char)(my_node_id >> 8);
+    pkt[13] = (unsigned char)my_node_id;
+    pkt[14] = (unsigned char)name_len;
+    memcpy(pkt + BEACON_HDR_LEN, my_name, name_len);
+
+    sendto(disc_sock, (const char*)pkt, (int)(BEACON_HDR_LEN + name_len), 0,
+           (struct sockaddr*)&group_addr, sizeof(group_addr));
+}
+
+/* Parse one datagram; returns its type, or 0 if it is not ours/valid */
+static int parse_beacon(const unsigned char *pkt, int n, const struct sockaddr_in *from,
+                        uint32_t *node_id, disc_peer_t *out) {
+    if (n < BEACON_HDR_LEN || memcmp(pkt, BEACON_MAGIC, 4) != 0) return 0;
+    int name_len = pkt[14];
+    if (name_len > DISC_NAME_LEN || BEACON_HDR_LEN + name_len > n) return 0;
+
+    *node_id = ((uint32_t)pkt[10] << 24) | ((uint32_t)pkt[11] << 16) |
+               ((uint32_t)pkt[12] << 8) | (uint32_t)pkt[13];
+    if (*node_id == my_node_id) return 0; /* our own beacon looped back */
+
+    if (pkt[4] == BEACON_ANNOUNCE) {
+        memset(out, 0, sizeof(*out));
+        memcpy(out->name, pkt + BEACON_HDR_LEN, (size_t)name_len);
+        out->name[name_len] = '\0';
+        out->proto = (char)pkt[5];
+        out->port = (pkt[6] << 8) | pkt[7];
+        out->interval_ms = (uint32_t)((pkt[8] << 8) | pkt[9]) * 100u;
+        if (out->interval_ms < DISC_BASE_INTERVAL_MS) out->interval_ms = DISC_BASE_INTERVAL_MS;
+        out->last_seen_ms = get_time_ms();
+        inet_ntop(AF_INET, &from->sin_addr, out->addr, sizeof(out->addr));
+        if (out->port <= 0 || out->name[0] == '\0') return 0;
+    }
+    return pkt[4];
+}
+
+/* ---------- discovery thread ---------- */
+
+#ifdef _WIN32
+static DWORD WINAPI discovery_fn(LPVOID arg)
+#else
+static void *discovery_fn(void *arg)
+#endif
+{
+    (void)arg;
+    uint64_t now = get_time_ms();
+    uint64_t last_beacon = 0;
+    uint64_t next_beacon = now + next_rand() % QUERY_REPLY_SPREAD_MS;
+    uint64_t next_expiry = now + DISC_BASE_INTERVAL_MS;
+
+    while (disc_running) {
+        now = get_time_ms();
+        uint64_t until = next_expiry;
+        if (my_port > 0 && next_beacon < until) until = next_beacon;
+        int wait_ms = until > now ? (int)(until - now) : 0;
+        if (wait_ms > 500) wait_ms = 500; /* bound shutdown latency */
+
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(disc_sock, &rfds);
+        struct timeval tv = { wait_ms / 1000, (wait_ms % 1000) * 1000 };
+        int r = select((int)disc_sock + 1, &rfds, NULL, NULL, &tv);
+        now = get_time_ms();
+
+        if (r > 0) {
+            unsigned char pkt[256];
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int n = recvfrom(disc_sock, (char*)pkt, sizeof(pkt), 0, (struct sockaddr*)&from, &from_len);
+            uint32_t node_id;
+            disc_peer_t p;
+            int type = (n > 0) ? parse_beacon(pkt, n, &from, &node_id, &p) : 0;
+            if (type == BEACON_ANNOUNCE) {
+                table_update(node_id, &p);
+            } else if (type == BEACON_QUERY && my_port > 0) {
+                uint64_t reply_at = now + next_rand() % QUERY_REPLY_SPREAD_MS;
+                if (reply_at < last_beacon + MIN_BEACON_GAP_MS) reply_at = last_beacon + MIN_BEACON_GAP_MS;
+                if (reply_at < next_beacon) next_beacon = reply_at;
+            }
+        }
+
+        if (my_port > 0 && now >= next_beacon) {
+            uint32_t interval = current_interval_ms();
+            send_beacon(BEACON_ANNOUNCE, interval);
+            last_beacon = now;
+            /* +/-20% jitter keeps announcers from synchronizing */
+            next_beacon = now + interval * 4 / 5 + next_rand() % (interval * 2 / 5 + 1);
+        }
+        if (now >= next_expiry) {
+            expire_peers(now);
+            next_expiry = now + DISC_BASE_INTERVAL_MS;
+        }
+    }
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+/* ---------- public API ---------- */
+
+int discovery_start(const char *name, int port, char proto) {
+    if (disc_running) return 0;
+
+    snprintf(my_name, sizeof(my_name), "%s", name ? name : "");
+    my_port = port;
+    my_proto = proto;
+    rng_state = (uint32_t)get_time_ms() ^ (uint32_t)(uintptr_t)&rng_state;
+    if (rng_state == 0) rng_state = 0x9e3779b9u;
+    for (int i = 0; i < 8; i++) next_rand();
+    my_node_id = next_rand();
+
+    disc_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (disc_sock == sock_invalid) {
+        perror("[ERROR] discovery socket");
+        return -1;
+    }
+
+    /* Several chat processes on one host may all listen on DISC_PORT */
+    int opt = 1;
+    setsockopt(disc_sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+    setsockopt(disc_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+#endif
+
+    struct sockaddr_in any;
+    memset(&any, 0, sizeof(any));
+    any.sin_family = AF_INET;
+    any.sin_addr.s_addr = htonl(INADDR_ANY);
+    any.sin_port = htons(DISC_PORT);
+    if (bind(disc_sock, (struct sockaddr*)&any, sizeof(any)) != 0) {
+        perror("[ERROR] discovery bind");
+        close_socket(disc_sock);
+        disc_sock = sock_invalid;
+        return -1;
+    }
+
+    struct in_addr ifaddr;
+    ifaddr.s_addr = htonl(INADDR_ANY);
+    const char *ifaddr_s = getenv("P2P_DISCOVERY_IFADDR");
+    if (ifaddr_s && *ifaddr_s && inet_pton(AF_INET, ifaddr_s, &ifaddr) != 1) {
+        fprintf(stderr, "[WARN] Ignoring invalid P2P_DISCOVERY_IFADDR='%s'\n", ifaddr_s);
+        ifaddr.s_addr = htonl(INADDR_ANY);
+    }
+
+    struct ip_mreq mreq;
+    inet_pton(AF_INET, DISC_GROUP, &mreq.imr_multiaddr);
+    mreq.imr_interface = ifaddr;
+    if (setsockopt(disc_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq, sizeof(mreq)) != 0) {
+        perror("[ERROR] discovery IP_ADD_MEMBERSHIP");
+        close_socket(disc_sock);
+        disc_sock = sock_invalid;
+        return -1;
+    }
+    if (ifaddr.s_addr != htonl(INADDR_ANY))
+        setsockopt(disc_sock, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&ifaddr, sizeof(ifaddr));
+
+    unsigned char ttl = 1, loop = 1; /* link-local; loop so same-host peers see us */
+    setsockopt(disc_sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
+    setsockopt(disc_sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop));
+
+    memset(&group_addr, 0, sizeof(group_addr));
+    group_addr.sin_family = AF_INET;
+    group_addr.sin_port = htons(DISC_PORT);
+    inet_pton(AF_INET, DISC_GROUP, &group_addr.sin_addr);
+
+#ifdef _WIN32
+    table_mutex = CreateMutex(NULL, FALSE, NULL);
+    disc_running = 1;
+    disc_thread = CreateThread(NULL, 0, discovery_fn, NULL, 0, NULL);
+#else
+    pthread_mutex_init(&table_mutex, NULL);
+    disc_running = 1;
+    pthread_create(&disc_thread, NULL, discovery_fn, NULL);
+#endif
+    return 0;
+}
+
+void discovery_query(void) {
+    if (disc_running) send_beacon(BEACON_QUERY, 0);
+}
+
+void discovery_stop(void) {
+    if (!disc_running) return;
+    disc_running = 0;
+#ifdef _WIN32
+    WaitForSingleObject(disc_thread, INFINITE);
+    CloseHandle(disc_thread);
+    CloseHandle(table_mutex);
+#else
+    pthread_join(disc_thread, NULL);
+    pthread_mutex_destroy(&table_mutex);
+#endif
+    close_socket(disc_sock);
+    disc_sock = sock_invalid;
+    peer_count = 0;
+}
+
+int discovery_list(disc_peer_t *out, int cap) {
+    if (!disc_running) return 0;
+    expire_peers(get_time_ms());
+    lock_table();
+    int n = peer_count < cap ? peer_count : cap;
+    memcpy(out, peers, (size_t)n * sizeof(*out));
+    unlock_table();
+
+    /* Most recently seen first */
+    for (int i = 1; i < n; i++) {
+        disc_peer_t tmp = out[i];
+        int j = i - 1;
+        while (j >= 0 && out[j].last_seen_ms < tmp.last_seen_ms) {
+            out[j + 1] = out[j];
+            j--;
+        }
+        out[j + 1] = tmp;
+    }
+    return n;
+}
+
+int discovery_lookup(const char *name, disc_peer_t *out) {
+    if (!disc_running || !name) return 0;
+    int found = 0;
+    lock_table();
+    for (int i = 0; i < peer_count; i++) {
+        if (strcmp(peers[i].name, name) == 0 &&
+            (!found || peers[i].last_seen_ms > out->last_seen_ms)) {
+            *out = peers[i];
+            found = 1;
+        }
+    }
+    unlock_table();
+    return found;
+}
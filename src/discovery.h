@@ -0,0 +1,53 @@
+/*
+ * discovery.h - LAN peer discovery over IPv4 multicast
+ *
+ * Peers that accept connections announce themselves with small periodic
+ * beacons on an administratively scoped multicast group (TTL 1, so they
+ * never leave the link). Every participant keeps a bounded table of the
+ * peers it has heard, so a client can connect to a peer by name.
+ */
+
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <stdint.h>
+#include "net.h"
+
+#define DISC_GROUP "239.255.42.99"
+#define DISC_PORT 45454
+#define DISC_NAME_LEN 32              /* Max peer name, without terminator */
+#define DISC_MAX_PEERS 256            /* Peer table capacity (oldest evicted) */
+#define DISC_BASE_INTERVAL_MS 5000    /* Beacon interval on a quiet LAN */
+#define DISC_MAX_LAN_RATE 20          /* Target beacons/s across the whole LAN */
+#define DISC_EXPIRY_INTERVALS 3       /* Missed beacons before a peer expires */
+#define DISC_QUERY_WAIT_MS 600        /* How long a client listens after a query */
+
+/* A peer heard on the LAN */
+typedef struct {
+    char name[DISC_NAME_LEN + 1];
+    char addr[NET_ADDRSTRLEN];        /* Numeric source address of its beacons */
+    int port;                         /* Advertised chat port */
+    char proto;                       /* 'T' for TCP chat, 'U' for UDP chat */
+    uint64_t last_seen_ms;
+    uint32_t interval_ms;             /* Beacon interval it advertised */
+} disc_peer_t;
+
+/* Start discovery. With port > 0 this node announces itself as name/proto;
+ * with port == 0 it only listens (and may send queries). The interface can
+ * be pinned with P2P_DISCOVERY_IFADDR (e.g. 127.0.0.1 for loopback tests).
+ * Returns 0 on success, -1 on error. */
+int discovery_start(const char *name, int port, char proto);
+
+/* Ask announcing peers to beacon now instead of at their next interval */
+void discovery_query(void);
+
+/* Stop the discovery thread and close its socket */
+void discovery_stop(void);
+
+/* Copy live peers into out (most recently seen first); returns count */
+int discovery_list(disc_peer_t *out, int cap);
+
+/* Find a live peer by exact name; returns 1 if found */
+int discovery_lookup(const char *name, disc_peer_t *out);
+
+#endif /* DISCOVERY_H */
@@ -1,4 +1,6 @@
 #include "encryption.h"
+#include "probes.h"
+#include "hwcount.h"
 #include <string.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
@@ -23,9 +25,9 @@ void derive_key_from_password(const char *password, unsigned char key[ENC_KEY_LE
     SHA256((const unsigned char *)password, strlen(password), key);
 }
 
-int encrypt_message(const unsigned char *plaintext, int plaintext_len,
-                    const unsigned char key[ENC_KEY_LEN],
-                    unsigned char *out, int out_cap) {
+static int encrypt_impl(const unsigned char *plaintext, int plaintext_len,
+                        const unsigned char key[ENC_KEY_LEN],
+                        unsigned char *out, int out_cap) {
     if (!plaintext || !out || plaintext_len < 0) return -1;
 
     int need = ENC_IV_LEN + plaintext_len + ENC_IV_LEN;
@@ -63,9 +65,9 @@ int encrypt_message(const unsigned char *plaintext, int plaintext_len,
     return ENC_IV_LEN + cipher_len;
 }
 
-int decrypt_message(const unsigned char *in, int in_len,
-                    const unsigned char key[ENC_KEY_LEN],
-                    unsigned char *plaintext, int plaintext_cap) {
+static int decrypt_impl(const unsigned char *in, int in_len,
+                        const unsigned char key[ENC_KEY_LEN],
+                        unsigned char *plaintext, int plaintext_cap) {
     if (!in || in_len < ENC_IV_LEN || !plaintext) return -1;
 
     const unsigned char *iv = in;
@@ -99,3 +101,30 @@ int decrypt_message(const unsigned char *in, int in_len,
     EVP_CIPHER_CTX_free(ctx);
     return pt_len;
 }
+
+/* Public entry points: the impls have several early returns, so the
+ * start/done probe pair and the stage counters live here where every
+ * path goes through */
+int encrypt_message(const unsigned char *plaintext, int plaintext_len,
+                    const unsigned char key[ENC_KEY_LEN],
+                    unsigned char *out, int out_cap) {
+    hw_mark_t hw;
+    P2P_PROBE1(encrypt__start, plaintext_len);
+    hw_begin(&hw);
+    int rc = encrypt_impl(plaintext, plaintext_len, key, out, out_cap);
+    hw_end(&hw, HW_STAGE_ENCRYPT);
+    P2P_PROBE2(encrypt__done, plaintext_len, rc);
+    return rc;
+}
+
+int decrypt_message(const unsigned char *in, int in_len,
+                    const unsigned char key[ENC_KEY_LEN],
+                    unsigned char *plaintext, int plaintext_cap) {
+    hw_mark_t hw;
+    P2P_PROBE1(decrypt__start, in_len);
+    hw_begin(&hw);
+    int rc = decrypt_impl(in, in_len, key, plaintext, plaintext_cap);
+    hw_end(&hw, HW_STAGE_DECRYPT);
+    P2P_PROBE2(decrypt__done, in_len, rc);
+    return rc;
+}
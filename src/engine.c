@@ -0,0 +1,1610 @@
+/*
+ * engine.c - Embeddable chat engine (libp2pchat)
+ *
+ * Each session keeps a receive buffer that frames are cut out of and a
+ * transmit buffer that encrypted frames are appended to and flushed from
+ * when the socket is writable. An outgoing file is mapped and encrypted a
+ * batch at a time, straight from the mapping and on the task pool, into
+ * one of a few batch buffers that are sent in turn; one sent with
+ * MSG_ZEROCOPY stays pinned until the kernel reports it complete, and the
+ * next batch is built in another meanwhile. Chat and ACKs queued during
+ * the transfer are held back until the file is done, since the receiver
+ * treats every frame after a FILE header as file data until the announced
+ * size has arrived. Incoming file frames are decrypted a few at a time on
+ * the pool and written in order.
+ *
+ * Readiness comes from a reactor (reactor.h). A session watches for
+ * writability only while it has something queued; sessions that queued
+ * frames or started closing outside their own socket callback go on a
+ * dirty list that each poll flushes and reaps before returning.
+ *
+ * Rate limits pay after the fact: a session reads or sends, charges its
+ * buckets, and if one went negative it is paused (that interest dropped)
+ * and a timer resumes it once the debt is repaid.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "engine.h"
+#include "encryption.h"
+#include "session.h"
+#include "net.h"
+#include "reactor.h"
+#include "pool.h"
+#include "affinity.h"
+#include "probes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #include <windows.h>
+    #define sock_invalid INVALID_SOCKET
+    #define close_socket(s) closesocket(s)
+    #define would_block() (WSAGetLastError() == WSAEWOULDBLOCK)
+    #define SEND_FLAGS 0
+#else
+    #include <errno.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/time.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #define sock_invalid -1
+    #define close_socket(s) close(s)
+    #define would_block() (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+    #define SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+#define ENGINE_RX_INIT 8192
+#define ENGINE_SCRATCH (FRAME_MAX_LEN + ENC_IV_LEN)
+#define ENGINE_SPARE_SESSIONS 64        /* Closed sessions kept, buffers and all, for reuse */
+#define ENGINE_EXPIRE_MS (P2P_ENGINE_ACK_TIMEOUT_MS / 10)
+#define ENGINE_BURST_MS 50              /* Bucket depth: this long at the rate */
+#define ENGINE_MIN_BURST 1500.0         /* ... but at least a packet's worth of bytes */
+#define ENGINE_MAX_WEIGHT 64
+#define ENGINE_CHUNK_MIN 4032           /* File plaintext per frame on slow paths */
+#define ENGINE_CHUNK_MAX 65536          /* ...and on fast ones; picked from the path estimate */
+#define ENGINE_CHUNK_FRAME (ENGINE_CHUNK_MAX + 2 * ENC_IV_LEN)   /* Largest encrypted chunk */
+#define ENGINE_BATCH (256 * 1024)       /* File frames encrypted and sent together */
+#define ENGINE_BATCH_POOL 4             /* Batch buffers rotated while zerocopy sends are in flight */
+#define ENGINE_PAR_JOBS (ENGINE_BATCH / ENGINE_CHUNK_MIN)   /* Most chunks one batch can hold */
+#define ENGINE_RECV_AHEAD 16            /* Incoming file frames decrypted together */
+#define ENGINE_SNDBUF_MAX (16 * 1024 * 1024)
+#define ENGINE_ZC_MIN 16384             /* Below this, copying beats page pinning plus a completion */
+#define ENGINE_ZC_WAIT_MS 5000          /* Closing: give up on a batch whose completion never comes */
+#define ENGINE_LISTEN_BACKLOG 1024
+#define ENGINE_DEFER_ACCEPT_S 5
+#define ENGINE_TFO_QUEUE 256
+
+/* ST_EARLY: client that sent RESUME and may send 0-RTT data */
+enum { ST_HANDSHAKE, ST_EARLY, ST_READY, ST_CLOSING };
+
+/* What a pause holds back; bit (1 << n) in p2p_session.paused */
+enum { PAUSE_RX, PAUSE_TX, PAUSE_FILE, PAUSES };
+
+typedef struct {
+    unsigned char *data;
+    size_t off;                         /* Already sent / consumed */
+    size_t len;
+    size_t cap;
+} buf_t;
+
+typedef struct {
+    uint32_t seq;
+    uint64_t sent_us;
+} pending_t;
+
+/* Read-only view of a whole file. len 0 (empty file) has data NULL. */
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+} file_map_t;
+
+typedef struct {
+    unsigned char *buf;                 /* ENGINE_BATCH bytes, allocated on first use */
+    size_t off;                         /* Already sent */
+    size_t len;                         /* 0: nothing to send */
+    int zc;                             /* Goes out with MSG_ZEROCOPY */
+    int pinned;                         /* The kernel holds buf until zc_id completes */
+    uint32_t zc_id;
+} batch_t;
+
+typedef struct {
+    const unsigned char *in;
+    int in_len;
+    unsigned char *out;
+    int out_cap;
+    const unsigned char *key;
+    int out_len;                        /* Result; -1 on error */
+} chunk_job_t;
+
+struct p2p_session {
+    p2p_engine_t *eng;
+    sock_t sock;
+    int handle;                         /* Reactor registration, -1 if none */
+    int watch;                          /* Current reactor interest */
+    int index;                          /* In eng->sessions */
+    int dirty;                          /* On eng->dirty */
+    int is_server;
+    int state;
+    int error;                          /* Reported by on_close */
+    int rx_eof;                         /* The peer's FIN is in: close once rx is parsed */
+    char peer[NET_ADDRSTRLEN];
+    unsigned char cnonce[SESSION_NONCE_LEN];
+    unsigned char key[ENC_KEY_LEN];     /* Everything we send; what we receive unless early_rx */
+    unsigned char early[ENC_KEY_LEN];   /* Server: the client's early data key */
+    unsigned char resume[ENC_KEY_LEN];  /* Client: key of the ticket being resumed */
+    int early_rx;                       /* Server: frames are early data until EARLY_END */
+    int early_left;                     /* Client: 0-RTT bytes p2p_send may still queue */
+    size_t early_cut;                   /* Client: tx bytes from tx.off to a frame boundary */
+    int resumed;
+    buf_t rx;
+    buf_t tx;
+    buf_t held;                         /* Chat queued behind an outgoing file */
+    uint32_t next_seq;
+    pending_t pending[P2P_ENGINE_MAX_PENDING];
+    int pending_count;
+    double rtt_total_ms;
+    p2p_stats_t stats;
+
+    token_bucket_t out_rate;            /* Wire bytes, per peer */
+    token_bucket_t in_rate;
+    token_bucket_t file_out;            /* File stream, within the above */
+    token_bucket_t file_in;
+    token_bucket_t chat_in;             /* Chat messages from the peer */
+    int paused;                         /* PAUSE_* bits */
+    uint64_t pause_until_us[PAUSES];
+    uint64_t resume_timer;
+    int weight;
+    size_t deficit;                     /* DRR credit left this round */
+    uint64_t round;                     /* When the credit was last topped up */
+
+    int out_active;                     /* Outgoing transfer */
+    int out_mapped;
+    file_map_t out_map;
+    FILE *out_fp;                       /* When the file can't be mapped */
+    uint64_t out_off;                   /* Next byte to encrypt */
+    uint64_t out_size;
+    char out_name[256];
+    batch_t batch[ENGINE_BATCH_POOL];
+    int batch_cur;                      /* Slot being sent, or filled next */
+    net_zc_t zc;
+    int zc_on;                          /* SO_ZEROCOPY accepted */
+    path_est_t path;
+    size_t chunk;                       /* Plaintext bytes per file frame */
+    uint64_t mark_delivered;            /* Start of the current delivery-rate sample */
+    uint64_t mark_ms;
+    FILE *in_file;                      /* Incoming transfer */
+    uint64_t in_left;
+    uint64_t in_size;
+    char in_name[256];
+    char in_path[512];
+
+    void *user;
+    p2p_session_t *next_spare;
+};
+
+struct p2p_engine {
+    p2p_callbacks_t cb;
+    void *user;
+    unsigned char psk[ENC_KEY_LEN];
+    char download_dir[256];
+    int accept_files;
+    sock_t listener;
+    int listen_handle;
+    p2p_session_t **sessions;
+    int count;
+    int cap;
+    p2p_session_t **dirty;              /* To flush or reap at the end of the poll */
+    int dirty_count;
+    int dirty_cap;
+    int rescan;                         /* dirty couldn't grow: check every session */
+    reactor_t *reactor;
+    uint64_t round;                     /* p2p_engine_poll calls so far */
+    double out_bps, in_bps, file_bps;   /* Session defaults, bytes/s; 0: none */
+    double chat_rate;                   /* Messages/s */
+    int tickets;
+    int zerocopy;
+    size_t zc_min;
+    int use_mmap;
+    unsigned char *scratch;             /* Decrypt / encrypt target; one poll at a time */
+    unsigned char *ahead;               /* ENGINE_RECV_AHEAD decrypted file chunks, on first use */
+    chunk_job_t jobs[ENGINE_PAR_JOBS];
+
+    p2p_session_t *spare;               /* Free list, at most ENGINE_SPARE_SESSIONS */
+    int spare_count;
+    p2p_stats_t done;                   /* Totals of closed sessions */
+    double done_rtt_ms;
+
+    p2p_hooks_t hooks;
+    void *hooks_ctx;
+};
+
+static uint64_t now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+/* ---------- buffers ---------- */
+
+static int buf_reserve(buf_t *b, size_t extra) {
+    if (b->off > 0 && b->off == b->len) b->off = b->len = 0;
+    if (b->len + extra <= b->cap) return 0;
+    /* Reclaim consumed space before growing */
+    if (b->off > 0) {
+        memmove(b->data, b->data + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
+        if (b->len + extra <= b->cap) return 0;
+    }
+    size_t cap = b->cap ? b->cap : ENGINE_RX_INIT;
+    while (cap < b->len + extra) cap *= 2;
+    unsigned char *p = (unsigned char*)realloc(b->data, cap);
+    if (!p) return -1;
+    b->data = p;
+    b->cap = cap;
+    return 0;
+}
+
+static size_t buf_pending(const buf_t *b) {
+    return b->len - b->off;
+}
+
+static void buf_free(buf_t *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+/* Write the 4-byte big-endian frame length at p */
+static void put_frame_header(unsigned char *p, int len) {
+    p[0] = (unsigned char)(len >> 24);
+    p[1] = (unsigned char)(len >> 16);
+    p[2] = (unsigned char)(len >> 8);
+    p[3] = (unsigned char)len;
+}
+
+static uint32_t get_frame_header(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Wire size of a len-byte plaintext: CBC pads to the next whole block */
+static size_t frame_size(size_t len) {
+    return FRAME_HDR_LEN + ENC_IV_LEN + (len / ENC_IV_LEN + 1) * ENC_IV_LEN;
+}
+
+/* Encrypt plaintext under key and append it to b as one frame */
+static int append_frame(buf_t *b, const unsigned char *plain, int len, const unsigned char *key) {
+    int cap = len + 2 * ENC_IV_LEN;
+    if (buf_reserve(b, (size_t)(FRAME_HDR_LEN + cap)) != 0) return -1;
+    unsigned char *hdr = b->data + b->len;
+    int enc_len = encrypt_message(plain, len, key, hdr + FRAME_HDR_LEN, cap);
+    if (enc_len < 0 || enc_len > FRAME_MAX_LEN) return -1;
+    put_frame_header(hdr, enc_len);
+    b->len += (size_t)(FRAME_HDR_LEN + enc_len);
+    return 0;
+}
+
+static int append_text(buf_t *b, const char *text, const unsigned char *key) {
+    return append_frame(b, (const unsigned char*)text, (int)strlen(text), key);
+}
+
+/* ---------- files ---------- */
+
+/* Map path for sequential reading; returns 0 on success */
+static int file_map(const char *path, file_map_t *m) {
+    memset(m, 0, sizeof(*m));
+#ifdef _WIN32
+    m->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                          FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m->file == INVALID_HANDLE_VALUE) return -1;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m->file, &size)) {
+        CloseHandle(m->file);
+        return -1;
+    }
+    m->len = (size_t)size.QuadPart;
+    if (m->len == 0) return 0;
+    m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m->mapping) m->data = (const unsigned char*)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m->data) {
+        if (m->mapping) CloseHandle(m->mapping);
+        CloseHandle(m->file);
+        return -1;
+    }
+    return 0;
+#else
+    m->fd = open(path, O_RDONLY);
+    if (m->fd < 0) return -1;
+    struct stat st;
+    if (fstat(m->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(m->fd);
+        return -1;
+    }
+    m->len = (size_t)st.st_size;
+    if (m->len == 0) return 0;
+    void *p = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, m->fd, 0);
+    if (p == MAP_FAILED) {
+        close(m->fd);
+        return -1;
+    }
+    /* Aggressive readahead, and large pages where the filesystem offers them */
+    madvise(p, m->len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(p, m->len, MADV_HUGEPAGE);
+#endif
+    m->data = (const unsigned char*)p;
+    return 0;
+#endif
+}
+
+static void file_unmap(file_map_t *m) {
+#ifdef _WIN32
+    if (m->data) UnmapViewOfFile(m->data);
+    if (m->mapping) CloseHandle(m->mapping);
+    CloseHandle(m->file);
+#else
+    if (m->data) munmap((void*)m->data, m->len);
+    close(m->fd);
+#endif
+    memset(m, 0, sizeof(*m));
+}
+
+/* Encrypt one chunk to its place in a batch; fills in the frame header in
+ * front of out, too */
+static void encrypt_chunk_task(void *arg) {
+    chunk_job_t *j = (chunk_job_t*)arg;
+    j->out_len = encrypt_message(j->in, j->in_len, j->key, j->out, j->out_cap);
+    if (j->out_len == (int)(frame_size((size_t)j->in_len) - FRAME_HDR_LEN))
+        put_frame_header(j->out - FRAME_HDR_LEN, j->out_len);
+    else
+        j->out_len = -1;                /* Would not fit the place laid out for it */
+}
+
+static void decrypt_chunk_task(void *arg) {
+    chunk_job_t *j = (chunk_job_t*)arg;
+    j->out_len = decrypt_message(j->in, j->in_len, j->key, j->out, j->out_cap);
+}
+
+/* Run jobs[0..n) on the shared pool, or inline when there is only one */
+static void run_jobs(chunk_job_t *jobs, int n, void (*fn)(void*)) {
+    pool_t *pool = n > 1 ? pool_shared() : NULL;
+    pool_group_t group = {0};
+    for (int i = 0; i < n; i++) {
+        if (pool) pool_submit(pool, &group, fn, &jobs[i]);
+        else fn(&jobs[i]);
+    }
+    if (pool) pool_wait(pool, &group);
+}
+
+/* ---------- sessions ---------- */
+
+/* Have the end of this poll flush s, or reap it */
+static void touch(p2p_session_t *s) {
+    p2p_engine_t *e = s->eng;
+    if (s->dirty) return;
+    if (e->dirty_count == e->dirty_cap) {
+        int cap = e->dirty_cap ? e->dirty_cap * 2 : 16;
+        p2p_session_t **list = (p2p_session_t**)realloc(e->dirty, (size_t)cap * sizeof(*list));
+        if (!list) {
+            e->rescan = 1;
+            return;
+        }
+        e->dirty = list;
+        e->dirty_cap = cap;
+    }
+    s->dirty = 1;
+    e->dirty[e->dirty_count++] = s;
+}
+
+static void fail(p2p_session_t *s, int error) {
+    if (s->state == ST_CLOSING) return;
+    s->state = ST_CLOSING;
+    s->error = error;
+    touch(s);
+}
+
+static void on_session_io(reactor_t *r, sock_t sock, int events, void *arg);
+static void session_free(p2p_session_t *s);
+static void parse_frames(p2p_session_t *s);
+
+/* ---------- rate limits ---------- */
+
+/* ENGINE_BURST_MS at the rate, but never less than min */
+static double bucket_depth(double rate, double min) {
+    double burst = rate * ENGINE_BURST_MS / 1000.0;
+    return burst > min ? burst : min;
+}
+
+static void on_resume(reactor_t *r, void *arg);
+
+/* One timer per session, due when the earliest pause ends */
+static void arm_resume(p2p_session_t *s) {
+    reactor_t *r = s->eng->reactor;
+    uint64_t due = 0;
+    for (int i = 0; i < PAUSES; i++) {
+        if ((s->paused & (1 << i)) && (due == 0 || s->pause_until_us[i] < due)) due = s->pause_until_us[i];
+    }
+    reactor_cancel(r, s->resume_timer);
+    s->resume_timer = 0;
+    if (!s->paused) return;
+    uint64_t now = now_us();
+    s->resume_timer = reactor_timer(r, due > now ? (int)((due - now + 999) / 1000) : 0, 0, on_resume, s);
+    if (!s->resume_timer) s->paused = 0;    /* Better over the limit than stuck */
+}
+
+/* A bucket is wait_us in debt: hold back what it pays for until then */
+static void pause_for(p2p_session_t *s, int what, uint64_t wait_us) {
+    if (wait_us == 0) return;
+    uint64_t until = now_us() + wait_us;
+    if (!(s->paused & (1 << what)) || until > s->pause_until_us[what]) s->pause_until_us[what] = until;
+    s->paused |= 1 << what;
+    s->stats.throttled++;
+    arm_resume(s);
+}
+
+static void on_resume(reactor_t *r, void *arg) {
+    p2p_session_t *s = (p2p_session_t*)arg;
+    uint64_t now = now_us();
+    (void)r;
+    s->resume_timer = 0;
+    for (int i = 0; i < PAUSES; i++) {
+        if (now >= s->pause_until_us[i]) s->paused &= ~(1 << i);
+    }
+    if (s->state == ST_CLOSING) return;
+    if (!(s->paused & (1 << PAUSE_RX))) parse_frames(s);   /* Frames left when a stream ran dry */
+    arm_resume(s);
+    touch(s);                           /* The end of the poll writes and re-watches */
+}
+
+static p2p_session_t *session_add(p2p_engine_t *e, sock_t sock, int is_server) {
+    if (e->count == e->cap) {
+        int cap = e->cap ? e->cap * 2 : 16;
+        p2p_session_t **list = (p2p_session_t**)realloc(e->sessions, (size_t)cap * sizeof(*list));
+        if (!list) return NULL;
+        e->sessions = list;
+        e->cap = cap;
+    }
+    p2p_session_t *s = e->spare;
+    if (s) {
+        /* Recycled: keep the buffers' memory, drop everything else */
+        buf_t rx = s->rx, tx = s->tx, held = s->held;
+        e->spare = s->next_spare;
+        e->spare_count--;
+        memset(s, 0, sizeof(*s));
+        s->rx = rx;
+        s->tx = tx;
+        s->held = held;
+        s->rx.off = s->rx.len = s->tx.off = s->tx.len = s->held.off = s->held.len = 0;
+    } else {
+        s = (p2p_session_t*)calloc(1, sizeof(*s));
+        if (!s) return NULL;
+    }
+    s->eng = e;
+    s->sock = sock;
+    s->is_server = is_server;
+    s->state = ST_HANDSHAKE;
+    s->next_seq = 1;
+    s->weight = 1;
+    s->deficit = P2P_ENGINE_QUANTUM;    /* The handshake needn't wait a round */
+    s->round = e->round;
+    tb_init(&s->out_rate, e->out_bps, bucket_depth(e->out_bps, ENGINE_MIN_BURST));
+    tb_init(&s->in_rate, e->in_bps, bucket_depth(e->in_bps, ENGINE_MIN_BURST));
+    tb_init(&s->file_out, e->file_bps, bucket_depth(e->file_bps, ENGINE_MIN_BURST));
+    tb_init(&s->file_in, e->file_bps, bucket_depth(e->file_bps, ENGINE_MIN_BURST));
+    /* Chat bursts up to a second's worth of messages, not ENGINE_BURST_MS */
+    tb_init(&s->chat_in, e->chat_rate, e->chat_rate > 1.0 ? e->chat_rate : 1.0);
+    path_init(&s->path);
+    s->chunk = ENGINE_CHUNK_MIN;
+
+    struct sockaddr_storage sa;
+    socklen_t sa_len = sizeof(sa);
+    if (getpeername(sock, (struct sockaddr*)&sa, &sa_len) == 0)
+        net_format_addr((struct sockaddr*)&sa, s->peer, sizeof(s->peer));
+    else
+        snprintf(s->peer, sizeof(s->peer), "unknown");
+
+    net_set_nonblocking(sock, 1);
+    if (e->zerocopy) s->zc_on = net_zc_init(&s->zc, sock) == 0;
+    s->watch = REACTOR_READ;
+    s->handle = reactor_add(e->reactor, sock, s->watch, on_session_io, s);
+    if (s->handle < 0) {
+        s->sock = sock_invalid;         /* The caller closes it */
+        session_free(s);
+        return NULL;
+    }
+    s->index = e->count;
+    e->sessions[e->count++] = s;
+    return s;
+}
+
+static void stats_add(p2p_stats_t *t, const p2p_stats_t *a) {
+    t->sent += a->sent;
+    t->received += a->received;
+    t->acked += a->acked;
+    t->expired += a->expired;
+    t->bytes_out += a->bytes_out;
+    t->bytes_in += a->bytes_in;
+    t->file_bytes_out += a->file_bytes_out;
+    t->file_bytes_in += a->file_bytes_in;
+    t->throttled += a->throttled;
+    t->file_batches += a->file_batches;
+    t->zerocopy_batches += a->zerocopy_batches;
+    if (a->rtt_min_ms > 0.0 && (t->rtt_min_ms == 0.0 || a->rtt_min_ms < t->rtt_min_ms)) t->rtt_min_ms = a->rtt_min_ms;
+    if (a->rtt_max_ms > t->rtt_max_ms) t->rtt_max_ms = a->rtt_max_ms;
+}
+
+static void close_transfer(p2p_session_t *s) {
+    if (s->out_mapped) file_unmap(&s->out_map);
+    if (s->out_fp) fclose(s->out_fp);
+    s->out_fp = NULL;
+    s->out_mapped = 0;
+    s->out_active = 0;
+}
+
+/* Free the batch buffers before the socket closes. One the kernel still
+ * has pinned is waited for, and abandoned rather than freed if its
+ * completion never comes. */
+static void release_batches(p2p_session_t *s) {
+    for (int i = 0; i < ENGINE_BATCH_POOL; i++) {
+        batch_t *b = &s->batch[i];
+        while (b->buf && b->pinned && !net_zc_done(&s->zc, b->zc_id)) {
+            if (net_zc_reap(&s->zc, ENGINE_ZC_WAIT_MS) <= 0) b->buf = NULL;
+        }
+        if (b->buf) aff_free_local(b->buf, ENGINE_BATCH);
+        memset(b, 0, sizeof(*b));
+    }
+}
+
+/* Close and free s, or park it on the spare list */
+static void session_free(p2p_session_t *s) {
+    p2p_engine_t *e = s->eng;
+    if (s->handle >= 0) {
+        reactor_del(e->reactor, s->handle);
+        s->handle = -1;
+    }
+    reactor_cancel(e->reactor, s->resume_timer);
+    s->resume_timer = 0;
+    close_transfer(s);
+    release_batches(s);
+    if (s->sock != sock_invalid) close_socket(s->sock);
+    if (s->in_file) fclose(s->in_file);
+    secure_bzero(s->key, sizeof(s->key));
+    secure_bzero(s->early, sizeof(s->early));
+    secure_bzero(s->resume, sizeof(s->resume));
+    stats_add(&e->done, &s->stats);
+    e->done_rtt_ms += s->rtt_total_ms;
+    if (e->spare_count < ENGINE_SPARE_SESSIONS) {
+        s->next_spare = e->spare;
+        e->spare = s;
+        e->spare_count++;
+        return;
+    }
+    buf_free(&s->rx);
+    buf_free(&s->tx);
+    buf_free(&s->held);
+    free(s);
+}
+
+static void established(p2p_session_t *s) {
+    s->state = ST_READY;
+    if (s->eng->cb.on_connect) s->eng->cb.on_connect(s, s->eng->user);
+}
+
+/* ---------- handshake ---------- */
+/*
+ * Fresh:   C: HELLO:<cnonce>                         S: SESSION:<ticket>:<snonce>
+ * Resumed: C: RESUME:<ticket>:<cnonce> + early data  S: TICKET:<next>:<snonce>
+ *          C: EARLY_END
+ * Refused: C: RESUME:<ticket>:<cnonce> + early data  S: RETRY, then C: HELLO:...
+ *
+ * HELLO, SESSION, RESUME and RETRY are encrypted with the password key.
+ * Early data, TICKET and EARLY_END use an early key from the ticket's key
+ * and the client's nonce. From then on both sides use a key from the
+ * ticket's key and both nonces, so no two connections share a key and
+ * frames can't be replayed from one into another. A server that refuses
+ * the ticket can't decrypt the early data and drops it. Tickets are single
+ * use, so a replayed first flight is refused too.
+ */
+
+static int send_hello(p2p_session_t *s) {
+    char hex[SESSION_HEX_LEN + 1];
+    char msg[16 + SESSION_HEX_LEN];
+    if (session_random(s->cnonce, SESSION_NONCE_LEN) != 0) return -1;
+    session_to_hex(s->cnonce, SESSION_NONCE_LEN, hex);
+    snprintf(msg, sizeof(msg), "HELLO:%s", hex);
+    s->state = ST_HANDSHAKE;
+    return append_text(&s->tx, msg, s->eng->psk);
+}
+
+/* RESUME; p2p_send queues early data behind it */
+static int send_resume(p2p_session_t *s, const session_ticket_t *t) {
+    char id_hex[SESSION_HEX_LEN + 1];
+    char nonce_hex[SESSION_HEX_LEN + 1];
+    char msg[16 + 2 * SESSION_HEX_LEN];
+    if (session_random(s->cnonce, SESSION_NONCE_LEN) != 0 ||
+        session_derive_early(t->key, s->cnonce, s->key) != 0) return -1;
+    memcpy(s->resume, t->key, ENC_KEY_LEN);
+    session_to_hex(t->id, SESSION_ID_LEN, id_hex);
+    session_to_hex(s->cnonce, SESSION_NONCE_LEN, nonce_hex);
+    snprintf(msg, sizeof(msg), "RESUME:%s:%s", id_hex, nonce_hex);
+    if (append_text(&s->tx, msg, s->eng->psk) != 0) return -1;
+    s->state = ST_EARLY;
+    s->early_left = P2P_EARLY_DATA_MAX;
+    return 0;
+}
+
+/* Client first flight */
+static int session_begin(p2p_session_t *s) {
+    session_ticket_t t;
+    int rc = (s->eng->tickets && session_take(&t)) ? send_resume(s, &t) : send_hello(s);
+    secure_bzero(&t, sizeof(t));
+    return rc;
+}
+
+/* Server: mint the ticket for s->key and send it with our nonce */
+static int send_ticket(p2p_session_t *s, const char *verb, const unsigned char *snonce, const unsigned char *key) {
+    session_ticket_t t;
+    char id_hex[SESSION_HEX_LEN + 1];
+    char nonce_hex[SESSION_HEX_LEN + 1];
+    char reply[64 + 2 * SESSION_HEX_LEN];
+    memset(&t, 0, sizeof(t));
+    if (s->eng->tickets) session_issue(s->key, &t);   /* Else all zero: nobody can redeem it */
+    session_to_hex(t.id, SESSION_ID_LEN, id_hex);
+    session_to_hex(snonce, SESSION_NONCE_LEN, nonce_hex);
+    snprintf(reply, sizeof(reply), "%s:%s:%s", verb, id_hex, nonce_hex);
+    secure_bzero(&t, sizeof(t));
+    return append_text(&s->tx, reply, key);
+}
+
+/* Client: store the ticket the server sent for the key now in use */
+static void keep_ticket(p2p_session_t *s, session_ticket_t *t) {
+    if (s->eng->tickets) {
+        memcpy(t->key, s->key, ENC_KEY_LEN);
+        t->issued = (int64_t)time(NULL);
+        session_save(t);
+    }
+    secure_bzero(t, sizeof(*t));
+}
+
+static void server_handshake(p2p_session_t *s, const char *msg) {
+    p2p_engine_t *e = s->eng;
+    unsigned char cnonce[SESSION_NONCE_LEN];
+    unsigned char snonce[SESSION_NONCE_LEN];
+    unsigned char id[SESSION_ID_LEN];
+
+    if (strncmp(msg, "HELLO:", 6) == 0 && session_from_hex(msg + 6, cnonce, SESSION_NONCE_LEN) == 0) {
+        if (session_random(snonce, SESSION_NONCE_LEN) != 0 ||
+            session_derive_key(e->psk, cnonce, snonce, s->key) != 0 ||
+            send_ticket(s, "SESSION", snonce, e->psk) != 0) {
+            fail(s, -1);
+            return;
+        }
+        established(s);
+    } else if (strncmp(msg, "RESUME:", 7) == 0 && strlen(msg) == 8 + 2 * SESSION_HEX_LEN &&
+               session_from_hex(msg + 7, id, SESSION_ID_LEN) == 0 &&
+               session_from_hex(msg + 8 + SESSION_HEX_LEN, cnonce, SESSION_NONCE_LEN) == 0) {
+        unsigned char secret[ENC_KEY_LEN];
+        if (!e->tickets || !session_redeem(id, secret)) {
+            if (append_text(&s->tx, "RETRY", e->psk) != 0) fail(s, -1);
+            return;
+        }
+        int ok = session_random(snonce, SESSION_NONCE_LEN) == 0 &&
+                 session_derive_early(secret, cnonce, s->early) == 0 &&
+                 session_derive_key(secret, cnonce, snonce, s->key) == 0;
+        secure_bzero(secret, sizeof(secret));
+        if (!ok || send_ticket(s, "TICKET", snonce, s->early) != 0) {
+            fail(s, -1);
+            return;
+        }
+        s->early_rx = 1;
+        s->resumed = 1;
+        established(s);
+    }
+}
+
+/* The server's answer to HELLO or RESUME */
+static void client_handshake(p2p_session_t *s, const unsigned char *frame, int n) {
+    p2p_engine_t *e = s->eng;
+    const char *msg = (const char*)e->scratch;
+    unsigned char snonce[SESSION_NONCE_LEN];
+    session_ticket_t t;
+    int len;
+    memset(&t, 0, sizeof(t));
+
+    if (s->state == ST_EARLY) {
+        len = decrypt_message(frame, n, s->key, e->scratch, ENGINE_SCRATCH - 1);
+        if (len == 8 + 2 * SESSION_HEX_LEN) {
+            e->scratch[len] = '\0';
+            if (strncmp(msg, "TICKET:", 7) == 0 &&
+                session_from_hex(msg + 7, t.id, SESSION_ID_LEN) == 0 &&
+                session_from_hex(msg + 8 + SESSION_HEX_LEN, snonce, SESSION_NONCE_LEN) == 0) {
+                /* End the early data under the early key, then switch */
+                int ok = append_text(&s->tx, "EARLY_END", s->key) == 0 &&
+                         session_derive_key(s->resume, s->cnonce, snonce, s->key) == 0;
+                secure_bzero(s->resume, sizeof(s->resume));
+                if (!ok) {
+                    fail(s, -1);
+                    return;
+                }
+                s->resumed = 1;
+                keep_ticket(s, &t);
+                established(s);
+                return;
+            }
+        }
+        len = decrypt_message(frame, n, e->psk, e->scratch, ENGINE_SCRATCH - 1);
+        if (len == 5 && memcmp(e->scratch, "RETRY", 5) == 0) {
+            /* The early data was dropped unread: no ACKs will come for it,
+             * and what is still queued of it would only be dropped too.
+             * A frame already partly on the wire is finished first so
+             * HELLO starts on a frame boundary. */
+            secure_bzero(s->resume, sizeof(s->resume));
+            s->pending_count = 0;
+            s->tx.len = s->tx.off + s->early_cut;
+            if (send_hello(s) != 0) fail(s, -1);
+        }
+        return;
+    }
+
+    len = decrypt_message(frame, n, e->psk, e->scratch, ENGINE_SCRATCH - 1);
+    if (len <= 0) return;
+    e->scratch[len] = '\0';
+    if (strncmp(msg, "SESSION:", 8) != 0 || strlen(msg) != 8 + 2 * SESSION_HEX_LEN + 1 ||
+        session_from_hex(msg + 8, t.id, SESSION_ID_LEN) != 0 ||
+        session_from_hex(msg + 9 + SESSION_HEX_LEN, snonce, SESSION_NONCE_LEN) != 0) return;
+    if (session_derive_key(e->psk, s->cnonce, snonce, s->key) != 0) {
+        fail(s, -1);
+        return;
+    }
+    keep_ticket(s, &t);
+    established(s);
+}
+
+static void handshake_frame(p2p_session_t *s, const unsigned char *frame, int n) {
+    p2p_engine_t *e = s->eng;
+    if (!s->is_server) {
+        client_handshake(s, frame, n);
+        return;
+    }
+    /* Frames that fail here are early data under a refused ticket: drop them */
+    int len = decrypt_message(frame, n, e->psk, e->scratch, ENGINE_SCRATCH - 1);
+    if (len <= 0) return;
+    e->scratch[len] = '\0';
+    server_handshake(s, (const char*)e->scratch);
+}
+
+/* ---------- receive ---------- */
+
+/* Where a frame queued now goes: behind an outgoing file it waits in held */
+static buf_t *queue_for(p2p_session_t *s) {
+    return s->out_active ? &s->held : &s->tx;
+}
+
+static void on_ack(p2p_session_t *s, uint32_t seq) {
+    for (int i = 0; i < s->pending_count; i++) {
+        if (s->pending[i].seq != seq) continue;
+        double rtt_ms = (now_us() - s->pending[i].sent_us) / 1000.0;
+        s->pending[i] = s->pending[--s->pending_count];
+        s->stats.acked++;
+        s->rtt_total_ms += rtt_ms;
+        s->stats.rtt_avg_ms = s->rtt_total_ms / (double)s->stats.acked;
+        if (s->stats.rtt_min_ms == 0.0 || rtt_ms < s->stats.rtt_min_ms) s->stats.rtt_min_ms = rtt_ms;
+        if (rtt_ms > s->stats.rtt_max_ms) s->stats.rtt_max_ms = rtt_ms;
+        if (s->eng->cb.on_ack) s->eng->cb.on_ack(s, seq, rtt_ms, s->eng->user);
+        return;
+    }
+}
+
+/* FILE:<name>:<size> - keep only the last path component */
+static void begin_file(p2p_session_t *s, const char *header) {
+    p2p_engine_t *e = s->eng;
+    char name[256];
+    long long size = -1;
+    if (sscanf(header, "FILE:%255[^:]:%lld", name, &size) != 2 || size < 0) return;
+    const char *base = name;
+    for (const char *p = name; *p; p++) {
+        if (*p == '/' || *p == '\\') base = p + 1;
+    }
+    if (!e->accept_files || !*base || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        /* Still consume the chunks so the stream stays in sync */
+        snprintf(s->in_name, sizeof(s->in_name), "%s", base);
+        s->in_path[0] = '\0';
+    } else {
+        snprintf(s->in_name, sizeof(s->in_name), "%s", base);
+        snprintf(s->in_path, sizeof(s->in_path), "%s/%s", e->download_dir, base);
+        s->in_file = fopen(s->in_path, "wb");
+        if (!s->in_file) s->in_path[0] = '\0';
+    }
+    s->in_size = (uint64_t)size;
+    s->in_left = (uint64_t)size;
+    if (size == 0) {
+        if (s->in_file) fclose(s->in_file);
+        s->in_file = NULL;
+        if (s->in_path[0] && e->cb.on_file) e->cb.on_file(s, s->in_name, 0, s->in_path, e->user);
+    }
+}
+
+static void file_chunk(p2p_session_t *s, const unsigned char *plain, int len) {
+    p2p_engine_t *e = s->eng;
+    uint64_t n = (uint64_t)len > s->in_left ? s->in_left : (uint64_t)len;
+    if (s->in_file && fwrite(plain, 1, (size_t)n, s->in_file) != n) {
+        fclose(s->in_file);
+        s->in_file = NULL;
+        s->in_path[0] = '\0';
+    }
+    s->in_left -= n;
+    s->stats.file_bytes_in += n;
+    if (s->in_left > 0) return;
+    if (s->in_file) fclose(s->in_file);
+    s->in_file = NULL;
+    if (s->in_path[0] && e->cb.on_file) e->cb.on_file(s, s->in_name, s->in_size, s->in_path, e->user);
+}
+
+/* 1 if the frame was a chat message */
+static int data_frame(p2p_session_t *s, const unsigned char *frame, int n) {
+    p2p_engine_t *e = s->eng;
+    int len = decrypt_message(frame, n, s->early_rx ? s->early : s->key, e->scratch, ENGINE_SCRATCH - 1);
+    if (len < 0) return 0;
+    if (s->in_left > 0) {
+        file_chunk(s, e->scratch, len);
+        return 0;
+    }
+    e->scratch[len] = '\0';
+    char *msg = (char*)e->scratch;
+
+    if (s->early_rx && strcmp(msg, "EARLY_END") == 0) {
+        s->early_rx = 0;
+        secure_bzero(s->early, sizeof(s->early));
+        return 0;
+    }
+    if (strncmp(msg, "ACK:", 4) == 0) {
+        on_ack(s, (uint32_t)strtoul(msg + 4, NULL, 10));
+        return 0;
+    }
+    if (strncmp(msg, "FILE:", 5) == 0) {
+        begin_file(s, msg);
+        return 0;
+    }
+    const char *text = msg;
+    if (strncmp(msg, "SEQ:", 4) == 0) {
+        char *colon = strchr(msg + 4, ':');
+        if (colon) {
+            char ack[32];
+            snprintf(ack, sizeof(ack), "ACK:%lu", strtoul(msg + 4, NULL, 10));
+            if (append_text(queue_for(s), ack, s->key) != 0) fail(s, -1);
+            text = colon + 1;
+        }
+    }
+    s->stats.received++;
+    if (e->cb.on_message) e->cb.on_message(s, text, strlen(text), e->user);
+    return 1;
+}
+
+/* While a file comes in: decrypt the complete chunk frames in hand
+ * together on the task pool and write them in order. Stops before any
+ * frame that might be past the end of the file, so the chat frame that
+ * follows is never taken for file data. Returns the frames consumed. */
+static int file_frames(p2p_session_t *s) {
+    p2p_engine_t *e = s->eng;
+    buf_t *b = &s->rx;
+    if (!e->ahead) e->ahead = (unsigned char*)malloc((size_t)ENGINE_RECV_AHEAD * ENGINE_CHUNK_FRAME);
+    if (!e->ahead) return 0;            /* One at a time, then */
+
+    int n = 0;
+    size_t off = b->off, wire = 0;
+    uint64_t most = 0;                  /* Upper bound on the plaintext in hand */
+    while (n < ENGINE_RECV_AHEAD && most < s->in_left && b->len - off >= FRAME_HDR_LEN) {
+        uint32_t len = get_frame_header(b->data + off);
+        if (len <= ENC_IV_LEN || len > ENGINE_CHUNK_FRAME || b->len - off < FRAME_HDR_LEN + len) break;
+        chunk_job_t *j = &e->jobs[n++];
+        j->in = b->data + off + FRAME_HDR_LEN;
+        j->in_len = (int)len;
+        j->out = e->ahead + (size_t)(n - 1) * ENGINE_CHUNK_FRAME;
+        j->out_cap = ENGINE_CHUNK_FRAME;
+        j->key = s->key;
+        most += len - ENC_IV_LEN - 1;   /* At least one byte of padding */
+        off += FRAME_HDR_LEN + len;
+        wire += len;
+    }
+    if (n == 0) return 0;
+    b->off = off;
+    run_jobs(e->jobs, n, decrypt_chunk_task);
+    for (int i = 0; i < n; i++) {
+        if (e->jobs[i].out_len < 0) {
+            fail(s, -1);
+            return n;
+        }
+        P2P_PROBE2(file__write, s->in_size - s->in_left, e->jobs[i].out_len);
+        file_chunk(s, e->jobs[i].out, e->jobs[i].out_len);
+    }
+    pause_for(s, PAUSE_RX, tb_reserve(&s->file_in, wire));
+    return n;
+}
+
+/* Cut complete frames out of the receive buffer; a stream over its rate
+ * leaves the rest there until on_resume */
+static void parse_frames(p2p_session_t *s) {
+    buf_t *b = &s->rx;
+    while (s->state != ST_CLOSING && !(s->paused & (1 << PAUSE_RX)) && buf_pending(b) >= FRAME_HDR_LEN) {
+        if (s->state == ST_READY && s->in_left > 0 && file_frames(s) > 0) continue;
+        const unsigned char *p = b->data + b->off;
+        uint32_t len = get_frame_header(p);
+        if (len == 0 || len > FRAME_MAX_LEN) {
+            fail(s, -1);
+            return;
+        }
+        if (buf_pending(b) < FRAME_HDR_LEN + len) break;
+        b->off += FRAME_HDR_LEN + len;
+        if (s->state == ST_HANDSHAKE || s->state == ST_EARLY) {
+            handshake_frame(s, p + FRAME_HDR_LEN, (int)len);
+        } else if (s->in_left > 0) {
+            data_frame(s, p + FRAME_HDR_LEN, (int)len);
+            pause_for(s, PAUSE_RX, tb_reserve(&s->file_in, len));
+        } else if (data_frame(s, p + FRAME_HDR_LEN, (int)len)) {
+            pause_for(s, PAUSE_RX, tb_reserve(&s->chat_in, 1));
+        }
+    }
+    /* Frames that arrived with the FIN are delivered before the close */
+    if (s->rx_eof && s->state != ST_CLOSING && !(s->paused & (1 << PAUSE_RX))) fail(s, 0);
+}
+
+/* At most one quantum per round: the loop moves on to the next session
+ * and comes back, since the socket stays readable */
+static void do_read(p2p_session_t *s) {
+    size_t got = 0;
+    while (got < P2P_ENGINE_QUANTUM) {
+        if (buf_reserve(&s->rx, ENGINE_RX_INIT) != 0) {
+            fail(s, -1);
+            return;
+        }
+        size_t room = s->rx.cap - s->rx.len;
+        if (room > P2P_ENGINE_QUANTUM - got) room = P2P_ENGINE_QUANTUM - got;
+        int n = recv(s->sock, (char*)s->rx.data + s->rx.len, (int)room, 0);
+        if (n > 0) {
+            s->rx.len += (size_t)n;
+            s->stats.bytes_in += (uint64_t)n;
+            got += (size_t)n;
+            continue;
+        }
+        if (n == 0) s->rx_eof = 1;
+        else if (!would_block()) fail(s, -1);
+        break;
+    }
+    parse_frames(s);
+    if (got) pause_for(s, PAUSE_RX, tb_reserve(&s->in_rate, got));
+}
+
+/* ---------- transmit ---------- */
+
+/*
+ * Feed the session's path estimate from its socket: RTT from TCP_INFO,
+ * delivery rate from how much of what we wrote the peer has acknowledged
+ * (written minus SIOCOUTQ) per RTT. Then size chunks to the rate and the
+ * send buffer to twice the bandwidth-delay product so the pipe stays full.
+ */
+static void transfer_tune(p2p_session_t *s) {
+    uint64_t now = now_us() / 1000;
+    int rtt_us = net_tcp_rtt_us(s->sock);
+    if (rtt_us > 0) path_on_rtt(&s->path, rtt_us / 1000.0);
+
+    long unacked = net_unacked_bytes(s->sock);
+    if (unacked >= 0 && (uint64_t)unacked <= s->stats.bytes_out) {
+        uint64_t delivered = s->stats.bytes_out - (uint64_t)unacked;
+        double elapsed = (double)(now - s->mark_ms);
+        if (delivered < s->mark_delivered || s->mark_ms == 0) {
+            s->mark_delivered = delivered;
+            s->mark_ms = now;
+        } else if (elapsed >= (s->path.srtt_ms > 1.0 ? s->path.srtt_ms : 1.0)) {
+            path_on_delivery(&s->path, delivered - s->mark_delivered, elapsed);
+            s->mark_delivered = delivered;
+            s->mark_ms = now;
+        }
+    }
+
+    double want = 2.0 * path_bdp_bytes(&s->path);
+    net_grow_buffers(s->sock, want > ENGINE_SNDBUF_MAX ? ENGINE_SNDBUF_MAX : (int)want, 0);
+    s->chunk = path_pick_chunk(&s->path, ENGINE_CHUNK_MIN, ENGINE_CHUNK_MAX);
+}
+
+/* Encrypt the next stretch of the outgoing file into the current batch
+ * slot. 1 if a batch is ready to send, 0 if the slot is still pinned by a
+ * zerocopy send (its completion raises REACTOR_ERROR), -1 on failure. */
+static int fill_batch(p2p_session_t *s) {
+    p2p_engine_t *e = s->eng;
+    batch_t *b = &s->batch[s->batch_cur];
+    if (b->pinned && !net_zc_done(&s->zc, b->zc_id)) net_zc_reap(&s->zc, 0);
+    if (b->pinned && !net_zc_done(&s->zc, b->zc_id)) return 0;
+    b->pinned = 0;
+    if (!b->buf) {
+        b->buf = (unsigned char*)aff_alloc_local(ENGINE_BATCH);   /* On the sender's node */
+        if (!b->buf) {
+            fail(s, -1);
+            return -1;
+        }
+#ifndef _WIN32
+        mlock(b->buf, ENGINE_BATCH);    /* Best effort; fine if RLIMIT_MEMLOCK says no */
+#endif
+    }
+
+    /* Under a file rate, a batch (and a chunk) no bigger than the bucket,
+     * so the pause that pays for it stays short */
+    size_t room = ENGINE_BATCH, chunk = s->chunk;
+    if (s->file_out.rate > 0.0) {
+        size_t depth = s->file_out.burst > ENGINE_CHUNK_MIN ? (size_t)s->file_out.burst : ENGINE_CHUNK_MIN;
+        if (chunk > depth) chunk = depth;
+        if (room > depth + frame_size(chunk)) room = depth + frame_size(chunk);
+    }
+
+    /* Lay the chunks out, then encrypt them all at once. Every frame's
+     * size is known up front, so each job writes straight to its final
+     * place; the capacity it is given may reach into the next frame's
+     * place (encrypt_message wants room for a whole extra block) but it
+     * never writes there. Without a mapping, chunks are read and
+     * encrypted one by one through the scratch buffer. */
+    int n = 0;
+    size_t used = 0;
+    uint64_t pos = s->out_off;
+    while (n < ENGINE_PAR_JOBS && pos < s->out_size) {
+        size_t c = s->out_size - pos < chunk ? (size_t)(s->out_size - pos) : chunk;
+        if (used + FRAME_HDR_LEN + c + 2 * ENC_IV_LEN > room) break;
+        chunk_job_t *j = &e->jobs[n++];
+        j->in = s->out_mapped ? s->out_map.data + pos : e->scratch;
+        j->in_len = (int)c;
+        j->out = b->buf + used + FRAME_HDR_LEN;
+        j->out_cap = (int)c + 2 * ENC_IV_LEN;
+        j->key = s->key;
+        P2P_PROBE2(file__read, pos, c);
+        if (!s->out_mapped) {
+            if (fread(e->scratch, 1, c, s->out_fp) != c) {
+                fail(s, -1);            /* Truncated under us: the stream can't be completed */
+                return -1;
+            }
+            encrypt_chunk_task(j);
+        }
+        pos += c;
+        used += frame_size(c);
+    }
+    if (s->out_mapped) run_jobs(e->jobs, n, encrypt_chunk_task);
+    for (int i = 0; i < n; i++) {
+        if (e->jobs[i].out_len < 0) {
+            fail(s, -1);
+            return -1;
+        }
+    }
+
+    b->off = 0;
+    b->len = used;
+    b->zc = s->zc_on && !s->zc.copied && used >= e->zc_min;
+    s->stats.file_bytes_out += pos - s->out_off;
+    pause_for(s, PAUSE_FILE, tb_reserve(&s->file_out, (size_t)(pos - s->out_off)));
+    s->out_off = pos;
+    return 1;
+}
+
+/* Send from the transmit buffer; bytes sent, 0 if the socket is full,
+ * -1 on failure */
+static long send_tx(p2p_session_t *s, size_t budget) {
+    size_t want = buf_pending(&s->tx);
+    if (want > budget) want = budget;
+    int n = send(s->sock, (const char*)s->tx.data + s->tx.off, (int)want, SEND_FLAGS);
+    if (n < 0) {
+        if (!would_block()) fail(s, -1);
+        return would_block() ? 0 : -1;
+    }
+    if (s->state == ST_EARLY) {
+        /* Track where the frame being sent ends, in case RETRY drops the rest */
+        size_t done = (size_t)n;
+        const unsigned char *p = s->tx.data + s->tx.off;
+        while (done > 0) {
+            if (s->early_cut == 0) s->early_cut = FRAME_HDR_LEN + get_frame_header(p);
+            size_t step = done < s->early_cut ? done : s->early_cut;
+            s->early_cut -= step;
+            done -= step;
+            p += step;
+        }
+    }
+    s->tx.off += (size_t)n;
+    s->stats.bytes_out += (uint64_t)n;
+    return n;
+}
+
+/* The same for the current file batch. A batch sent with zerocopy stays
+ * pinned, so the next one goes in the following slot. */
+static long send_batch(p2p_session_t *s, size_t budget) {
+    batch_t *b = &s->batch[s->batch_cur];
+    size_t want = b->len - b->off;
+    if (want > budget) want = budget;
+    long n;
+    if (b->zc) {
+        int pinned = 0;
+        uint32_t id = 0;
+        n = net_zc_send(&s->zc, b->buf + b->off, want, &id, &pinned);
+        if (pinned) {
+            b->pinned = 1;
+            b->zc_id = id;
+        }
+    } else {
+        n = send(s->sock, (const char*)b->buf + b->off, (int)want, SEND_FLAGS);
+    }
+    if (n < 0) {
+        if (!would_block()) fail(s, -1);
+        return would_block() ? 0 : -1;
+    }
+    b->off += (size_t)n;
+    s->stats.bytes_out += (uint64_t)n;
+    if (b->off == b->len) {
+        s->stats.file_batches++;
+        if (b->pinned) {
+            s->stats.zerocopy_batches++;
+            s->batch_cur = (s->batch_cur + 1) % ENGINE_BATCH_POOL;
+        }
+        b->off = b->len = 0;
+        transfer_tune(s);
+    }
+    return n;
+}
+
+/* The last batch is out: release the chat held behind the file */
+static void finish_transfer(p2p_session_t *s) {
+    close_transfer(s);
+    if (buf_pending(&s->held)) {
+        if (buf_reserve(&s->tx, buf_pending(&s->held)) != 0) {
+            fail(s, -1);
+            return;
+        }
+        memcpy(s->tx.data + s->tx.len, s->held.data + s->held.off, buf_pending(&s->held));
+        s->tx.len += buf_pending(&s->held);
+        s->held.off = s->held.len = 0;
+    }
+    if (s->eng->cb.on_file_sent) s->eng->cb.on_file_sent(s, s->out_name, s->out_size, s->eng->user);
+}
+
+/* The outgoing file has something to do now */
+static int file_backlog(const p2p_session_t *s) {
+    const batch_t *b = &s->batch[s->batch_cur];
+    if (!s->out_active) return 0;
+    if (b->len > b->off || s->out_off == s->out_size) return 1;
+    return !(s->paused & (1 << PAUSE_FILE)) && (!b->pinned || net_zc_done(&s->zc, b->zc_id));
+}
+
+/* Something to send now, or a file batch to build */
+static int tx_backlog(const p2p_session_t *s) {
+    return buf_pending(&s->tx) || file_backlog(s);
+}
+
+/* Deficit round robin: the first write of each round tops the credit up by
+ * weight * P2P_ENGINE_QUANTUM and sending spends it. Credit is dropped when
+ * the backlog empties and capped at one quantum while the socket is full,
+ * so a session can't save up for a burst. Frames queued before a file go
+ * first, then its batches, then what was held behind it. */
+static void do_write(p2p_session_t *s) {
+    p2p_engine_t *e = s->eng;
+    size_t quantum = (size_t)s->weight * P2P_ENGINE_QUANTUM;
+    if (s->paused & (1 << PAUSE_TX)) return;
+    if (s->round != e->round) {
+        s->round = e->round;
+        s->deficit += quantum;
+    }
+    size_t sent = 0;
+    while (sent < s->deficit && s->state != ST_CLOSING) {
+        long n;
+        const batch_t *b = &s->batch[s->batch_cur];
+        if (buf_pending(&s->tx)) {
+            n = send_tx(s, s->deficit - sent);
+        } else if (!s->out_active) {
+            break;
+        } else if (b->len > b->off) {
+            n = send_batch(s, s->deficit - sent);
+        } else if (s->out_off == s->out_size) {
+            finish_transfer(s);
+            continue;
+        } else if (!(s->paused & (1 << PAUSE_FILE)) && fill_batch(s) > 0) {
+            continue;
+        } else {
+            break;
+        }
+        if (n <= 0) break;
+        sent += (size_t)n;
+    }
+    s->deficit = sent < s->deficit ? s->deficit - sent : 0;
+    if (!tx_backlog(s)) s->deficit = 0;
+    else if (s->deficit > quantum) s->deficit = quantum;
+    if (sent) pause_for(s, PAUSE_TX, tb_reserve(&s->out_rate, sent));
+}
+
+/* Watch for writability only while something is queued, and for neither
+ * direction while it is paused */
+static void session_watch(p2p_session_t *s) {
+    int want = (s->paused & (1 << PAUSE_RX) ? 0 : REACTOR_READ) |
+               (tx_backlog(s) && !(s->paused & (1 << PAUSE_TX)) ? REACTOR_WRITE : 0);
+    if (want == s->watch) return;
+    if (reactor_mod(s->eng->reactor, s->handle, want) != 0) fail(s, -1);
+    else s->watch = want;
+}
+
+static void on_session_io(reactor_t *r, sock_t sock, int events, void *arg) {
+    p2p_session_t *s = (p2p_session_t*)arg;
+    (void)r;
+    (void)sock;
+    /* Zerocopy completions arrive on the error queue and look like an error */
+    if ((events & REACTOR_ERROR) && s->zc_on && net_zc_reap(&s->zc, 0) > 0) events &= ~REACTOR_ERROR;
+    /* A hangup is reported even while paused: read on to the end rather than spin */
+    if (s->state != ST_CLOSING && (events & REACTOR_READ) &&
+        (!(s->paused & (1 << PAUSE_RX)) || (events & REACTOR_ERROR))) do_read(s);
+    if (s->state != ST_CLOSING && tx_backlog(s)) do_write(s);
+    if (s->state != ST_CLOSING) session_watch(s);
+}
+
+static void expire_pending(p2p_session_t *s, uint64_t now) {
+    uint64_t timeout_us = (uint64_t)P2P_ENGINE_ACK_TIMEOUT_MS * 1000;
+    for (int i = 0; i < s->pending_count; ) {
+        if (now > s->pending[i].sent_us && now - s->pending[i].sent_us > timeout_us) {
+            s->pending[i] = s->pending[--s->pending_count];
+            s->stats.expired++;
+        } else {
+            i++;
+        }
+    }
+}
+
+static void on_expire_timer(reactor_t *r, void *arg) {
+    p2p_engine_t *e = (p2p_engine_t*)arg;
+    uint64_t now = now_us();
+    (void)r;
+    for (int i = 0; i < e->count; i++) {
+        if (e->sessions[i]->state == ST_READY) expire_pending(e->sessions[i], now);
+    }
+}
+
+static void on_engine_wake(reactor_t *r, void *arg) {
+    p2p_engine_t *e = (p2p_engine_t*)arg;
+    (void)r;
+    if (e->hooks.on_wake) e->hooks.on_wake(e, e->hooks_ctx);
+}
+
+static void on_listener_io(reactor_t *r, sock_t sock, int events, void *arg) {
+    p2p_engine_t *e = (p2p_engine_t*)arg;
+    (void)r;
+    (void)events;
+    for (;;) {
+        sock_t c = accept(sock, NULL, NULL);
+        if (c == sock_invalid) break;
+        if (e->hooks.on_accept && e->hooks.on_accept(e, (p2p_socket_t)c, e->hooks_ctx)) continue;
+        if (!session_add(e, c, 1)) close_socket(c);
+    }
+}
+
+/* Accept only once the peer's first bytes are in, and let returning
+ * clients put their HELLO in the SYN */
+static void set_listener_opts(sock_t s) {
+#ifdef TCP_DEFER_ACCEPT
+    int defer_secs = ENGINE_DEFER_ACCEPT_S;
+    setsockopt((int)s, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_secs, sizeof(defer_secs));
+#endif
+#if !defined(_WIN32) && defined(TCP_FASTOPEN)
+    int qlen = ENGINE_TFO_QUEUE;
+    if (cfg_env_int("P2P_TCP_FASTOPEN", 1))
+        setsockopt((int)s, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+#endif
+}
+
+static int listen_on(p2p_engine_t *e, int port, int reuseport) {
+    sock_t s = net_bind_any(SOCK_STREAM, port, reuseport);
+    if (s == sock_invalid) return -1;
+    set_listener_opts(s);
+    if (listen(s, ENGINE_LISTEN_BACKLOG) != 0) {
+        close_socket(s);
+        return -1;
+    }
+    net_set_nonblocking(s, 1);
+    int handle = reactor_add(e->reactor, s, REACTOR_READ, on_listener_io, e);
+    if (handle < 0) {
+        close_socket(s);
+        return -1;
+    }
+    if (e->listener != sock_invalid) {
+        reactor_del(e->reactor, e->listen_handle);
+        close_socket(e->listener);
+    }
+    e->listener = s;
+    e->listen_handle = handle;
+    return 0;
+}
+
+/* Flush what was queued outside socket callbacks and reap closed
+ * sessions; on_close may close or queue to others, so the list can grow
+ * while it is walked */
+static void flush_dirty(p2p_engine_t *e) {
+    if (e->rescan) {
+        e->rescan = 0;
+        for (int i = 0; i < e->count; i++) touch(e->sessions[i]);
+    }
+    for (int i = 0; i < e->dirty_count; i++) {
+        p2p_session_t *s = e->dirty[i];
+        s->dirty = 0;
+        if (s->state != ST_CLOSING) {
+            if (tx_backlog(s)) do_write(s);
+            if (s->state != ST_CLOSING) session_watch(s);
+            continue;                   /* If that failed it, fail() queued it again */
+        }
+        e->sessions[s->index] = e->sessions[--e->count];
+        e->sessions[s->index]->index = s->index;
+        /* Orderly close: one last try to get queued frames out */
+        if (s->error == 0 && buf_pending(&s->tx))
+            send(s->sock, (const char*)s->tx.data + s->tx.off, (int)buf_pending(&s->tx), SEND_FLAGS);
+        if (e->cb.on_close) e->cb.on_close(s, s->error, e->user);
+        session_free(s);
+    }
+    e->dirty_count = 0;
+}
+
+/* ---------- public API ---------- */
+
+/* kbit/s from the config, else the environment, as bytes/s */
+static double kbps_limit(uint32_t kbps, const char *env) {
+    int v = kbps ? (int)kbps : cfg_env_int(env, 0);
+    return v > 0 ? v * 1000.0 / 8.0 : 0.0;
+}
+
+p2p_engine_t *p2p_engine_new(const p2p_config_t *cfg) {
+    p2p_engine_t *e = (p2p_engine_t*)calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->scratch = (unsigned char*)malloc(ENGINE_SCRATCH);
+    if (!e->scratch) {
+        free(e);
+        return NULL;
+    }
+    e->cb = cfg->cb;
+    e->user = cfg->user;
+    derive_key_from_password(cfg->password ? cfg->password : "", e->psk);
+    if (cfg->download_dir) {
+        snprintf(e->download_dir, sizeof(e->download_dir), "%s", cfg->download_dir);
+        e->accept_files = 1;
+    }
+    e->out_bps = kbps_limit(cfg->peer_out_kbps, "P2P_PEER_OUT_KBPS");
+    e->in_bps = kbps_limit(cfg->peer_in_kbps, "P2P_PEER_IN_KBPS");
+    e->file_bps = kbps_limit(cfg->file_kbps, "P2P_FILE_KBPS");
+    e->chat_rate = cfg->chat_in_rate ? (double)cfg->chat_in_rate : (double)cfg_env_int("P2P_PEER_CHAT_RATE", 0);
+    if (e->chat_rate < 0.0) e->chat_rate = 0.0;
+    e->tickets = cfg->tickets;
+    e->zerocopy = cfg->zerocopy ? 1 : cfg_env_int("P2P_ZEROCOPY", 0);
+    e->zc_min = (size_t)cfg_env_int("P2P_ZEROCOPY_MIN", ENGINE_ZC_MIN);
+    e->use_mmap = cfg_env_int("P2P_FILE_MMAP", 1);
+    e->listener = sock_invalid;
+    e->reactor = reactor_new(REACTOR_DEFAULT);
+    if (!e->reactor || !reactor_timer(e->reactor, ENGINE_EXPIRE_MS, ENGINE_EXPIRE_MS, on_expire_timer, e)) {
+        reactor_free(e->reactor);
+        free(e->scratch);
+        free(e);
+        return NULL;
+    }
+    reactor_on_wake(e->reactor, on_engine_wake, e);
+    return e;
+}
+
+void p2p_engine_free(p2p_engine_t *e) {
+    if (!e) return;
+    for (int i = 0; i < e->count; i++) session_free(e->sessions[i]);
+    while (e->spare) {
+        p2p_session_t *s = e->spare;
+        e->spare = s->next_spare;
+        buf_free(&s->rx);
+        buf_free(&s->tx);
+        buf_free(&s->held);
+        free(s);
+    }
+    if (e->listener != sock_invalid) close_socket(e->listener);
+    reactor_free(e->reactor);
+    free(e->sessions);
+    free(e->dirty);
+    free(e->scratch);
+    free(e->ahead);
+    secure_bzero(e->psk, sizeof(e->psk));
+    free(e);
+}
+
+int p2p_listen(p2p_engine_t *e, int port) {
+    return listen_on(e, port, 0);
+}
+
+int p2p_listen_shared(p2p_engine_t *e, int port) {
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+    return listen_on(e, port, 1);
+#else
+    (void)e;
+    (void)port;
+    return -1;
+#endif
+}
+
+p2p_session_t *p2p_connect(p2p_engine_t *e, const char *host, int port) {
+    sock_t sock = net_connect_happy(host, port, cfg_env_int("P2P_TCP_FASTOPEN", 1));
+    if (sock == sock_invalid) return NULL;
+    return p2p_adopt(e, (p2p_socket_t)sock, 0);
+}
+
+p2p_session_t *p2p_adopt(p2p_engine_t *e, p2p_socket_t sock, int is_server) {
+    p2p_session_t *s = session_add(e, (sock_t)sock, is_server);
+    if (!s) {
+        close_socket((sock_t)sock);
+        return NULL;
+    }
+    if (!is_server && session_begin(s) != 0) fail(s, -1);
+    touch(s);
+    return s;
+}
+
+int p2p_send(p2p_session_t *s, const char *text) {
+    if ((s->state != ST_READY && s->state != ST_EARLY) || strlen(text) > P2P_MAX_TEXT) return -1;
+    /* Full: an ACK or expiry makes room; evicting would lose its ACK */
+    if (s->pending_count == P2P_ENGINE_MAX_PENDING) return -1;
+    char msg[P2P_MAX_TEXT + 32];
+    uint32_t seq = s->next_seq;
+    int len = snprintf(msg, sizeof(msg), "SEQ:%u:%s", seq, text);
+    /* 0-RTT data is capped: the server buffers it before it can tell a
+     * replay from the real thing */
+    if (s->state == ST_EARLY) {
+        int wire = (int)frame_size((size_t)len);
+        if (wire > s->early_left) return -1;
+        s->early_left -= wire;
+    }
+    if (append_text(queue_for(s), msg, s->key) != 0) return -1;   /* Early key until TICKET */
+    touch(s);
+    s->next_seq++;
+    s->stats.sent++;
+    s->pending[s->pending_count].seq = seq;
+    s->pending[s->pending_count].sent_us = now_us();
+    s->pending_count++;
+    return (int)seq;
+}
+
+int p2p_send_file(p2p_session_t *s, const char *path) {
+    if (s->state != ST_READY || s->out_active) return -1;
+    uint64_t size;
+    s->out_mapped = s->eng->use_mmap && file_map(path, &s->out_map) == 0;
+    if (s->out_mapped) {
+        size = s->out_map.len;
+    } else {
+        FILE *f = fopen(path, "rb");
+        if (!f) return -1;
+        fseek(f, 0, SEEK_END);
+        long end = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        if (end < 0) {
+            fclose(f);
+            return -1;
+        }
+        s->out_fp = f;
+        size = (uint64_t)end;
+    }
+    const char *base = path;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/' || *p == '\\') base = p + 1;
+    }
+    char header[512];
+    snprintf(header, sizeof(header), "FILE:%s:%llu", base, (unsigned long long)size);
+    s->out_active = 1;                  /* Set first so close_transfer can undo the above */
+    if (append_text(&s->tx, header, s->key) != 0) {
+        close_transfer(s);
+        return -1;
+    }
+    snprintf(s->out_name, sizeof(s->out_name), "%s", base);
+    s->out_off = 0;
+    s->out_size = size;
+    /* Start a fresh delivery sample, and size the first chunks to what
+     * is known of the path so far */
+    s->mark_ms = 0;
+    transfer_tune(s);
+    touch(s);
+    return 0;
+}
+
+void p2p_close(p2p_session_t *s) {
+    fail(s, 0);
+}
+
+int p2p_engine_poll(p2p_engine_t *e, int timeout_ms) {
+    e->round++;
+    /* Something to flush or close already: don't sleep */
+    if (e->dirty_count || e->rescan) timeout_ms = 0;
+    int ready = reactor_run_once(e->reactor, timeout_ms);
+    flush_dirty(e);
+    return ready;
+}
+
+void p2p_engine_wake(p2p_engine_t *e) {
+    reactor_wake(e->reactor);
+}
+
+void p2p_engine_set_hooks(p2p_engine_t *e, const p2p_hooks_t *hooks, void *ctx) {
+    if (hooks) e->hooks = *hooks;
+    else memset(&e->hooks, 0, sizeof(e->hooks));
+    e->hooks_ctx = ctx;
+}
+
+int p2p_engine_sessions(const p2p_engine_t *e) {
+    return e->count;
+}
+
+p2p_session_t *p2p_engine_session(const p2p_engine_t *e, int i) {
+    return i >= 0 && i < e->count ? e->sessions[i] : NULL;
+}
+
+void p2p_engine_stats(const p2p_engine_t *e, p2p_stats_t *out) {
+    double rtt_ms = e->done_rtt_ms;
+    *out = e->done;
+    out->pending = 0;
+    for (int i = 0; i < e->count; i++) {
+        const p2p_session_t *s = e->sessions[i];
+        stats_add(out, &s->stats);
+        rtt_ms += s->rtt_total_ms;
+        out->pending += s->pending_count;
+    }
+    out->rtt_avg_ms = out->acked ? rtt_ms / (double)out->acked : 0.0;
+}
+
+void p2p_session_stats(const p2p_session_t *s, p2p_stats_t *out) {
+    *out = s->stats;
+    out->pending = s->pending_count;
+    out->path_rtt_ms = s->path.srtt_ms;
+    out->path_bw = s->path.btl_bw;
+    out->file_chunk = s->chunk;
+}
+
+const char *p2p_session_peer(const p2p_session_t *s) {
+    return s->peer;
+}
+
+int p2p_session_ready(const p2p_session_t *s) {
+    return s->state == ST_READY;
+}
+
+int p2p_session_early(const p2p_session_t *s) {
+    return s->state == ST_EARLY;
+}
+
+int p2p_session_resumed(const p2p_session_t *s) {
+    return s->resumed;
+}
+
+p2p_socket_t p2p_session_socket(const p2p_session_t *s) {
+    return (p2p_socket_t)s->sock;
+}
+
+void p2p_session_set_user(p2p_session_t *s, void *user) {
+    s->user = user;
+}
+
+void *p2p_session_user(const p2p_session_t *s) {
+    return s->user;
+}
+
+void p2p_session_set_rate(p2p_session_t *s, uint32_t out_kbps, uint32_t in_kbps) {
+    double out = out_kbps * 1000.0 / 8.0, in = in_kbps * 1000.0 / 8.0;
+    tb_set_rate(&s->out_rate, out, bucket_depth(out, ENGINE_MIN_BURST));
+    tb_set_rate(&s->in_rate, in, bucket_depth(in, ENGINE_MIN_BURST));
+}
+
+void p2p_session_set_weight(p2p_session_t *s, int weight) {
+    s->weight = weight < 1 ? 1 : weight > ENGINE_MAX_WEIGHT ? ENGINE_MAX_WEIGHT : weight;
+}
@@ -0,0 +1,204 @@
+/*
+ * engine.h - Embeddable chat engine (libp2pchat)
+ *
+ * The TCP chat protocol behind an explicit context object: no file-scope
+ * state, no terminal I/O. An engine owns any number of sessions (accepted
+ * or connected) and drives all of them from p2p_engine_poll, which waits
+ * for socket readiness and delivers events through the callbacks. Sockets
+ * are non-blocking and every session has its own buffers, keys and stats,
+ * so thousands of sessions can share one thread, and tests or benchmarks
+ * can run both ends in one process.
+ *
+ * This is the one implementation of the TCP chat protocol; p2pchat is a
+ * terminal front end for it. A client holding a session ticket (session.h)
+ * resumes with it and may send up to P2P_EARLY_DATA_MAX bytes of chat as
+ * 0-RTT data before the server answers. Files are mapped and encrypted in
+ * batches on the task pool (pool.h), and with zerocopy on the batches go
+ * out with MSG_ZEROCOPY; chunk size and send buffer follow a per-session
+ * path estimate.
+ *
+ * An engine is single-threaded: call every function for one engine, and
+ * its sessions, from the same thread; p2p_engine_wake is the one exception.
+ * Separate engines are independent (shard.h runs one per core). Each
+ * waits on its own reactor (reactor.h); P2P_REACTOR picks the backend.
+ *
+ * Sessions share the loop fairly: each poll is a round in which a session
+ * reads at most P2P_ENGINE_QUANTUM bytes and sends what its deficit round
+ * robin credit allows (weight * P2P_ENGINE_QUANTUM), so one bulk peer can't
+ * starve the rest. Token buckets can further cap each session's bytes per
+ * second either way, its file stream, and the chat messages it may send us;
+ * a session over its rate stops being read or written until the bucket
+ * refills, which pushes back on the peer through TCP.
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define P2P_MAX_TEXT 4000               /* Longest chat message accepted by p2p_send */
+#define P2P_ENGINE_MAX_PENDING 256      /* Unacknowledged messages tracked per session */
+#define P2P_ENGINE_ACK_TIMEOUT_MS 5000  /* Unacknowledged after this: counted as expired */
+#define P2P_ENGINE_QUANTUM 65536        /* Bytes per session per poll round, each way */
+#define P2P_EARLY_DATA_MAX 16384        /* 0-RTT bytes behind RESUME; under TFO the first MSS rides the SYN */
+
+typedef struct p2p_engine p2p_engine_t;
+typedef struct p2p_session p2p_session_t;
+
+#ifdef _WIN32
+typedef uintptr_t p2p_socket_t;         /* SOCKET */
+#else
+typedef int p2p_socket_t;
+#endif
+
+typedef struct {
+    uint64_t sent;                      /* Chat messages sent */
+    uint64_t received;                  /* Chat messages received */
+    uint64_t acked;
+    uint64_t expired;                   /* No ACK within P2P_ENGINE_ACK_TIMEOUT_MS */
+    uint64_t bytes_out;                 /* Wire bytes */
+    uint64_t bytes_in;
+    uint64_t file_bytes_out;            /* File payload */
+    uint64_t file_bytes_in;
+    double rtt_min_ms;
+    double rtt_avg_ms;
+    double rtt_max_ms;
+    uint64_t throttled;                 /* Times a rate limit held a session back */
+    uint64_t file_batches;              /* Encrypted file batches written */
+    uint64_t zerocopy_batches;          /* ...of them with MSG_ZEROCOPY */
+    int pending;                        /* Messages awaiting ACK now */
+    /* Path estimate, per session only: smoothed RTT, bottleneck bandwidth
+     * (bytes/s, 0 if unknown) and the file chunk size it picked */
+    double path_rtt_ms;
+    double path_bw;
+    uint32_t file_chunk;
+} p2p_stats_t;
+
+/* Every callback is optional and runs inside p2p_engine_poll. They may call
+ * p2p_send, p2p_send_file and p2p_close on any session of the engine. */
+typedef struct {
+    /* Handshake done: the session can send */
+    void (*on_connect)(p2p_session_t *s, void *user);
+    void (*on_message)(p2p_session_t *s, const char *text, size_t len, void *user);
+    void (*on_ack)(p2p_session_t *s, uint32_t seq, double rtt_ms, void *user);
+    /* A file arrived complete and was saved at path */
+    void (*on_file)(p2p_session_t *s, const char *name, uint64_t size, const char *path, void *user);
+    /* All of an outgoing file was handed to the socket */
+    void (*on_file_sent)(p2p_session_t *s, const char *name, uint64_t size, void *user);
+    /* Last call for s; error is 0 for an orderly close */
+    void (*on_close)(p2p_session_t *s, int error, void *user);
+} p2p_callbacks_t;
+
+typedef struct {
+    const char *password;               /* Shared secret both peers derive their key from */
+    const char *download_dir;           /* Where received files go; NULL refuses files */
+    p2p_callbacks_t cb;
+    void *user;                         /* Passed to every callback */
+    /* Per-session limits, 0 for the environment's (none if unset there):
+     * kbit/s each way on the wire, kbit/s of file data each way, and chat
+     * messages per second accepted from the peer (bursts of up to a
+     * second's worth) */
+    uint32_t peer_out_kbps;             /* P2P_PEER_OUT_KBPS */
+    uint32_t peer_in_kbps;              /* P2P_PEER_IN_KBPS */
+    uint32_t file_kbps;                 /* P2P_FILE_KBPS */
+    uint32_t chat_in_rate;              /* P2P_PEER_CHAT_RATE */
+    /* Issue and redeem (server) or present and keep (client) resumption
+     * tickets in session.h's store, which the application opens. The
+     * store is per process and not locked: one engine at most. */
+    int tickets;
+    int zerocopy;                       /* 1: MSG_ZEROCOPY file batches; 0: P2P_ZEROCOPY */
+} p2p_config_t;
+
+/* For code that drives engines from its own threads (see shard.h); both
+ * run inside p2p_engine_poll with the ctx given to p2p_engine_set_hooks */
+typedef struct {
+    /* p2p_engine_wake was called since the last on_wake */
+    void (*on_wake)(p2p_engine_t *e, void *ctx);
+    /* A connection was accepted; return 1 to take the socket over (the
+     * engine forgets it), 0 to let the engine serve it */
+    int (*on_accept)(p2p_engine_t *e, p2p_socket_t sock, void *ctx);
+} p2p_hooks_t;
+
+/* Create an engine; the config is copied. NULL on error. */
+p2p_engine_t *p2p_engine_new(const p2p_config_t *cfg);
+
+/* Close every session (without callbacks) and free the engine */
+void p2p_engine_free(p2p_engine_t *e);
+
+/* Accept sessions on port (all addresses, dual-stack); 0 on success */
+int p2p_listen(p2p_engine_t *e, int port);
+
+/* Like p2p_listen, but several engines may listen on the same port and the
+ * kernel spreads incoming connections between them (SO_REUSEPORT).
+ * -1 where the platform can't do that. */
+int p2p_listen_shared(p2p_engine_t *e, int port);
+
+/* Connect to host:port and start the handshake. The TCP connect itself
+ * blocks (Happy Eyeballs, bounded by HE_CONNECT_TIMEOUT_MS); on_connect
+ * follows from p2p_engine_poll. NULL if the peer is unreachable. With
+ * tickets on and one stored, the session starts out early (see
+ * p2p_session_early). */
+p2p_session_t *p2p_connect(p2p_engine_t *e, const char *host, int port);
+
+/* Serve an already connected socket, e.g. one accepted by another engine,
+ * as the server or client end of the handshake. NULL on error (the socket
+ * is closed). */
+p2p_session_t *p2p_adopt(p2p_engine_t *e, p2p_socket_t sock, int is_server);
+
+/* Queue a chat message; returns its seq (> 0), or -1 if the session can't
+ * send now (not connected, its early data budget is spent, or
+ * P2P_ENGINE_MAX_PENDING messages await an ACK) or the text is too long.
+ * Sent as poll finds room. */
+int p2p_send(p2p_session_t *s, const char *text);
+
+/* Stream a file to the peer; chat sent meanwhile follows the file.
+ * 0 if the transfer was queued; -1 if the file can't be read or another
+ * transfer is still going. */
+int p2p_send_file(p2p_session_t *s, const char *path);
+
+/* Close after the next poll; on_close follows */
+void p2p_close(p2p_session_t *s);
+
+/* Wait up to timeout_ms (-1 forever, 0 not at all) for socket activity and
+ * process it. Returns the number of sockets that had events, -1 on error. */
+int p2p_engine_poll(p2p_engine_t *e, int timeout_ms);
+
+/* Make the current or next p2p_engine_poll return promptly and run the
+ * on_wake hook. Safe from any thread; calls before on_wake runs coalesce. */
+void p2p_engine_wake(p2p_engine_t *e);
+
+void p2p_engine_set_hooks(p2p_engine_t *e, const p2p_hooks_t *hooks, void *ctx);
+
+/* Number of live sessions, and the i-th of them (0 <= i < count). The
+ * order changes when sessions close. */
+int p2p_engine_sessions(const p2p_engine_t *e);
+p2p_session_t *p2p_engine_session(const p2p_engine_t *e, int i);
+
+/* Totals over every session the engine has served, live and closed;
+ * pending counts the live ones */
+void p2p_engine_stats(const p2p_engine_t *e, p2p_stats_t *out);
+
+void p2p_session_stats(const p2p_session_t *s, p2p_stats_t *out);
+const char *p2p_session_peer(const p2p_session_t *s);
+int p2p_session_ready(const p2p_session_t *s);
+
+/* Client resuming a session: until on_connect, p2p_send goes out as 0-RTT
+ * data. If the server refuses the ticket it drops that data and on_connect
+ * follows a full handshake, with p2p_session_resumed 0. */
+int p2p_session_early(const p2p_session_t *s);
+
+/* 1 once a session was resumed from a ticket, its early data accepted */
+int p2p_session_resumed(const p2p_session_t *s);
+
+p2p_socket_t p2p_session_socket(const p2p_session_t *s);
+void p2p_session_set_user(p2p_session_t *s, void *user);
+void *p2p_session_user(const p2p_session_t *s);
+
+/* Override the engine's wire limits for one session, kbit/s (0: none) */
+void p2p_session_set_rate(p2p_session_t *s, uint32_t out_kbps, uint32_t in_kbps);
+
+/* Send-path share relative to other sessions (1 to 64, default 1) */
+void p2p_session_set_weight(p2p_session_t *s, int weight);
+
+#endif /* ENGINE_H */
@@ -0,0 +1,171 @@
+/*
+ * hwcount.c - Hardware counters per message stage
+ *
+ * Linux only; elsewhere hw_init reports that counting is unavailable and
+ * the rest does nothing. Totals are shared by all threads and updated with
+ * atomic adds, so a stage may run on any thread.
+ */
+
+#define _GNU_SOURCE
+
+#include "hwcount.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+  #include <errno.h>
+  #include <unistd.h>
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+  #include <linux/perf_event.h>
+#endif
+
+static const char *stage_names[HW_STAGE_COUNT] = { "encrypt", "decrypt", "framing", "logging" };
+
+static int enabled = 0;
+
+#ifdef __linux__
+
+static const uint64_t counter_config[HW_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int user_only = 0;               /* Kernel counting was refused */
+static int avail_mask = 0;              /* Counters at least one thread could open */
+static uint64_t totals[HW_STAGE_COUNT][HW_COUNTERS];
+static uint64_t wall_ns[HW_STAGE_COUNT];
+static uint64_t calls[HW_STAGE_COUNT];
+
+/* Per thread: group leader fd (-2 not tried yet, -1 unavailable) and the
+ * position of each counter in the group read, -1 if it did not open */
+static __thread int group_fd = -2;
+static __thread int slot[HW_COUNTERS];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int open_counter(uint64_t config, int group, int exclude_kernel) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = group == -1;        /* Leader starts stopped, members follow it */
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void open_group(void) {
+    group_fd = open_counter(counter_config[0], -1, user_only);
+    if (group_fd < 0 && (errno == EACCES || errno == EPERM) && !user_only) {
+        user_only = 1;
+        group_fd = open_counter(counter_config[0], -1, 1);
+    }
+    if (group_fd < 0) {
+        group_fd = -1;
+        return;
+    }
+    int next = 0;
+    slot[0] = next++;
+    for (int i = 1; i < HW_COUNTERS; i++) {
+        int fd = open_counter(counter_config[i], group_fd, user_only);
+        slot[i] = fd >= 0 ? next++ : -1;    /* fd stays open for the thread's lifetime */
+    }
+    for (int i = 0; i < HW_COUNTERS; i++) {
+        if (slot[i] >= 0) __sync_fetch_and_or(&avail_mask, 1 << i);
+    }
+    ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void read_group(uint64_t v[HW_COUNTERS]) {
+    struct { uint64_t nr; uint64_t values[HW_COUNTERS]; } buf;
+    memset(v, 0, HW_COUNTERS * sizeof(uint64_t));
+    if (group_fd < 0 || read(group_fd, &buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) return;
+    for (int i = 0; i < HW_COUNTERS; i++) {
+        if (slot[i] >= 0 && (uint64_t)slot[i] < buf.nr) v[i] = buf.values[slot[i]];
+    }
+}
+
+void hw_init(void) {
+    enabled = cfg_env_int("P2P_HWCOUNT", 0) != 0;
+    if (!enabled) return;
+    memset(totals, 0, sizeof(totals));
+    memset(wall_ns, 0, sizeof(wall_ns));
+    memset(calls, 0, sizeof(calls));
+    /* Probe once here so a missing PMU is reported up front */
+    open_group();
+    if (group_fd < 0) {
+        printf("[WARN] Hardware counters unavailable (%s); stages report wall time only.\n", strerror(errno));
+    } else {
+        printf("[PERF] Hardware counters on%s.\n", user_only ? " (user space only: perf_event_paranoid)" : "");
+    }
+}
+
+void hw_begin(hw_mark_t *m) {
+    m->active = enabled;
+    if (!enabled) return;
+    if (group_fd == -2) open_group();
+    read_group(m->v);
+    m->start_ns = now_ns();
+}
+
+void hw_end(hw_mark_t *m, hw_stage_t stage) {
+    if (!m->active) return;
+    uint64_t end_ns = now_ns();
+    uint64_t v[HW_COUNTERS];
+    read_group(v);
+    for (int i = 0; i < HW_COUNTERS; i++) {
+        __sync_fetch_and_add(&totals[stage][i], v[i] - m->v[i]);
+    }
+    __sync_fetch_and_add(&wall_ns[stage], end_ns - m->start_ns);
+    __sync_fetch_and_add(&calls[stage], 1);
+}
+
+void hw_report(void) {
+    if (!enabled) return;
+    printf("=== Stage Counters%s ===\n", user_only ? " (user space)" : "");
+    printf("%-8s %8s %9s %11s %6s %12s %13s\n",
+           "stage", "calls", "us/call", "cycles/call", "IPC", "cache-miss/c", "branch-miss/c");
+    for (int s = 0; s < HW_STAGE_COUNT; s++) {
+        if (calls[s] == 0) continue;
+        double n = (double)calls[s];
+        printf("%-8s %8llu %9.2f", stage_names[s], (unsigned long long)calls[s], wall_ns[s] / n / 1000.0);
+        if (avail_mask & 1) printf(" %11.0f", totals[s][0] / n);
+        else printf(" %11s", "n/a");
+        if ((avail_mask & 3) == 3 && totals[s][0]) printf(" %6.2f", (double)totals[s][1] / totals[s][0]);
+        else printf(" %6s", "n/a");
+        if (avail_mask & 4) printf(" %12.1f", totals[s][2] / n);
+        else printf(" %12s", "n/a");
+        if (avail_mask & 8) printf(" %13.1f", totals[s][3] / n);
+        else printf(" %13s", "n/a");
+        printf("\n");
+    }
+    printf("===============================\n\n");
+}
+
+#else /* !__linux__ */
+
+void hw_init(void) {
+    if (cfg_env_int("P2P_HWCOUNT", 0)) printf("[WARN] Hardware counters need Linux perf_event_open; ignoring P2P_HWCOUNT.\n");
+    (void)stage_names;
+}
+
+void hw_begin(hw_mark_t *m) { m->active = 0; }
+void hw_end(hw_mark_t *m, hw_stage_t stage) { (void)m; (void)stage; }
+void hw_report(void) {}
+
+#endif
+
+int hw_enabled(void) {
+    return enabled;
+}
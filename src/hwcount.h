@@ -0,0 +1,52 @@
+/*
+ * hwcount.h - Hardware counters per message stage (Linux perf_event_open)
+ *
+ * Optional instrumentation, off unless P2P_HWCOUNT=1. Each thread lazily
+ * opens one counter group (cycles, instructions, cache misses, branch
+ * misses) for itself; a stage reads the group on entry and exit and adds
+ * the difference to that stage's totals. One read() per boundary, so this
+ * is for diagnosis, not for leaving on.
+ *
+ * Cycles against wall time tell the kind of cost: high IPC means compute,
+ * low IPC with many cache misses means memory, and wall time far above
+ * the counted cycles means the stage is waiting in (or on) the kernel.
+ * When perf_event_paranoid forbids kernel counting the counters fall back
+ * to user space only, and the report says so.
+ */
+
+#ifndef HWCOUNT_H
+#define HWCOUNT_H
+
+#include <stdint.h>
+
+typedef enum {
+    HW_STAGE_ENCRYPT,
+    HW_STAGE_DECRYPT,
+    HW_STAGE_FRAMING,     /* Frame header + send syscall */
+    HW_STAGE_LOGGING,     /* Chat log and WAL appends */
+    HW_STAGE_COUNT
+} hw_stage_t;
+
+#define HW_COUNTERS 4     /* cycles, instructions, cache misses, branch misses */
+
+/* Snapshot taken at stage entry */
+typedef struct {
+    int active;
+    uint64_t start_ns;
+    uint64_t v[HW_COUNTERS];
+} hw_mark_t;
+
+/* Read P2P_HWCOUNT; call once from main before the worker threads start */
+void hw_init(void);
+
+/* 1 if counting is on */
+int hw_enabled(void);
+
+/* Bracket a stage; cheap no-ops when counting is off */
+void hw_begin(hw_mark_t *m);
+void hw_end(hw_mark_t *m, hw_stage_t stage);
+
+/* Print per-stage calls, wall time, IPC and misses per call */
+void hw_report(void);
+
+#endif /* HWCOUNT_H */
@@ -0,0 +1,644 @@
+/*
+ * net.c - Socket helpers shared by the chat front-ends
+ *
+ * Frame format on TCP: [u32 length, big-endian][ciphertext]
+ * Connection setup: getaddrinfo + Happy Eyeballs (RFC 8305) racing.
+ * Local addresses: getifaddrs, cached, no resolver involved.
+ */
+
+#include "net.h"
+#include "hwcount.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #define sock_invalid_net INVALID_SOCKET
+    #define close_socket_net(s) closesocket(s)
+#else
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <sys/uio.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <arpa/inet.h>
+    #include <net/if.h>
+    #include <ifaddrs.h>
+    #include <sys/ioctl.h>
+    #ifdef __linux__
+        #include <linux/errqueue.h>
+        #include <linux/sockios.h>
+    #endif
+    #define sock_invalid_net -1
+    #define close_socket_net(s) close(s)
+#endif
+
+/* Send exactly len bytes */
+int net_send_all(sock_t s, const void *buf, size_t len) {
+    const char *p = (const char*)buf;
+    while (len > 0) {
+#ifdef _WIN32
+        int n = send(s, p, (int)len, 0);
+        if (n == SOCKET_ERROR) return -1;
+#else
+        ssize_t n = send(s, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+#endif
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* ---------- busy polling ---------- */
+
+int net_set_busy_poll(sock_t s, int us) {
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) != 0) return -1;
+#ifdef SO_PREFER_BUSY_POLL
+    /* Keep the NIC's interrupts deferred while we poll (5.11+); optional */
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+#endif
+    return 0;
+#else
+    (void)s;
+    (void)us;
+    return -1;
+#endif
+}
+
+void net_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+int net_busy_wait(sock_t s, int idle_us) {
+#ifdef MSG_DONTWAIT
+    uint64_t start = perf_now_us();
+    char c;
+    for (unsigned i = 0;; i++) {
+        if (recv(s, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0) return 1;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return 1;
+        /* The clock is cheap but not free: look at it every 64 spins */
+        if ((i & 63) == 0 && perf_now_us() - start >= (uint64_t)idle_us) return 0;
+        net_cpu_relax();
+    }
+#else
+    (void)s;
+    (void)idle_us;
+    return 0;
+#endif
+}
+
+/* ---------- path information ---------- */
+
+int net_tcp_rtt_us(sock_t s) {
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(s, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0) return (int)ti.tcpi_rtt;
+#else
+    (void)s;
+#endif
+    return 0;
+}
+
+long net_unacked_bytes(sock_t s) {
+#if defined(__linux__) && defined(SIOCOUTQ)
+    int n = 0;
+    if (ioctl(s, SIOCOUTQ, &n) == 0) return n;
+#else
+    (void)s;
+#endif
+    return -1;
+}
+
+static void grow_buffer(sock_t s, int opt, int bytes) {
+    int cur = 0;
+    socklen_t len = sizeof(cur);
+    if (bytes <= 0) return;
+    if (getsockopt(s, SOL_SOCKET, opt, (char*)&cur, &len) == 0 && cur >= bytes) return;
+    setsockopt(s, SOL_SOCKET, opt, (const char*)&bytes, sizeof(bytes));
+}
+
+void net_grow_buffers(sock_t s, int sndbuf, int rcvbuf) {
+    grow_buffer(s, SO_SNDBUF, sndbuf);
+    grow_buffer(s, SO_RCVBUF, rcvbuf);
+}
+
+/* ---------- MSG_ZEROCOPY ---------- */
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define NET_HAVE_ZEROCOPY 1
+#endif
+
+int net_zc_init(net_zc_t *zc, sock_t s) {
+    memset(zc, 0, sizeof(*zc));
+    zc->sock = s;
+#ifdef NET_HAVE_ZEROCOPY
+    int one = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) zc->enabled = 1;
+#endif
+    return zc->enabled ? 0 : -1;
+}
+
+long net_zc_send(net_zc_t *zc, const void *buf, size_t len, uint32_t *last_id, int *pinned) {
+#ifdef NET_HAVE_ZEROCOPY
+    const char *p = (const char*)buf;
+    size_t sent = 0;
+    *pinned = 0;
+    while (sent < len) {
+        ssize_t n = send(zc->sock, p + sent, len - sent, MSG_NOSIGNAL | MSG_ZEROCOPY);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno != ENOBUFS) return -1;
+            /* Out of optmem for notifications: reap some, else copy */
+            if (net_zc_reap(zc, 0) > 0) continue;
+            n = send(zc->sock, p + sent, len - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return -1;
+            }
+            sent += (size_t)n;
+            continue;
+        }
+        /* Every successful call consumes one notification id */
+        *last_id = zc->next_id++;
+        zc->sends++;
+        *pinned = 1;
+        sent += (size_t)n;
+    }
+    if (sent == 0 && len > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return (long)sent;
+#else
+    (void)zc; (void)buf; (void)len; (void)last_id;
+    *pinned = 0;
+    return -1;
+#endif
+}
+
+int net_zc_done(const net_zc_t *zc, uint32_t id) {
+    return (int32_t)(id - zc->done_upto) < 0;
+}
+
+int net_zc_reap(net_zc_t *zc, int wait_ms) {
+#ifdef NET_HAVE_ZEROCOPY
+    int count = 0;
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(zc->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            if (count > 0 || wait_ms <= 0) return count;
+            /* The error queue signals POLLERR */
+            struct pollfd pfd = { zc->sock, 0, 0 };
+            int pr = poll(&pfd, 1, wait_ms);
+            if (pr < 0 && errno != EINTR) return -1;
+            if (pr == 0) return 0;
+            wait_ms = 0;
+            continue;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+            struct sock_extended_err *ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            /* [ee_info, ee_data] is an inclusive range of completed ids;
+             * TCP completes them in order */
+            if ((int32_t)(ee->ee_data + 1 - zc->done_upto) > 0) zc->done_upto = ee->ee_data + 1;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zc->copied = 1;
+            count++;
+        }
+    }
+#else
+    (void)zc; (void)wait_ms;
+    return -1;
+#endif
+}
+
+/* Receive exactly len bytes */
+int net_recv_all(sock_t s, void *buf, size_t len) {
+    char *p = (char*)buf;
+    while (len > 0) {
+#ifdef _WIN32
+        int n = recv(s, p, (int)len, 0);
+        if (n == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEINTR) continue;
+            return -1;
+        }
+#else
+        ssize_t n = recv(s, p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+#endif
+        if (n == 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+/* Send one length-prefixed frame as a single gathered write */
+static int send_frame(sock_t s, const unsigned char *payload, int len) {
+    unsigned char hdr[FRAME_HDR_LEN];
+    hdr[0] = (unsigned char)(len >> 24);
+    hdr[1] = (unsigned char)(len >> 16);
+    hdr[2] = (unsigned char)(len >> 8);
+    hdr[3] = (unsigned char)len;
+
+#ifdef _WIN32
+    if (net_send_all(s, hdr, sizeof(hdr)) < 0) return -1;
+    return net_send_all(s, payload, (size_t)len);
+#else
+    struct iovec iov[2] = {
+        { hdr, sizeof(hdr) },
+        { (void*)payload, (size_t)len },
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    ssize_t n;
+    do {
+        n = sendmsg(s, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return -1;
+
+    /* Short write: finish whatever is left of header + payload */
+    size_t sent = (size_t)n;
+    if (sent < sizeof(hdr)) {
+        if (net_send_all(s, hdr + sent, sizeof(hdr) - sent) < 0) return -1;
+        sent = sizeof(hdr);
+    }
+    sent -= sizeof(hdr);
+    return net_send_all(s, payload + sent, (size_t)len - sent);
+#endif
+}
+
+int net_send_frame(sock_t s, const unsigned char *payload, int len) {
+    if (len < 0 || len > FRAME_MAX_LEN) return -1;
+    hw_mark_t hw;
+    hw_begin(&hw);
+    int rc = send_frame(s, payload, len);
+    hw_end(&hw, HW_STAGE_FRAMING);
+    return rc;
+}
+
+/* Receive one frame into buf */
+int net_recv_frame(sock_t s, unsigned char *buf, int cap) {
+    unsigned char hdr[FRAME_HDR_LEN];
+    int r = net_recv_all(s, hdr, sizeof(hdr));
+    if (r <= 0) return r;
+
+    uint32_t len = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) |
+                   ((uint32_t)hdr[2] << 8) | (uint32_t)hdr[3];
+    if (len > FRAME_MAX_LEN || (int)len > cap) {
+        fprintf(stderr, "[ERROR] Frame of %u bytes exceeds buffer (%d)\n", len, cap);
+        return -1;
+    }
+    if (len == 0) return -1;
+
+    r = net_recv_all(s, buf, len);
+    if (r <= 0) return r;
+    return (int)len;
+}
+
+/* ---------- addressing ---------- */
+
+int net_resolve(const char *host, int port, int socktype, struct addrinfo **out) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    char port_s[16];
+    snprintf(port_s, sizeof(port_s), "%d", port);
+
+    int rc = getaddrinfo(host, port_s, &hints, out);
+    if (rc != 0) {
+        fprintf(stderr, "[ERROR] Cannot resolve '%s': %s\n", host, gai_strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+int net_validate_host(const char *host) {
+    if (!host || !*host) return 0;
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) return 0;
+    freeaddrinfo(res);
+    return 1;
+}
+
+void net_format_addr(const struct sockaddr *sa, char *buf, size_t buflen) {
+    char host[NI_MAXHOST], serv[NI_MAXSERV];
+    socklen_t len = (sa->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6)
+                                                : sizeof(struct sockaddr_in);
+    if (getnameinfo(sa, len, host, sizeof(host), serv, sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        snprintf(buf, buflen, "?");
+        return;
+    }
+    /* Show v4-mapped peers of a dual-stack socket as plain IPv4 */
+    if (strncmp(host, "::ffff:", 7) == 0 && strchr(host + 7, '.'))
+        snprintf(buf, buflen, "%s:%s", host + 7, serv);
+    else if (sa->sa_family == AF_INET6)
+        snprintf(buf, buflen, "[%s]:%s", host, serv);
+    else
+        snprintf(buf, buflen, "%s:%s", host, serv);
+}
+
+sock_t net_bind_any(int socktype, int port, int reuseport) {
+    int opt = 1;
+    sock_t s = socket(AF_INET6, socktype, 0);
+    if (s != sock_invalid_net) {
+        int v6only = 0;
+        setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6only, sizeof(v6only));
+        if (socktype == SOCK_STREAM)
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+        if (reuseport) setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+#endif
+        struct sockaddr_in6 sa6;
+        memset(&sa6, 0, sizeof(sa6));
+        sa6.sin6_family = AF_INET6;
+        sa6.sin6_addr = in6addr_any;
+        sa6.sin6_port = htons((unsigned short)port);
+        if (bind(s, (struct sockaddr*)&sa6, sizeof(sa6)) == 0) return s;
+        close_socket_net(s);
+    }
+
+    /* No IPv6 on this host: plain IPv4 */
+    s = socket(AF_INET, socktype, 0);
+    if (s == sock_invalid_net) return sock_invalid_net;
+    if (socktype == SOCK_STREAM)
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+    if (reuseport) setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+#endif
+    struct sockaddr_in sa4;
+    memset(&sa4, 0, sizeof(sa4));
+    sa4.sin_family = AF_INET;
+    sa4.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa4.sin_port = htons((unsigned short)port);
+    if (bind(s, (struct sockaddr*)&sa4, sizeof(sa4)) == 0) return s;
+    close_socket_net(s);
+    return sock_invalid_net;
+}
+
+/* ---------- Happy Eyeballs connect ---------- */
+
+int net_set_nonblocking(sock_t s, int on) {
+#ifdef _WIN32
+    u_long mode = on ? 1 : 0;
+    return ioctlsocket(s, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0) return -1;
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(s, F_SETFL, flags);
+#endif
+}
+
+static int connect_in_progress(void) {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+/* RFC 8305 section 4: alternate address families, starting with the
+ * family of the first (most preferred) result. */
+static int interleave_families(struct addrinfo *res, struct addrinfo **out, int cap) {
+    struct addrinfo *primary[HE_MAX_ATTEMPTS], *secondary[HE_MAX_ATTEMPTS];
+    int np = 0, ns = 0;
+    int first_family = res ? res->ai_family : AF_UNSPEC;
+
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == first_family) {
+            if (np < HE_MAX_ATTEMPTS) primary[np++] = ai;
+        } else if (ns < HE_MAX_ATTEMPTS) {
+            secondary[ns++] = ai;
+        }
+    }
+
+    int n = 0, i = 0, j = 0;
+    while (n < cap && (i < np || j < ns)) {
+        if (i < np) out[n++] = primary[i++];
+        if (n < cap && j < ns) out[n++] = secondary[j++];
+    }
+    return n;
+}
+
+sock_t net_connect_happy(const char *host, int port, int tfo) {
+    struct addrinfo *res = NULL;
+    if (net_resolve(host, port, SOCK_STREAM, &res) != 0) return sock_invalid_net;
+
+    struct addrinfo *cand[HE_MAX_ATTEMPTS];
+    int ncand = interleave_families(res, cand, HE_MAX_ATTEMPTS);
+
+    /* A lone address has nothing to race; let TFO put data on the SYN */
+    if (ncand == 1) {
+        sock_t s = socket(cand[0]->ai_family, SOCK_STREAM, 0);
+        if (s == sock_invalid_net) {
+            freeaddrinfo(res);
+            return sock_invalid_net;
+        }
+#if !defined(_WIN32) && defined(TCP_FASTOPEN_CONNECT)
+        int on = 1;
+        if (tfo) setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+#else
+        (void)tfo;
+#endif
+        if (connect(s, cand[0]->ai_addr, (socklen_t)cand[0]->ai_addrlen) != 0) {
+            close_socket_net(s);
+            s = sock_invalid_net;
+        }
+        freeaddrinfo(res);
+        return s;
+    }
+
+    sock_t attempt[HE_MAX_ATTEMPTS];
+    int active = 0, next = 0;
+    sock_t winner = sock_invalid_net;
+    uint64_t now = get_time_ms();
+    uint64_t next_start = now;
+    uint64_t deadline = now + HE_CONNECT_TIMEOUT_MS;
+
+    while (winner == sock_invalid_net && now < deadline) {
+        /* Start the next attempt when its delay is up or nothing is in flight */
+        if (next < ncand && (now >= next_start || active == 0)) {
+            struct addrinfo *ai = cand[next++];
+            sock_t s = socket(ai->ai_family, SOCK_STREAM, 0);
+            if (s != sock_invalid_net && net_set_nonblocking(s, 1) == 0) {
+                if (connect(s, ai->ai_addr, (socklen_t)ai->ai_addrlen) == 0) {
+                    winner = s;
+                    break;
+                }
+                if (connect_in_progress()) {
+                    attempt[active++] = s;
+                    next_start = now + HE_ATTEMPT_DELAY_MS;
+                    continue;
+                }
+            }
+            if (s != sock_invalid_net) close_socket_net(s);
+            continue; /* failed synchronously: try the next address now */
+        }
+        if (active == 0) break; /* every candidate failed */
+
+        struct pollfd pfd[HE_MAX_ATTEMPTS];
+        for (int i = 0; i < active; i++) {
+            pfd[i].fd = attempt[i];
+            pfd[i].events = POLLOUT;
+            pfd[i].revents = 0;
+        }
+        uint64_t until = (next < ncand) ? next_start : deadline;
+        int wait_ms = until > now ? (int)(until - now) : 0;
+#ifdef _WIN32
+        int r = WSAPoll(pfd, (ULONG)active, wait_ms);
+#else
+        int r = poll(pfd, (nfds_t)active, wait_ms);
+#endif
+        if (r > 0) {
+            for (int i = active - 1; i >= 0; i--) {
+                if (!pfd[i].revents) continue;
+                int err = 0;
+                socklen_t el = sizeof(err);
+                getsockopt(attempt[i], SOL_SOCKET, SO_ERROR, (char*)&err, &el);
+                if (err == 0 && winner == sock_invalid_net) {
+                    winner = attempt[i];
+                } else {
+                    close_socket_net(attempt[i]);
+                    next_start = 0; /* a failure releases the next attempt at once */
+                }
+                attempt[i] = attempt[--active];
+            }
+        }
+        now = get_time_ms();
+    }
+
+    for (int i = 0; i < active; i++) close_socket_net(attempt[i]);
+    freeaddrinfo(res);
+
+    if (winner != sock_invalid_net) net_set_nonblocking(winner, 0);
+    return winner;
+}
+
+/* ---------- local interface discovery ---------- */
+
+static net_local_addr_t local_cache[NET_MAX_LOCAL_ADDRS];
+static int local_cache_count = 0;
+static volatile int local_cache_valid = 0;
+
+static int addr_scope(const struct sockaddr *sa) {
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in*)sa;
+        return (ntohl(in->sin_addr.s_addr) >> 24) == 127 ? 3 : 0;
+    }
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6*)sa;
+    if (IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr)) return 3;
+    if (IN6_IS_ADDR_LINKLOCAL(&in6->sin6_addr)) return 2;
+    return 1;
+}
+
+static void cache_add(const char *ifname, const struct sockaddr *sa) {
+    if (local_cache_count >= NET_MAX_LOCAL_ADDRS) return;
+    if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6) return;
+
+    net_local_addr_t *e = &local_cache[local_cache_count];
+    socklen_t len = (sa->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6)
+                                                : sizeof(struct sockaddr_in);
+    if (getnameinfo(sa, len, e->addr, sizeof(e->addr), NULL, 0, NI_NUMERICHOST) != 0) return;
+    snprintf(e->ifname, sizeof(e->ifname), "%s", ifname);
+    e->family = sa->sa_family;
+    e->scope = addr_scope(sa);
+    local_cache_count++;
+}
+
+static void enumerate_local_addrs(void) {
+    local_cache_count = 0;
+#ifdef _WIN32
+    /* No getifaddrs: resolve our own host name numerically. Windows answers
+     * this from its local adapter table rather than a DNS query. */
+    char host[256];
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    if (gethostname(host, sizeof(host)) == 0 && getaddrinfo(host, NULL, &hints, &res) == 0) {
+        for (struct addrinfo *ai = res; ai; ai = ai->ai_next) cache_add("", ai->ai_addr);
+        freeaddrinfo(res);
+    }
+#else
+    struct ifaddrs *ifa_list = NULL;
+    if (getifaddrs(&ifa_list) != 0) return;
+    for (struct ifaddrs *ifa = ifa_list; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr) continue;
+        if (!(ifa->ifa_flags & IFF_UP) || !(ifa->ifa_flags & IFF_RUNNING)) continue;
+        cache_add(ifa->ifa_name, ifa->ifa_addr);
+    }
+    freeifaddrs(ifa_list);
+#endif
+
+    /* Stable insertion sort by scope: LAN IPv4 first, loopback last */
+    for (int i = 1; i < local_cache_count; i++) {
+        net_local_addr_t tmp = local_cache[i];
+        int j = i - 1;
+        while (j >= 0 && local_cache[j].scope > tmp.scope) {
+            local_cache[j + 1] = local_cache[j];
+            j--;
+        }
+        local_cache[j + 1] = tmp;
+    }
+}
+
+int net_local_addrs(net_local_addr_t *out, int cap) {
+    if (!local_cache_valid) {
+        enumerate_local_addrs();
+        local_cache_valid = 1;
+    }
+    int n = local_cache_count < cap ? local_cache_count : cap;
+    memcpy(out, local_cache, (size_t)n * sizeof(*out));
+    return n;
+}
+
+void net_local_addrs_refresh(void) {
+    local_cache_valid = 0;
+}
+
+void net_primary_local_ip(char *buf, size_t buflen) {
+    net_local_addr_t first;
+    if (net_local_addrs(&first, 1) == 1)
+        snprintf(buf, buflen, "%s", first.addr);
+    else
+        snprintf(buf, buflen, "Unknown");
+}
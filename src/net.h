@@ -0,0 +1,149 @@
+/*
+ * net.h - Socket helpers shared by the chat front-ends
+ *
+ * TCP is a byte stream, so every encrypted message is sent as a frame:
+ * a 4-byte big-endian length followed by that many ciphertext bytes.
+ *
+ * Addressing is family-agnostic: peers are resolved with getaddrinfo,
+ * listeners are dual-stack IPv6 sockets where the OS allows it, and
+ * outgoing TCP connections race every resolved address (Happy Eyeballs).
+ */
+
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "utils.h"
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+#else
+    #include <sys/socket.h>
+    #include <netdb.h>
+#endif
+
+#define FRAME_HDR_LEN 4
+#define FRAME_MAX_LEN (1 << 20)   /* Reject frames larger than 1 MiB */
+
+#define NET_ADDRSTRLEN 64         /* Fits "[v6-address%scope]:port" */
+#define HE_ATTEMPT_DELAY_MS 250   /* RFC 8305 recommended Connection Attempt Delay */
+#define HE_MAX_ATTEMPTS 16        /* Addresses raced per connect */
+#define HE_CONNECT_TIMEOUT_MS 10000
+#define NET_MAX_LOCAL_ADDRS 32    /* Interface addresses kept in the cache */
+#define NET_BUSY_POLL_US 50       /* SO_BUSY_POLL per receive, as the kernel docs suggest */
+
+/* One usable local interface address */
+typedef struct {
+    char ifname[32];              /* Interface name, e.g. "eth0" */
+    int family;                   /* AF_INET or AF_INET6 */
+    int scope;                    /* Lower is preferred: 0 LAN v4, 1 global v6, 2 link-local v6, 3 loopback */
+    char addr[NET_ADDRSTRLEN];    /* Numeric address */
+} net_local_addr_t;
+
+/* Send exactly len bytes; returns 0 on success, -1 on error */
+int net_send_all(sock_t s, const void *buf, size_t len);
+
+/* Receive exactly len bytes; returns 1 on success, 0 if the peer closed, -1 on error */
+int net_recv_all(sock_t s, void *buf, size_t len);
+
+/* Send one length-prefixed frame; returns 0 on success, -1 on error */
+int net_send_frame(sock_t s, const unsigned char *payload, int len);
+
+/* Receive one frame into buf; returns payload length, 0 if the peer closed, -1 on error */
+int net_recv_frame(sock_t s, unsigned char *buf, int cap);
+
+/* Resolve host/port for the given socket type (SOCK_STREAM / SOCK_DGRAM).
+ * Returns 0 on success; free the list with freeaddrinfo(). */
+int net_resolve(const char *host, int port, int socktype, struct addrinfo **out);
+
+/* Non-zero if host is an IPv4/IPv6 literal or a resolvable name */
+int net_validate_host(const char *host);
+
+/* Format an address as "a.b.c.d:port" or "[v6]:port" */
+void net_format_addr(const struct sockaddr *sa, char *buf, size_t buflen);
+
+/* Create a socket bound to the wildcard address on port. Prefers a
+ * dual-stack IPv6 socket and falls back to IPv4. If reuseport is set,
+ * SO_REUSEPORT is enabled before bind. Returns sock_invalid on failure. */
+sock_t net_bind_any(int socktype, int port, int reuseport);
+
+/* Switch O_NONBLOCK (FIONBIO) on or off; 0 on success */
+int net_set_nonblocking(sock_t s, int on);
+
+/* Connect to host:port over TCP, racing all resolved addresses with a
+ * staggered start (RFC 8305) and keeping the first to complete. With a
+ * single candidate and tfo set, TCP_FASTOPEN_CONNECT is used instead.
+ * Returns a blocking, connected socket or sock_invalid. */
+sock_t net_connect_happy(const char *host, int port, int tfo);
+
+/* List usable local addresses, best first. Enumerates interfaces directly
+ * (getifaddrs) without touching DNS; the result is cached after the first
+ * call. Returns the number of entries written to out. */
+int net_local_addrs(net_local_addr_t *out, int cap);
+
+/* Kernel's smoothed RTT for a TCP socket in microseconds; 0 if unknown */
+int net_tcp_rtt_us(sock_t s);
+
+/* Bytes written to a TCP socket that the peer has not acknowledged yet;
+ * -1 where the OS does not report it */
+long net_unacked_bytes(sock_t s);
+
+/* Raise SO_SNDBUF / SO_RCVBUF to at least the given sizes; 0 leaves one
+ * alone. Never shrinks, so kernel autotuning keeps what it grew. */
+void net_grow_buffers(sock_t s, int sndbuf, int rcvbuf);
+
+/* Have receives on s poll the device queue for up to us microseconds
+ * instead of sleeping until the interrupt (SO_BUSY_POLL, plus
+ * SO_PREFER_BUSY_POLL where the headers know it). Linux only; values above
+ * net.core.busy_read need CAP_NET_ADMIN. 0 on success. */
+int net_set_busy_poll(sock_t s, int us);
+
+/* Spin on non-blocking peeks for up to idle_us. Returns 1 as soon as a
+ * receive on s won't block (data, end of stream or an error to report),
+ * 0 once idle_us has passed without (at once where MSG_DONTWAIT is
+ * missing). */
+int net_busy_wait(sock_t s, int idle_us);
+
+/* Spin-loop hint: let a sibling hyperthread run, save power */
+void net_cpu_relax(void);
+
+/*
+ * MSG_ZEROCOPY transmit (Linux 4.14+). The kernel pins the caller's pages
+ * instead of copying them, so a buffer handed to net_zc_send must not be
+ * touched until its id shows up as completed (net_zc_done). Completions
+ * arrive on the socket error queue; net_zc_reap drains them.
+ */
+typedef struct {
+    sock_t sock;
+    int enabled;            /* SO_ZEROCOPY accepted by the socket */
+    int copied;             /* Kernel fell back to copying (e.g. loopback) */
+    uint32_t next_id;       /* Id the kernel assigns to the next zerocopy send */
+    uint32_t done_upto;     /* Every id below this has completed */
+    uint32_t sends;         /* Zerocopy send calls made */
+} net_zc_t;
+
+/* Enable SO_ZEROCOPY on s; returns 0 if zerocopy sends can be used */
+int net_zc_init(net_zc_t *zc, sock_t s);
+
+/* Send buf with MSG_ZEROCOPY, as much as the socket takes (all of it when
+ * blocking). Returns the bytes sent, or -1 on error, or with errno EAGAIN
+ * when a non-blocking socket took nothing. If *pinned comes back set, buf
+ * stays in use until *last_id completes; otherwise the bytes were copied. */
+long net_zc_send(net_zc_t *zc, const void *buf, size_t len, uint32_t *last_id, int *pinned);
+
+/* Non-zero once the send with this id has completed */
+int net_zc_done(const net_zc_t *zc, uint32_t id);
+
+/* Drain completion notifications, waiting up to wait_ms for the first one.
+ * Returns the number of notifications read, or -1 on error. */
+int net_zc_reap(net_zc_t *zc, int wait_ms);
+
+/* Drop the cached interface list so the next lookup re-enumerates */
+void net_local_addrs_refresh(void);
+
+/* Best local address for display ("Unknown" if none) */
+void net_primary_local_ip(char *buf, size_t buflen);
+
+#endif /* NET_H */
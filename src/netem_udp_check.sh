@@ -0,0 +1,55 @@
+#!/bin/sh
+# netem_udp_check.sh - Run udp_chat through p2pchat_netem and check delivery
+#
+# Usage: ./netem_udp_check.sh [seed] [messages]
+#
+# Starts a udp_chat server on 9000, the emulator on 9100 (20% loss, reorder,
+# duplication, jitter) and a client through it, sends numbered messages and
+# checks the server printed every one of them exactly once and in order.
+# The same seed impairs the same packets on every run. Needs ./udp_chat and
+# ./p2pchat_netem built as in the README. Exit status 0 on success.
+
+SEED=${1:-3}
+COUNT=${2:-30}
+SPORT=9000
+NPORT=9100
+TMP=${TMPDIR:-/tmp}/netem_udp_check.$$
+mkdir -p "$TMP" || exit 1
+
+./p2pchat_netem -s "$SEED" -l 20 -d 10 -j 5 -r 5 -D 5 -T 40 $NPORT 127.0.0.1 $SPORT > "$TMP/netem.log" 2>&1 &
+NETEM=$!
+(printf 'server\n%s\n' $SPORT; sleep 30) | P2P_OUTBOX=0 ./udp_chat > "$TMP/server.log" 2>&1 &
+SERVER=$!
+sleep 1
+
+(printf 'client\n%s\n127.0.0.1\n' $NPORT
+ i=1
+ while [ $i -le "$COUNT" ]; do
+     printf 'msg %d\n' $i
+     i=$((i + 1))
+ done
+ sleep 20) | P2P_OUTBOX=0 ./udp_chat > "$TMP/client.log" 2>&1 &
+CLIENT=$!
+
+# Wait until the server has shown everything, or give up after 25 s
+t=0
+while [ $t -lt 25 ]; do
+    [ "$(grep -c '^Peer: msg ' "$TMP/server.log")" -ge "$COUNT" ] && break
+    sleep 1
+    t=$((t + 1))
+done
+kill $CLIENT $SERVER $NETEM 2>/dev/null
+wait $CLIENT $SERVER $NETEM 2>/dev/null
+
+grep '^Peer: msg ' "$TMP/server.log" | sed 's/^Peer: msg //' > "$TMP/got"
+i=1
+while [ $i -le "$COUNT" ]; do echo $i; i=$((i + 1)); done > "$TMP/want"
+
+if cmp -s "$TMP/got" "$TMP/want"; then
+    echo "[INFO] seed $SEED: all $COUNT messages delivered once, in order."
+    rm -rf "$TMP"
+    exit 0
+fi
+echo "[ERROR] seed $SEED: delivered $(wc -l < "$TMP/got") of $COUNT messages; logs in $TMP" >&2
+diff "$TMP/want" "$TMP/got" | head -20 >&2
+exit 1
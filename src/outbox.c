@@ -0,0 +1,269 @@
+/*
+ * outbox.c - Durable outbox for messages the peer has not acknowledged
+ *
+ * Log record: [u32 body_len][u8 type][u64 id][text], big-endian, where
+ * body_len covers type + id + text. Type 'M' enqueues a message, 'A'
+ * acknowledges one. A torn record at the tail (crash mid-append) ends
+ * recovery; the log is then rewritten with just the pending messages.
+ * Delivery is at-least-once: a crash can resurrect acknowledged entries
+ * (ACK records and truncation are not synced), never lose pending ones.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "outbox.h"
+#include "wal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    typedef CRITICAL_SECTION ob_mutex_t;
+#else
+    #include <pthread.h>
+    typedef pthread_mutex_t ob_mutex_t;
+#endif
+
+#define REC_HDR_LEN 13
+#define REC_MSG 'M'
+#define REC_ACK 'A'
+
+typedef struct {
+    uint64_t id;
+    uint64_t ticket;           /* WAL commit ticket of its record */
+    char *text;
+} pending_t;
+
+struct outbox {
+    wal_t *wal;
+    ob_mutex_t lock;
+    pending_t pending[OUTBOX_MAX_PENDING];
+    int count;
+    uint64_t next_id;
+};
+
+static void ob_lock(outbox_t *ob) {
+#ifdef _WIN32
+    EnterCriticalSection(&ob->lock);
+#else
+    pthread_mutex_lock(&ob->lock);
+#endif
+}
+static void ob_unlock(outbox_t *ob) {
+#ifdef _WIN32
+    LeaveCriticalSection(&ob->lock);
+#else
+    pthread_mutex_unlock(&ob->lock);
+#endif
+}
+
+static size_t encode_record(unsigned char *out, char type, uint64_t id, const char *text, size_t text_len) {
+    uint32_t body = (uint32_t)(1 + 8 + text_len);
+    out[0] = (unsigned char)(body >> 24);
+    out[1] = (unsigned char)(body >> 16);
+    out[2] = (unsigned char)(body >> 8);
+    out[3] = (unsigned char)body;
+    out[4] = (unsigned char)type;
+    for (int i = 0; i < 8; i++) out[5 + i] = (unsigned char)(id >> (56 - 8 * i));
+    if (text_len) memcpy(out + REC_HDR_LEN, text, text_len);
+    return REC_HDR_LEN + text_len;
+}
+
+static int remove_pending(outbox_t *ob, uint64_t id) {
+    for (int i = 0; i < ob->count; i++) {
+        if (ob->pending[i].id == id) {
+            free(ob->pending[i].text);
+            memmove(&ob->pending[i], &ob->pending[i + 1], (size_t)(ob->count - i - 1) * sizeof(pending_t));
+            ob->count--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Rewrite the log with only the pending messages (caller holds lock) */
+static int compact(outbox_t *ob) {
+    size_t cap = 1, len = 0;
+    for (int i = 0; i < ob->count; i++) cap += REC_HDR_LEN + strlen(ob->pending[i].text);
+    unsigned char *buf = (unsigned char*)malloc(cap);
+    if (!buf) return -1;
+    for (int i = 0; i < ob->count; i++)
+        len += encode_record(buf + len, REC_MSG, ob->pending[i].id,
+                             ob->pending[i].text, strlen(ob->pending[i].text));
+    int rc = wal_replace(ob->wal, buf, len);
+    free(buf);
+    return rc;
+}
+
+/* Replay the existing log into the pending list; returns 1 if it had
+ * anything besides pending messages (acks or a torn tail) */
+static int recover(outbox_t *ob, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+
+    int dirty = 0;
+    unsigned char hdr[REC_HDR_LEN];
+    char *text = (char*)malloc(OUTBOX_MAX_MSG);
+    while (text && fread(hdr, 1, REC_HDR_LEN, f) == REC_HDR_LEN) {
+        uint32_t body = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) |
+                        ((uint32_t)hdr[2] << 8) | (uint32_t)hdr[3];
+        uint64_t id = 0;
+        for (int i = 0; i < 8; i++) id = (id << 8) | hdr[5 + i];
+        if (body < 9 || body - 9 >= OUTBOX_MAX_MSG) { dirty = 1; break; }
+
+        size_t text_len = body - 9;
+        if (fread(text, 1, text_len, f) != text_len) { dirty = 1; break; }
+        text[text_len] = '\0';
+
+        if (id >= ob->next_id) ob->next_id = id + 1;
+        if (hdr[4] == REC_MSG && ob->count < OUTBOX_MAX_PENDING) {
+            ob->pending[ob->count].id = id;
+            ob->pending[ob->count].ticket = 0;   /* on disk already */
+            ob->pending[ob->count].text = strdup(text);
+            if (ob->pending[ob->count].text) ob->count++;
+        } else {
+            if (hdr[4] == REC_ACK) remove_pending(ob, id);
+            dirty = 1;
+        }
+    }
+    if (!feof(f)) dirty = 1;
+    free(text);
+    fclose(f);
+    return dirty;
+}
+
+outbox_t *outbox_open(const char *path, int commit_window_ms) {
+    outbox_t *ob = (outbox_t*)calloc(1, sizeof(*ob));
+    if (!ob) return NULL;
+    ob->next_id = 1;
+#ifdef _WIN32
+    InitializeCriticalSection(&ob->lock);
+#else
+    pthread_mutex_init(&ob->lock, NULL);
+#endif
+
+    int dirty = recover(ob, path);
+    ob->wal = wal_open(path, commit_window_ms);
+    if (!ob->wal) {
+        outbox_close(ob);
+        return NULL;
+    }
+    if (dirty) compact(ob);
+    return ob;
+}
+
+uint64_t outbox_push(outbox_t *ob, const char *text) {
+    size_t text_len = strlen(text);
+    if (text_len >= OUTBOX_MAX_MSG) text_len = OUTBOX_MAX_MSG - 1;
+
+    unsigned char rec[REC_HDR_LEN + OUTBOX_MAX_MSG];
+    ob_lock(ob);
+    if (ob->count >= OUTBOX_MAX_PENDING) {
+        ob_unlock(ob);
+        fprintf(stderr, "[WARN] Outbox full (%d messages pending).\n", OUTBOX_MAX_PENDING);
+        return 0;
+    }
+    char *copy = (char*)malloc(text_len + 1);
+    if (!copy) {
+        ob_unlock(ob);
+        return 0;
+    }
+    memcpy(copy, text, text_len);
+    copy[text_len] = '\0';
+
+    uint64_t id = ob->next_id++;
+    size_t len = encode_record(rec, REC_MSG, id, copy, text_len);
+    uint64_t ticket = wal_append(ob->wal, rec, len);
+    if (ticket == 0) {
+        ob_unlock(ob);
+        free(copy);
+        return 0;
+    }
+    ob->pending[ob->count].id = id;
+    ob->pending[ob->count].ticket = ticket;
+    ob->pending[ob->count].text = copy;
+    ob->count++;
+    ob_unlock(ob);
+    return id;
+}
+
+int outbox_sync(outbox_t *ob, uint64_t id) {
+    uint64_t ticket = 0;
+    ob_lock(ob);
+    for (int i = 0; i < ob->count; i++) {
+        if (ob->pending[i].id == id) ticket = ob->pending[i].ticket;
+    }
+    ob_unlock(ob);
+    if (ticket == 0) return 0;
+
+    /* Wait outside the lock so concurrent pushes share one sync */
+    if (wal_wait(ob->wal, ticket) != 0) {
+        fprintf(stderr, "[WARN] Outbox sync failed; message %llu may not survive a crash.\n",
+                (unsigned long long)id);
+        return -1;
+    }
+    return 0;
+}
+
+int outbox_ack(outbox_t *ob, uint64_t id) {
+    ob_lock(ob);
+    int found = remove_pending(ob, id);
+    if (found) {
+        if (ob->count == 0) {
+            wal_truncate(ob->wal);          /* everything delivered */
+        } else if (wal_size(ob->wal) > OUTBOX_COMPACT_BYTES) {
+            compact(ob);
+        } else {
+            /* Lazy: a lost ACK record only means a duplicate after a crash */
+            unsigned char rec[REC_HDR_LEN];
+            wal_append(ob->wal, rec, encode_record(rec, REC_ACK, id, NULL, 0));
+        }
+    }
+    ob_unlock(ob);
+    return found;
+}
+
+int outbox_pending_after(outbox_t *ob, uint64_t after_id, outbox_entry_t *out, int cap) {
+    int n = 0;
+    ob_lock(ob);
+    for (int i = 0; i < ob->count && n < cap; i++) {
+        if (ob->pending[i].id <= after_id) continue;
+        out[n].id = ob->pending[i].id;
+        snprintf(out[n].text, sizeof(out[n].text), "%s", ob->pending[i].text);
+        n++;
+    }
+    ob_unlock(ob);
+    return n;
+}
+
+int outbox_count(outbox_t *ob) {
+    ob_lock(ob);
+    int n = ob->count;
+    ob_unlock(ob);
+    return n;
+}
+
+void outbox_path_for(char *out, size_t out_sz, const char *dir, const char *proto, const char *peer) {
+    char safe[128];
+    size_t j = 0;
+    for (size_t i = 0; peer[i] && j < sizeof(safe) - 1; i++) {
+        char c = peer[i];
+        int ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '-';
+        safe[j++] = ok ? c : '_';
+    }
+    safe[j] = '\0';
+    snprintf(out, out_sz, "%s/outbox_%s_%s.wal", dir, proto, safe);
+}
+
+void outbox_close(outbox_t *ob) {
+    if (!ob) return;
+    if (ob->wal) wal_close(ob->wal);
+    for (int i = 0; i < ob->count; i++) free(ob->pending[i].text);
+#ifdef _WIN32
+    DeleteCriticalSection(&ob->lock);
+#else
+    pthread_mutex_destroy(&ob->lock);
+#endif
+    free(ob);
+}
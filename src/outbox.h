@@ -0,0 +1,58 @@
+/*
+ * outbox.h - Durable outbox for messages the peer has not acknowledged
+ *
+ * Every outgoing chat message is appended to a write-ahead log before it
+ * is sent, and an ACK record is appended once the peer acknowledges it.
+ * Entries survive restarts and are redelivered, in order, the next time
+ * the peer is reachable. The log shrinks back to empty whenever nothing
+ * is pending, and is compacted once acknowledged records pile up.
+ */
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OUTBOX_MAX_PENDING 1024             /* Unacknowledged messages kept */
+#define OUTBOX_MAX_MSG 4096                 /* Longest message stored */
+#define OUTBOX_COMPACT_BYTES (256 * 1024)   /* Rewrite the log past this size */
+#define OUTBOX_DEFAULT_SYNC_MS 5            /* Group commit window */
+#define OUTBOX_RETRY_MS 3000                /* Reconnect interval while the peer is down */
+
+/* A pending message as returned by outbox_pending_after */
+typedef struct {
+    uint64_t id;
+    char text[OUTBOX_MAX_MSG];
+} outbox_entry_t;
+
+typedef struct outbox outbox_t;
+
+/* Open or recover the outbox at path. commit_window_ms is passed to the
+ * WAL (WAL_NO_SYNC keeps appends in the page cache). NULL on error. */
+outbox_t *outbox_open(const char *path, int commit_window_ms);
+
+/* Enqueue text; returns its id (ids increase), or 0 on failure. The record
+ * is written but not necessarily durable yet, so the caller can send it
+ * at once and call outbox_sync afterwards. */
+uint64_t outbox_push(outbox_t *ob, const char *text);
+
+/* Block until the push that returned id is durable (or the entry is
+ * already acknowledged); 0 on success */
+int outbox_sync(outbox_t *ob, uint64_t id);
+
+/* Mark id delivered; returns 1 if it was pending */
+int outbox_ack(outbox_t *ob, uint64_t id);
+
+/* Copy up to cap pending entries with id > after_id, oldest first */
+int outbox_pending_after(outbox_t *ob, uint64_t after_id, outbox_entry_t *out, int cap);
+
+/* Number of pending entries */
+int outbox_count(outbox_t *ob);
+
+/* Build the per-peer outbox path "<dir>/outbox_<proto>_<peer>.wal" */
+void outbox_path_for(char *out, size_t out_sz, const char *dir, const char *proto, const char *peer);
+
+void outbox_close(outbox_t *ob);
+
+#endif /* OUTBOX_H */
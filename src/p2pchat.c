@@ -2,13 +2,16 @@
  * p2pchat.c — Cross-platform P2P chat with Encryption + Performance Monitor
  *
  * Save as: p2pchat.c
- * Build (Linux/macOS): gcc -pthread p2pchat.c encryption.c utils.c -o p2pchat -lcrypto -lssl
- * Build (Windows MinGW): gcc p2pchat.c encryption.c utils.c -o p2pchat.exe -lws2_32 -lcrypto -lssl
+ * Build (Linux/macOS): gcc -pthread p2pchat.c encryption.c utils.c net.c discovery.c outbox.c wal.c session.c hwcount.c statshm.c pool.c reactor.c affinity.c engine.c -o p2pchat -lcrypto -lssl
+ * Build (Windows MinGW): gcc p2pchat.c encryption.c utils.c net.c discovery.c outbox.c wal.c session.c hwcount.c statshm.c pool.c reactor.c affinity.c engine.c -o p2pchat.exe -lws2_32 -lcrypto -lssl
  *
  * Features:
  *  - Part 1: Core TCP socket communication (server/client)
  *  - Part 2: AES-256-CBC encryption with password
  *  - Part 3: Latency measurement and performance monitoring
+ *
+ * The protocol itself (handshake, resumption, framing, files) lives in
+ * engine.c; this is its terminal front end.
  */
 
 #define _CRT_SECURE_NO_WARNINGS
@@ -18,8 +21,18 @@
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
-#include "encryption.h"
 #include "utils.h"
+#include "net.h"
+#include "discovery.h"
+#include "outbox.h"
+#include "wal.h"
+#include "session.h"
+#include "probes.h"
+#include "hwcount.h"
+#include "pool.h"
+#include "reactor.h"
+#include "affinity.h"
+#include "engine.h"
 
 const char *SECRET_KEY = "admin123";
 
@@ -53,14 +66,13 @@ const char *SECRET_KEY = "admin123";
 #endif
 
 /* Common */
-#define RECV_BUF 4096
 #define SEND_BUF 4096
 #define LOG_DIR "../logs"
 #define LOG_FILE "../logs/chatlog.txt"
+#define HISTORY_FILE "../logs/chat_history.txt"
 
 static volatile int running = 1;
-static sock_t conn_sock = sock_invalid;
-static unsigned char derived_key[ENC_KEY_LEN];
+static char peer_name[NET_ADDRSTRLEN] = "unknown"; /* Current peer, keys the per-peer stats */
 
 /* Cross-platform thread & mutex types */
 #ifdef _WIN32
@@ -155,43 +167,68 @@ static void ensure_logs_dir(void) {
 
 /* thread-safe logging */
 static void log_message(const char *fmt, ...) {
+    hw_mark_t hw;
+    hw_begin(&hw);
     ensure_logs_dir();
     mutex_lock(&log_mutex);
     FILE *f = fopen(LOG_FILE, "a");
     if (!f) {
         perror("[ERROR] fopen log");
         mutex_unlock(&log_mutex);
+        hw_end(&hw, HW_STAGE_LOGGING);
         return;
     }
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(f, fmt, ap);
+    int written = vfprintf(f, fmt, ap);
     fprintf(f, "\n");
     va_end(ap);
     fclose(f);
+    P2P_PROBE1(log__write, written + 1);
     mutex_unlock(&log_mutex);
+    hw_end(&hw, HW_STAGE_LOGGING);
 }
 
-/* Save chat history to a separate file */
-static void save_history(const char *who, int seq, const char *msg) {
+/*
+ * Chat history goes through a WAL so it can be made durable without an
+ * fsync per line: with P2P_HISTORY_SYNC_MS >= 0 one fdatasync covers every
+ * line appended within that window. P2P_HISTORY_WAIT=1 makes senders wait
+ * for their line's commit before moving on (one wait per batch, see
+ * history_commit).
+ */
+static wal_t *history = NULL;
+static int history_wait = 0;
+static uint64_t history_ticket = 0;  /* last append by the sending side */
+
+static void open_history(void) {
     ensure_logs_dir();
-    mutex_lock(&log_mutex);
-    FILE *f = fopen("../logs/chat_history.txt", "a");
-    if (!f) {
-        perror("[ERROR] fopen history");
-        mutex_unlock(&log_mutex);
-        return;
-    }
+    int sync_ms = cfg_env_int("P2P_HISTORY_SYNC_MS", WAL_NO_SYNC);
+    history = wal_open(HISTORY_FILE, sync_ms < 0 ? WAL_NO_SYNC : sync_ms);
+    history_wait = sync_ms >= 0 && cfg_env_int("P2P_HISTORY_WAIT", 0);
+}
+
+/* Save chat history to a separate file; returns the commit ticket (0 on error) */
+static uint64_t save_history(const char *who, int seq, const char *msg) {
+    if (!history) return 0;
     time_t now = time(NULL);
     char ts[32];
     strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    fprintf(f, "[%s] %s (seq=%d): %s\n", ts, who, seq, msg);
-    fclose(f);
-    mutex_unlock(&log_mutex);
+    char line[SEND_BUF + 96];
+    int n = snprintf(line, sizeof(line), "[%s] %s (seq=%d): %s\n", ts, who, seq, msg);
+    if (n < 0) return 0;
+    if ((size_t)n >= sizeof(line)) n = (int)sizeof(line) - 1;
+    uint64_t ticket = wal_append(history, line, (size_t)n);
+    if (!ticket) fprintf(stderr, "[ERROR] Failed to save history.\n");
+    return ticket;
+}
+
+/* With P2P_HISTORY_WAIT, block until everything sent so far is on disk */
+static void history_commit(void) {
+    if (history_wait && history_ticket) wal_wait(history, history_ticket);
 }
 
 void view_chat_history() {
-    FILE *fp = fopen("../logs/chat_history.txt", "r");
+    FILE *fp = fopen(HISTORY_FILE, "r");
     if (!fp) {
         printf("No chat history found.\n");
         return;
@@ -211,45 +248,6 @@ static void ensure_downloads_dir(void) {
     mkdir_path("../downloads");
 }
 
-void send_file(sock_t sock, const char *filepath, unsigned char *key) {
-    FILE *f = fopen(filepath, "rb");
-    if (!f) {
-        perror("[ERROR] fopen");
-        return;
-    }
-
-    // Get file size
-    fseek(f, 0, SEEK_END);
-    long filesize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    // Send a header first: "FILE:<filename>:<size>"
-    char filename[256];
-    const char *slash = strrchr(filepath, '/');
-    if (!slash) slash = strrchr(filepath, '\\');
-    if (slash) strcpy(filename, slash + 1);
-    else strcpy(filename, filepath);
-
-    char header[512];
-    snprintf(header, sizeof(header), "FILE:%s:%ld", filename, filesize);
-    unsigned char encrypted_header[SEND_BUF];
-    int enc_len = encrypt_message((unsigned char*)header, strlen(header), key, encrypted_header, SEND_BUF);
-    send(sock, (const char*)encrypted_header, enc_len, 0);
-
-    // Send file in chunks
-    unsigned char buf[1024];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
-        unsigned char enc_chunk[2048];
-        int enc_chunk_len = encrypt_message(buf, n, key, enc_chunk, sizeof(enc_chunk));
-        send(sock, (const char*)enc_chunk, enc_chunk_len, 0);
-    }
-
-    fclose(f);
-    printf("[INFO] File '%s' sent successfully.\n", filename);
-}
-
-
 /* portable sleep ms */
 static void sleep_ms(int ms) {
 #ifdef _WIN32
@@ -272,284 +270,465 @@ static int parse_port(const char *s, int *out_port) {
     return 1;
 }
 
+/* Accepts IPv4/IPv6 literals and host names */
 static int validate_ip(const char *ip) {
-    if (!ip || !*ip) return 0;
-    struct in_addr addr;
-    return inet_pton(AF_INET, ip, &addr) == 1;
+    return net_validate_host(ip);
 }
 
-/* Get local LAN IP (IPv4) */
-static void get_local_ip(char *buffer, size_t buflen) {
-    char host[256];
-    if (gethostname(host, sizeof(host)) == -1) {
-        strncpy(buffer, "Unknown", buflen);
+/* Print every usable local address (interface list, no DNS), best first */
+static void print_local_addrs(const char *label) {
+    net_local_addr_t addrs[NET_MAX_LOCAL_ADDRS];
+    int n = net_local_addrs(addrs, NET_MAX_LOCAL_ADDRS);
+    if (n == 0) {
+        printf("[INFO] %s: Unknown\n", label);
         return;
     }
-
-    struct hostent *host_entry = gethostbyname(host);
-    if (!host_entry) {
-        strncpy(buffer, "Unknown", buflen);
-        return;
+    for (int i = 0; i < n; i++) {
+        if (addrs[i].scope == 3 && i > 0) continue; /* loopback only if nothing else */
+        printf("[INFO] %s: %s%s%s%s\n", label, addrs[i].addr,
+               addrs[i].ifname[0] ? " (" : "", addrs[i].ifname, addrs[i].ifname[0] ? ")" : "");
     }
+}
+
 
-    const char *ip = inet_ntoa(*(struct in_addr*)host_entry->h_addr_list[0]);
-    strncpy(buffer, ip, buflen);
+/* ---------- LAN discovery ---------- */
+
+static int discovery_enabled = 0;
+
+/* Name we announce: P2P_NAME, else the host name */
+static void discovery_name(char *out, size_t out_sz) {
+    const char *name = getenv("P2P_NAME");
+    if (name && *name) {
+        snprintf(out, out_sz, "%s", name);
+    } else if (gethostname(out, (int)out_sz) != 0) {
+        snprintf(out, out_sz, "peer");
+    }
+    out[out_sz - 1] = '\0';
 }
 
+static void print_discovered_peers(void) {
+    static disc_peer_t list[DISC_MAX_PEERS];
+    int n = discovery_list(list, DISC_MAX_PEERS);
+    printf("\n===== LAN Peers (%d) =====\n", n);
+    uint64_t now = get_time_ms();
+    for (int i = 0; i < n; i++) {
+        printf("  %-20s %s port %d (%s, seen %llus ago)\n", list[i].name, list[i].addr, list[i].port,
+               list[i].proto == 'U' ? "UDP" : "TCP",
+               (unsigned long long)((now - list[i].last_seen_ms) / 1000));
+    }
+    printf("==========================\n\n");
+}
 
-/* ---------- networking helpers ---------- */
+/* Offer discovered peers to the client. Returns 1 and fills host/port if
+ * the user picked one, 0 to fall back to manual entry, -1 on EOF. */
+static int choose_discovered_peer(char *host, size_t host_sz, int *port) {
+    discovery_query();
+    sleep_ms(DISC_QUERY_WAIT_MS);
+    print_discovered_peers();
 
-static sock_t start_server(int port) {
-    sock_t s;
-#ifdef _WIN32
-    s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (s == INVALID_SOCKET) {
-        fprintf(stderr, "[ERROR] socket: %d\n", WSAGetLastError());
-        return sock_invalid;
+    char name[DISC_NAME_LEN + 2];
+    printf("Connect to peer name (blank = enter address manually): ");
+    fflush(stdout);
+    if (!fgets(name, sizeof(name), stdin)) return -1;
+    trim_newline(name);
+    if (name[0] == '\0') return 0;
+
+    disc_peer_t peer;
+    if (!discovery_lookup(name, &peer) || peer.proto != 'T') {
+        printf("[WARN] No TCP peer named '%s' on the LAN.\n", name);
+        return 0;
     }
-#else
-    s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) {
-        perror("[ERROR] socket");
-        return sock_invalid;
+    snprintf(host, host_sz, "%s", peer.addr);
+    *port = peer.port;
+    return 1;
+}
+
+/* ---------- durable outbox ---------- */
+/*
+ * Every chat message is written to the outbox before it is sent and stays
+ * there until the peer ACKs it. Sends all go through flush_outbox(), which
+ * drains entries in id order, so queued and freshly typed messages can
+ * never overtake each other. If the client cannot reach the peer, typed
+ * messages simply accumulate until the engine thread gets through.
+ *
+ * Everything that touches the engine runs on the engine thread (or on
+ * main before that thread starts): the input loop hands lines and files
+ * over through cmd_queue and p2p_engine_wake.
+ */
+static outbox_t *outbox = NULL;
+static uint64_t last_sent_outbox_id = 0;   /* highest id sent on this connection */
+static volatile int connected = 0;
+static p2p_engine_t *engine = NULL;
+static p2p_session_t *peer = NULL;         /* The one session; engine thread only */
+static int is_server = 0;
+static int resume_enabled = 1;
+static int resume_tried = 0;               /* This session started with a ticket */
+
+/* Engine seq of each message in flight on this connection, with its outbox
+ * entry (0 if none) and the seq perf tracks its RTT under */
+typedef struct {
+    uint32_t seq;
+    uint64_t outbox_id;
+    uint32_t perf_seq;
+} sent_map_t;
+static sent_map_t sent_map[P2P_ENGINE_MAX_PENDING];
+static int outbox_stalled = 0;             /* The session was full; flush again on ACK */
+
+/* p2p_send refuses a message once P2P_ENGINE_MAX_PENDING are in flight, so
+ * a free slot is there unless some expired unacknowledged; those are the
+ * oldest entries, and the oldest gives way */
+static void remember_sent(uint32_t seq, uint64_t outbox_id, uint32_t perf_seq) {
+    int slot = 0;
+    for (int i = 0; i < P2P_ENGINE_MAX_PENDING; i++) {
+        if (!sent_map[i].seq) {
+            slot = i;
+            break;
+        }
+        if (sent_map[i].seq < sent_map[slot].seq) slot = i;
     }
-#endif
+    sent_map[slot].seq = seq;
+    sent_map[slot].outbox_id = outbox_id;
+    sent_map[slot].perf_seq = perf_seq;
+}
 
-    int opt = 1;
-    setsockopt((int)s, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+static void forget_sent(void) {
+    memset(sent_map, 0, sizeof(sent_map));
+    outbox_stalled = 0;
+}
 
-    struct sockaddr_in sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
-    sa.sin_port = htons((unsigned short)port);
+/* Log + save history once a chat message is queued to the engine */
+static void chat_sent(const char *line, int seq) {
+    char ts[16];
+    timestamp_now(ts, sizeof(ts));
+    log_message("%s You: %s (seq #%d)", ts, line, seq);
+    uint64_t ticket = save_history("YOU", seq, line);
+    if (ticket) history_ticket = ticket;
+}
 
-    if (bind((int)s, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
-#ifdef _WIN32
-        fprintf(stderr, "[ERROR] bind: %d\n", WSAGetLastError());
-        closesocket(s);
-#else
-        perror("[ERROR] bind");
-        close(s);
-#endif
-        return sock_invalid;
+/* Queue one chat line on the session. Returns its perf seq, -1 if the
+ * line is too long to send at all, -2 if the session can't take it now. */
+static int send_chat_message(const char *line, uint64_t outbox_id) {
+    if (strlen(line) > P2P_MAX_TEXT) {
+        fprintf(stderr, "[ERROR] Message too long.\n");
+        return -1;
     }
+    if (!peer) return -2;
+
+    hw_mark_t hw;
+    hw_begin(&hw);
+    int seq = p2p_send(peer, line);
+    hw_end(&hw, HW_STAGE_FRAMING);
+    if (seq < 0) return -2;
+
+    uint32_t pseq = perf_add_pending_message(line);
+    remember_sent((uint32_t)seq, outbox_id, pseq);
+    perf_trace("send", pseq, (int64_t)strlen(line));
+    perf_count(PERF_CTR_SENT, 1);
+    P2P_PROBE2(msg__send, pseq, strlen(line));
+    chat_sent(line, (int)pseq);
+    return (int)pseq;
+}
 
-    if (listen((int)s, 1) != 0) {
-#ifdef _WIN32
-        fprintf(stderr, "[ERROR] listen: %d\n", WSAGetLastError());
-        closesocket(s);
-#else
-        perror("[ERROR] listen");
-        close(s);
-#endif
-        return sock_invalid;
+/* Send every outbox entry not yet sent on this connection, oldest first,
+ * while the session takes them (early data is capped). Returns the number
+ * sent. */
+static int flush_outbox(void) {
+    static outbox_entry_t entry;   /* 4 KB; engine thread only */
+    int sent = 0;
+
+    while ((connected || (peer && p2p_session_early(peer))) &&
+           outbox_pending_after(outbox, last_sent_outbox_id, &entry, 1) == 1) {
+        int seq = send_chat_message(entry.text, entry.id);
+        if (seq == -2) {
+            outbox_stalled = connected;
+            break;
+        }
+        if (seq > 0) sent++;
+        last_sent_outbox_id = entry.id; /* -1: unencodable, skip rather than wedge */
     }
+    history_commit();
+    return sent;
+}
 
-    char local_ip[64];
-    get_local_ip(local_ip, sizeof(local_ip));
-    printf("[INFO] Server started.\n");
-    printf("[INFO] Your LAN IP: %s\n", local_ip);
-    printf("[INFO] Waiting for peer to connect on port %d...\n", port);
-    fflush(stdout);
+/* ---------- commands from the input loop ---------- */
 
+enum { CMD_CHAT, CMD_FILE };
 
-    struct sockaddr_in cli;
-    socklen_t len = sizeof(cli);
-    int c = (int)accept((int)s, (struct sockaddr*)&cli, &len);
-    if (c < 0) {
-#ifdef _WIN32
-        fprintf(stderr, "[ERROR] accept: %d\n", WSAGetLastError());
-        closesocket(s);
-#else
-        perror("[ERROR] accept");
-        close(s);
-#endif
-        return sock_invalid;
+typedef struct cmd {
+    struct cmd *next;
+    int kind;
+    char text[];
+} cmd_t;
+
+static mutex_t cmd_mutex;
+static cmd_t *cmd_head = NULL, *cmd_tail = NULL;
+
+/* Hand a line or a file path to the engine thread */
+static void post_command(int kind, const char *text) {
+    size_t len = strlen(text);
+    cmd_t *c = (cmd_t*)malloc(sizeof(*c) + len + 1);
+    if (!c) {
+        fprintf(stderr, "[ERROR] Out of memory.\n");
+        return;
     }
+    c->next = NULL;
+    c->kind = kind;
+    memcpy(c->text, text, len + 1);
+    mutex_lock(&cmd_mutex);
+    if (cmd_tail) cmd_tail->next = c;
+    else cmd_head = c;
+    cmd_tail = c;
+    mutex_unlock(&cmd_mutex);
+    p2p_engine_wake(engine);
+}
 
-    char ipstr[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &cli.sin_addr, ipstr, sizeof(ipstr));
-    printf("[CONNECTED] Peer connected from %s:%d\n", ipstr, ntohs(cli.sin_port));
-#ifdef _WIN32
-    closesocket(s);
-#else
-    close(s);
-#endif
-    return (sock_t)c;
+static cmd_t *take_commands(void) {
+    mutex_lock(&cmd_mutex);
+    cmd_t *c = cmd_head;
+    cmd_head = cmd_tail = NULL;
+    mutex_unlock(&cmd_mutex);
+    return c;
 }
 
-static sock_t start_client(const char *peer_ip, int peer_port) {
-    sock_t s;
-#ifdef _WIN32
-    s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (s == INVALID_SOCKET) {
-        fprintf(stderr, "[ERROR] socket: %d\n", WSAGetLastError());
-        return sock_invalid;
+/* ---------- file transfer ---------- */
+
+/* Taken when a transfer starts, for its report */
+static uint64_t file_start_ms;
+static double file_start_cpu;
+static uint64_t file_start_batches, file_start_zc;
+
+static void start_file(const char *filepath) {
+    p2p_stats_t st;
+    if (!peer || !connected) {
+        printf("[WARN] Not connected; files are not queued.\n");
+        return;
     }
-#else
-    s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) {
-        perror("[ERROR] socket");
-        return sock_invalid;
+    p2p_session_stats(peer, &st);
+    file_start_ms = get_time_ms();
+    file_start_cpu = perf_thread_cpu_ms();
+    file_start_batches = st.file_batches;
+    file_start_zc = st.zerocopy_batches;
+    if (p2p_send_file(peer, filepath) != 0)
+        fprintf(stderr, "[ERROR] Cannot send '%s': unreadable, or another file is still going.\n", filepath);
+}
+
+/* ---------- engine callbacks ---------- */
+
+static void on_wake(p2p_engine_t *e, void *ctx) {
+    (void)e;
+    (void)ctx;
+    cmd_t *c = take_commands();
+    while (c) {
+        cmd_t *next = c->next;
+        if (c->kind == CMD_FILE) start_file(c->text);
+        else if (send_chat_message(c->text, 0) == -2)
+            printf(connected ? "[WARN] Too many messages awaiting an ACK. Message not sent.\n"
+                             : "[WARN] Peer not connected. Message not sent.\n");
+        free(c);
+        c = next;
     }
-#endif
+    if (outbox) flush_outbox();
+    else history_commit();
+}
 
-    struct sockaddr_in sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons((unsigned short)peer_port);
+/* One peer per run: later ones are turned away */
+static int on_accept(p2p_engine_t *e, p2p_socket_t sock, void *ctx) {
+    (void)ctx;
+    if (p2p_engine_sessions(e) == 0) return 0;
+    close_socket((sock_t)sock);
+    return 1;
+}
 
-    if (inet_pton(AF_INET, peer_ip, &sa.sin_addr) != 1) {
-        fprintf(stderr, "[ERROR] Invalid IP address format.\n");
-#ifdef _WIN32
-        closesocket(s);
-#else
-        close(s);
-#endif
-        return sock_invalid;
+/* The connection is up; a resuming client sends from the outbox right
+ * away (0-RTT), before the handshake completes */
+static void session_opened(p2p_session_t *s) {
+    peer = s;
+    resume_tried = p2p_session_early(s);
+    forget_sent();
+    last_sent_outbox_id = 0;
+    printf("[CONNECTED] Connected to peer at %s\n", p2p_session_peer(s));
+    if (resume_tried) {
+        int n = outbox ? flush_outbox() : 0;
+        printf("[INFO] Resuming previous session; %d queued message(s) sent as 0-RTT data.\n", n);
     }
+}
 
-    if (connect((int)s, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
-#ifdef _WIN32
-        fprintf(stderr, "[ERROR] connect: %d\n", WSAGetLastError());
-        closesocket(s);
-#else
-        perror("[ERROR] connect");
-        close(s);
-#endif
-        return sock_invalid;
+/* Keys agreed: open the connection for chat and flush the outbox. After a
+ * full handshake anything sent as early data was discarded, so the whole
+ * outbox goes again. */
+static void on_connect(p2p_session_t *s, void *user) {
+    (void)user;
+    int fresh = !p2p_session_resumed(s);
+    peer = s;
+    snprintf(peer_name, sizeof(peer_name), "%s", p2p_session_peer(s));
+    perf_set_peer(perf_peer(peer_name, "chat"));
+    if (fresh) {
+        last_sent_outbox_id = 0;
+        forget_sent();
+        if (resume_tried) printf("\n[INFO] Session ticket refused; doing a full handshake.\n");
+    } else if (is_server) {
+        printf("\n[INFO] Peer resumed its previous session (0-RTT).\n");
     }
+    connected = 1;
+    if (outbox) {
+        int n = outbox_count(outbox);
+        if (n > 0 && fresh) printf("[INFO] Delivering %d queued message(s)...\n", n);
+        flush_outbox();
+    }
+}
 
-    printf("[CONNECTED] Connected to peer at %s:%d\n", peer_ip, peer_port);
-    return s;
+static void on_message(p2p_session_t *s, const char *text, size_t len, void *user) {
+    (void)s;
+    (void)user;
+    perf_count(PERF_CTR_RECV, 1);
+    perf_trace("recv", 0, (int64_t)len);
+    P2P_PROBE2(msg__recv, 0, len);
+    char ts[16];
+    timestamp_now(ts, sizeof(ts));
+    printf("\n%s Peer: %s\n", ts, text);
+    log_message("%s Peer: %s", ts, text);
+    printf("You: ");
+    fflush(stdout);
+
+    /* Auto-display stats every 10 messages */
+    perf_auto_display_stats(STATS_DISPLAY_INTERVAL);
+}
+
+static void on_ack(p2p_session_t *s, uint32_t seq, double rtt_ms, void *user) {
+    (void)s;
+    (void)rtt_ms;
+    (void)user;
+    for (int i = 0; i < P2P_ENGINE_MAX_PENDING; i++) {
+        if (sent_map[i].seq != seq || !sent_map[i].perf_seq) continue;
+        perf_acknowledge_message(sent_map[i].perf_seq);
+        if (sent_map[i].outbox_id) outbox_ack(outbox, sent_map[i].outbox_id);
+        memset(&sent_map[i], 0, sizeof(sent_map[i]));
+        break;
+    }
+    if (outbox_stalled) {
+        outbox_stalled = 0;
+        flush_outbox();
+    }
+}
+
+static void on_file(p2p_session_t *s, const char *name, uint64_t size, const char *path, void *user) {
+    (void)s;
+    (void)path;
+    (void)user;
+    perf_count(PERF_CTR_FILE_IN, size);
+    perf_peer_note(perf_peer(peer_name, "file"), PERF_CTR_FILE_IN, size);
+    printf("\n[INFO] Received file '%s' (%llu bytes) -> saved in ../downloads\nYou: ",
+           name, (unsigned long long)size);
+    fflush(stdout);
+}
+
+static void on_file_sent(p2p_session_t *s, const char *name, uint64_t size, void *user) {
+    (void)user;
+    p2p_stats_t st;
+    p2p_session_stats(s, &st);
+    printf("\n[INFO] File '%s' sent successfully.\n", name);
+    perf_count(PERF_CTR_FILE_OUT, size);
+    perf_peer_note(perf_peer(peer_name, "file"), PERF_CTR_FILE_OUT, size);
+    /* CPU vs wall time makes the copy/zerocopy trade-off measurable */
+    printf("[PERF] %llu bytes in %llu ms, %.1f ms CPU; %llu of %llu batches zerocopy.\n",
+           (unsigned long long)size, (unsigned long long)(get_time_ms() - file_start_ms),
+           perf_thread_cpu_ms() - file_start_cpu,
+           (unsigned long long)(st.zerocopy_batches - file_start_zc),
+           (unsigned long long)(st.file_batches - file_start_batches));
+    printf("[PERF] Path: RTT %.2f ms, bandwidth %.1f Mbit/s, chunk %lu bytes.\n",
+           st.path_rtt_ms, st.path_bw * 8.0 / 1e6, (unsigned long)st.file_chunk);
+    pool_t *pool = pool_shared();
+    if (pool) {
+        pool_stats_t ps;
+        pool_stats(pool, &ps);
+        printf("[PERF] Task pool: %d workers, %llu tasks so far (%llu stolen, %llu run by waiters).\n",
+               ps.workers, (unsigned long long)ps.executed, (unsigned long long)ps.stolen,
+               (unsigned long long)ps.helped);
+    }
+    printf("You: ");
+    fflush(stdout);
+}
+
+static void on_close(p2p_session_t *s, int error, void *user) {
+    (void)s;
+    (void)user;
+    if (running) {
+        if (error) fprintf(stderr, "\n[ERROR] Connection to peer lost.\n");
+        else printf("\n[INFO] Connection closed by peer.\n");
+        log_message("Peer disconnected.");
+    }
+    peer = NULL;
+    connected = 0;
+    running = 0;
 }
 
-/* ---------- receiver thread ---------- */
+/* ---------- engine thread ---------- */
+
+static thread_t engine_th;
+static int engine_started = 0;
+static char reconnect_host[64];
+static int reconnect_port = 0;
+
+/* Client whose peer was down: one connect attempt. It blocks for up to a
+ * connect timeout, which is fine with nothing else to serve. */
+static void try_reconnect(void) {
+    p2p_session_t *s = p2p_connect(engine, reconnect_host, reconnect_port);
+    if (!s) return;
+    session_opened(s);
+    printf("\n[INFO] Peer is reachable again.\n");
+    printf("You: ");
+    fflush(stdout);
+}
 
 #ifdef _WIN32
-  DWORD WINAPI receiver_fn(LPVOID arg)
+  DWORD WINAPI engine_fn(LPVOID arg)
 #else
-  void *receiver_fn(void *arg)
+  void *engine_fn(void *arg)
 #endif
 {
     (void)arg;
-    char buf[RECV_BUF];
-
-    while (running) {
-#ifdef _WIN32
-        int n = recv(conn_sock, buf, (int)sizeof(buf) - 1, 0);
-#else
-        ssize_t n = recv(conn_sock, buf, sizeof(buf) - 1, 0);
-#endif
-        if (n == 0) {
-            printf("\n[INFO] Connection closed by peer.\n");
-            log_message("Peer disconnected.");
-            running = 0;
-            break;
-        } else if (n < 0) {
-#ifdef _WIN32
-            int err = WSAGetLastError();
-            if (err == WSAEINTR) continue;
-            fprintf(stderr, "\n[ERROR] recv: %d\n", err);
-#else
-            if (errno == EINTR) continue;
-            perror("\n[ERROR] recv");
-#endif
-            running = 0;
-            break;
-        }
-
-        /* Decrypt message */
-        unsigned char decrypted[RECV_BUF];
-        int dec_len = decrypt_message((unsigned char*)buf, n, derived_key, 
-                                     decrypted, RECV_BUF);
-        if (dec_len < 0) {
-            fprintf(stderr, "[ERROR] Failed to decrypt message.\n");
-            continue;
-        }
+    int pinned = aff_pin(AFF_RX, 0) >= 0;
+    uint64_t next_retry = 0;
+    sock_t polled = sock_invalid;
 
-        decrypted[dec_len] = '\0';
-        
-        /* Parse message for performance tracking */
-        char clean_message[RECV_BUF];
-        uint32_t sequence = 0;
-        int is_tracked = perf_parse_message((char*)decrypted, clean_message, 
-                                           sizeof(clean_message), &sequence);
-        
-        /* Check if this is an ACK message */
-        int ack_result = perf_handle_ack(clean_message);
-        if (ack_result >= 0) {
-            /* This was an ACK, don't display as regular message */
-            continue;
-        }
+    /* Busy-poll mode: after each event, spin this long for the next one
+     * before going back to a blocking poll */
+    int busy_us = cfg_env_int("P2P_BUSY_POLL_US", 0);
+    if (busy_us > 0 && !pinned)
+        fprintf(stderr, "[WARN] Busy polling with an unpinned receiver; set P2P_PIN_RX to give it a core.\n");
 
-        if (strncmp(clean_message, "FILE:", 5) == 0) {
-            // Parse header
-            char fname[256];
-            long fsize;
-            sscanf(clean_message, "FILE:%255[^:]:%ld", fname, &fsize);
-
-            // Ensure downloads directory exists
-            #ifdef _WIN32
-                _mkdir("../downloads");
-            #else
-                mkdir("../downloads", 0755);
-            #endif
-
-            // Build full path under ../downloads
-            char filepath[512];
-            snprintf(filepath, sizeof(filepath), "../downloads/%s", fname);
-
-            FILE *f = fopen(filepath, "wb"); // save in downloads
-            if (!f) {
-                perror("[ERROR] fopen recv file");
-                continue;
+    while (running) {
+        int timeout = -1;
+        if (!peer && !is_server && outbox) {
+            uint64_t now = get_time_ms();
+            if (now >= next_retry) {
+                try_reconnect();
+                next_retry = get_time_ms() + OUTBOX_RETRY_MS;
             }
+            if (!peer) timeout = OUTBOX_RETRY_MS;
+        }
 
-            long received = 0;
-            while (received < fsize) {
-                unsigned char chunk[RECV_BUF];
-                int n = recv(conn_sock, chunk, sizeof(chunk), 0);
-                if (n <= 0) break;
-
-                unsigned char dec_chunk[RECV_BUF];
-                int dec_len = decrypt_message(chunk, n, derived_key, dec_chunk, sizeof(dec_chunk));
-                if (dec_len < 0) {
-                    fprintf(stderr, "[ERROR] Failed to decrypt chunk.\n");
-                    break;
-                }
-
-                fwrite(dec_chunk, 1, dec_len, f);
-                received += dec_len;
+        int ready = 0;
+        if (busy_us > 0 && peer) {
+            sock_t s = (sock_t)p2p_session_socket(peer);
+            if (s != polled) {
+                polled = s;
+                if (net_set_busy_poll(s, NET_BUSY_POLL_US) != 0)
+                    printf("[INFO] Kernel busy polling unavailable; spinning on the socket only.\n");
             }
-
-            fclose(f);
-            printf("\n[INFO] Received file '%s' (%ld bytes) -> saved in ../downloads\nYou: ", fname, fsize);
-            fflush(stdout);
-            continue;
+            ready = net_busy_wait(s, busy_us);
         }
-
-
-
-        /* Display regular message */
-        char ts[16];
-        timestamp_now(ts, sizeof(ts));
-        printf("\n%s Peer: %s\n", ts, clean_message);
-        log_message("%s Peer: %s", ts, clean_message);
-        
-        /* Send ACK if this was a tracked message */
-        if (is_tracked && sequence > 0) {
-            perf_send_ack(conn_sock, sequence, derived_key);
+        if (p2p_engine_poll(engine, ready ? 0 : timeout) < 0) {
+            fprintf(stderr, "[ERROR] Event loop failed.\n");
+            running = 0;
         }
-        
-        printf("You: ");
-        fflush(stdout);
-        
-        /* Auto-display stats every 10 messages */
-        perf_auto_display_stats(STATS_DISPLAY_INTERVAL);
     }
-    
+
+    /* Orderly close: lines the input loop queued before it stopped, and
+     * everything else queued, go out first */
+    on_wake(engine, NULL);
+    if (peer) p2p_close(peer);
+    p2p_engine_poll(engine, 0);
 #ifdef _WIN32
     return 0;
 #else
@@ -558,6 +737,13 @@ static sock_t start_client(const char *peer_ip, int peer_port) {
 }
 
 /* ---------- cleanup thread ---------- */
+
+static reactor_t *maint;                /* Housekeeping timers, run by cleanup_fn */
+
+static void publish_tick(reactor_t *r, void *arg) { (void)r; (void)arg; perf_publish(); }
+static void slo_tick(reactor_t *r, void *arg) { (void)r; (void)arg; perf_slo_check(); }
+static void expire_tick(reactor_t *r, void *arg) { (void)r; (void)arg; perf_cleanup_expired(DEFAULT_TIMEOUT_MS); }
+
 #ifdef _WIN32
   DWORD WINAPI cleanup_fn(LPVOID arg)
 #else
@@ -565,10 +751,8 @@ static sock_t start_client(const char *peer_ip, int peer_port) {
 #endif
 {
     (void)arg;
-    while (running) {
-        sleep_ms(5000); /* Check every 5 seconds */
-        perf_cleanup_expired(DEFAULT_TIMEOUT_MS);
-    }
+    aff_pin(AFF_TIMER, 0);
+    reactor_run(maint);                 /* Until main calls reactor_stop */
 #ifdef _WIN32
     return 0;
 #else
@@ -576,6 +760,61 @@ static sock_t start_client(const char *peer_ip, int peer_port) {
 #endif
 }
 
+/* ---------- connection management ---------- */
+
+/* One outbox per peer, so queued messages only go to the peer they were for */
+static void open_outbox(const char *peer_key) {
+    ensure_logs_dir();
+    char path[512];
+    outbox_path_for(path, sizeof(path), LOG_DIR, "tcp", peer_key);
+    int sync_ms = cfg_env_int("P2P_OUTBOX_SYNC_MS", OUTBOX_DEFAULT_SYNC_MS);
+    outbox = outbox_open(path, sync_ms < 0 ? WAL_NO_SYNC : sync_ms);
+    if (!outbox) {
+        fprintf(stderr, "[WARN] Outbox unavailable; messages to an offline peer will be lost.\n");
+        return;
+    }
+    int n = outbox_count(outbox);
+    if (n > 0) printf("[INFO] %d undelivered message(s) in the outbox will be sent once connected.\n", n);
+}
+
+/* Resumption tickets: the server's outstanding ones, or the client's one
+ * for this peer */
+static void open_session_store(const char *role, const char *peer_key) {
+    ensure_logs_dir();
+    char path[512];
+    session_path_for(path, sizeof(path), LOG_DIR, role, peer_key);
+    if (session_store_open(path) != 0)
+        fprintf(stderr, "[WARN] Session tickets unavailable; every connection will do a full handshake.\n");
+}
+
+/* The engine for this run: the protocol, files and resumption all live
+ * there (engine.h); this program only drives it from the terminal */
+static p2p_engine_t *open_engine(void) {
+    ensure_downloads_dir();
+    p2p_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.password = SECRET_KEY;
+    cfg.download_dir = "../downloads";
+    cfg.cb.on_connect = on_connect;
+    cfg.cb.on_message = on_message;
+    cfg.cb.on_ack = on_ack;
+    cfg.cb.on_file = on_file;
+    cfg.cb.on_file_sent = on_file_sent;
+    cfg.cb.on_close = on_close;
+    cfg.tickets = is_server ? 1 : resume_enabled;
+    p2p_engine_t *e = p2p_engine_new(&cfg);
+    if (!e) {
+        fprintf(stderr, "[ERROR] Event loop unavailable.\n");
+        return NULL;
+    }
+    p2p_hooks_t hooks;
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.on_wake = on_wake;
+    hooks.on_accept = on_accept;
+    p2p_engine_set_hooks(e, &hooks, NULL);
+    return e;
+}
+
 /* ---------- shutdown handling ---------- */
 
 #ifdef _WIN32
@@ -584,7 +823,7 @@ static BOOL WINAPI console_handler(DWORD signal) {
         printf("\n=== Final Statistics ===\n");
         perf_display_stats();
         running = 0;
-        if (conn_sock != sock_invalid) closesocket(conn_sock);
+        if (engine) p2p_engine_wake(engine);
         printf("[INFO] Shutting down...\n");
     }
     return TRUE;
@@ -595,7 +834,7 @@ static void sigint_handler(int signum) {
     printf("\n=== Final Statistics ===\n");
     perf_display_stats();
     running = 0;
-    if (conn_sock != sock_invalid) close(conn_sock);
+    if (engine) p2p_engine_wake(engine);
     printf("[INFO] Shutting down...\n");
 }
 #endif
@@ -612,10 +851,12 @@ int main(void) {
 #endif
 
     mutex_init(&log_mutex);
+    mutex_init(&cmd_mutex);
+    open_history();
     perf_init(); /* Initialize performance monitoring */
-    
-    /* Derive key from password */
-    derive_key_from_password(SECRET_KEY, derived_key);
+    aff_init();  /* Before any thread starts: P2P_PIN_* (affinity.h) */
+    perf_slo_init(LOG_DIR);
+    hw_init();
 
 #ifdef _WIN32
     SetConsoleCtrlHandler(console_handler, TRUE);
@@ -630,6 +871,8 @@ int main(void) {
     printf("=== P2P Chat System with Performance Monitor ===\n");
     printf("Features: Encryption + Latency Tracking + Statistics\n");
     printf("Commands: 'stats' = show stats, 'reset' = reset stats\n");
+    discovery_enabled = cfg_env_int("P2P_DISCOVERY", 0);
+    if (discovery_enabled) printf("Commands: '/peers' = list peers found on the LAN\n");
     printf("Start as (server/client)? ");
     fflush(stdout);
 
@@ -653,56 +896,103 @@ int main(void) {
             fprintf(stderr, "[ERROR] Invalid port. Must be between 1 and 65535.\n");
             goto cleanup;
         }
-        conn_sock = start_server(port);
-        if (conn_sock == sock_invalid) goto cleanup;
-
-    } else {
-        /* Auto client mode: detect own device IP and connect to localhost */
-        char hostbuffer[256];
-        char *IPbuffer;
-        struct hostent *host_entry;
-
-        /* Get and display own IP */
-        if (gethostname(hostbuffer, sizeof(hostbuffer)) == -1) {
-            perror("[ERROR] gethostname failed");
-            goto cleanup;
+        if (discovery_enabled) {
+            char name[DISC_NAME_LEN + 1];
+            discovery_name(name, sizeof(name));
+            if (discovery_start(name, port, 'T') == 0)
+                printf("[INFO] Announcing as '%s' on the LAN.\n", name);
         }
-        host_entry = gethostbyname(hostbuffer);
-        if (host_entry == NULL) {
-            perror("[ERROR] gethostbyname failed");
+        char peer_key[32];
+        snprintf(peer_key, sizeof(peer_key), "server_%d", port);
+        if (cfg_env_int("P2P_OUTBOX", 1)) open_outbox(peer_key);
+        is_server = 1;
+        open_session_store("server", peer_key + 7);
+        engine = open_engine();
+        if (!engine) goto cleanup;
+
+        /* Dual-stack: one IPv6 listener also takes IPv4 peers */
+        if (p2p_listen(engine, port) != 0) {
+#ifdef _WIN32
+            fprintf(stderr, "[ERROR] listen: %d\n", WSAGetLastError());
+#else
+            perror("[ERROR] listen");
+#endif
             goto cleanup;
         }
-        IPbuffer = inet_ntoa(*((struct in_addr*) host_entry->h_addr_list[0]));
-        printf("[INFO] This device IP: %s\n", IPbuffer);
+        printf("[INFO] Server started.\n");
+        print_local_addrs("Your LAN IP");
+        printf("[INFO] Waiting for peer to connect on port %d...\n", port);
+        fflush(stdout);
+        while (running && p2p_engine_sessions(engine) == 0) p2p_engine_poll(engine, 250);
+        if (!running) goto cleanup;
+        peer = p2p_engine_session(engine, 0);
+        printf("[CONNECTED] Peer connected from %s\n", p2p_session_peer(peer));
+
+    } else {
+        /* Display own addresses straight from the interface list */
+        print_local_addrs("This device IP");
 
-        /* Ask user for server port */
-        char port_s[16];
+        char ip_input[64];
         int port = 0;
-        printf("Enter server port: ");
-        fflush(stdout);
-        if (!fgets(port_s, sizeof(port_s), stdin)) goto cleanup;
-        trim_newline(port_s);
-        if (!parse_port(port_s, &port)) {
-            fprintf(stderr, "[ERROR] Invalid port number.\n");
-            goto cleanup;
+        int picked = 0;
+
+        /* Listen-only discovery: pick a peer by name instead of typing its address */
+        if (discovery_enabled && discovery_start(NULL, 0, 'T') == 0) {
+            picked = choose_discovered_peer(ip_input, sizeof(ip_input), &port);
+            if (picked < 0) goto cleanup;
         }
 
-        /* Ask user for server IP */
-        char ip_input[64];
-        printf("Enter server IP (LAN): ");
-        fflush(stdout);
-        if (!fgets(ip_input, sizeof(ip_input), stdin)) goto cleanup;
-        trim_newline(ip_input);
+        if (!picked) {
+            /* Ask user for server port */
+            char port_s[16];
+            printf("Enter server port: ");
+            fflush(stdout);
+            if (!fgets(port_s, sizeof(port_s), stdin)) goto cleanup;
+            trim_newline(port_s);
+            if (!parse_port(port_s, &port)) {
+                fprintf(stderr, "[ERROR] Invalid port number.\n");
+                goto cleanup;
+            }
 
-        if (!validate_ip(ip_input)) {
-            fprintf(stderr, "[ERROR] Invalid IP format.\n");
-            goto cleanup;
+            /* Ask user for server IP */
+            printf("Enter server IP or host name (IPv4/IPv6): ");
+            fflush(stdout);
+            if (!fgets(ip_input, sizeof(ip_input), stdin)) goto cleanup;
+            trim_newline(ip_input);
+
+            if (!validate_ip(ip_input)) {
+                fprintf(stderr, "[ERROR] Invalid IP address or unknown host.\n");
+                goto cleanup;
+            }
         }
 
         const char *server_ip = ip_input;
+        char peer_key[96];
+        snprintf(peer_key, sizeof(peer_key), "%s_%d", server_ip, port);
+        if (cfg_env_int("P2P_OUTBOX", 1)) open_outbox(peer_key);
+        resume_enabled = cfg_env_int("P2P_RESUME", 1);
+        if (resume_enabled) open_session_store("client", peer_key);
+        engine = open_engine();
+        if (!engine) goto cleanup;
         printf("[INFO] Connecting to server at %s:%d\n", server_ip, port);
-        conn_sock = start_client(server_ip, port);
-        if (conn_sock == sock_invalid) goto cleanup;
+        snprintf(reconnect_host, sizeof(reconnect_host), "%s", server_ip);
+        reconnect_port = port;
+
+        /* Races every address server_ip resolves to; a dead family costs
+         * at most HE_ATTEMPT_DELAY_MS instead of a full connect timeout */
+        p2p_session_t *s = p2p_connect(engine, server_ip, port);
+        if (s) {
+            session_opened(s);
+        } else {
+#ifdef _WIN32
+            fprintf(stderr, "[ERROR] connect: %d\n", WSAGetLastError());
+#else
+            perror("[ERROR] connect");
+#endif
+            if (!outbox) goto cleanup;
+            printf("[INFO] Peer unreachable. Messages will be queued and delivered when it is back"
+                   " (retrying every %d s).\n", OUTBOX_RETRY_MS / 1000);
+        }
     }
 
 
@@ -712,16 +1002,26 @@ int main(void) {
     printf("[INFO] Type 'stats' to view performance statistics.\n");
     printf("[INFO] Type 'reset' to reset statistics.\n\n");
 
-    /* start receiver thread */
-    thread_t rx = start_thread(receiver_fn, NULL);
+    /* start the engine thread; from here on only it touches the engine */
+    engine_th = start_thread(engine_fn, NULL);
 #ifdef _WIN32
-    if (!rx) {
+    if (!engine_th) {
         fprintf(stderr, "[ERROR] CreateThread failed.\n");
         goto cleanup;
     }
 #endif
+    engine_started = 1;
 
-    /* start cleanup thread */
+    /* start cleanup thread; it also refreshes the stats segment */
+    perf_publish_init(is_server ? "tcp-server" : "tcp-client");
+    maint = reactor_new(REACTOR_DEFAULT);
+    if (!maint) {
+        fprintf(stderr, "[ERROR] Event loop unavailable.\n");
+        goto cleanup;
+    }
+    reactor_timer(maint, 250, 250, publish_tick, NULL);
+    reactor_timer(maint, 1000, 1000, slo_tick, NULL);
+    reactor_timer(maint, 5000, 5000, expire_tick, NULL);
     thread_t cleanup_th = start_thread(cleanup_fn, NULL);
 #ifdef _WIN32
     if (!cleanup_th) {
@@ -730,8 +1030,9 @@ int main(void) {
     }
 #endif
 
-    /* sender loop */
+    /* input loop */
     char line[SEND_BUF];
+    aff_pin(AFF_TX, 0);
     while (running) {
         printf("You: ");
         fflush(stdout);
@@ -757,72 +1058,84 @@ int main(void) {
             perf_reset_stats();
             continue;
         }
+        if (strcmp(line, "/peers") == 0) {
+            if (discovery_enabled) print_discovered_peers();
+            else printf("[INFO] LAN discovery is off (set P2P_DISCOVERY=1).\n");
+            continue;
+        }
         if (strcmp(line, "/history") == 0) {
             view_chat_history();
             continue; // don’t send this as a chat message
         }
         if (strncmp(line, "/sendfile ", 10) == 0) {
             const char *filepath = line + 10;  // Skip "/sendfile "
-            send_file(conn_sock, filepath, derived_key);
+            if (!connected) {
+                printf("[WARN] Not connected; files are not queued.\n");
+                continue;
+            }
+            post_command(CMD_FILE, filepath);
             continue; // Don't send as chat
         }
 
-
-        /* Format message with sequence number for tracking */
-        char formatted_msg[SEND_BUF];
-        int seq = perf_format_message(formatted_msg, sizeof(formatted_msg), line);
-        if (seq < 0) {
-            fprintf(stderr, "[ERROR] Message too long.\n");
+        if (outbox) {
+            /* Logged; the engine thread sends it after anything older
+             * without waiting for the sync, and the next line waits for
+             * it instead */
+            uint64_t id = outbox_push(outbox, line);
+            if (!id) continue;
+            if (!connected)
+                printf("[INFO] Peer offline; message queued (%d pending).\n", outbox_count(outbox));
+            p2p_engine_wake(engine);
+            outbox_sync(outbox, id);
             continue;
         }
 
-        /* Encrypt the formatted message */
-        unsigned char encrypted[SEND_BUF];
-        int enc_len = encrypt_message((unsigned char*)formatted_msg, 
-                                     strlen(formatted_msg), derived_key, 
-                                     encrypted, SEND_BUF);
-        if (enc_len < 0) {
-            fprintf(stderr, "[ERROR] Failed to encrypt message.\n");
+        if (!connected) {
+            printf("[WARN] Peer not connected yet. Message not sent.\n");
             continue;
         }
-
-        /* Send encrypted message */
-#ifdef _WIN32
-        int sent = send(conn_sock, (const char*)encrypted, enc_len, 0);
-        if (sent == SOCKET_ERROR) {
-            fprintf(stderr, "\n[ERROR] send: %d\n", WSAGetLastError());
-            running = 0;
-            break;
-        }
-#else
-        ssize_t sent = send(conn_sock, (const char*)encrypted, enc_len, 0);
-        if (sent < 0) {
-            perror("\n[ERROR] send");
-            running = 0;
-            break;
-        }
-#endif
-
-        /* Log + save history */
-        char ts[16];
-        timestamp_now(ts, sizeof(ts));
-        log_message("%s You: %s (seq #%d)", ts, line, seq);
-        save_history("YOU", seq, line);
+        post_command(CMD_CHAT, line);
     }
 
     /* wait for threads */
-    join_thread(rx);
+    p2p_engine_wake(engine);
+    join_thread(engine_th);
+    engine_started = 0;
+    reactor_stop(maint);
     join_thread(cleanup_th);
 
 cleanup:
-    if (conn_sock != sock_invalid) {
-#ifdef _WIN32
-        shutdown(conn_sock, SD_BOTH);
-        closesocket(conn_sock);
-#else
-        shutdown(conn_sock, SHUT_RDWR);
-        close(conn_sock);
-#endif
+    running = 0;
+    if (engine_started) {
+        p2p_engine_wake(engine);
+        join_thread(engine_th);
+    }
+    discovery_stop();
+    p2p_engine_free(engine);
+    engine = NULL;
+    for (cmd_t *c = take_commands(); c; ) {
+        cmd_t *next = c->next;
+        free(c);
+        c = next;
+    }
+
+    if (outbox) {
+        int left = outbox_count(outbox);
+        if (left > 0) printf("[INFO] %d undelivered message(s) kept in the outbox for next time.\n", left);
+        outbox_close(outbox);
+    }
+    session_store_close();
+    reactor_free(maint);
+    perf_publish_close();
+
+    if (history) {
+        uint64_t syncs = 0, appends = 0;
+        wal_sync_stats(history, &syncs, &appends);
+        if (syncs > 0) {
+            printf("[INFO] History: %llu line(s) made durable in %llu fdatasync call(s).\n",
+                   (unsigned long long)appends, (unsigned long long)syncs);
+        }
+        wal_close(history);
     }
 
     /* Display final stats */
@@ -832,6 +1145,7 @@ cleanup:
 #ifdef _WIN32
     WSACleanup();
 #endif
+    mutex_destroy(&cmd_mutex);
     mutex_destroy(&log_mutex);
 
     return 0;
@@ -0,0 +1,221 @@
+/*
+ * p2pchat_bench.c - In-process throughput / latency benchmark
+ *
+ * Runs both ends of N sessions inside one process over loopback: every
+ * client keeps a window of messages in flight and sends the next one as
+ * each ACK comes back, until it has sent its share. No terminal; just the
+ * engine's own send, framing, crypto and ACK path.
+ *
+ * With shards = 0 everything runs in one engine on the main thread;
+ * otherwise in a shard-per-core runtime (shard.h) with that many shards.
+ *
+ * Usage: p2pchat_bench [sessions] [messages per session] [window] [port] [shards]
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "shard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+  #include <winsock2.h>
+  #include <windows.h>
+  #define sleep_ms(ms) Sleep(ms)
+#else
+  #include <unistd.h>
+  #define sleep_ms(ms) usleep((ms) * 1000)
+#endif
+
+/* connected and acked are bumped from every shard's thread */
+typedef struct {
+    int sessions;
+    int per_session;
+    int window;
+    int connected;
+    uint64_t acked;
+    uint64_t target;
+} bench_t;
+
+typedef struct {
+    int sent;
+    int acked;
+} client_t;
+
+static double now_ms(void) {
+#ifdef _WIN32
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+static void send_more(p2p_session_t *s, bench_t *b) {
+    client_t *c = (client_t*)p2p_session_user(s);
+    if (!c) return;   /* Server side of the pair */
+    while (c->sent < b->per_session && c->sent - c->acked < b->window) {
+        if (p2p_send(s, "benchmark message payload of a typical chat line length") < 0) return;
+        c->sent++;
+    }
+}
+
+static void on_connect(p2p_session_t *s, void *user) {
+    bench_t *b = (bench_t*)user;
+    if (p2p_session_user(s)) __atomic_add_fetch(&b->connected, 1, __ATOMIC_RELAXED);
+}
+
+static void on_ack(p2p_session_t *s, uint32_t seq, double rtt_ms, void *user) {
+    (void)seq;
+    (void)rtt_ms;
+    bench_t *b = (bench_t*)user;
+    client_t *c = (client_t*)p2p_session_user(s);
+    c->acked++;
+    __atomic_add_fetch(&b->acked, 1, __ATOMIC_RELAXED);
+    send_more(s, b);
+}
+
+/* Posted to every shard: start the clients it owns */
+static void kick(p2p_engine_t *e, void *arg) {
+    for (int i = 0; i < p2p_engine_sessions(e); i++) send_more(p2p_engine_session(e, i), (bench_t*)arg);
+}
+
+static int run_single(bench_t *b, const p2p_config_t *cfg, int port) {
+    p2p_engine_t *e = p2p_engine_new(cfg);
+    if (!e || p2p_listen(e, port) != 0) {
+        fprintf(stderr, "[ERROR] Cannot listen on port %d.\n", port);
+        return 1;
+    }
+
+    client_t *clients = (client_t*)calloc((size_t)b->sessions, sizeof(client_t));
+    p2p_session_t **cs = (p2p_session_t**)calloc((size_t)b->sessions, sizeof(*cs));
+    if (!clients || !cs) return 1;
+    for (int i = 0; i < b->sessions; i++) {
+        cs[i] = p2p_connect(e, "127.0.0.1", port);
+        if (!cs[i]) {
+            fprintf(stderr, "[ERROR] Connect %d failed.\n", i);
+            return 1;
+        }
+        p2p_session_set_user(cs[i], &clients[i]);
+        if (i % 64 == 63) p2p_engine_poll(e, 0);   /* Keep the accept queue short */
+    }
+
+    double start = now_ms();
+    while (b->connected < b->sessions) {
+        if (p2p_engine_poll(e, 100) < 0 || now_ms() - start > 10000) {
+            fprintf(stderr, "[ERROR] Only %d of %d sessions completed the handshake.\n", b->connected, b->sessions);
+            return 1;
+        }
+    }
+    double handshake_ms = now_ms() - start;
+
+    start = now_ms();
+    kick(e, b);
+    while (b->acked < b->target) {
+        if (p2p_engine_poll(e, 1000) <= 0 && now_ms() - start > 30000) break;
+    }
+    double elapsed = now_ms() - start;
+
+    double rtt_sum = 0.0, rtt_max = 0.0;
+    for (int i = 0; i < b->sessions; i++) {
+        p2p_stats_t st;
+        p2p_session_stats(cs[i], &st);
+        rtt_sum += st.rtt_avg_ms;
+        if (st.rtt_max_ms > rtt_max) rtt_max = st.rtt_max_ms;
+    }
+
+    printf("[PERF] %d sessions, handshakes in %.1f ms\n", b->sessions, handshake_ms);
+    printf("[PERF] %llu of %llu messages ACKed in %.1f ms: %.0f msg/s\n",
+           (unsigned long long)b->acked, (unsigned long long)b->target, elapsed,
+           elapsed > 0 ? b->acked * 1000.0 / elapsed : 0.0);
+    printf("[PERF] RTT avg %.3f ms, max %.3f ms (window %d)\n", rtt_sum / b->sessions, rtt_max, b->window);
+
+    p2p_engine_free(e);
+    free(cs);
+    free(clients);
+    return b->acked == b->target ? 0 : 1;
+}
+
+static int run_sharded(bench_t *b, const p2p_config_t *cfg, int port, int shards) {
+    p2p_runtime_config_t rc;
+    rc.engine = *cfg;
+    rc.shards = shards;
+    p2p_runtime_t *rt = p2p_runtime_new(&rc);
+    if (!rt || p2p_runtime_listen(rt, port) != 0 || p2p_runtime_start(rt) != 0) {
+        fprintf(stderr, "[ERROR] Cannot start %d shards on port %d.\n", shards, port);
+        return 1;
+    }
+    client_t *clients = (client_t*)calloc((size_t)b->sessions, sizeof(client_t));
+    if (!clients) return 1;
+
+    double start = now_ms();
+    for (int i = 0; i < b->sessions; i++) p2p_runtime_connect(rt, "127.0.0.1", port, &clients[i]);
+    while (__atomic_load_n(&b->connected, __ATOMIC_RELAXED) < b->sessions) {
+        if (now_ms() - start > 10000) {
+            fprintf(stderr, "[ERROR] Only %d of %d sessions completed the handshake.\n", b->connected, b->sessions);
+            p2p_runtime_free(rt);
+            return 1;
+        }
+        sleep_ms(1);
+    }
+    double handshake_ms = now_ms() - start;
+
+    start = now_ms();
+    for (int i = 0; i < p2p_runtime_shards(rt); i++) p2p_runtime_post(rt, i, kick, b);
+    while (__atomic_load_n(&b->acked, __ATOMIC_RELAXED) < b->target && now_ms() - start < 30000) sleep_ms(1);
+    double elapsed = now_ms() - start;
+    uint64_t acked = __atomic_load_n(&b->acked, __ATOMIC_RELAXED);
+
+    sleep_ms(2 * P2P_SHARD_TICK_MS);   /* Let every shard publish its final stats */
+    printf("[PERF] %d sessions on %d shards, handshakes in %.1f ms\n", b->sessions, p2p_runtime_shards(rt), handshake_ms);
+    printf("[PERF] %llu of %llu messages ACKed in %.1f ms: %.0f msg/s\n",
+           (unsigned long long)acked, (unsigned long long)b->target, elapsed,
+           elapsed > 0 ? acked * 1000.0 / elapsed : 0.0);
+    for (int i = 0; i < p2p_runtime_shards(rt); i++) {
+        p2p_shard_stats_t st;
+        p2p_runtime_stats(rt, i, &st);
+        printf("[PERF] shard %d: %d sessions, %llu sent, %llu received, RTT avg %.3f ms, max %.3f ms, %llu tasks\n",
+               i, st.sessions, (unsigned long long)st.stats.sent, (unsigned long long)st.stats.received,
+               st.stats.rtt_avg_ms, st.stats.rtt_max_ms, (unsigned long long)st.tasks);
+    }
+
+    p2p_runtime_free(rt);
+    free(clients);
+    return acked == b->target ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    bench_t b;
+    memset(&b, 0, sizeof(b));
+    b.sessions = argc > 1 ? atoi(argv[1]) : 100;
+    b.per_session = argc > 2 ? atoi(argv[2]) : 1000;
+    b.window = argc > 3 ? atoi(argv[3]) : 16;
+    int port = argc > 4 ? atoi(argv[4]) : 9700;
+    int shards = argc > 5 ? atoi(argv[5]) : 0;
+    if (b.sessions < 1 || b.per_session < 1 || b.window < 1 || shards < 0) {
+        fprintf(stderr, "Usage: %s [sessions] [messages per session] [window] [port] [shards]\n", argv[0]);
+        return 1;
+    }
+    b.target = (uint64_t)b.sessions * (uint64_t)b.per_session;
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) return 1;
+#endif
+
+    p2p_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.password = "benchmark";
+    cfg.cb.on_connect = on_connect;
+    cfg.cb.on_ack = on_ack;
+    cfg.user = &b;
+    int rc = shards > 0 ? run_sharded(&b, &cfg, port, shards) : run_single(&b, &cfg, port);
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return rc;
+}
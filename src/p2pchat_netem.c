@@ -0,0 +1,557 @@
+/*
+ * p2pchat_netem.c - Emulated network link for testing the chat protocols
+ *
+ * A proxy that sits between a chat client and server and impairs what it
+ * forwards, each direction on its own: loss, delay with jitter, reordering,
+ * duplication, a bandwidth limit and a bounded queue. Every decision comes
+ * from a generator seeded with -s and drawn a fixed number of times per
+ * packet, so with the same seed the n-th packet of a direction is always
+ * lost, duplicated or held back alike and gets the same delay offset;
+ * changing one knob doesn't reshuffle the others. Delays count from when
+ * a packet really arrived, so the interleaving of close packets can still
+ * vary with the sender's timing.
+ *
+ * Usage: p2pchat_netem [options] listen_port host port
+ *   -t          TCP instead of UDP
+ *   -s seed     generator seed (default 1)
+ *   -l pct      loss, percent
+ *   -d ms       one-way delay
+ *   -j ms       jitter: delay varies uniformly by +-ms
+ *   -r pct      reordering: held back an extra -g ms so later ones pass
+ *   -g ms       reordering gap (default 5)
+ *   -D pct      duplication
+ *   -b kbit/s   bandwidth; packets queue behind each other
+ *   -q packets  queue limit per direction; tail drop beyond (default 1000)
+ *   -T seconds  exit after this long (default: run until Ctrl+C)
+ *
+ * UDP: point the client at listen_port; each client address gets its own
+ * upstream socket to host:port. TCP: every accepted connection gets its
+ * own upstream connection; delay, jitter and bandwidth apply to the data
+ * as it is read, in order, while loss, reordering and duplication are the
+ * transport's business and ignored.
+ *
+ *   ./p2pchat_netem -s 7 -l 5 -d 20 -j 5 -r 2 -D 1 9100 127.0.0.1 9000
+ *   (then udp_chat as server on 9000, and a client to 127.0.0.1:9100)
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "net.h"
+#include "reactor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #include <windows.h>
+    #define sock_invalid INVALID_SOCKET
+    #define close_socket(s) closesocket(s)
+    #define SHUT_WR_SD SD_SEND
+#else
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #define sock_invalid -1
+    #define close_socket(s) close(s)
+    #define SHUT_WR_SD SHUT_WR
+#endif
+
+#define NETEM_MAX_FLOWS 64
+#define NETEM_BUF 65536
+#define DIR_UP 0                        /* Client to server */
+#define DIR_DOWN 1
+
+typedef struct {
+    uint64_t due_us;
+    uint64_t order;                     /* FIFO among equal due times */
+    uint64_t arrived_us;
+    int flow;
+    uint32_t gen;                       /* Flow's generation when queued */
+    int dir;
+    int len;                            /* TCP: 0 means end of stream */
+    unsigned char data[];
+} pkt_t;
+
+typedef struct {
+    uint64_t rng;
+    uint64_t busy_until_us;             /* When the last queued packet has been "sent" */
+    uint64_t last_due_us;               /* TCP: never deliver out of order */
+    int queued;
+    uint64_t in, bytes_in;
+    uint64_t lost, overflow, duplicated, reordered;
+    uint64_t delivered, bytes_out;
+    uint64_t delay_total_us, delay_max_us;
+} link_t;
+
+typedef struct {
+    int used;
+    uint32_t gen;
+    sock_t down;                        /* TCP: accepted client socket */
+    sock_t up;                          /* Upstream socket to host:port */
+    int down_handle, up_handle;
+    struct sockaddr_storage client;     /* UDP: where DIR_DOWN goes */
+    socklen_t client_len;
+    int eof[2];                         /* TCP: end of stream delivered */
+} flow_t;
+
+static struct {
+    int tcp;
+    double loss, reorder, dup;
+    int delay_ms, jitter_ms, gap_ms;
+    double rate_bps;                    /* Bytes per second; 0: unlimited */
+    int queue_limit;
+} cfg = { 0, 0.0, 0.0, 0.0, 0, 0, 5, 0.0, 1000 };
+
+static reactor_t *loop;
+static sock_t listener = sock_invalid;
+static struct sockaddr_storage target;
+static socklen_t target_len;
+static const char *target_host;
+static int target_port;
+static link_t links[2];
+static flow_t flows[NETEM_MAX_FLOWS];
+static pkt_t **heap;
+static int heap_count, heap_cap;
+static uint64_t next_order;
+static uint64_t timer_id, timer_due_us;
+static uint64_t started_us;
+
+static uint64_t now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+/* ---------- seeded generator (splitmix64) ---------- */
+
+static double draw(link_t *l) {
+    uint64_t z = (l->rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return (double)(z >> 11) / 9007199254740992.0;     /* [0, 1) */
+}
+
+/* ---------- delivery queue: min-heap on (due, order) ---------- */
+
+static int before(const pkt_t *a, const pkt_t *b) {
+    return a->due_us < b->due_us || (a->due_us == b->due_us && a->order < b->order);
+}
+
+static int heap_push(pkt_t *p) {
+    if (heap_count == heap_cap) {
+        int cap = heap_cap ? heap_cap * 2 : 256;
+        pkt_t **h = (pkt_t**)realloc(heap, (size_t)cap * sizeof(*h));
+        if (!h) return -1;
+        heap = h;
+        heap_cap = cap;
+    }
+    int i = heap_count++;
+    heap[i] = p;
+    while (i > 0 && before(heap[i], heap[(i - 1) / 2])) {
+        pkt_t *t = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = t;
+        i = (i - 1) / 2;
+    }
+    return 0;
+}
+
+static pkt_t *heap_pop(void) {
+    pkt_t *top = heap[0];
+    heap[0] = heap[--heap_count];
+    for (int i = 0;;) {
+        int l = 2 * i + 1, m = i;
+        if (l < heap_count && before(heap[l], heap[m])) m = l;
+        if (l + 1 < heap_count && before(heap[l + 1], heap[m])) m = l + 1;
+        if (m == i) break;
+        pkt_t *t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+    return top;
+}
+
+static void deliver_tick(reactor_t *r, void *arg);
+
+/* Keep one timer, due with the earliest packet */
+static void arm_timer(void) {
+    uint64_t due = heap_count ? heap[0]->due_us : 0;
+    if (timer_id && due == timer_due_us) return;
+    reactor_cancel(loop, timer_id);
+    timer_id = 0;
+    timer_due_us = due;
+    if (!heap_count) return;
+    uint64_t now = now_us();
+    int delay_ms = due > now ? (int)((due - now + 999) / 1000) : 0;
+    timer_id = reactor_timer(loop, delay_ms, 0, deliver_tick, NULL);
+}
+
+/* ---------- flows ---------- */
+
+static void flow_close(int f) {
+    flow_t *fl = &flows[f];
+    if (!fl->used) return;
+    reactor_del(loop, fl->up_handle);
+    close_socket(fl->up);
+    if (cfg.tcp) {
+        reactor_del(loop, fl->down_handle);
+        close_socket(fl->down);
+    }
+    fl->used = 0;
+    fl->gen++;                          /* Packets still queued for it are dropped */
+}
+
+/* ---------- the impaired link ---------- */
+
+static void enqueue(int f, int dir, const unsigned char *data, int len) {
+    link_t *l = &links[dir];
+    /* Fixed draws per packet: one knob never shifts another's decisions */
+    double u_loss = draw(l), u_dup = draw(l);
+    l->in++;
+    l->bytes_in += (uint64_t)len;
+    if (!cfg.tcp && u_loss < cfg.loss) {
+        l->lost++;
+        return;
+    }
+    int copies = (!cfg.tcp && u_dup < cfg.dup) ? 2 : 1;
+    if (copies == 2) l->duplicated++;
+
+    for (int c = 0; c < copies; c++) {
+        double u_jitter = draw(l), u_reorder = draw(l);
+        if (cfg.queue_limit > 0 && l->queued >= cfg.queue_limit) {
+            l->overflow++;
+            continue;
+        }
+        pkt_t *p = (pkt_t*)malloc(sizeof(*p) + (size_t)len);
+        if (!p) {
+            l->overflow++;
+            continue;
+        }
+        uint64_t now = now_us();
+        /* Serialization behind whatever is already on the wire */
+        uint64_t start = l->busy_until_us > now ? l->busy_until_us : now;
+        l->busy_until_us = start + (cfg.rate_bps > 0.0 ? (uint64_t)(len * 1e6 / cfg.rate_bps) : 0);
+        int64_t delay = (int64_t)cfg.delay_ms * 1000 + (int64_t)((2.0 * u_jitter - 1.0) * cfg.jitter_ms * 1000.0);
+        uint64_t due = l->busy_until_us + (uint64_t)(delay > 0 ? delay : 0);
+        if (!cfg.tcp && u_reorder < cfg.reorder) {
+            due += (uint64_t)cfg.gap_ms * 1000;
+            l->reordered++;
+        }
+        if (cfg.tcp) {
+            if (due < l->last_due_us) due = l->last_due_us;
+            l->last_due_us = due;
+        }
+        p->due_us = due;
+        p->order = next_order++;
+        p->arrived_us = now;
+        p->flow = f;
+        p->gen = flows[f].gen;
+        p->dir = dir;
+        p->len = len;
+        if (len) memcpy(p->data, data, (size_t)len);
+        if (heap_push(p) != 0) {
+            free(p);
+            l->overflow++;
+            continue;
+        }
+        l->queued++;
+    }
+    arm_timer();
+}
+
+static void deliver(pkt_t *p) {
+    flow_t *fl = &flows[p->flow];
+    link_t *l = &links[p->dir];
+    if (!fl->used || fl->gen != p->gen) return;
+    if (cfg.tcp) {
+        sock_t to = p->dir == DIR_UP ? fl->up : fl->down;
+        if (p->len == 0) {
+            shutdown(to, SHUT_WR_SD);
+            fl->eof[p->dir] = 1;
+            if (fl->eof[DIR_UP] && fl->eof[DIR_DOWN]) flow_close(p->flow);
+            return;
+        }
+        if (net_send_all(to, p->data, (size_t)p->len) != 0) {
+            flow_close(p->flow);
+            return;
+        }
+    } else if (p->dir == DIR_UP) {
+        send(fl->up, (const char*)p->data, p->len, 0);
+    } else {
+        sendto(listener, (const char*)p->data, p->len, 0, (struct sockaddr*)&fl->client, fl->client_len);
+    }
+    uint64_t waited = now_us() - p->arrived_us;
+    l->delivered++;
+    l->bytes_out += (uint64_t)p->len;
+    l->delay_total_us += waited;
+    if (waited > l->delay_max_us) l->delay_max_us = waited;
+}
+
+static void deliver_tick(reactor_t *r, void *arg) {
+    (void)r;
+    (void)arg;
+    timer_id = 0;
+    uint64_t now = now_us();
+    while (heap_count && heap[0]->due_us <= now) {
+        pkt_t *p = heap_pop();
+        links[p->dir].queued--;
+        deliver(p);
+        free(p);
+    }
+    arm_timer();
+}
+
+/* ---------- sockets ---------- */
+
+static unsigned char buf[NETEM_BUF];
+
+/* Reply from the server, or TCP data from either end */
+static void on_up_io(reactor_t *r, sock_t sock, int events, void *arg) {
+    (void)r;
+    (void)events;
+    int f = (int)(intptr_t)arg;
+    int n = recv(sock, (char*)buf, sizeof(buf), 0);
+    if (cfg.tcp && n <= 0) {
+        /* The end of stream travels the link too, behind the data */
+        if (n == 0) {
+            reactor_del(loop, flows[f].up_handle);
+            flows[f].up_handle = -1;
+            enqueue(f, DIR_DOWN, NULL, 0);
+        } else {
+            flow_close(f);
+        }
+        return;
+    }
+    if (n > 0) enqueue(f, DIR_DOWN, buf, n);
+}
+
+static void on_down_tcp(reactor_t *r, sock_t sock, int events, void *arg) {
+    (void)r;
+    (void)events;
+    int f = (int)(intptr_t)arg;
+    int n = recv(sock, (char*)buf, sizeof(buf), 0);
+    if (n > 0) {
+        enqueue(f, DIR_UP, buf, n);
+    } else if (n == 0) {
+        reactor_del(loop, flows[f].down_handle);
+        flows[f].down_handle = -1;
+        enqueue(f, DIR_UP, NULL, 0);
+    } else {
+        flow_close(f);
+    }
+}
+
+static int flow_slot(void) {
+    for (int i = 0; i < NETEM_MAX_FLOWS; i++) {
+        if (!flows[i].used) return i;
+    }
+    return -1;
+}
+
+static void on_listener_udp(reactor_t *r, sock_t sock, int events, void *arg) {
+    (void)r;
+    (void)events;
+    (void)arg;
+    struct sockaddr_storage from;
+    socklen_t from_len = sizeof(from);
+    int n = recvfrom(sock, (char*)buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_len);
+    if (n < 0) return;
+
+    int f = -1;
+    for (int i = 0; i < NETEM_MAX_FLOWS; i++) {
+        if (flows[i].used && flows[i].client_len == from_len && memcmp(&flows[i].client, &from, from_len) == 0) {
+            f = i;
+            break;
+        }
+    }
+    if (f < 0) {
+        f = flow_slot();
+        if (f < 0) return;
+        flow_t *fl = &flows[f];
+        fl->up = socket(target.ss_family, SOCK_DGRAM, 0);
+        if (fl->up == sock_invalid) return;
+        if (connect(fl->up, (struct sockaddr*)&target, target_len) != 0 ||
+            (fl->up_handle = reactor_add(loop, fl->up, REACTOR_READ, on_up_io, (void*)(intptr_t)f)) < 0) {
+            close_socket(fl->up);
+            return;
+        }
+        net_set_nonblocking(fl->up, 1);
+        fl->client = from;
+        fl->client_len = from_len;
+        fl->used = 1;
+        char name[NET_ADDRSTRLEN];
+        net_format_addr((struct sockaddr*)&from, name, sizeof(name));
+        printf("[INFO] New flow from %s\n", name);
+    }
+    enqueue(f, DIR_UP, buf, n);
+}
+
+static void on_listener_tcp(reactor_t *r, sock_t sock, int events, void *arg) {
+    (void)r;
+    (void)events;
+    (void)arg;
+    sock_t c = accept(sock, NULL, NULL);
+    if (c == sock_invalid) return;
+    int f = flow_slot();
+    sock_t up = f < 0 ? sock_invalid : net_connect_happy(target_host, target_port, 0);
+    if (up == sock_invalid) {
+        fprintf(stderr, "[WARN] %s; dropping the connection.\n", f < 0 ? "Too many flows" : "Upstream unreachable");
+        close_socket(c);
+        return;
+    }
+    flow_t *fl = &flows[f];
+    fl->down = c;
+    fl->up = up;
+    fl->eof[DIR_UP] = fl->eof[DIR_DOWN] = 0;
+    fl->down_handle = reactor_add(loop, c, REACTOR_READ, on_down_tcp, (void*)(intptr_t)f);
+    fl->up_handle = reactor_add(loop, up, REACTOR_READ, on_up_io, (void*)(intptr_t)f);
+    fl->used = 1;
+    if (fl->down_handle < 0 || fl->up_handle < 0) {
+        flow_close(f);
+        return;
+    }
+    printf("[INFO] New TCP flow %d\n", f);
+}
+
+/* ---------- main ---------- */
+
+static void stop_tick(reactor_t *r, void *arg) {
+    (void)arg;
+    reactor_stop(r);
+}
+
+#ifdef _WIN32
+static BOOL WINAPI console_handler(DWORD signal) {
+    if (signal == CTRL_C_EVENT && loop) reactor_stop(loop);
+    return TRUE;
+}
+#else
+static void sigint_handler(int signum) {
+    (void)signum;
+    if (loop) reactor_stop(loop);       /* An atomic store and a send: signal-safe */
+}
+#endif
+
+static void print_link(const char *name, const link_t *l, double secs) {
+    printf("[PERF] %s: %llu in, %llu lost, %llu overflowed, %llu duplicated, %llu reordered, %llu delivered\n",
+           name, (unsigned long long)l->in, (unsigned long long)l->lost, (unsigned long long)l->overflow,
+           (unsigned long long)l->duplicated, (unsigned long long)l->reordered, (unsigned long long)l->delivered);
+    printf("[PERF] %s: %.1f kbit/s delivered, delay avg %.2f ms, max %.2f ms\n", name,
+           secs > 0.0 ? l->bytes_out * 8.0 / 1000.0 / secs : 0.0,
+           l->delivered ? l->delay_total_us / 1000.0 / (double)l->delivered : 0.0, l->delay_max_us / 1000.0);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t] [-s seed] [-l loss%%] [-d delay_ms] [-j jitter_ms] [-r reorder%%] [-g gap_ms]\n"
+                    "       [-D dup%%] [-b kbit/s] [-q packets] [-T seconds] listen_port host port\n", prog);
+}
+
+int main(int argc, char **argv) {
+    uint64_t seed = 1;
+    int run_s = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        const char *opt = argv[i];
+        if (strcmp(opt, "-t") == 0) {
+            cfg.tcp = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *val = argv[++i];
+        if (strcmp(opt, "-s") == 0) seed = strtoull(val, NULL, 10);
+        else if (strcmp(opt, "-l") == 0) cfg.loss = atof(val) / 100.0;
+        else if (strcmp(opt, "-d") == 0) cfg.delay_ms = atoi(val);
+        else if (strcmp(opt, "-j") == 0) cfg.jitter_ms = atoi(val);
+        else if (strcmp(opt, "-r") == 0) cfg.reorder = atof(val) / 100.0;
+        else if (strcmp(opt, "-g") == 0) cfg.gap_ms = atoi(val);
+        else if (strcmp(opt, "-D") == 0) cfg.dup = atof(val) / 100.0;
+        else if (strcmp(opt, "-b") == 0) cfg.rate_bps = atof(val) * 1000.0 / 8.0;
+        else if (strcmp(opt, "-q") == 0) cfg.queue_limit = atoi(val);
+        else if (strcmp(opt, "-T") == 0) run_s = atoi(val);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - i != 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    int listen_port = atoi(argv[i]);
+    target_host = argv[i + 1];
+    target_port = atoi(argv[i + 2]);
+    if (cfg.tcp && (cfg.loss > 0.0 || cfg.reorder > 0.0 || cfg.dup > 0.0))
+        fprintf(stderr, "[WARN] TCP: loss, reordering and duplication are ignored.\n");
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        fprintf(stderr, "[ERROR] WSAStartup failed.\n");
+        return 1;
+    }
+    SetConsoleCtrlHandler(console_handler, TRUE);
+#else
+    signal(SIGINT, sigint_handler);
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    /* Each direction has its own stream, both derived from the seed */
+    links[DIR_UP].rng = seed;
+    links[DIR_DOWN].rng = seed ^ 0x5DEECE66DULL;
+
+    struct addrinfo *res = NULL;
+    if (net_resolve(target_host, target_port, cfg.tcp ? SOCK_STREAM : SOCK_DGRAM, &res) != 0) {
+        fprintf(stderr, "[ERROR] Cannot resolve %s.\n", target_host);
+        return 1;
+    }
+    memcpy(&target, res->ai_addr, res->ai_addrlen);
+    target_len = (socklen_t)res->ai_addrlen;
+    freeaddrinfo(res);
+
+    loop = reactor_new(REACTOR_DEFAULT);
+    listener = net_bind_any(cfg.tcp ? SOCK_STREAM : SOCK_DGRAM, listen_port, 0);
+    if (!loop || listener == sock_invalid || (cfg.tcp && listen(listener, 16) != 0)) {
+        fprintf(stderr, "[ERROR] Cannot listen on port %d.\n", listen_port);
+        return 1;
+    }
+    net_set_nonblocking(listener, 1);
+    reactor_add(loop, listener, REACTOR_READ, cfg.tcp ? on_listener_tcp : on_listener_udp, NULL);
+    if (run_s > 0) reactor_timer(loop, run_s * 1000, 0, stop_tick, NULL);
+
+    printf("[INFO] %s :%d -> %s:%d, seed %llu: loss %.2f%%, delay %d ms +-%d, reorder %.2f%% (+%d ms), "
+           "dup %.2f%%, rate %.0f kbit/s (0: unlimited), queue %d\n",
+           cfg.tcp ? "TCP" : "UDP", listen_port, target_host, target_port, (unsigned long long)seed,
+           cfg.loss * 100.0, cfg.delay_ms, cfg.jitter_ms, cfg.reorder * 100.0, cfg.gap_ms, cfg.dup * 100.0,
+           cfg.rate_bps * 8.0 / 1000.0, cfg.queue_limit);
+    started_us = now_us();
+    reactor_run(loop);
+
+    double secs = (now_us() - started_us) / 1e6;
+    print_link("client->server", &links[DIR_UP], secs);
+    print_link("server->client", &links[DIR_DOWN], secs);
+
+    for (int f = 0; f < NETEM_MAX_FLOWS; f++) flow_close(f);
+    while (heap_count) free(heap_pop());
+    free(heap);
+    close_socket(listener);
+    reactor_free(loop);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}
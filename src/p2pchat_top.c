@@ -0,0 +1,187 @@
+/*
+ * p2pchat_top.c - Live view of running chat processes
+ *
+ * Reads the stats segment every chat process publishes (see statshm.h)
+ * and redraws a table once per interval, like top. Reading never touches
+ * the chat processes themselves: no signal, socket or lock.
+ *
+ * Usage: p2pchat_top [-d seconds] [-n iterations] [pid ...]
+ * Without pids every segment in /dev/shm is shown (Linux); elsewhere the
+ * pids must be given.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "statshm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+  #include <windows.h>
+  #define sleep_ms(ms) Sleep(ms)
+#else
+  #include <dirent.h>
+  #include <errno.h>
+  #include <signal.h>
+  #include <unistd.h>
+  #define sleep_ms(ms) usleep((ms) * 1000)
+#endif
+
+#define MAX_PROCS 64
+#define STALE_S 5           /* Not refreshed for this long: flagged */
+
+typedef struct {
+    int pid;
+    const statshm_t *shm;
+    statshm_t prev;         /* Last snapshot, for per-interval rates */
+    int have_prev;
+} proc_t;
+
+static proc_t procs[MAX_PROCS];
+static int proc_count = 0;
+
+static proc_t *find_proc(int pid) {
+    for (int i = 0; i < proc_count; i++) {
+        if (procs[i].pid == pid) return &procs[i];
+    }
+    return NULL;
+}
+
+static void track(int pid) {
+    if (find_proc(pid) || proc_count == MAX_PROCS) return;
+    const statshm_t *shm = statshm_attach(pid);
+    if (!shm) return;
+    proc_t *p = &procs[proc_count++];
+    memset(p, 0, sizeof(*p));
+    p->pid = pid;
+    p->shm = shm;
+}
+
+static int alive(int pid) {
+#ifdef _WIN32
+    HANDLE h = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid);
+    if (!h) return 0;
+    int running = WaitForSingleObject(h, 0) == WAIT_TIMEOUT;
+    CloseHandle(h);
+    return running;
+#else
+    return kill(pid, 0) == 0 || errno == EPERM;
+#endif
+}
+
+/* Drop processes that exited (their segment is already unlinked, or was
+ * left behind by a crash) */
+static void prune(void) {
+    for (int i = 0; i < proc_count; ) {
+        if (!alive(procs[i].pid)) {
+            statshm_detach(procs[i].shm);
+            procs[i] = procs[--proc_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+#ifndef _WIN32
+static void scan(void) {
+    DIR *d = opendir("/dev/shm");
+    if (!d) return;
+    struct dirent *e;
+    size_t plen = strlen(STATSHM_PREFIX);
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, STATSHM_PREFIX, plen) != 0) continue;
+        int pid = atoi(e->d_name + plen);
+        if (pid > 0) track(pid);
+    }
+    closedir(d);
+}
+#endif
+
+static void format_uptime(char *out, size_t sz, uint64_t secs) {
+    if (secs >= 86400) snprintf(out, sz, "%llud%02lluh", (unsigned long long)(secs / 86400), (unsigned long long)(secs % 86400 / 3600));
+    else snprintf(out, sz, "%02llu:%02llu:%02llu", (unsigned long long)(secs / 3600),
+                  (unsigned long long)(secs % 3600 / 60), (unsigned long long)(secs % 60));
+}
+
+static void draw(int interval_s) {
+    time_t now = time(NULL);
+    char clock[16];
+    strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&now));
+
+    printf("\033[H\033[2J");
+    printf("p2pchat_top - %s - %d process(es), every %d s\n\n", clock, proc_count, interval_s);
+    printf("%7s %-10s %9s %7s %7s %6s %5s %8s %8s %8s %8s %9s %5s %9s %9s %3s\n",
+           "PID", "ROLE", "UPTIME", "SENT", "RECV", "MSG/S", "PEND", "AVG ms", "P50 ms", "P99 ms", "SRTT ms",
+           "BW Mbit/s", "RETX", "FILE OUT", "FILE IN", "SLO");
+
+    for (int i = 0; i < proc_count; i++) {
+        proc_t *p = &procs[i];
+        statshm_t s;
+        if (statshm_read(p->shm, &s) != 0) {
+            printf("%7d (busy)\n", p->pid);
+            continue;
+        }
+        char up[32];
+        format_uptime(up, sizeof(up), (uint64_t)now - s.started_unix);
+
+        double rate = 0.0;
+        if (p->have_prev) {
+            uint64_t msgs = s.counters[PERF_CTR_SENT] + s.counters[PERF_CTR_RECV];
+            uint64_t before = p->prev.counters[PERF_CTR_SENT] + p->prev.counters[PERF_CTR_RECV];
+            rate = (double)(msgs - before) / interval_s;
+        }
+        p->prev = s;
+        p->have_prev = 1;
+
+        printf("%7d %-10.10s %9s %7llu %7llu %6.1f %5d %8.2f %8.2f %8.2f %8.2f %9.1f %5llu %8.1fM %8.1fM %3llu%s\n",
+               s.pid, s.role, up,
+               (unsigned long long)s.counters[PERF_CTR_SENT], (unsigned long long)s.counters[PERF_CTR_RECV],
+               rate, s.pending, s.stats.avg_latency, s.p50_ms, s.p99_ms, s.srtt_ms,
+               s.btl_bw * 8.0 / 1e6, (unsigned long long)s.counters[PERF_CTR_RETRANSMIT],
+               s.counters[PERF_CTR_FILE_OUT] / 1e6, s.counters[PERF_CTR_FILE_IN] / 1e6,
+               (unsigned long long)s.counters[PERF_CTR_SLO_ALERTS],
+               (uint64_t)now - s.updated_unix > STALE_S ? "  (stale)" : "");
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    int interval_s = 1;
+    int iterations = -1;
+    int explicit_pids = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            interval_s = atoi(argv[++i]);
+            if (interval_s < 1) interval_s = 1;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (atoi(argv[i]) > 0) {
+            track(atoi(argv[i]));
+            explicit_pids = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-d seconds] [-n iterations] [pid ...]\n", argv[0]);
+            return 1;
+        }
+    }
+#ifdef _WIN32
+    if (!explicit_pids) {
+        fprintf(stderr, "[ERROR] Give the pids of the chat processes to watch.\n");
+        return 1;
+    }
+#endif
+
+    for (int n = 0; iterations < 0 || n < iterations; n++) {
+        if (n > 0) sleep_ms(interval_s * 1000);
+#ifndef _WIN32
+        if (!explicit_pids) scan();
+#endif
+        prune();
+        draw(interval_s);
+    }
+
+    for (int i = 0; i < proc_count; i++) statshm_detach(procs[i].shm);
+    return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * pool.c - Work-stealing task pool for CPU-heavy stages
+ *
+ * Each deque is a growable ring with its own lock. Only its owner pushes
+ * and pops at the bottom, thieves take from the top, and tasks are coarse
+ * (a file chunk's worth of crypto), so the lock is almost never contended
+ * and a lock-free Chase-Lev deque would buy little here.
+ *
+ * Idle workers sleep on work_cv. queued and sleepers are both updated
+ * with sequentially consistent atomics, and a sleeper rechecks queued
+ * under the pool lock, so a submitter only takes that lock when somebody
+ * is actually asleep.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "pool.h"
+#include "utils.h"
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    typedef CRITICAL_SECTION pool_mutex_t;
+    typedef CONDITION_VARIABLE pool_cond_t;
+    typedef HANDLE pool_thread_t;
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #include <pthread.h>
+    typedef pthread_mutex_t pool_mutex_t;
+    typedef pthread_cond_t pool_cond_t;
+    typedef pthread_t pool_thread_t;
+    #define THREAD_LOCAL __thread
+#endif
+
+#define DEQUE_INIT 64
+
+typedef struct {
+    pool_fn fn;
+    void *arg;
+    pool_group_t *group;
+} task_t;
+
+typedef struct {
+    pool_mutex_t lock;
+    task_t *ring;
+    unsigned cap;                       /* Power of two */
+    unsigned top;                       /* Next to steal */
+    unsigned bottom;                    /* Next free slot at the owner's end */
+} deque_t;
+
+typedef struct {
+    pool_t *pool;
+    int index;
+    pool_thread_t thread;
+    deque_t dq;
+} worker_t;
+
+struct pool {
+    worker_t *workers;
+    int count;
+    unsigned next_deque;                /* Round-robin for outside submitters */
+
+    pool_mutex_t lock;
+    pool_cond_t work_cv;                /* Workers: something was queued, or stopping */
+    pool_cond_t done_cv;                /* Waiters: a group finished */
+    int queued;                         /* Tasks sitting in any deque */
+    int sleepers;
+    int stopping;
+
+    uint64_t executed;
+    uint64_t stolen;
+    uint64_t helped;
+};
+
+/* Worker index of the calling thread in the pool it belongs to */
+static THREAD_LOCAL pool_t *self_pool = NULL;
+static THREAD_LOCAL int self_index = -1;
+
+static pool_t *shared_pool = NULL;
+
+/* ---------- primitives ---------- */
+
+static void mutex_init(pool_mutex_t *m) {
+#ifdef _WIN32
+    InitializeCriticalSection(m);
+#else
+    pthread_mutex_init(m, NULL);
+#endif
+}
+static void mutex_destroy(pool_mutex_t *m) {
+#ifdef _WIN32
+    DeleteCriticalSection(m);
+#else
+    pthread_mutex_destroy(m);
+#endif
+}
+static void mutex_lock(pool_mutex_t *m) {
+#ifdef _WIN32
+    EnterCriticalSection(m);
+#else
+    pthread_mutex_lock(m);
+#endif
+}
+static void mutex_unlock(pool_mutex_t *m) {
+#ifdef _WIN32
+    LeaveCriticalSection(m);
+#else
+    pthread_mutex_unlock(m);
+#endif
+}
+static void cond_init(pool_cond_t *cv) {
+#ifdef _WIN32
+    InitializeConditionVariable(cv);
+#else
+    pthread_cond_init(cv, NULL);
+#endif
+}
+static void cond_destroy(pool_cond_t *cv) {
+#ifdef _WIN32
+    (void)cv;
+#else
+    pthread_cond_destroy(cv);
+#endif
+}
+static void cond_wait(pool_cond_t *cv, pool_mutex_t *m) {
+#ifdef _WIN32
+    SleepConditionVariableCS(cv, m, INFINITE);
+#else
+    pthread_cond_wait(cv, m);
+#endif
+}
+static void cond_signal(pool_cond_t *cv) {
+#ifdef _WIN32
+    WakeConditionVariable(cv);
+#else
+    pthread_cond_signal(cv);
+#endif
+}
+static void cond_broadcast(pool_cond_t *cv) {
+#ifdef _WIN32
+    WakeAllConditionVariable(cv);
+#else
+    pthread_cond_broadcast(cv);
+#endif
+}
+
+/* ---------- deques ---------- */
+
+static int deque_push(deque_t *d, const task_t *t) {
+    mutex_lock(&d->lock);
+    if (d->bottom - d->top == d->cap) {
+        unsigned cap = d->cap ? d->cap * 2 : DEQUE_INIT;
+        task_t *ring = (task_t*)malloc(cap * sizeof(*ring));
+        if (!ring) {
+            mutex_unlock(&d->lock);
+            return -1;
+        }
+        for (unsigned i = d->top; i != d->bottom; i++) ring[i & (cap - 1)] = d->ring[i & (d->cap - 1)];
+        free(d->ring);
+        d->ring = ring;
+        d->cap = cap;
+    }
+    d->ring[d->bottom & (d->cap - 1)] = *t;
+    d->bottom++;
+    mutex_unlock(&d->lock);
+    return 0;
+}
+
+/* Owner's end: newest first */
+static int deque_pop(deque_t *d, task_t *out) {
+    mutex_lock(&d->lock);
+    int ok = d->bottom != d->top;
+    if (ok) *out = d->ring[--d->bottom & (d->cap - 1)];
+    mutex_unlock(&d->lock);
+    return ok;
+}
+
+/* Thieves' end: oldest first */
+static int deque_steal(deque_t *d, task_t *out) {
+    mutex_lock(&d->lock);
+    int ok = d->bottom != d->top;
+    if (ok) *out = d->ring[d->top++ & (d->cap - 1)];
+    mutex_unlock(&d->lock);
+    return ok;
+}
+
+/* ---------- scheduling ---------- */
+
+/* Own deque first, then the others starting after it */
+static int take(pool_t *p, int self, task_t *out) {
+    if (__atomic_load_n(&p->queued, __ATOMIC_SEQ_CST) == 0) return 0;
+    if (self >= 0 && deque_pop(&p->workers[self].dq, out)) {
+        __atomic_sub_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+        return 1;
+    }
+    int start = self >= 0 ? self + 1 : (int)(__atomic_load_n(&p->next_deque, __ATOMIC_RELAXED) % (unsigned)p->count);
+    for (int i = 0; i < p->count; i++) {
+        int victim = (start + i) % p->count;
+        if (victim == self) continue;
+        if (deque_steal(&p->workers[victim].dq, out)) {
+            __atomic_sub_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+            if (self >= 0) __atomic_add_fetch(&p->stolen, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void run(pool_t *p, const task_t *t) {
+    t->fn(t->arg);
+    __atomic_add_fetch(&p->executed, 1, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&t->group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        mutex_lock(&p->lock);
+        cond_broadcast(&p->done_cv);
+        mutex_unlock(&p->lock);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg)
+#else
+static void *worker_main(void *arg)
+#endif
+{
+    worker_t *w = (worker_t*)arg;
+    pool_t *p = w->pool;
+    self_pool = p;
+    self_index = w->index;
+    aff_pin(AFF_POOL, w->index);
+    /* First ring from here, after pinning, so its memory is on our node */
+    mutex_lock(&w->dq.lock);
+    if (!w->dq.ring) {
+        w->dq.ring = (task_t*)malloc(DEQUE_INIT * sizeof(task_t));
+        if (w->dq.ring) w->dq.cap = DEQUE_INIT;
+    }
+    mutex_unlock(&w->dq.lock);
+    for (;;) {
+        task_t t;
+        if (take(p, w->index, &t)) {
+            run(p, &t);
+            continue;
+        }
+        mutex_lock(&p->lock);
+        __atomic_add_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (!p->stopping && __atomic_load_n(&p->queued, __ATOMIC_SEQ_CST) == 0)
+            cond_wait(&p->work_cv, &p->lock);
+        __atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+        int done = p->stopping && __atomic_load_n(&p->queued, __ATOMIC_SEQ_CST) == 0;
+        mutex_unlock(&p->lock);
+        if (done) break;
+    }
+    return 0;
+}
+
+/* ---------- public API ---------- */
+
+pool_t *pool_new(int workers) {
+    if (workers < 0) workers = 0;
+    if (workers > POOL_MAX_WORKERS) workers = POOL_MAX_WORKERS;
+    pool_t *p = (pool_t*)calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    mutex_init(&p->lock);
+    cond_init(&p->work_cv);
+    cond_init(&p->done_cv);
+    if (workers == 0) return p;
+
+    p->workers = (worker_t*)calloc((size_t)workers, sizeof(*p->workers));
+    if (!p->workers) {
+        pool_free(p);
+        return NULL;
+    }
+    for (int i = 0; i < workers; i++) {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        mutex_init(&p->workers[i].dq.lock);
+    }
+    /* Every deque exists before any worker can try to steal from it */
+    p->count = workers;
+    for (int i = 0; i < workers; i++) {
+        worker_t *w = &p->workers[i];
+#ifdef _WIN32
+        w->thread = CreateThread(NULL, 0, worker_main, w, 0, NULL);
+        if (!w->thread) {
+#else
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+#endif
+            fprintf(stderr, "[WARN] Task pool: only %d of %d workers started.\n", i, workers);
+            /* Deques past i have no owner, but stay reachable to stealers and waiters */
+            break;
+        }
+    }
+    return p;
+}
+
+void pool_free(pool_t *p) {
+    if (!p) return;
+    mutex_lock(&p->lock);
+    p->stopping = 1;
+    cond_broadcast(&p->work_cv);
+    mutex_unlock(&p->lock);
+    for (int i = 0; i < p->count; i++) {
+        worker_t *w = &p->workers[i];
+        if (!w->thread) continue;
+#ifdef _WIN32
+        WaitForSingleObject(w->thread, INFINITE);
+        CloseHandle(w->thread);
+#else
+        pthread_join(w->thread, NULL);
+#endif
+    }
+    for (int i = 0; i < p->count; i++) {
+        mutex_destroy(&p->workers[i].dq.lock);
+        free(p->workers[i].dq.ring);
+    }
+    free(p->workers);
+    cond_destroy(&p->work_cv);
+    cond_destroy(&p->done_cv);
+    mutex_destroy(&p->lock);
+    free(p);
+}
+
+pool_t *pool_shared(void) {
+    pool_t *p = __atomic_load_n(&shared_pool, __ATOMIC_ACQUIRE);
+    if (p) return p;
+    p = pool_new(cfg_env_int("P2P_POOL_THREADS", cfg_cpu_count() - 1));
+    if (!p) return NULL;
+    pool_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&shared_pool, &expected, p, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pool_free(p);                   /* Lost the race: use the winner's */
+        p = expected;
+    }
+    return p;
+}
+
+void pool_submit(pool_t *p, pool_group_t *g, pool_fn fn, void *arg) {
+    task_t t;
+    t.fn = fn;
+    t.arg = arg;
+    t.group = g;
+    __atomic_add_fetch(&g->pending, 1, __ATOMIC_ACQ_REL);
+
+    int self = self_pool == p ? self_index : -1;
+    deque_t *d = NULL;
+    if (p->count > 0) {
+        int i = self >= 0 ? self : (int)(__atomic_fetch_add(&p->next_deque, 1, __ATOMIC_RELAXED) % (unsigned)p->count);
+        d = &p->workers[i].dq;
+    }
+    if (!d || deque_push(d, &t) != 0) {
+        run(p, &t);
+        return;
+    }
+    __atomic_add_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        mutex_lock(&p->lock);
+        cond_signal(&p->work_cv);
+        mutex_unlock(&p->lock);
+    }
+}
+
+void pool_wait(pool_t *p, pool_group_t *g) {
+    int self = self_pool == p ? self_index : -1;
+    while (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) > 0) {
+        task_t t;
+        if (take(p, self, &t)) {
+            run(p, &t);
+            __atomic_add_fetch(&p->helped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        /* Nothing to help with: the rest is running on workers */
+        mutex_lock(&p->lock);
+        while (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) > 0 && __atomic_load_n(&p->queued, __ATOMIC_SEQ_CST) == 0)
+            cond_wait(&p->done_cv, &p->lock);
+        mutex_unlock(&p->lock);
+    }
+}
+
+void pool_stats(pool_t *p, pool_stats_t *out) {
+    out->workers = p->count;
+    out->executed = __atomic_load_n(&p->executed, __ATOMIC_RELAXED);
+    out->stolen = __atomic_load_n(&p->stolen, __ATOMIC_RELAXED);
+    out->helped = __atomic_load_n(&p->helped, __ATOMIC_RELAXED);
+}
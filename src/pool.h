@@ -0,0 +1,56 @@
+/*
+ * pool.h - Work-stealing task pool for CPU-heavy stages
+ *
+ * Every worker owns a deque. A task submitted from a worker goes on the
+ * bottom of that worker's deque and is taken back from there, newest
+ * first, while it is still in cache; idle workers steal from the top of
+ * other deques, oldest first. Tasks from threads outside the pool are
+ * spread over the deques round-robin.
+ *
+ * A thread waiting for its group runs queued tasks itself in the meantime,
+ * so it lends its core instead of blocking, and a pool with no workers
+ * simply runs everything inline.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+#define POOL_MAX_WORKERS 64
+
+typedef struct pool pool_t;
+typedef void (*pool_fn)(void *arg);
+
+/* Tasks that can be waited for together; zero-initialize before use */
+typedef struct {
+    int pending;
+} pool_group_t;
+
+typedef struct {
+    int workers;
+    uint64_t executed;                  /* Tasks run, by anyone */
+    uint64_t stolen;                    /* ...taken from another worker's deque */
+    uint64_t helped;                    /* ...run by a thread waiting in pool_wait */
+} pool_stats_t;
+
+/* Start a pool with the given number of worker threads (0: run inline) */
+pool_t *pool_new(int workers);
+
+/* Wait for the workers to finish every queued task, then free the pool */
+void pool_free(pool_t *p);
+
+/* The process-wide pool, started on first use with P2P_POOL_THREADS
+ * workers (default: one less than the CPU count; the waiter is the last) */
+pool_t *pool_shared(void);
+
+/* Queue fn(arg) as part of group g. Without workers, or if the deque
+ * can't grow, fn runs before pool_submit returns. */
+void pool_submit(pool_t *p, pool_group_t *g, pool_fn fn, void *arg);
+
+/* Return once every task of g has finished, running tasks meanwhile */
+void pool_wait(pool_t *p, pool_group_t *g);
+
+void pool_stats(pool_t *p, pool_stats_t *out);
+
+#endif /* POOL_H */
@@ -0,0 +1,39 @@
+/*
+ * probes.h - USDT static probes for bpftrace / perf
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) available each probe is a single
+ * NOP plus an ELF note; nothing runs unless a tracer attaches. Without it,
+ * or with -DP2P_NO_PROBES, the macros compile away entirely.
+ *
+ * Provider "p2pchat". Probes and arguments:
+ *   msg__send(seq, bytes)        msg__recv(seq, bytes)
+ *   encrypt__start(bytes)        encrypt__done(bytes, out_len or -1)
+ *   decrypt__start(bytes)        decrypt__done(bytes, out_len or -1)
+ *   ack__send(seq)               ack__recv(seq, rtt_us)
+ *   retransmit(seq, bytes)
+ *   file__read(offset, bytes)    file__write(offset, bytes)
+ *   log__write(bytes)            wal__append(ticket, bytes)
+ *
+ * e.g. bpftrace -e 'usdt:./p2pchat:p2pchat:ack__recv { @rtt = hist(arg1); }'
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if defined(__linux__) && !defined(P2P_NO_PROBES) && defined(__has_include)
+  #if __has_include(<sys/sdt.h>)
+    #include <sys/sdt.h>
+    #define P2P_HAVE_USDT 1
+  #endif
+#endif
+
+#ifdef P2P_HAVE_USDT
+  #define P2P_PROBE1(name, a)    DTRACE_PROBE1(p2pchat, name, a)
+  #define P2P_PROBE2(name, a, b) DTRACE_PROBE2(p2pchat, name, a, b)
+#else
+  /* sizeof: arguments are not evaluated but still count as used */
+  #define P2P_PROBE1(name, a)    ((void)sizeof(a))
+  #define P2P_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#endif
+
+#endif /* PROBES_H */
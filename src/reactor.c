@@ -0,0 +1,683 @@
+/*
+ * reactor.c - Event loop: socket readiness, timers and cross-thread wakeups
+ *
+ * Registered sockets live in a slot array; a handle is a slot index. Every
+ * slot carries a generation that is bumped when the slot is deleted (and,
+ * for io_uring, whenever its poll request is replaced), and every event
+ * the kernel hands back is tagged with the generation it was armed under,
+ * so events for a socket deleted earlier in the same round are dropped.
+ *
+ * Timers are a binary min-heap on the due time. The wakeup channel is a
+ * loopback datagram socket connected to itself, registered like any other
+ * socket, so it works with every backend on every platform.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "reactor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #include <windows.h>
+    #define sock_invalid INVALID_SOCKET
+    #define close_socket(s) closesocket(s)
+    #define poll_fds(p, n, t) WSAPoll((p), (ULONG)(n), (t))
+#else
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <sys/socket.h>
+    #define sock_invalid -1
+    #define close_socket(s) close(s)
+    #define poll_fds(p, n, t) poll((p), (nfds_t)(n), (t))
+#endif
+
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #define HAVE_EPOLL 1
+    #if defined(__has_include)
+        #if __has_include(<linux/io_uring.h>)
+            #include <linux/io_uring.h>
+            #include <sys/mman.h>
+            #include <sys/syscall.h>
+            #define HAVE_URING 1
+        #endif
+    #endif
+#endif
+
+#define URING_ENTRIES 256
+#define TAG_TIMEOUT (1ULL << 63)        /* uring user_data: our wait timeouts */
+#define TAG_IGNORE  (1ULL << 62)        /* uring user_data: poll removals */
+
+typedef struct {
+    sock_t sock;
+    int events;
+    reactor_io_fn fn;
+    void *arg;
+    uint32_t gen;
+    int used;
+    int next_free;
+} slot_t;
+
+typedef struct {
+    uint64_t due_us;
+    uint64_t id;
+    int period_ms;
+    reactor_fn fn;
+    void *arg;
+} rtimer_t;
+
+#ifdef HAVE_URING
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz;
+    unsigned to_submit;
+    uint64_t timeout_seq;               /* Latest timeout request... */
+    uint64_t timeout_due_us;            /* ...and when it fires; 0: none pending */
+} uring_t;
+#endif
+
+struct reactor {
+    reactor_backend_t backend;
+
+    slot_t *slots;
+    int slot_cap;
+    int free_head;
+    int live;
+
+    rtimer_t *timers;                   /* Heap */
+    int timer_count;
+    int timer_cap;
+    uint64_t next_timer_id;
+    uint64_t running_timer;             /* Its callback is on the stack */
+    int running_cancelled;
+
+    sock_t wake_sock;
+    int wake_armed;
+    reactor_fn wake_fn;
+    void *wake_arg;
+    int stopping;
+
+    struct pollfd *pfds;                /* poll */
+    int *pfd_slot;
+    uint32_t *pfd_gen;
+    int pfd_cap;
+#ifdef HAVE_EPOLL
+    int epfd;                           /* epoll */
+    struct epoll_event evs[256];
+#endif
+#ifdef HAVE_URING
+    uring_t ring;                       /* uring */
+#endif
+};
+
+static uint64_t now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+static void set_nonblocking(sock_t s) {
+#ifdef _WIN32
+    u_long mode = 1;
+    ioctlsocket(s, FIONBIO, &mode);
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags >= 0) fcntl(s, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+/* ---------- io_uring ---------- */
+
+#ifdef HAVE_URING
+static int uring_setup(uring_t *u) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+    u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0) return -1;
+
+    u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && u->cq_sz > u->sq_sz) u->sq_sz = u->cq_sz;
+    u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) goto fail;
+    u->cq_ptr = single ? u->sq_ptr
+                       : mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ptr == MAP_FAILED) goto fail;
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto fail;
+
+    char *sq = (char*)u->sq_ptr, *cq = (char*)u->cq_ptr;
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    if (u->sq_ptr && u->sq_ptr != MAP_FAILED) munmap(u->sq_ptr, u->sq_sz);
+    if (!single && u->cq_ptr && u->cq_ptr != MAP_FAILED) munmap(u->cq_ptr, u->cq_sz);
+    close(u->fd);
+    return -1;
+}
+
+static void uring_close(uring_t *u) {
+    munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+    if (u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_sz);
+    munmap(u->sq_ptr, u->sq_sz);
+    close(u->fd);
+}
+
+static int uring_enter(uring_t *u, unsigned min_complete) {
+    int n = (int)syscall(__NR_io_uring_enter, u->fd, u->to_submit, min_complete,
+                         min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n > 0) u->to_submit -= (unsigned)n;
+    return n;
+}
+
+/* Next free submission entry, zeroed; flushes the ring when it is full */
+static struct io_uring_sqe *uring_sqe(uring_t *u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+        uring_enter(u, 0);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) return NULL;
+    }
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    return sqe;
+}
+
+static void uring_push(uring_t *u) {
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+}
+
+static short poll_mask(int events) {
+    return (short)(((events & REACTOR_READ) ? POLLIN : 0) | ((events & REACTOR_WRITE) ? POLLOUT : 0));
+}
+
+static int uring_arm(reactor_t *r, int h) {
+    slot_t *s = &r->slots[h];
+    struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s->sock;
+    sqe->poll32_events = (unsigned)poll_mask(s->events);
+    sqe->user_data = ((uint64_t)s->gen << 32) | (uint32_t)h;
+    uring_push(&r->ring);
+    return 0;
+}
+
+static void uring_disarm(reactor_t *r, int h) {
+    slot_t *s = &r->slots[h];
+    struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+    if (!sqe) return;       /* Its completion will carry a stale generation */
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = ((uint64_t)s->gen << 32) | (uint32_t)h;
+    sqe->user_data = TAG_IGNORE;
+    uring_push(&r->ring);
+}
+
+static int uring_wait(reactor_t *r, int timeout_ms) {
+    uring_t *u = &r->ring;
+    /* One wait timeout in flight at a time, unless we need an earlier one */
+    if (timeout_ms > 0) {
+        uint64_t due = now_us() + (uint64_t)timeout_ms * 1000;
+        if (u->timeout_due_us == 0 || due < u->timeout_due_us) {
+            struct io_uring_sqe *sqe = uring_sqe(u);
+            if (sqe) {
+                struct __kernel_timespec ts;
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->addr = (uint64_t)(uintptr_t)&ts;
+                sqe->len = 1;
+                sqe->user_data = TAG_TIMEOUT | ++u->timeout_seq;
+                uring_push(u);
+                u->timeout_due_us = due;
+                uring_enter(u, 0);      /* The kernel copies ts here */
+            }
+        }
+    }
+    if (uring_enter(u, timeout_ms != 0 ? 1 : 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME)
+        return -1;
+
+    int ready = 0;
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        uint64_t ud = cqe->user_data;
+        int res = cqe->res;
+        if (ud & TAG_TIMEOUT) {
+            if ((ud & ~TAG_TIMEOUT) == u->timeout_seq) u->timeout_due_us = 0;
+            continue;
+        }
+        if (ud & TAG_IGNORE) continue;
+        int h = (int)(uint32_t)ud;
+        if (h >= r->slot_cap || !r->slots[h].used || r->slots[h].gen != (uint32_t)(ud >> 32) || res < 0) continue;
+        slot_t *s = &r->slots[h];
+        /* One-shot: re-arm before the callback, which may mod or del it */
+        s->gen++;
+        uring_arm(r, h);
+        int ev = ((res & POLLIN) ? REACTOR_READ : 0) | ((res & POLLOUT) ? REACTOR_WRITE : 0);
+        if (res & (POLLERR | POLLHUP)) ev |= REACTOR_ERROR | REACTOR_READ;
+        ready++;
+        s->fn(r, s->sock, ev, s->arg);
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return ready;
+}
+#endif
+
+/* ---------- epoll ---------- */
+
+#ifdef HAVE_EPOLL
+static int epoll_ctl_slot(reactor_t *r, int op, int h) {
+    slot_t *s = &r->slots[h];
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((s->events & REACTOR_READ) ? EPOLLIN : 0) | ((s->events & REACTOR_WRITE) ? EPOLLOUT : 0);
+    ev.data.u64 = ((uint64_t)s->gen << 32) | (uint32_t)h;
+    return epoll_ctl(r->epfd, op, s->sock, &ev);
+}
+
+static int epoll_wait_slots(reactor_t *r, int timeout_ms) {
+    int n = epoll_wait(r->epfd, r->evs, (int)(sizeof(r->evs) / sizeof(r->evs[0])), timeout_ms);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    for (int i = 0; i < n; i++) {
+        int h = (int)(uint32_t)r->evs[i].data.u64;
+        slot_t *s = &r->slots[h];
+        if (!s->used || s->gen != (uint32_t)(r->evs[i].data.u64 >> 32)) continue;
+        uint32_t e = r->evs[i].events;
+        int ev = ((e & EPOLLIN) ? REACTOR_READ : 0) | ((e & EPOLLOUT) ? REACTOR_WRITE : 0);
+        if (e & (EPOLLERR | EPOLLHUP)) ev |= REACTOR_ERROR | REACTOR_READ;
+        s->fn(r, s->sock, ev, s->arg);
+    }
+    return n;
+}
+#endif
+
+/* ---------- poll ---------- */
+
+static int poll_slots(reactor_t *r, int timeout_ms) {
+    if (r->live > r->pfd_cap) {
+        int cap = r->live * 2;
+        struct pollfd *p = (struct pollfd*)realloc(r->pfds, (size_t)cap * sizeof(*p));
+        if (p) r->pfds = p;
+        int *idx = (int*)realloc(r->pfd_slot, (size_t)cap * sizeof(*idx));
+        if (idx) r->pfd_slot = idx;
+        uint32_t *gen = (uint32_t*)realloc(r->pfd_gen, (size_t)cap * sizeof(*gen));
+        if (gen) r->pfd_gen = gen;
+        if (!p || !idx || !gen) return -1;
+        r->pfd_cap = cap;
+    }
+    int n = 0;
+    for (int h = 0; h < r->slot_cap; h++) {
+        slot_t *s = &r->slots[h];
+        if (!s->used) continue;
+        r->pfds[n].fd = s->sock;
+        r->pfds[n].events = (short)(((s->events & REACTOR_READ) ? POLLIN : 0) | ((s->events & REACTOR_WRITE) ? POLLOUT : 0));
+        r->pfds[n].revents = 0;
+        r->pfd_slot[n] = h;
+        r->pfd_gen[n] = s->gen;
+        n++;
+    }
+    int ready = poll_fds(r->pfds, n, timeout_ms);
+    if (ready <= 0) {
+#ifdef _WIN32
+        return ready < 0 && WSAGetLastError() != WSAEINTR ? -1 : 0;
+#else
+        return ready < 0 && errno != EINTR ? -1 : 0;
+#endif
+    }
+    for (int i = 0; i < n; i++) {
+        short re = r->pfds[i].revents;
+        if (!re) continue;
+        slot_t *s = &r->slots[r->pfd_slot[i]];
+        if (!s->used || s->gen != r->pfd_gen[i]) continue;
+        int ev = ((re & POLLIN) ? REACTOR_READ : 0) | ((re & POLLOUT) ? REACTOR_WRITE : 0);
+        if (re & (POLLERR | POLLHUP | POLLNVAL)) ev |= REACTOR_ERROR | REACTOR_READ;
+        s->fn(r, s->sock, ev, s->arg);
+    }
+    return ready;
+}
+
+/* ---------- timers ---------- */
+
+static void heap_swap(reactor_t *r, int a, int b) {
+    rtimer_t t = r->timers[a];
+    r->timers[a] = r->timers[b];
+    r->timers[b] = t;
+}
+
+static void heap_up(reactor_t *r, int i) {
+    while (i > 0 && r->timers[(i - 1) / 2].due_us > r->timers[i].due_us) {
+        heap_swap(r, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(reactor_t *r, int i) {
+    for (;;) {
+        int l = 2 * i + 1, m = i;
+        if (l < r->timer_count && r->timers[l].due_us < r->timers[m].due_us) m = l;
+        if (l + 1 < r->timer_count && r->timers[l + 1].due_us < r->timers[m].due_us) m = l + 1;
+        if (m == i) return;
+        heap_swap(r, i, m);
+        i = m;
+    }
+}
+
+static int heap_push(reactor_t *r, const rtimer_t *t) {
+    if (r->timer_count == r->timer_cap) {
+        int cap = r->timer_cap ? r->timer_cap * 2 : 16;
+        rtimer_t *p = (rtimer_t*)realloc(r->timers, (size_t)cap * sizeof(*p));
+        if (!p) return -1;
+        r->timers = p;
+        r->timer_cap = cap;
+    }
+    r->timers[r->timer_count] = *t;
+    heap_up(r, r->timer_count++);
+    return 0;
+}
+
+static void heap_remove(reactor_t *r, int i) {
+    r->timers[i] = r->timers[--r->timer_count];
+    if (i < r->timer_count) {
+        heap_down(r, i);
+        heap_up(r, i);
+    }
+}
+
+static void run_timers(reactor_t *r) {
+    uint64_t now = now_us();
+    while (r->timer_count > 0 && r->timers[0].due_us <= now) {
+        rtimer_t t = r->timers[0];
+        heap_remove(r, 0);
+        r->running_timer = t.id;
+        r->running_cancelled = 0;
+        t.fn(r, t.arg);
+        r->running_timer = 0;
+        if (t.period_ms > 0 && !r->running_cancelled) {
+            t.due_us += (uint64_t)t.period_ms * 1000;
+            if (t.due_us <= now) t.due_us = now + (uint64_t)t.period_ms * 1000;   /* Fell behind: skip, don't burst */
+            heap_push(r, &t);
+        }
+    }
+}
+
+/* ---------- wakeup ---------- */
+
+static sock_t wake_socket(void) {
+    sock_t s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s == sock_invalid) return s;
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(s, (struct sockaddr*)&sa, sizeof(sa)) != 0 ||
+        getsockname(s, (struct sockaddr*)&sa, &len) != 0 ||
+        connect(s, (struct sockaddr*)&sa, len) != 0) {
+        close_socket(s);
+        return sock_invalid;
+    }
+    set_nonblocking(s);
+    return s;
+}
+
+static void on_wake_io(reactor_t *r, sock_t sock, int events, void *arg) {
+    (void)events;
+    (void)arg;
+    char drain[64];
+    while (recv(sock, drain, sizeof(drain), 0) > 0) {}
+    /* Cleared before the callback runs: a wake from here on sends again */
+    __atomic_store_n(&r->wake_armed, 0, __ATOMIC_RELEASE);
+    if (r->wake_fn) r->wake_fn(r, r->wake_arg);
+}
+
+/* ---------- public API ---------- */
+
+static reactor_backend_t pick_backend(reactor_backend_t b) {
+    if (b == REACTOR_DEFAULT) {
+        const char *env = getenv("P2P_REACTOR");
+        if (env && strcmp(env, "poll") == 0) b = REACTOR_POLL;
+        else if (env && strcmp(env, "epoll") == 0) b = REACTOR_EPOLL;
+        else if (env && strcmp(env, "uring") == 0) b = REACTOR_URING;
+#ifdef HAVE_EPOLL
+        else b = REACTOR_EPOLL;
+#else
+        else b = REACTOR_POLL;
+#endif
+    }
+#ifndef HAVE_EPOLL
+    if (b == REACTOR_EPOLL) b = REACTOR_POLL;
+#endif
+#ifndef HAVE_URING
+    if (b == REACTOR_URING) b = REACTOR_POLL;
+#endif
+    return b;
+}
+
+reactor_t *reactor_new(reactor_backend_t backend) {
+    reactor_t *r = (reactor_t*)calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    r->free_head = -1;
+    r->next_timer_id = 1;
+    r->backend = pick_backend(backend);
+#ifdef HAVE_URING
+    if (r->backend == REACTOR_URING && uring_setup(&r->ring) != 0) {
+        fprintf(stderr, "[WARN] io_uring unavailable; using epoll.\n");
+        r->backend = REACTOR_EPOLL;
+    }
+#endif
+#ifdef HAVE_EPOLL
+    if (r->backend == REACTOR_EPOLL && (r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) r->backend = REACTOR_POLL;
+#endif
+    r->wake_sock = wake_socket();
+    if (r->wake_sock == sock_invalid || reactor_add(r, r->wake_sock, REACTOR_READ, on_wake_io, NULL) < 0) {
+        reactor_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void reactor_free(reactor_t *r) {
+    if (!r) return;
+    if (r->wake_sock != sock_invalid) close_socket(r->wake_sock);
+#ifdef HAVE_EPOLL
+    if (r->backend == REACTOR_EPOLL) close(r->epfd);
+#endif
+#ifdef HAVE_URING
+    if (r->backend == REACTOR_URING) uring_close(&r->ring);
+#endif
+    free(r->slots);
+    free(r->timers);
+    free(r->pfds);
+    free(r->pfd_slot);
+    free(r->pfd_gen);
+    free(r);
+}
+
+const char *reactor_backend_name(const reactor_t *r) {
+    switch (r->backend) {
+    case REACTOR_EPOLL: return "epoll";
+    case REACTOR_URING: return "io_uring";
+    default: return "poll";
+    }
+}
+
+int reactor_add(reactor_t *r, sock_t sock, int events, reactor_io_fn fn, void *arg) {
+    if (r->free_head < 0) {
+        int cap = r->slot_cap ? r->slot_cap * 2 : 64;
+        slot_t *p = (slot_t*)realloc(r->slots, (size_t)cap * sizeof(*p));
+        if (!p) return -1;
+        memset(p + r->slot_cap, 0, (size_t)(cap - r->slot_cap) * sizeof(*p));
+        for (int i = cap - 1; i >= r->slot_cap; i--) {
+            p[i].next_free = r->free_head;
+            r->free_head = i;
+        }
+        r->slots = p;
+        r->slot_cap = cap;
+    }
+    int h = r->free_head;
+    slot_t *s = &r->slots[h];
+    r->free_head = s->next_free;
+    s->sock = sock;
+    s->events = events;
+    s->fn = fn;
+    s->arg = arg;
+    s->used = 1;
+    r->live++;
+
+    int rc = 0;
+#ifdef HAVE_EPOLL
+    if (r->backend == REACTOR_EPOLL) rc = epoll_ctl_slot(r, EPOLL_CTL_ADD, h);
+#endif
+#ifdef HAVE_URING
+    if (r->backend == REACTOR_URING) rc = uring_arm(r, h);
+#endif
+    if (rc != 0) {
+        s->used = 0;
+        s->next_free = r->free_head;
+        r->free_head = h;
+        r->live--;
+        return -1;
+    }
+    return h;
+}
+
+int reactor_mod(reactor_t *r, int handle, int events) {
+    slot_t *s = &r->slots[handle];
+    if (s->events == events) return 0;
+    s->events = events;
+#ifdef HAVE_EPOLL
+    if (r->backend == REACTOR_EPOLL) return epoll_ctl_slot(r, EPOLL_CTL_MOD, handle);
+#endif
+#ifdef HAVE_URING
+    if (r->backend == REACTOR_URING) {
+        uring_disarm(r, handle);
+        s->gen++;
+        return uring_arm(r, handle);
+    }
+#endif
+    return 0;
+}
+
+void reactor_del(reactor_t *r, int handle) {
+    slot_t *s = &r->slots[handle];
+    if (!s->used) return;
+#ifdef HAVE_EPOLL
+    if (r->backend == REACTOR_EPOLL) epoll_ctl(r->epfd, EPOLL_CTL_DEL, s->sock, NULL);
+#endif
+#ifdef HAVE_URING
+    if (r->backend == REACTOR_URING) {
+        uring_disarm(r, handle);
+        /* The socket may be closed before the removal is submitted */
+        uring_enter(&r->ring, 0);
+    }
+#endif
+    s->used = 0;
+    s->gen++;
+    s->next_free = r->free_head;
+    r->free_head = handle;
+    r->live--;
+}
+
+uint64_t reactor_timer(reactor_t *r, int delay_ms, int period_ms, reactor_fn fn, void *arg) {
+    rtimer_t t;
+    t.due_us = now_us() + (uint64_t)(delay_ms > 0 ? delay_ms : 0) * 1000;
+    t.id = r->next_timer_id++;
+    t.period_ms = period_ms;
+    t.fn = fn;
+    t.arg = arg;
+    return heap_push(r, &t) == 0 ? t.id : 0;
+}
+
+void reactor_cancel(reactor_t *r, uint64_t id) {
+    if (id == 0) return;
+    if (id == r->running_timer) {
+        r->running_cancelled = 1;
+        return;
+    }
+    for (int i = 0; i < r->timer_count; i++) {
+        if (r->timers[i].id == id) {
+            heap_remove(r, i);
+            return;
+        }
+    }
+}
+
+void reactor_on_wake(reactor_t *r, reactor_fn fn, void *arg) {
+    r->wake_fn = fn;
+    r->wake_arg = arg;
+}
+
+void reactor_wake(reactor_t *r) {
+    if (__atomic_exchange_n(&r->wake_armed, 1, __ATOMIC_ACQ_REL) == 0)
+        send(r->wake_sock, "w", 1, 0);
+}
+
+int reactor_run_once(reactor_t *r, int timeout_ms) {
+    if (r->timer_count > 0) {
+        uint64_t now = now_us(), due = r->timers[0].due_us;
+        int until = due <= now ? 0 : (int)((due - now + 999) / 1000);
+        if (timeout_ms < 0 || until < timeout_ms) timeout_ms = until;
+    }
+    int n;
+    switch (r->backend) {
+#ifdef HAVE_EPOLL
+    case REACTOR_EPOLL: n = epoll_wait_slots(r, timeout_ms); break;
+#endif
+#ifdef HAVE_URING
+    case REACTOR_URING: n = uring_wait(r, timeout_ms); break;
+#endif
+    default: n = poll_slots(r, timeout_ms); break;
+    }
+    run_timers(r);
+    return n;
+}
+
+void reactor_run(reactor_t *r) {
+    while (!__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE)) {
+        if (reactor_run_once(r, -1) < 0) break;
+    }
+    __atomic_store_n(&r->stopping, 0, __ATOMIC_RELEASE);
+}
+
+void reactor_stop(reactor_t *r) {
+    __atomic_store_n(&r->stopping, 1, __ATOMIC_RELEASE);
+    reactor_wake(r);
+}
@@ -0,0 +1,84 @@
+/*
+ * reactor.h - Event loop: socket readiness, timers and cross-thread wakeups
+ *
+ * One reactor is driven by one thread. Sockets are registered with a
+ * callback and an interest set (level-triggered: a callback keeps coming
+ * while the condition holds), timers fire once or periodically, and
+ * reactor_wake lets any thread interrupt the wait.
+ *
+ * Backends, chosen when the reactor is created:
+ *   poll   - everywhere (WSAPoll on Windows); rebuilds its fd array per wait
+ *   epoll  - Linux; interest kept in the kernel, cost per ready fd only
+ *   uring  - Linux 5.x io_uring, one-shot POLL_ADDs re-armed after each
+ *            completion, the wait itself a TIMEOUT request
+ * REACTOR_DEFAULT takes P2P_REACTOR ("poll", "epoll", "uring") from the
+ * environment, else epoll on Linux and poll elsewhere. A backend the
+ * platform lacks falls back to poll; io_uring refused by the kernel (old
+ * kernel, seccomp) falls back to epoll.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include "utils.h"
+
+#define REACTOR_READ  1
+#define REACTOR_WRITE 2
+#define REACTOR_ERROR 4                 /* Reported only: hangup or socket error */
+
+typedef enum {
+    REACTOR_DEFAULT,
+    REACTOR_POLL,
+    REACTOR_EPOLL,
+    REACTOR_URING
+} reactor_backend_t;
+
+typedef struct reactor reactor_t;
+
+typedef void (*reactor_io_fn)(reactor_t *r, sock_t sock, int events, void *arg);
+typedef void (*reactor_fn)(reactor_t *r, void *arg);
+
+/* NULL on error */
+reactor_t *reactor_new(reactor_backend_t backend);
+
+/* Sockets stay open: they belong to whoever added them */
+void reactor_free(reactor_t *r);
+
+const char *reactor_backend_name(const reactor_t *r);
+
+/* Watch sock for events (REACTOR_READ | REACTOR_WRITE); returns a handle
+ * for reactor_mod / reactor_del, -1 on error */
+int reactor_add(reactor_t *r, sock_t sock, int events, reactor_io_fn fn, void *arg);
+int reactor_mod(reactor_t *r, int handle, int events);
+
+/* Stop watching; no callback for the handle after this, even one already
+ * collected by the current wait. Call before closing the socket. */
+void reactor_del(reactor_t *r, int handle);
+
+/* Run fn after delay_ms, then every period_ms (0: once). Returns an id for
+ * reactor_cancel, 0 on error. */
+uint64_t reactor_timer(reactor_t *r, int delay_ms, int period_ms, reactor_fn fn, void *arg);
+
+/* Safe from inside the timer's own callback */
+void reactor_cancel(reactor_t *r, uint64_t id);
+
+/* fn runs on the reactor's thread after each reactor_wake */
+void reactor_on_wake(reactor_t *r, reactor_fn fn, void *arg);
+
+/* Interrupt the current or next wait. Safe from any thread; calls before
+ * the reactor gets to run the wake callback coalesce into one. */
+void reactor_wake(reactor_t *r);
+
+/* Wait up to timeout_ms (-1: until something happens) or the next timer,
+ * whichever is first, and dispatch. Returns the number of socket events,
+ * -1 on error. */
+int reactor_run_once(reactor_t *r, int timeout_ms);
+
+/* Dispatch until reactor_stop */
+void reactor_run(reactor_t *r);
+
+/* Make reactor_run return. Safe from any thread. */
+void reactor_stop(reactor_t *r);
+
+#endif /* REACTOR_H */
@@ -0,0 +1,211 @@
+/*
+ * session.c - Per-connection session keys and resumption tickets
+ *
+ * The store is a small table rewritten whole on every change through
+ * wal_replace (temp file + rename + sync), so a redeemed ticket is gone
+ * from disk before the server acts on the data that came with it.
+ *
+ * File format: "P2PT" then per ticket [id 16][key 32][issued u64 LE].
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "session.h"
+#include "wal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#define STORE_MAGIC "P2PT"
+#define RECORD_LEN (SESSION_ID_LEN + ENC_KEY_LEN + 8)
+
+static wal_t *store = NULL;
+static session_ticket_t tickets[SESSION_MAX_TICKETS];
+static int ticket_count = 0;
+
+int session_random(unsigned char *buf, int len) {
+    return RAND_bytes(buf, len) == 1 ? 0 : -1;
+}
+
+/* HMAC-SHA256(secret, label | cnonce [| snonce]) */
+static int derive(const unsigned char secret[ENC_KEY_LEN], const char *label,
+                  const unsigned char *cnonce, const unsigned char *snonce,
+                  unsigned char out[ENC_KEY_LEN]) {
+    unsigned char msg[32 + 2 * SESSION_NONCE_LEN];
+    size_t len = strlen(label);
+    memcpy(msg, label, len);
+    memcpy(msg + len, cnonce, SESSION_NONCE_LEN);
+    len += SESSION_NONCE_LEN;
+    if (snonce) {
+        memcpy(msg + len, snonce, SESSION_NONCE_LEN);
+        len += SESSION_NONCE_LEN;
+    }
+
+    unsigned int out_len = 0;
+    if (!HMAC(EVP_sha256(), secret, ENC_KEY_LEN, msg, len, out, &out_len)) return -1;
+    return out_len == ENC_KEY_LEN ? 0 : -1;
+}
+
+int session_derive_key(const unsigned char psk[ENC_KEY_LEN],
+                       const unsigned char cnonce[SESSION_NONCE_LEN],
+                       const unsigned char snonce[SESSION_NONCE_LEN],
+                       unsigned char out[ENC_KEY_LEN]) {
+    return derive(psk, "p2pchat session", cnonce, snonce, out);
+}
+
+int session_derive_early(const unsigned char ticket_key[ENC_KEY_LEN],
+                         const unsigned char cnonce[SESSION_NONCE_LEN],
+                         unsigned char out[ENC_KEY_LEN]) {
+    return derive(ticket_key, "p2pchat early", cnonce, NULL, out);
+}
+
+void session_to_hex(const unsigned char *in, int len, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < len; i++) {
+        out[2 * i] = digits[in[i] >> 4];
+        out[2 * i + 1] = digits[in[i] & 15];
+    }
+    out[2 * len] = '\0';
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int session_from_hex(const char *in, unsigned char *out, int len) {
+    for (int i = 0; i < len; i++) {
+        int hi = hex_digit(in[2 * i]);
+        int lo = hi < 0 ? -1 : hex_digit(in[2 * i + 1]);
+        if (lo < 0) return -1;
+        out[i] = (unsigned char)(hi << 4 | lo);
+    }
+    return 0;
+}
+
+void session_path_for(char *out, size_t out_sz, const char *dir, const char *role, const char *peer) {
+    char safe[128];
+    size_t j = 0;
+    for (size_t i = 0; peer[i] && j < sizeof(safe) - 1; i++) {
+        char c = peer[i];
+        int ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '-';
+        safe[j++] = ok ? c : '_';
+    }
+    safe[j] = '\0';
+    snprintf(out, out_sz, "%s/session_%s_%s.tkt", dir, role, safe);
+}
+
+/* ---------- store ---------- */
+
+static int expired(const session_ticket_t *t) {
+    int64_t age = (int64_t)time(NULL) - t->issued;
+    return age < 0 || age > SESSION_TICKET_TTL_S;
+}
+
+static void drop(int i) {
+    memset(&tickets[i], 0, sizeof(tickets[i]));
+    tickets[i] = tickets[--ticket_count];
+}
+
+static int persist(void) {
+    unsigned char buf[4 + SESSION_MAX_TICKETS * RECORD_LEN];
+    size_t len = 4;
+    memcpy(buf, STORE_MAGIC, 4);
+    for (int i = 0; i < ticket_count; i++) {
+        unsigned char *r = buf + len;
+        memcpy(r, tickets[i].id, SESSION_ID_LEN);
+        memcpy(r + SESSION_ID_LEN, tickets[i].key, ENC_KEY_LEN);
+        uint64_t issued = (uint64_t)tickets[i].issued;
+        for (int b = 0; b < 8; b++) r[SESSION_ID_LEN + ENC_KEY_LEN + b] = (unsigned char)(issued >> (8 * b));
+        len += RECORD_LEN;
+    }
+    int rc = wal_replace(store, buf, len);
+    memset(buf, 0, sizeof(buf));
+    return rc;
+}
+
+int session_store_open(const char *path) {
+    ticket_count = 0;
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        unsigned char magic[4];
+        unsigned char r[RECORD_LEN];
+        if (fread(magic, 1, 4, f) == 4 && memcmp(magic, STORE_MAGIC, 4) == 0) {
+            while (ticket_count < SESSION_MAX_TICKETS && fread(r, 1, RECORD_LEN, f) == RECORD_LEN) {
+                session_ticket_t *t = &tickets[ticket_count];
+                memcpy(t->id, r, SESSION_ID_LEN);
+                memcpy(t->key, r + SESSION_ID_LEN, ENC_KEY_LEN);
+                uint64_t issued = 0;
+                for (int b = 0; b < 8; b++) issued |= (uint64_t)r[SESSION_ID_LEN + ENC_KEY_LEN + b] << (8 * b);
+                t->issued = (int64_t)issued;
+                if (!expired(t)) ticket_count++;
+            }
+        }
+        memset(r, 0, sizeof(r));
+        fclose(f);
+    }
+    store = wal_open(path, WAL_NO_SYNC);
+    return store ? 0 : -1;
+}
+
+int session_issue(const unsigned char key[ENC_KEY_LEN], session_ticket_t *out) {
+    if (!store) return -1;
+    /* Full: forget the oldest */
+    if (ticket_count == SESSION_MAX_TICKETS) {
+        int oldest = 0;
+        for (int i = 1; i < ticket_count; i++) {
+            if (tickets[i].issued < tickets[oldest].issued) oldest = i;
+        }
+        drop(oldest);
+    }
+    session_ticket_t *t = &tickets[ticket_count];
+    if (session_random(t->id, SESSION_ID_LEN) != 0) return -1;
+    memcpy(t->key, key, ENC_KEY_LEN);
+    t->issued = (int64_t)time(NULL);
+    ticket_count++;
+    *out = *t;
+    return persist();
+}
+
+int session_redeem(const unsigned char id[SESSION_ID_LEN], unsigned char key[ENC_KEY_LEN]) {
+    if (!store) return 0;
+    for (int i = 0; i < ticket_count; i++) {
+        if (memcmp(tickets[i].id, id, SESSION_ID_LEN) != 0) continue;
+        int ok = !expired(&tickets[i]);
+        if (ok) memcpy(key, tickets[i].key, ENC_KEY_LEN);
+        drop(i);
+        /* Not durably gone means not redeemed: a crash must not allow a replay */
+        if (persist() != 0) return 0;
+        return ok;
+    }
+    return 0;
+}
+
+int session_save(const session_ticket_t *t) {
+    if (!store) return -1;
+    tickets[0] = *t;
+    ticket_count = 1;
+    return persist();
+}
+
+int session_take(session_ticket_t *out) {
+    if (!store || ticket_count == 0) return 0;
+    int ok = !expired(&tickets[0]);
+    if (ok) *out = tickets[0];
+    drop(0);
+    persist();
+    return ok;
+}
+
+void session_store_close(void) {
+    if (store) wal_close(store);
+    store = NULL;
+    memset(tickets, 0, sizeof(tickets));
+    ticket_count = 0;
+}
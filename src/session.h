@@ -0,0 +1,78 @@
+/*
+ * session.h - Per-connection session keys and resumption tickets
+ *
+ * A fresh connection agrees on a session key: the client sends a random
+ * nonce, the server answers with its own nonce and a ticket, and both
+ * derive the key from the shared password key and the two nonces.
+ *
+ * A ticket lets the next connection to the same peer skip that round
+ * trip: the client presents it with a fresh nonce in its first flight and
+ * sends chat data right behind it (0-RTT), under an early key derived from
+ * the ticket's key and that nonce. The server answers with its own nonce,
+ * and the rest of the connection uses a key derived from the ticket's key
+ * and both nonces, which the next ticket carries. Tickets are single use
+ * and expire; the server deletes a ticket durably before accepting data
+ * under it, so a replayed first flight finds nothing to redeem.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include "encryption.h"
+
+#define SESSION_ID_LEN 16                 /* Ticket identifier */
+#define SESSION_NONCE_LEN 16              /* Handshake nonce per side */
+#define SESSION_HEX_LEN 32                /* Either of the above as hex */
+#define SESSION_TICKET_TTL_S 3600         /* Tickets older than this are refused */
+#define SESSION_MAX_TICKETS 64            /* Server: outstanding tickets kept */
+
+typedef struct {
+    unsigned char id[SESSION_ID_LEN];
+    unsigned char key[ENC_KEY_LEN];       /* Session key the ticket resumes */
+    int64_t issued;                       /* time(NULL) when issued */
+} session_ticket_t;
+
+/* Fill buf with len random bytes; 0 on success */
+int session_random(unsigned char *buf, int len);
+
+/* Session key = HMAC-SHA256(psk, "p2pchat session" | cnonce | snonce) */
+int session_derive_key(const unsigned char psk[ENC_KEY_LEN],
+                       const unsigned char cnonce[SESSION_NONCE_LEN],
+                       const unsigned char snonce[SESSION_NONCE_LEN],
+                       unsigned char out[ENC_KEY_LEN]);
+
+/* Early data key = HMAC-SHA256(ticket key, "p2pchat early" | cnonce) */
+int session_derive_early(const unsigned char ticket_key[ENC_KEY_LEN],
+                         const unsigned char cnonce[SESSION_NONCE_LEN],
+                         unsigned char out[ENC_KEY_LEN]);
+
+/* Hex helpers for the text control frames; from_hex returns 0 on success */
+void session_to_hex(const unsigned char *in, int len, char *out);
+int session_from_hex(const char *in, unsigned char *out, int len);
+
+/* Path of the ticket store for a role ("server" / "client") and peer */
+void session_path_for(char *out, size_t out_sz, const char *dir, const char *role, const char *peer);
+
+/* Load the ticket store at path (missing file = empty); 0 on success.
+ * One store per process; not thread-safe, the chat drives it from one
+ * thread at a time. */
+int session_store_open(const char *path);
+
+/* Server: mint a ticket for key and persist it */
+int session_issue(const unsigned char key[ENC_KEY_LEN], session_ticket_t *out);
+
+/* Server: redeem a ticket. On success copies its key and durably removes
+ * it; returns 1. Returns 0 for unknown, used or expired tickets. */
+int session_redeem(const unsigned char id[SESSION_ID_LEN], unsigned char key[ENC_KEY_LEN]);
+
+/* Client: replace the stored ticket */
+int session_save(const session_ticket_t *t);
+
+/* Client: take the stored ticket, removing it (single use); 1 if one was
+ * present and fresh */
+int session_take(session_ticket_t *out);
+
+void session_store_close(void);
+
+#endif /* SESSION_H */
@@ -0,0 +1,362 @@
+/*
+ * shard.c - Shard-per-core runtime on top of the chat engine
+ *
+ * Each shard's mailbox is an intrusive multi-producer, single-consumer
+ * queue (Vyukov): producers swap themselves in as the head with one atomic
+ * exchange, the shard pops from the tail without atomics read-modify-write.
+ * A push is followed by p2p_engine_wake, which costs a syscall only when
+ * the shard isn't already due to wake.
+ *
+ * Stats are published by each shard into its own slot under a sequence
+ * counter, the same seqlock as statshm, so readers never block a shard.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "shard.h"
+#include "utils.h"
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    typedef HANDLE shard_thread_t;
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #include <pthread.h>
+    typedef pthread_t shard_thread_t;
+    #define THREAD_LOCAL __thread
+#endif
+
+#define STATS_READ_RETRIES 1000
+
+typedef struct task {
+    struct task *next;
+    p2p_task_fn fn;
+    void *arg;
+} task_t;
+
+typedef struct {
+    p2p_runtime_t *rt;
+    int index;
+    p2p_engine_t *eng;
+    shard_thread_t thread;
+
+    task_t *head;                       /* Producers: any thread */
+    char pad[64];                       /* Keep producers off the consumer's line */
+    task_t *tail;                       /* Consumer: this shard only */
+    task_t stub;
+
+    uint64_t tasks;
+    uint64_t polls;
+    uint64_t published_ms;
+    uint32_t stats_seq;                 /* Odd while the slot is being written */
+    p2p_shard_stats_t pub;
+} shard_t;
+
+struct p2p_runtime {
+    shard_t **shards;
+    int count;
+    int started;
+    int stopping;
+    int handoff;                        /* Shard 0 accepts for everyone */
+    unsigned next_accept;
+    unsigned next_connect;
+};
+
+typedef struct {
+    char host[256];
+    int port;
+    void *user;
+} connect_req_t;
+
+typedef struct {
+    int refs;                           /* Shards yet to send it */
+    char text[1];
+} broadcast_t;
+
+static THREAD_LOCAL int current_shard = -1;
+
+static uint64_t now_ms(void) {
+#ifdef _WIN32
+    return (uint64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+/* ---------- mailbox ---------- */
+
+static void mailbox_init(shard_t *sh) {
+    sh->stub.next = NULL;
+    sh->head = &sh->stub;
+    sh->tail = &sh->stub;
+}
+
+static void mailbox_push(shard_t *sh, task_t *t) {
+    __atomic_store_n(&t->next, NULL, __ATOMIC_RELAXED);
+    task_t *prev = __atomic_exchange_n(&sh->head, t, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, t, __ATOMIC_RELEASE);
+}
+
+/* NULL when empty, or when a push is half done; its wake follows */
+static task_t *mailbox_pop(shard_t *sh) {
+    task_t *tail = sh->tail;
+    task_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &sh->stub) {
+        if (!next) return NULL;
+        sh->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        sh->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&sh->head, __ATOMIC_ACQUIRE)) return NULL;
+    mailbox_push(sh, &sh->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        sh->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void mailbox_drain(shard_t *sh) {
+    task_t *t;
+    while ((t = mailbox_pop(sh)) != NULL) {
+        t->fn(sh->eng, t->arg);
+        free(t);
+        sh->tasks++;
+    }
+}
+
+/* ---------- shard loop ---------- */
+
+static void publish(shard_t *sh) {
+    __atomic_store_n(&sh->stats_seq, sh->stats_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    sh->pub.sessions = p2p_engine_sessions(sh->eng);
+    p2p_engine_stats(sh->eng, &sh->pub.stats);
+    sh->pub.tasks = sh->tasks;
+    sh->pub.polls = sh->polls;
+    __atomic_store_n(&sh->stats_seq, sh->stats_seq + 1, __ATOMIC_RELEASE);
+    sh->published_ms = now_ms();
+}
+
+static void on_wake(p2p_engine_t *e, void *ctx) {
+    (void)e;
+    mailbox_drain((shard_t*)ctx);
+}
+
+static void adopt_task(p2p_engine_t *e, void *arg) {
+    p2p_adopt(e, (p2p_socket_t)(uintptr_t)arg, 1);
+}
+
+/* Shard 0 without SO_REUSEPORT: keep every n-th connection, post the rest */
+static int on_accept(p2p_engine_t *e, p2p_socket_t sock, void *ctx) {
+    (void)e;
+    p2p_runtime_t *rt = ((shard_t*)ctx)->rt;
+    if (!rt->handoff) return 0;
+    int target = (int)(rt->next_accept++ % (unsigned)rt->count);
+    if (target == 0) return 0;
+    return p2p_runtime_post(rt, target, adopt_task, (void*)(uintptr_t)sock) == 0;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI shard_main(LPVOID arg)
+#else
+static void *shard_main(void *arg)
+#endif
+{
+    shard_t *sh = (shard_t*)arg;
+    current_shard = sh->index;
+    /* Sessions are allocated on this thread, so pinned shards keep them local */
+    aff_pin(AFF_SHARD, sh->index);
+    while (!__atomic_load_n(&sh->rt->stopping, __ATOMIC_ACQUIRE)) {
+        if (p2p_engine_poll(sh->eng, P2P_SHARD_TICK_MS) < 0) {
+            fprintf(stderr, "[ERROR] Shard %d: poll failed, stopping.\n", sh->index);
+            break;
+        }
+        sh->polls++;
+        if (now_ms() - sh->published_ms >= P2P_SHARD_TICK_MS) publish(sh);
+    }
+    /* Tasks posted during shutdown still own memory */
+    mailbox_drain(sh);
+    publish(sh);
+    return 0;
+}
+
+/* ---------- tasks ---------- */
+
+static void connect_task(p2p_engine_t *e, void *arg) {
+    connect_req_t *req = (connect_req_t*)arg;
+    p2p_session_t *s = p2p_connect(e, req->host, req->port);
+    if (s) p2p_session_set_user(s, req->user);
+    else fprintf(stderr, "[WARN] Shard %d: connect to %s:%d failed.\n", current_shard, req->host, req->port);
+    free(req);
+}
+
+static void broadcast_task(p2p_engine_t *e, void *arg) {
+    broadcast_t *b = (broadcast_t*)arg;
+    for (int i = 0; i < p2p_engine_sessions(e); i++) {
+        p2p_session_t *s = p2p_engine_session(e, i);
+        if (p2p_session_ready(s)) p2p_send(s, b->text);
+    }
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) free(b);
+}
+
+/* ---------- public API ---------- */
+
+p2p_runtime_t *p2p_runtime_new(const p2p_runtime_config_t *cfg) {
+    int n = cfg->shards > 0 ? cfg->shards : cfg_cpu_count();
+    if (n > P2P_MAX_SHARDS) n = P2P_MAX_SHARDS;
+    p2p_runtime_t *rt = (p2p_runtime_t*)calloc(1, sizeof(*rt));
+    if (!rt) return NULL;
+    rt->shards = (shard_t**)calloc((size_t)n, sizeof(*rt->shards));
+    if (!rt->shards) {
+        free(rt);
+        return NULL;
+    }
+    p2p_hooks_t hooks;
+    hooks.on_wake = on_wake;
+    hooks.on_accept = on_accept;
+    for (int i = 0; i < n; i++) {
+        /* One allocation per shard, written only by its own thread */
+        shard_t *sh = (shard_t*)calloc(1, sizeof(*sh));
+        if (!sh || !(sh->eng = p2p_engine_new(&cfg->engine))) {
+            free(sh);
+            p2p_runtime_free(rt);
+            return NULL;
+        }
+        sh->rt = rt;
+        sh->index = i;
+        mailbox_init(sh);
+        p2p_engine_set_hooks(sh->eng, &hooks, sh);
+        rt->shards[rt->count++] = sh;
+    }
+    return rt;
+}
+
+int p2p_runtime_listen(p2p_runtime_t *rt, int port) {
+    if (rt->started) return -1;
+    if (p2p_listen_shared(rt->shards[0]->eng, port) != 0) {
+        if (p2p_listen(rt->shards[0]->eng, port) != 0) return -1;
+        rt->handoff = rt->count > 1;
+        return 0;
+    }
+    for (int i = 1; i < rt->count; i++) {
+        if (p2p_listen_shared(rt->shards[i]->eng, port) != 0) return -1;
+    }
+    return 0;
+}
+
+int p2p_runtime_start(p2p_runtime_t *rt) {
+    if (rt->started) return -1;
+    for (int i = 0; i < rt->count; i++) {
+        shard_t *sh = rt->shards[i];
+#ifdef _WIN32
+        sh->thread = CreateThread(NULL, 0, shard_main, sh, 0, NULL);
+        if (!sh->thread) {
+#else
+        if (pthread_create(&sh->thread, NULL, shard_main, sh) != 0) {
+#endif
+            fprintf(stderr, "[ERROR] Cannot start shard %d.\n", i);
+            return -1;          /* p2p_runtime_free joins the ones running */
+        }
+        rt->started = i + 1;
+    }
+    return 0;
+}
+
+void p2p_runtime_free(p2p_runtime_t *rt) {
+    if (!rt) return;
+    __atomic_store_n(&rt->stopping, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < rt->started; i++) p2p_engine_wake(rt->shards[i]->eng);
+    for (int i = 0; i < rt->started; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(rt->shards[i]->thread, INFINITE);
+        CloseHandle(rt->shards[i]->thread);
+#else
+        pthread_join(rt->shards[i]->thread, NULL);
+#endif
+    }
+    for (int i = 0; i < rt->count; i++) {
+        shard_t *sh = rt->shards[i];
+        mailbox_drain(sh);      /* Never started: tasks still hold memory */
+        p2p_engine_free(sh->eng);
+        free(sh);
+    }
+    free(rt->shards);
+    free(rt);
+}
+
+int p2p_runtime_shards(const p2p_runtime_t *rt) {
+    return rt->count;
+}
+
+int p2p_runtime_post(p2p_runtime_t *rt, int shard, p2p_task_fn fn, void *arg) {
+    if (shard < 0 || shard >= rt->count) return -1;
+    task_t *t = (task_t*)malloc(sizeof(*t));
+    if (!t) return -1;
+    t->fn = fn;
+    t->arg = arg;
+    shard_t *sh = rt->shards[shard];
+    mailbox_push(sh, t);
+    p2p_engine_wake(sh->eng);
+    return 0;
+}
+
+int p2p_runtime_connect(p2p_runtime_t *rt, const char *host, int port, void *session_user) {
+    connect_req_t *req = (connect_req_t*)malloc(sizeof(*req));
+    if (!req) return -1;
+    snprintf(req->host, sizeof(req->host), "%s", host);
+    req->port = port;
+    req->user = session_user;
+    int shard = (int)(__atomic_fetch_add(&rt->next_connect, 1, __ATOMIC_RELAXED) % (unsigned)rt->count);
+    if (p2p_runtime_post(rt, shard, connect_task, req) != 0) {
+        free(req);
+        return -1;
+    }
+    return 0;
+}
+
+int p2p_runtime_broadcast(p2p_runtime_t *rt, const char *text) {
+    size_t len = strlen(text);
+    if (len > P2P_MAX_TEXT) return -1;
+    broadcast_t *b = (broadcast_t*)malloc(sizeof(*b) + len);
+    if (!b) return -1;
+    memcpy(b->text, text, len + 1);
+    b->refs = rt->count;
+    int rc = 0;
+    for (int i = 0; i < rt->count; i++) {
+        if (p2p_runtime_post(rt, i, broadcast_task, b) != 0) {
+            rc = -1;
+            if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) free(b);
+        }
+    }
+    return rc;
+}
+
+void p2p_runtime_stats(const p2p_runtime_t *rt, int shard, p2p_shard_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    if (shard < 0 || shard >= rt->count) return;
+    const shard_t *sh = rt->shards[shard];
+    for (int i = 0; i < STATS_READ_RETRIES; i++) {
+        uint32_t before = __atomic_load_n(&sh->stats_seq, __ATOMIC_ACQUIRE);
+        if (before & 1) continue;
+        memcpy(out, (const void*)&sh->pub, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&sh->stats_seq, __ATOMIC_RELAXED) == before) return;
+    }
+}
+
+int p2p_shard_current(void) {
+    return current_shard;
+}
@@ -0,0 +1,71 @@
+/*
+ * shard.h - Shard-per-core runtime on top of the chat engine
+ *
+ * A runtime runs one thread per shard (by default one per online CPU),
+ * and every shard owns a private engine with its own sessions, buffers,
+ * session pool and stats. A session lives on one shard for its whole
+ * life and its callbacks run on that shard's thread, so the data path
+ * takes no lock shared between cores.
+ *
+ * Work for another shard is passed as a message: p2p_runtime_post puts a
+ * task on the shard's lock-free mailbox and wakes its loop. Connects and
+ * broadcasts are built on that. Incoming connections are spread by the
+ * kernel where SO_REUSEPORT allows; elsewhere shard 0 accepts and hands
+ * sockets out round-robin.
+ */
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "engine.h"
+
+#define P2P_MAX_SHARDS 256
+#define P2P_SHARD_TICK_MS 100           /* Longest a shard sleeps: ACK expiry and stats refresh */
+
+typedef struct p2p_runtime p2p_runtime_t;
+
+/* Runs on the shard's thread, with the shard's engine */
+typedef void (*p2p_task_fn)(p2p_engine_t *e, void *arg);
+
+typedef struct {
+    p2p_config_t engine;                /* Every shard's engine; callbacks run on shard threads */
+    int shards;                         /* 0: one per online CPU */
+} p2p_runtime_config_t;
+
+typedef struct {
+    int sessions;                       /* Live now */
+    p2p_stats_t stats;                  /* Totals over the shard's sessions, live and closed */
+    uint64_t tasks;                     /* Mailbox messages handled */
+    uint64_t polls;                     /* Event loop rounds */
+} p2p_shard_stats_t;
+
+/* Create the shards; their threads start with p2p_runtime_start. NULL on error. */
+p2p_runtime_t *p2p_runtime_new(const p2p_runtime_config_t *cfg);
+
+/* Accept sessions on port; call before p2p_runtime_start. 0 on success. */
+int p2p_runtime_listen(p2p_runtime_t *rt, int port);
+
+int p2p_runtime_start(p2p_runtime_t *rt);
+
+/* Stop and join the shard threads, close every session and free rt */
+void p2p_runtime_free(p2p_runtime_t *rt);
+
+int p2p_runtime_shards(const p2p_runtime_t *rt);
+
+/* Run fn(engine, arg) on shard's thread; 0 if queued. Safe from any thread. */
+int p2p_runtime_post(p2p_runtime_t *rt, int shard, p2p_task_fn fn, void *arg);
+
+/* Connect on the next shard round-robin; the session's user pointer is set
+ * to session_user before its on_connect. 0 if queued. */
+int p2p_runtime_connect(p2p_runtime_t *rt, const char *host, int port, void *session_user);
+
+/* Send text to every connected session on every shard. 0 if queued. */
+int p2p_runtime_broadcast(p2p_runtime_t *rt, const char *text);
+
+/* Latest stats of one shard; refreshed by the shard every P2P_SHARD_TICK_MS */
+void p2p_runtime_stats(const p2p_runtime_t *rt, int shard, p2p_shard_stats_t *out);
+
+/* Index of the shard the calling thread runs, or -1 outside the runtime */
+int p2p_shard_current(void);
+
+#endif /* SHARD_H */
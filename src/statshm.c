@@ -0,0 +1,161 @@
+/*
+ * statshm.c - Live stats published in shared memory
+ *
+ * On Linux the segment is a plain file in /dev/shm (what shm_open would
+ * create, without needing -lrt on older glibc); other POSIX systems use
+ * shm_open, Windows a named pagefile-backed mapping.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "statshm.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+  #include <windows.h>
+  #define getpid_() ((int)GetCurrentProcessId())
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #define getpid_() ((int)getpid())
+#endif
+
+#define READ_RETRIES 1000
+
+static void seg_name(char *out, size_t out_sz, int pid) {
+#if defined(_WIN32)
+    snprintf(out, out_sz, "Local\\" STATSHM_PREFIX "%d", pid);
+#elif defined(__linux__)
+    snprintf(out, out_sz, "/dev/shm/" STATSHM_PREFIX "%d", pid);
+#else
+    snprintf(out, out_sz, "/" STATSHM_PREFIX "%d", pid);
+#endif
+}
+
+#ifndef _WIN32
+static int seg_open(const char *name, int flags, mode_t mode) {
+#ifdef __linux__
+    return open(name, flags, mode);
+#else
+    return shm_open(name, flags, mode);
+#endif
+}
+
+static void seg_unlink(const char *name) {
+#ifdef __linux__
+    unlink(name);
+#else
+    shm_unlink(name);
+#endif
+}
+#endif
+
+statshm_t *statshm_create(const char *role) {
+    char name[64];
+    seg_name(name, sizeof(name), getpid_());
+    statshm_t *shm;
+#ifdef _WIN32
+    HANDLE h = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(statshm_t), name);
+    if (!h) return NULL;
+    shm = (statshm_t*)MapViewOfFile(h, FILE_MAP_WRITE, 0, 0, sizeof(statshm_t));
+    CloseHandle(h);     /* The view keeps the mapping alive */
+    if (!shm) return NULL;
+#else
+    int fd = seg_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, sizeof(statshm_t)) != 0) {
+        close(fd);
+        seg_unlink(name);
+        return NULL;
+    }
+    shm = (statshm_t*)mmap(NULL, sizeof(statshm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        seg_unlink(name);
+        return NULL;
+    }
+#endif
+    memset(shm, 0, sizeof(*shm));
+    shm->version = STATSHM_VERSION;
+    shm->pid = getpid_();
+    snprintf(shm->role, sizeof(shm->role), "%s", role);
+    shm->started_unix = (uint64_t)time(NULL);
+    shm->updated_unix = shm->started_unix;
+    /* Magic last: a reader that sees it sees an initialized header */
+    __atomic_store_n(&shm->magic, STATSHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+void statshm_write_begin(statshm_t *shm) {
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void statshm_write_end(statshm_t *shm) {
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+void statshm_destroy(statshm_t *shm) {
+    if (!shm) return;
+    char name[64];
+    seg_name(name, sizeof(name), shm->pid);
+#ifdef _WIN32
+    UnmapViewOfFile(shm);
+#else
+    munmap(shm, sizeof(statshm_t));
+    seg_unlink(name);
+#endif
+}
+
+const statshm_t *statshm_attach(int pid) {
+    char name[64];
+    seg_name(name, sizeof(name), pid);
+    const statshm_t *shm;
+#ifdef _WIN32
+    HANDLE h = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (!h) return NULL;
+    shm = (const statshm_t*)MapViewOfFile(h, FILE_MAP_READ, 0, 0, sizeof(statshm_t));
+    CloseHandle(h);
+    if (!shm) return NULL;
+#else
+    int fd = seg_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(statshm_t)) {
+        close(fd);
+        return NULL;
+    }
+    shm = (const statshm_t*)mmap(NULL, sizeof(statshm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) return NULL;
+#endif
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != STATSHM_MAGIC || shm->version != STATSHM_VERSION) {
+        statshm_detach(shm);
+        return NULL;
+    }
+    return shm;
+}
+
+void statshm_detach(const statshm_t *shm) {
+    if (!shm) return;
+#ifdef _WIN32
+    UnmapViewOfFile((LPCVOID)shm);
+#else
+    munmap((void*)shm, sizeof(statshm_t));
+#endif
+}
+
+int statshm_read(const statshm_t *shm, statshm_t *out) {
+    for (int i = 0; i < READ_RETRIES; i++) {
+        uint32_t before = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) continue;
+        memcpy(out, (const void*)shm, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == before) return 0;
+    }
+    return -1;
+}
@@ -0,0 +1,62 @@
+/*
+ * statshm.h - Live stats published in shared memory
+ *
+ * Each chat process maps one small segment (/dev/shm/p2pchat.<pid> on
+ * Linux, "Local\p2pchat.<pid>" on Windows) and rewrites it from its
+ * periodic housekeeping thread. Readers such as p2pchat_top map it read
+ * only and copy it under a seqlock: the writer makes seq odd, updates the
+ * fields, then makes it even again; a reader retries if it saw an odd seq
+ * or seq changed under it. The chat side never blocks on, or even knows
+ * about, its readers.
+ */
+
+#ifndef STATSHM_H
+#define STATSHM_H
+
+#include <stdint.h>
+#include "utils.h"
+
+#define STATSHM_MAGIC 0x53503250u       /* "P2PS" */
+#define STATSHM_VERSION 1
+#define STATSHM_PREFIX "p2pchat."
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    volatile uint32_t seq;      /* Odd while an update is in progress */
+    int32_t pid;
+    char role[16];              /* e.g. "tcp-server", "udp-client" */
+    uint64_t started_unix;
+    uint64_t updated_unix;
+
+    perf_stats_t stats;
+    int32_t pending;
+    int32_t window_s;           /* Window of the percentiles below */
+    uint32_t window_samples;
+    double p50_ms;
+    double p99_ms;
+    double srtt_ms;
+    double rttvar_ms;
+    double min_rtt_ms;
+    double btl_bw;              /* Bytes/s */
+    uint64_t counters[PERF_CTR_COUNT];
+} statshm_t;
+
+/* Writer: create this process's segment; NULL if shared memory is unavailable */
+statshm_t *statshm_create(const char *role);
+
+/* Writer: bracket every update of the fields */
+void statshm_write_begin(statshm_t *shm);
+void statshm_write_end(statshm_t *shm);
+
+/* Writer: unmap and remove the segment */
+void statshm_destroy(statshm_t *shm);
+
+/* Reader: map the segment of pid read only; NULL if there is none */
+const statshm_t *statshm_attach(int pid);
+void statshm_detach(const statshm_t *shm);
+
+/* Reader: consistent copy; 0 on success, -1 if the writer kept changing it */
+int statshm_read(const statshm_t *shm, statshm_t *out);
+
+#endif /* STATSHM_H */
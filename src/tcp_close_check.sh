@@ -0,0 +1,50 @@
+#!/bin/sh
+# tcp_close_check.sh - Check p2pchat delivers what a peer sent just before closing
+#
+# Usage: ./tcp_close_check.sh [messages]
+#
+# Starts a p2pchat server on 9200 and a client that, once connected, sends
+# numbered messages and hits end of input right after the last one, so the
+# messages and the FIN tend to reach the server in the same read. Checks the server printed
+# every message exactly once and in order. Needs ./p2pchat built as in the
+# README. Exit status 0 on success.
+
+COUNT=${1:-20}
+PORT=9200
+TMP=${TMPDIR:-/tmp}/tcp_close_check.$$
+mkdir -p "$TMP" || exit 1
+
+(printf 'server\n%s\n' $PORT; sleep 10) | P2P_OUTBOX=0 P2P_RESUME=0 ./p2pchat > "$TMP/server.log" 2>&1 &
+SERVER=$!
+sleep 1
+
+(printf 'client\n%s\n127.0.0.1\n' $PORT
+ sleep 1                             # Handshake done: chat is sent, not refused
+ i=1
+ while [ $i -le "$COUNT" ]; do
+     printf 'msg %d\n' $i
+     i=$((i + 1))
+ done) | P2P_OUTBOX=0 P2P_RESUME=0 ./p2pchat > "$TMP/client.log" 2>&1
+
+# The client is gone; give the server a moment to report the close
+t=0
+while [ $t -lt 5 ]; do
+    grep -q 'Connection closed by peer' "$TMP/server.log" && break
+    sleep 1
+    t=$((t + 1))
+done
+kill $SERVER 2>/dev/null
+wait $SERVER 2>/dev/null
+
+grep -o 'Peer: msg [0-9]*' "$TMP/server.log" | sed 's/^Peer: msg //' > "$TMP/got"
+i=1
+while [ $i -le "$COUNT" ]; do echo $i; i=$((i + 1)); done > "$TMP/want"
+
+if cmp -s "$TMP/got" "$TMP/want"; then
+    echo "[INFO] all $COUNT messages sent before the close were delivered."
+    rm -rf "$TMP"
+    exit 0
+fi
+echo "[ERROR] delivered $(wc -l < "$TMP/got") of $COUNT messages; logs in $TMP" >&2
+diff "$TMP/want" "$TMP/got" | head -20 >&2
+exit 1
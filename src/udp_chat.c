@@ -9,6 +9,13 @@
 
 #include "encryption.h"
 #include "utils.h"
+#include "net.h"
+#include "outbox.h"
+#include "wal.h"
+#include "probes.h"
+#include "hwcount.h"
+#include "reactor.h"
+#include "affinity.h"
 const char *SECRET_KEY = "admin123";
 
 // Platform-specific headers
@@ -16,6 +23,7 @@ const char *SECRET_KEY = "admin123";
   #include <winsock2.h>
   #include <ws2tcpip.h>
   #include <windows.h>
+  #include <direct.h>
   typedef SOCKET sock_t;
   typedef int socklen_t;
   #define sock_invalid INVALID_SOCKET
@@ -29,6 +37,10 @@ const char *SECRET_KEY = "admin123";
   #include <sys/socket.h>
   #include <netinet/in.h>
   #include <pthread.h>
+  #include <sys/stat.h>
+  #ifdef __linux__
+    #include <linux/filter.h>
+  #endif
   typedef int sock_t;
   #define sock_invalid -1
   #define close_socket(s) close(s)
@@ -38,8 +50,16 @@ const char *SECRET_KEY = "admin123";
 
 /* -------------------- RELIABILITY PROTOCOL & PACKET DEFINITIONS -------------------- */
 #define PAYLOAD_SIZE 1024
-#define TIMEOUT_MS 2000         // Timeout for retransmission
-#define MAX_UNACKED_PACKETS 64  // Max number of messages we can have in flight
+#define TIMEOUT_MS 2000         // Retransmission timeout before any RTT sample (and its ceiling)
+#define RTO_MIN_MS 200          // Floor for the RTT-derived retransmission timeout
+#define MAX_UNACKED_PACKETS 256 // Hard cap on messages in flight
+#define MIN_WINDOW 16           // In-flight floor while the path estimate is small or unknown
+#define PACE_GAIN 1.25          // Pace a little above the measured delivery rate so it can grow
+#define PACE_MIN_RATE 1250000.0 // 10 Mbit/s floor, so pacing never slows interactive chat
+#define PACE_BURST_PKTS 4       // Datagrams allowed back to back
+#define UDP_MAX_SHARDS 16       // Max SO_REUSEPORT receive sockets in server mode
+#define RETX_SCAN_MAX_MS 100    // Longest gap between retransmit scans
+#define LOG_DIR "../logs"
 
 typedef enum {
     PKT_MSG,
@@ -47,28 +67,82 @@ typedef enum {
     PKT_FIN
 } PacketType;
 
+/*
+ * seq_num of an ACK is cumulative: the next seq the receiver expects, so it
+ * covers everything below. Out-of-order MSGs wait in the receiver's reorder
+ * buffer until the gap fills.
+ *
+ * epoch names one run of the sender, so a restarted peer (whose seqs begin
+ * again at 0) is told apart from a late packet of the old one; ACKs echo
+ * it. una is the sender's lowest unacknowledged seq, where a receiver that
+ * has not heard from this epoch yet starts counting.
+ */
 typedef struct {
     PacketType type;
     uint32_t   seq_num;
+    uint32_t   epoch;
+    uint32_t   una;
     int        payload_len;
     char       payload[PAYLOAD_SIZE];
 } Packet;
 
+// Only the header and payload_len bytes of payload go on the wire
+#define PACKET_HDR_LEN ((int)offsetof(Packet, payload))
+
 /* -------------------- GLOBAL STATE -------------------- */
 static volatile int running = 1;
 static sock_t sock = sock_invalid;
-static struct sockaddr_in peer_addr;
+static struct sockaddr_storage peer_addr;   // IPv4 or IPv6
+static socklen_t peer_addr_len = 0;
 static volatile int peer_addr_known = 0;
 
 static uint32_t next_seq_num_to_send = 0;
 static uint32_t expected_seq_num_to_recv = 0;
+static uint32_t tx_epoch = 0;           // This run; set once in main
+static uint32_t rx_epoch = 0;           // Peer's run we are receiving from
+static int rx_epoch_known = 0;
+
+// Out-of-order MSGs by seq % MAX_UNACKED_PACKETS; rx_mutex covers these and
+// the rx_ fields above. The sender never has more than MAX_UNACKED_PACKETS
+// in flight, so slots cannot collide.
+static Packet reorder[MAX_UNACKED_PACKETS];
+static unsigned char reorder_used[MAX_UNACKED_PACKETS];
 
 static Packet unacked_packets[MAX_UNACKED_PACKETS];
 static uint64_t sent_time_ms[MAX_UNACKED_PACKETS];
+static uint64_t unacked_outbox_id[MAX_UNACKED_PACKETS];  // 0 if not from the outbox
+static int unacked_retx[MAX_UNACKED_PACKETS];            // Retransmitted: no RTT sample (Karn)
 static int unacked_count = 0;
 
+// Path estimate from ACK timing; unacked_mutex covers it and the counters
+static path_est_t path;
+static uint64_t acked_bytes = 0;         // Wire bytes of MSG packets ACKed so far
+static uint64_t sample_bytes = 0;        // ...at the start of the current rate sample
+static uint64_t sample_start_ms = 0;
+static perf_peer_t peer_stats = -1;      // Per-peer stats entry of peer_addr
+
+// Sends (not ACKs) are spread at the path rate instead of leaving in bursts
+// that overflow switch queues and the peer's socket buffer. pace_mutex
+// covers the bucket; lock order is unacked_mutex -> pace_mutex.
+static token_bucket_t pacer;
+static int pacing = 1;
+static int pace_fixed = 0;              // P2P_UDP_PACE_KBPS set: don't follow the estimate
+
+// Durable outbox: every message goes through it, so nothing typed while the
+// peer is unknown (or unacked at exit) is lost. NULL when P2P_OUTBOX=0.
+static outbox_t *outbox = NULL;
+static uint64_t last_pumped_id = 0;     // Highest outbox id put on the wire this run
+
 static mutex_t peer_addr_mutex;
 static mutex_t unacked_mutex;
+static mutex_t rx_mutex;        // Orders delivery across receive shards
+static mutex_t pump_mutex;      // One thread at a time drains the outbox
+static mutex_t pace_mutex;
+
+/* Server-mode receive shards: one SO_REUSEPORT socket + pinned thread each.
+ * shard_socks[0] is also `sock`, which all sends go out of. */
+static sock_t shard_socks[UDP_MAX_SHARDS];
+static int shard_count = 1;
 
 /* -------------------- CROSS-PLATFORM UTILITY FUNCTIONS -------------------- */
 static void mutex_init(mutex_t *m) {
@@ -101,81 +175,364 @@ static void mutex_unlock(mutex_t *m) {
   static void join_thread(thread_t t) { pthread_join(t, NULL); }
 #endif
 
+static void sleep_us(uint64_t us) {
+#ifdef _WIN32
+    Sleep((DWORD)((us + 999) / 1000));
+#else
+    usleep((useconds_t)us);
+#endif
+}
+
 static void trim_newline(char *s) { if (!s) return; size_t n = strlen(s); while (n > 0 && (s[n-1] == '\n' || s[n-1] == '\r')) s[--n] = '\0'; }
 
+/* -------------------- PACING -------------------- */
+// Set the send rate (bytes/s) for both the userspace bucket and, on Linux,
+// the kernel: SO_MAX_PACING_RATE is enforced by the fq qdisc where present.
+static void set_pacing_rate(double rate) {
+    mutex_lock(&pace_mutex);
+    tb_set_rate(&pacer, rate, PACE_BURST_PKTS * (double)sizeof(Packet));
+    mutex_unlock(&pace_mutex);
+#if defined(__linux__) && defined(SO_MAX_PACING_RATE)
+    unsigned int r = rate >= 4294967295.0 ? ~0u : (unsigned int)rate;
+    for (int i = 0; i < shard_count; i++)
+        setsockopt(shard_socks[i], SOL_SOCKET, SO_MAX_PACING_RATE, &r, sizeof(r));
+#endif
+}
+
+static void init_pacing(void) {
+    pacing = cfg_env_int("P2P_UDP_PACING", 1);
+    int kbps = cfg_env_int("P2P_UDP_PACE_KBPS", 0);
+    pace_fixed = kbps > 0;
+    tb_init(&pacer, 0.0, PACE_BURST_PKTS * (double)sizeof(Packet));
+    if (pacing) set_pacing_rate(pace_fixed ? kbps * 1000.0 / 8.0 : PACE_MIN_RATE);
+}
+
+// Send one datagram to the peer once the bucket allows it. It may sleep,
+// so it is never called with unacked_mutex held or on a receive shard.
+static void paced_send(const Packet *pkt, int len) {
+    if (pacing) {
+        mutex_lock(&pace_mutex);
+        uint64_t wait = tb_reserve(&pacer, (size_t)len);
+        mutex_unlock(&pace_mutex);
+        if (wait > 0) sleep_us(wait);
+    }
+    sendto(sock, (const char*)pkt, len, 0, (struct sockaddr*)&peer_addr, peer_addr_len);
+}
+
+/* -------------------- PATH ESTIMATE -------------------- */
+// Messages allowed in flight: enough to cover the bandwidth-delay product.
+// Caller holds unacked_mutex.
+static int window_size(void) {
+    int w = (int)(path_bdp_bytes(&path) / sizeof(Packet));
+    if (w < MIN_WINDOW) w = MIN_WINDOW;
+    if (w > MAX_UNACKED_PACKETS) w = MAX_UNACKED_PACKETS;
+    return w;
+}
+
+// Lowest seq still unacknowledged. Caller holds unacked_mutex.
+static uint32_t lowest_unacked(void) {
+    uint32_t una = next_seq_num_to_send;
+    for (int i = 0; i < unacked_count; i++) {
+        if ((int32_t)(unacked_packets[i].seq_num - una) < 0) una = unacked_packets[i].seq_num;
+    }
+    return una;
+}
+
+// Account for the ACK of unacked slot i. Caller holds unacked_mutex.
+static void on_acked(int i, uint64_t now) {
+    if (!unacked_retx[i]) path_on_rtt(&path, (double)(now - sent_time_ms[i]));
+    acked_bytes += PACKET_HDR_LEN + unacked_packets[i].payload_len;
+
+    // One delivery-rate sample per RTT; UDP buffers do not autotune, so grow
+    // them with the estimate
+    double rtt = path.srtt_ms > 1.0 ? path.srtt_ms : 1.0;
+    if (sample_start_ms == 0) {
+        sample_start_ms = now;
+        sample_bytes = acked_bytes;
+    } else if (now - sample_start_ms >= rtt) {
+        path_on_delivery(&path, acked_bytes - sample_bytes, (double)(now - sample_start_ms));
+        sample_start_ms = now;
+        sample_bytes = acked_bytes;
+        int buf = 2 * window_size() * (int)sizeof(Packet);
+        for (int s = 0; s < shard_count; s++) net_grow_buffers(shard_socks[s], buf, buf);
+        if (pacing && !pace_fixed) {
+            double rate = path.btl_bw * PACE_GAIN;
+            set_pacing_rate(rate < PACE_MIN_RATE ? PACE_MIN_RATE : rate);
+        }
+    }
+}
+
+/* -------------------- SEND PATH -------------------- */
+// Encrypt text into a new MSG packet and put it in flight. Returns 1 if
+// sent, 0 if the unacked window is full, -1 on error.
+static int send_chat_packet(const char *text, uint64_t outbox_id) {
+    Packet tx_packet;
+    tx_packet.type = PKT_MSG;
+
+    unsigned char encrypted_payload[PAYLOAD_SIZE];
+    int enc_len = encrypt_message((unsigned char*)text, strlen(text), (unsigned char*)SECRET_KEY, encrypted_payload, PAYLOAD_SIZE);
+    if (enc_len < 0) {
+        fprintf(stderr, "[ERROR] Failed to encrypt message.\n");
+        return -1;
+    }
+    memcpy(tx_packet.payload, encrypted_payload, enc_len);
+    tx_packet.payload_len = enc_len;
+
+    mutex_lock(&unacked_mutex);
+    if (unacked_count >= window_size()) {
+        mutex_unlock(&unacked_mutex);
+        return 0;
+    }
+    tx_packet.una = lowest_unacked();   // Before this one joins the window
+    tx_packet.seq_num = next_seq_num_to_send++;
+    tx_packet.epoch = tx_epoch;
+    unacked_packets[unacked_count] = tx_packet;
+    sent_time_ms[unacked_count] = get_time_ms();
+    unacked_outbox_id[unacked_count] = outbox_id;
+    unacked_retx[unacked_count] = 0;
+    unacked_count++;
+    perf_count(PERF_CTR_SENT, 1);
+    mutex_unlock(&unacked_mutex);
+
+    // Track latency
+    perf_add_pending_message(text);
+
+    printf("[INFO] Sending MSG #%u...\n", tx_packet.seq_num);
+    perf_trace("send", tx_packet.seq_num, enc_len);
+    P2P_PROBE2(msg__send, tx_packet.seq_num, enc_len);
+    paced_send(&tx_packet, PACKET_HDR_LEN + enc_len);
+    return 1;
+}
+
+// Put queued outbox entries on the wire, oldest first, while the window has
+// room. Called when a message is queued, and on the timer thread when a
+// receive shard asks for it (the peer became known, an ACK freed a slot).
+static void pump_outbox(void) {
+    static outbox_entry_t entry;   // 4 KB; pump_mutex serializes its use
+    if (!outbox || !peer_addr_known) return;
+
+    mutex_lock(&pump_mutex);
+    while (running && outbox_pending_after(outbox, last_pumped_id, &entry, 1) == 1) {
+        if (send_chat_packet(entry.text, entry.id) <= 0) break;
+        last_pumped_id = entry.id;
+    }
+    mutex_unlock(&pump_mutex);
+}
+
 /* -------------------- RECEIVER -------------------- */
-#ifdef _WIN32
-DWORD WINAPI receiver_fn(LPVOID arg)
+// One reactor per shard socket; main stops them at shutdown. Shards never
+// send paced: they wake rt_reactor, whose thread runs the pump.
+static reactor_t *rx_reactors[UDP_MAX_SHARDS];
+static reactor_t *rt_reactor;
+
+#ifdef MSG_DONTWAIT
+#define RX_FLAGS MSG_DONTWAIT   // Drain every queued datagram per wakeup
 #else
-void *receiver_fn(void *arg)
+#define RX_FLAGS 0              // One per wakeup; readiness says it won't block
 #endif
-{
-    Packet rx_packet;
-    struct sockaddr_in sender_addr;
-    socklen_t sender_len = sizeof(sender_addr);
 
-    while (running) {
-        int n = recvfrom(sock, (char*)&rx_packet, sizeof(Packet), 0, (struct sockaddr*)&sender_addr, &sender_len);
-        if (n <= 0) continue;
+// Show one in-order MSG. Caller holds rx_mutex, so messages print in
+// sequence order even when shards race.
+static void deliver(const Packet *pkt) {
+    unsigned char decrypted_payload[PAYLOAD_SIZE];
+    int dec_len = decrypt_message((unsigned char*)pkt->payload, pkt->payload_len, (unsigned char*)SECRET_KEY, decrypted_payload, PAYLOAD_SIZE - 1);
+    if (dec_len >= 0) {
+        perf_count(PERF_CTR_RECV, 1);
+        decrypted_payload[dec_len] = '\0';
+        printf("\nPeer: %s\n", (char*)decrypted_payload);
+    }
+}
+
+// Take a MSG into the reorder buffer, deliver whatever is now in order and
+// ACK cumulatively. Nothing is acknowledged before it has been delivered.
+static void receive_msg(const Packet *pkt) {
+    P2P_PROBE2(msg__recv, pkt->seq_num, pkt->payload_len);
+
+    mutex_lock(&rx_mutex);
+    if (!rx_epoch_known || (int32_t)(pkt->epoch - rx_epoch) > 0) {
+        // First packet, or the peer restarted: count from its lowest unacked
+        if (rx_epoch_known) printf("\n[INFO] Peer restarted; resynchronizing at MSG #%u.\n", pkt->una);
+        rx_epoch = pkt->epoch;
+        rx_epoch_known = 1;
+        expected_seq_num_to_recv = pkt->una;
+        memset(reorder_used, 0, sizeof(reorder_used));
+    } else if (pkt->epoch != rx_epoch) {
+        mutex_unlock(&rx_mutex);   // Late packet from the peer's previous run
+        return;
+    }
+    // The sender only moves una past what was ACKed, which after our own
+    // restart may be more than we know of
+    while ((int32_t)(pkt->una - expected_seq_num_to_recv) > 0)
+        reorder_used[expected_seq_num_to_recv++ % MAX_UNACKED_PACKETS] = 0;
+
+    uint32_t ahead = pkt->seq_num - expected_seq_num_to_recv;
+    if (ahead < MAX_UNACKED_PACKETS) {
+        int slot = (int)(pkt->seq_num % MAX_UNACKED_PACKETS);
+        if (ahead == 0) {
+            deliver(pkt);
+            expected_seq_num_to_recv++;
+        } else if (!reorder_used[slot]) {
+            reorder[slot] = *pkt;
+            reorder_used[slot] = 1;
+        }
+        for (slot = (int)(expected_seq_num_to_recv % MAX_UNACKED_PACKETS); reorder_used[slot];
+             slot = (int)(expected_seq_num_to_recv % MAX_UNACKED_PACKETS)) {
+            deliver(&reorder[slot]);
+            reorder_used[slot] = 0;
+            expected_seq_num_to_recv++;
+        }
+    }
+    // Duplicates and packets beyond the window are answered too, so a
+    // sender whose ACK was lost learns where we are
+
+    Packet ack_packet;
+    ack_packet.type = PKT_ACK;
+    ack_packet.seq_num = expected_seq_num_to_recv;
+    ack_packet.epoch = rx_epoch;
+    ack_packet.una = 0;
+    ack_packet.payload_len = 0;
+    mutex_unlock(&rx_mutex);
+    sendto(sock, (char*)&ack_packet, PACKET_HDR_LEN, 0, (struct sockaddr*)&peer_addr, peer_addr_len);
+    P2P_PROBE1(ack__send, ack_packet.seq_num);
+}
+
+// Retire every unacked MSG below the cumulative ACK. The outbox is updated
+// after unacked_mutex is released: it may write, compact or sync the log.
+static void receive_ack(const Packet *pkt) {
+    uint64_t done_ids[MAX_UNACKED_PACKETS];
+    int n_done = 0;
+
+    if (pkt->epoch != tx_epoch) return;   // For a previous run of ours
+    mutex_lock(&unacked_mutex);
+    uint64_t now = get_time_ms();
+    for (int i = 0; i < unacked_count; ) {
+        if ((int32_t)(unacked_packets[i].seq_num - pkt->seq_num) >= 0) {
+            i++;
+            continue;
+        }
+        printf("[INFO] ACK #%u received.\n", unacked_packets[i].seq_num);
+
+        // --- Perf Integration ---
+        char decrypted_ack[64];
+        snprintf(decrypted_ack, sizeof(decrypted_ack), "ACK:%u", unacked_packets[i].seq_num);
+        perf_handle_ack(decrypted_ack);
+
+        if (unacked_outbox_id[i]) done_ids[n_done++] = unacked_outbox_id[i];
+        on_acked(i, now);
+
+        unacked_packets[i] = unacked_packets[unacked_count - 1];
+        sent_time_ms[i] = sent_time_ms[unacked_count - 1];
+        unacked_outbox_id[i] = unacked_outbox_id[unacked_count - 1];
+        unacked_retx[i] = unacked_retx[unacked_count - 1];
+        unacked_count--;
+    }
+    mutex_unlock(&unacked_mutex);
+
+    for (int i = 0; i < n_done && outbox; i++) outbox_ack(outbox, done_ids[i]);
+}
+
+// Handle what is queued on rx_sock; returns the number of datagrams read
+static int drain_shard(sock_t rx_sock) {
+    Packet rx_packet;
+    struct sockaddr_storage sender_addr;
+    socklen_t sender_len;
+    int got = 0;
+
+    do {
+        sender_len = sizeof(sender_addr);
+        int n = recvfrom(rx_sock, (char*)&rx_packet, sizeof(Packet), RX_FLAGS, (struct sockaddr*)&sender_addr, &sender_len);
+        if (n < 0) break;
+        got++;
+        if (n < PACKET_HDR_LEN) continue;
+        perf_trace(rx_packet.type == PKT_MSG ? "recv" : "recv_ctl", rx_packet.seq_num, n);
+        if (rx_packet.type == PKT_MSG &&
+            (rx_packet.payload_len < 0 || rx_packet.payload_len > n - PACKET_HDR_LEN)) continue;
 
         if (!peer_addr_known) {
             mutex_lock(&peer_addr_mutex);
-            memcpy(&peer_addr, &sender_addr, sizeof(peer_addr));
-            peer_addr_known = 1;
-            char peer_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &peer_addr.sin_addr, peer_ip, sizeof(peer_ip));
-            printf("\n[CONNECTED] Peer is at %s:%d\n", peer_ip, ntohs(peer_addr.sin_port));
-            printf("You: ");
-            fflush(stdout);
+            if (!peer_addr_known) {
+                memcpy(&peer_addr, &sender_addr, sender_len);
+                peer_addr_len = sender_len;
+                peer_addr_known = 1;
+                char peer_s[NET_ADDRSTRLEN];
+                net_format_addr((struct sockaddr*)&peer_addr, peer_s, sizeof(peer_s));
+                printf("\n[CONNECTED] Peer is at %s\n", peer_s);
+                peer_stats = perf_peer(peer_s, "chat");
+                perf_set_peer(peer_stats);
+                printf("You: ");
+                fflush(stdout);
+            }
             mutex_unlock(&peer_addr_mutex);
+            reactor_wake(rt_reactor); // deliver anything queued while the peer was unknown
         }
 
         switch (rx_packet.type) {
-            case PKT_MSG: {
-                Packet ack_packet;
-                ack_packet.type = PKT_ACK;
-                ack_packet.seq_num = rx_packet.seq_num;
-                sendto(sock, (char*)&ack_packet, sizeof(Packet), 0, (struct sockaddr*)&peer_addr, sizeof(peer_addr));
-
-                if (rx_packet.seq_num == expected_seq_num_to_recv) {
-                    unsigned char decrypted_payload[PAYLOAD_SIZE];
-                    int dec_len = decrypt_message((unsigned char*)rx_packet.payload, rx_packet.payload_len, (unsigned char*)SECRET_KEY, decrypted_payload, PAYLOAD_SIZE);
-                    if (dec_len >= 0) {
-                        decrypted_payload[dec_len] = '\0';
-                        printf("\nPeer: %s\n", (char*)decrypted_payload);
-                    }
-                    expected_seq_num_to_recv++;
-                }
+            case PKT_MSG:
+                receive_msg(&rx_packet);
                 break;
-            }
-            case PKT_ACK: {
-                mutex_lock(&unacked_mutex);
-                for (int i = 0; i < unacked_count; i++) {
-                    if (unacked_packets[i].seq_num == rx_packet.seq_num) {
-                        printf("[INFO] ACK #%u received.\n", rx_packet.seq_num);
-                        
-                        // --- Perf Integration ---
-                        char decrypted_ack[64];
-                        snprintf(decrypted_ack, sizeof(decrypted_ack), "ACK:%u", rx_packet.seq_num);
-                        perf_handle_ack(decrypted_ack);
-                        
-                        unacked_packets[i] = unacked_packets[unacked_count - 1];
-                        sent_time_ms[i] = sent_time_ms[unacked_count - 1];
-                        unacked_count--;
-                        break;
-                    }
-                }
-                mutex_unlock(&unacked_mutex);
+            case PKT_ACK:
+                receive_ack(&rx_packet);
+                reactor_wake(rt_reactor); // a window slot may have opened
                 break;
-            }
             case PKT_FIN: {
+                if (rx_epoch_known && (int32_t)(rx_packet.epoch - rx_epoch) < 0) break;   // Previous run's
                 printf("\n[INFO] Peer has disconnected. Shutting down.\n");
                 running = 0;
                 break;
             }
         }
         if (running) { printf("You: "); fflush(stdout); }
+    } while (RX_FLAGS && running);
+    return got;
+}
+
+static void on_datagram(reactor_t *r, sock_t rx_sock, int events, void *arg) {
+    (void)r; (void)events; (void)arg;
+    drain_shard(rx_sock);
+}
+
+#ifdef MSG_DONTWAIT
+// Busy-poll mode: spin on the socket while traffic flows, and only after
+// busy_us without a datagram fall back to sleeping in the reactor
+static void busy_receive(int shard, int busy_us) {
+    sock_t s = shard_socks[shard];
+    if (net_set_busy_poll(s, NET_BUSY_POLL_US) != 0)
+        printf("[INFO] Kernel busy polling unavailable; spinning on the socket only.\n");
+    uint64_t last = perf_now_us();
+    while (running) {
+        if (drain_shard(s) > 0) {
+            last = perf_now_us();
+            continue;
+        }
+        if (perf_now_us() - last < (uint64_t)busy_us) {
+            net_cpu_relax();
+            continue;
+        }
+        reactor_run_once(rx_reactors[shard], -1);   // Until traffic, or main's reactor_stop
+        last = perf_now_us();
     }
+}
+#endif
+
+#ifdef _WIN32
+DWORD WINAPI receiver_fn(LPVOID arg)
+#else
+void *receiver_fn(void *arg)
+#endif
+{
+    int shard = (int)(intptr_t)arg;
+    // P2P_PIN_RX if set; otherwise several shards still get a core each
+    int pinned = aff_pin(AFF_RX, shard) >= 0;
+    if (!pinned && shard_count > 1) pinned = aff_pin_cpu(shard % cfg_cpu_count()) == 0;
+#ifdef MSG_DONTWAIT
+    int busy_us = cfg_env_int("P2P_BUSY_POLL_US", 0);
+    if (busy_us > 0) {
+        if (!pinned) fprintf(stderr, "[WARN] Busy polling with an unpinned receiver; set P2P_PIN_RX to give it a core.\n");
+        busy_receive(shard, busy_us);
+        return 0;
+    }
+#endif
+    reactor_run(rx_reactors[shard]);
     return 0;
 }
 
@@ -187,6 +544,7 @@ void *sender_fn(void *arg)
 #endif
 {
     char line[PAYLOAD_SIZE - 64];
+    aff_pin(AFF_TX, 0);
     while (running) {
         printf("You: ");
         fflush(stdout);
@@ -208,71 +566,150 @@ void *sender_fn(void *arg)
             continue;
         }
 
-        if (!peer_addr_known) {
-            printf("[WARN] Peer address not known yet. Message not sent.\n");
+        if (outbox) {
+            // Logged, then delivered in order by the pump without waiting
+            // for the sync; the next line waits for it instead
+            uint64_t id = outbox_push(outbox, line);
+            if (!id) continue;
+            if (!peer_addr_known)
+                printf("[INFO] Peer not connected yet; message queued (%d pending).\n", outbox_count(outbox));
+            pump_outbox();
+            outbox_sync(outbox, id);
             continue;
         }
 
-        // Track latency
-        perf_add_pending_message(line);
-
-        Packet tx_packet;
-        tx_packet.type = PKT_MSG;
-
-        unsigned char encrypted_payload[PAYLOAD_SIZE];
-        int enc_len = encrypt_message((unsigned char*)line, strlen(line), (unsigned char*)SECRET_KEY, encrypted_payload, PAYLOAD_SIZE);
-        if (enc_len < 0) {
-            fprintf(stderr, "[ERROR] Failed to encrypt message.\n");
+        if (!peer_addr_known) {
+            printf("[WARN] Peer address not known yet. Message not sent.\n");
             continue;
         }
-        memcpy(tx_packet.payload, encrypted_payload, enc_len);
-        tx_packet.payload_len = enc_len;
-
-        mutex_lock(&unacked_mutex);
-        if (unacked_count >= MAX_UNACKED_PACKETS) {
+        if (send_chat_packet(line, 0) == 0)
             printf("[WARN] Too many unacknowledged packets. Please wait.\n");
-            mutex_unlock(&unacked_mutex);
-            continue;
-        }
-        tx_packet.seq_num = next_seq_num_to_send++;
-        unacked_packets[unacked_count] = tx_packet;
-        sent_time_ms[unacked_count] = get_time_ms();
-        unacked_count++;
-        mutex_unlock(&unacked_mutex);
-
-        printf("[INFO] Sending MSG #%u...\n", tx_packet.seq_num);
-        sendto(sock, (char*)&tx_packet, sizeof(Packet), 0, (struct sockaddr*)&peer_addr, sizeof(peer_addr));
     }
     return 0;
 }
 
 /* -------------------- RETRANSMITTER -------------------- */
+// Timers on their own reactor: stats publishing, the SLO check, and a
+// retransmit scan that re-arms itself for the next RTO deadline. Its
+// wakeups run the outbox pump for the receive shards.
+static void pump_wake(reactor_t *r, void *arg) { (void)r; (void)arg; pump_outbox(); }
+
+static void publish_tick(reactor_t *r, void *arg) { (void)r; (void)arg; perf_publish(); }
+static void slo_tick(reactor_t *r, void *arg) { (void)r; (void)arg; perf_slo_check(); }
+
+static void retransmit_tick(reactor_t *r, void *arg) {
+    static Packet due[MAX_UNACKED_PACKETS];   // only this thread uses it
+
+    // Pick what is due under the lock; send it paced after releasing it,
+    // so ACK processing is never stuck behind the pacer
+    int n_due = 0;
+    mutex_lock(&unacked_mutex);
+    uint64_t now = get_time_ms();
+    uint64_t next = now + RETX_SCAN_MAX_MS;
+    int rto = path_rto_ms(&path, RTO_MIN_MS, TIMEOUT_MS);
+    uint32_t una = lowest_unacked();
+    for (int i = 0; i < unacked_count; i++) {
+        if (now - sent_time_ms[i] > (uint64_t)rto) {
+            due[n_due] = unacked_packets[i];
+            due[n_due++].una = una;   // Current, not as first sent
+            sent_time_ms[i] = now;
+            unacked_retx[i] = 1;
+            perf_count(PERF_CTR_RETRANSMIT, 1);
+            perf_peer_note(peer_stats, PERF_CTR_RETRANSMIT, 1);
+        }
+        uint64_t deadline = sent_time_ms[i] + (uint64_t)rto + 1;
+        if (deadline < next) next = deadline;
+    }
+    mutex_unlock(&unacked_mutex);
+
+    for (int i = 0; i < n_due && running; i++) {
+        printf("[TIMEOUT] Retrying MSG #%u...\n", due[i].seq_num);
+        perf_trace("retransmit", due[i].seq_num, due[i].payload_len);
+        P2P_PROBE2(retransmit, due[i].seq_num, due[i].payload_len);
+        paced_send(&due[i], PACKET_HDR_LEN + due[i].payload_len);
+    }
+    // Messages sent after this scan are due no sooner than RTO_MIN_MS from
+    // now, so the RETX_SCAN_MAX_MS cap catches them in time
+    uint64_t after = get_time_ms();
+    reactor_timer(r, next > after ? (int)(next - after) : 0, 0, retransmit_tick, arg);
+}
+
 #ifdef _WIN32
 DWORD WINAPI retransmitter_fn(LPVOID arg)
 #else
 void *retransmitter_fn(void *arg)
 #endif
 {
-    while(running) {
-#ifdef _WIN32
-        Sleep(100);
-#else
-        usleep(100 * 1000);
+    (void)arg;
+    aff_pin(AFF_TIMER, 0);
+    reactor_run(rt_reactor);
+    return 0;
+}
+
+/* -------------------- SERVER SHARDS -------------------- */
+/*
+ * Bind shard_count sockets to the same port with SO_REUSEPORT so the kernel
+ * hashes each peer's 4-tuple onto one of them. P2P_UDP_SHARDS overrides the
+ * default of one shard per CPU. With P2P_UDP_CPU_STEER=1 a classic BPF program
+ * instead picks the shard pinned to the CPU that took the packet off the NIC.
+ */
+static int open_server_shards(int port) {
+    shard_count = cfg_env_int("P2P_UDP_SHARDS", cfg_cpu_count());
+#if defined(_WIN32) || !defined(SO_REUSEPORT)
+    shard_count = 1;
 #endif
-        mutex_lock(&unacked_mutex);
-        uint64_t now = get_time_ms();
-        for (int i = 0; i < unacked_count; i++) {
-            if (now - sent_time_ms[i] > TIMEOUT_MS) {
-                printf("[TIMEOUT] Retrying MSG #%u...\n", unacked_packets[i].seq_num);
-                sendto(sock, (char*)&unacked_packets[i], sizeof(Packet), 0, (struct sockaddr*)&peer_addr, sizeof(peer_addr));
-                sent_time_ms[i] = now;
-            }
+    if (shard_count < 1) shard_count = 1;
+    if (shard_count > UDP_MAX_SHARDS) shard_count = UDP_MAX_SHARDS;
+
+    for (int i = 0; i < shard_count; i++) {
+        // Dual-stack where available, so IPv4 and IPv6 clients share the shards
+        sock_t s = net_bind_any(SOCK_DGRAM, port, shard_count > 1);
+        if (s == sock_invalid) {
+            perror("[ERROR] bind failed");
+            for (int j = 0; j < i; j++) close_socket(shard_socks[j]);
+            return -1;
         }
-        mutex_unlock(&unacked_mutex);
+        shard_socks[i] = s;
     }
+    sock = shard_socks[0];
+
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    if (shard_count > 1 && cfg_env_int("P2P_UDP_CPU_STEER", 0)) {
+        // A = cpu % shard_count; the kernel uses A as the index into the group
+        struct sock_filter code[] = {
+            { BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+            { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)shard_count },
+            { BPF_RET | BPF_A, 0, 0, 0 },
+        };
+        struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+        if (setsockopt(shard_socks[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+            perror("[WARN] setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+    }
+#endif
     return 0;
 }
 
+/* -------------------- OUTBOX -------------------- */
+// One outbox per peer (client: host_port, server: server_port), so queued
+// messages are only ever redelivered to the peer they were written for.
+static void open_outbox(const char *peer_key) {
+#ifdef _WIN32
+    _mkdir(LOG_DIR);
+#else
+    mkdir(LOG_DIR, 0755);
+#endif
+    char path[512];
+    outbox_path_for(path, sizeof(path), LOG_DIR, "udp", peer_key);
+    int sync_ms = cfg_env_int("P2P_OUTBOX_SYNC_MS", OUTBOX_DEFAULT_SYNC_MS);
+    outbox = outbox_open(path, sync_ms < 0 ? WAL_NO_SYNC : sync_ms);
+    if (!outbox) {
+        fprintf(stderr, "[WARN] Outbox unavailable; messages to an offline peer will be dropped.\n");
+        return;
+    }
+    int n = outbox_count(outbox);
+    if (n > 0) printf("[INFO] %d undelivered message(s) in the outbox will be sent once the peer is reachable.\n", n);
+}
+
 /* -------------------- MAIN -------------------- */
 int main(void) {
 #ifdef _WIN32
@@ -282,9 +719,9 @@ int main(void) {
 
     mutex_init(&peer_addr_mutex);
     mutex_init(&unacked_mutex);
-
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock == sock_invalid) { perror("[ERROR] socket creation failed"); return 1; }
+    mutex_init(&rx_mutex);
+    mutex_init(&pump_mutex);
+    mutex_init(&pace_mutex);
 
     printf("=== P2P UDP Chat (w/ Reliability) ===\nStart as (server/client)? ");
     char mode[32];
@@ -298,53 +735,110 @@ int main(void) {
     trim_newline(port_s);
     port = atoi(port_s);
 
+    char peer_key[96];
     if (strcmp(mode, "server") == 0) {
-        struct sockaddr_in server_addr;
-        memset(&server_addr, 0, sizeof(server_addr));
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        server_addr.sin_port = htons(port);
-
-        if (bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            perror("[ERROR] bind failed");
-            close_socket(sock);
-            return 1;
-        }
-        printf("[INFO] Server listening on port %d. Waiting for client...\n", port);
+        snprintf(peer_key, sizeof(peer_key), "server_%d", port);
+        if (open_server_shards(port) < 0) return 1;
+        printf("[INFO] Server listening on port %d (%d receive shard%s). Waiting for client...\n",
+               port, shard_count, shard_count == 1 ? "" : "s");
     } else {
         char ip_str[64];
-        printf("Enter server IP address: ");
+        printf("Enter server IP address or host name: ");
         fgets(ip_str, sizeof(ip_str), stdin);
         trim_newline(ip_str);
-        
-        memset(&peer_addr, 0, sizeof(peer_addr));
-        peer_addr.sin_family = AF_INET;
-        peer_addr.sin_port = htons(port);
-        inet_pton(AF_INET, ip_str, &peer_addr.sin_addr);
+        snprintf(peer_key, sizeof(peer_key), "%s_%d", ip_str, port);
+
+        // No handshake to race over UDP: take the resolver's preferred address
+        struct addrinfo *res = NULL;
+        if (net_resolve(ip_str, port, SOCK_DGRAM, &res) != 0) return 1;
+        memcpy(&peer_addr, res->ai_addr, res->ai_addrlen);
+        peer_addr_len = (socklen_t)res->ai_addrlen;
+        sock = socket(res->ai_family, SOCK_DGRAM, 0);
+        freeaddrinfo(res);
+        if (sock == sock_invalid) { perror("[ERROR] socket creation failed"); return 1; }
+        shard_socks[0] = sock;
+        shard_count = 1;
         peer_addr_known = 1;
         printf("[INFO] Client ready. Type a message to begin.\n");
     }
 
+    if (cfg_env_int("P2P_OUTBOX", 1)) open_outbox(peer_key);
+
     // --- Perf Initialization ---
     perf_init();
+    perf_slo_init(LOG_DIR);
+    hw_init();
+    perf_publish_init(strcmp(mode, "server") == 0 ? "udp-server" : "udp-client");
+    if (peer_addr_known) {
+        char peer_s[NET_ADDRSTRLEN];
+        net_format_addr((struct sockaddr*)&peer_addr, peer_s, sizeof(peer_s));
+        peer_stats = perf_peer(peer_s, "chat");
+        perf_set_peer(peer_stats);
+    }
+    path_init(&path);
+    tx_epoch = (uint32_t)get_time_ms();   // Later on every restart
+    init_pacing();
+    for (int i = 0; i < shard_count; i++) {
+        int buf = 2 * MIN_WINDOW * (int)sizeof(Packet);
+        net_grow_buffers(shard_socks[i], buf, buf);
+    }
 
-    // Start all threads
-    thread_t rx_thread = start_thread(receiver_fn, NULL);
+    // Start all threads: one receiver per shard; each pins itself (affinity.h)
+    aff_init();
+    thread_t rx_threads[UDP_MAX_SHARDS];
+    for (int i = 0; i < shard_count; i++) {
+        rx_reactors[i] = reactor_new(REACTOR_DEFAULT);
+        if (!rx_reactors[i] || reactor_add(rx_reactors[i], shard_socks[i], REACTOR_READ, on_datagram, NULL) < 0) {
+            fprintf(stderr, "[ERROR] Event loop unavailable.\n");
+            return 1;
+        }
+    }
+    rt_reactor = reactor_new(REACTOR_DEFAULT);
+    if (!rt_reactor) {
+        fprintf(stderr, "[ERROR] Event loop unavailable.\n");
+        return 1;
+    }
+    reactor_on_wake(rt_reactor, pump_wake, NULL);
+    reactor_timer(rt_reactor, 100, 100, publish_tick, NULL);
+    reactor_timer(rt_reactor, 1000, 1000, slo_tick, NULL);
+    reactor_timer(rt_reactor, RETX_SCAN_MAX_MS, 0, retransmit_tick, NULL);
+    for (int i = 0; i < shard_count; i++) {
+        rx_threads[i] = start_thread(receiver_fn, (void*)(intptr_t)i);
+    }
     thread_t tx_thread = start_thread(sender_fn, NULL);
     thread_t rt_thread = start_thread(retransmitter_fn, NULL);
+    pump_outbox(); // client: peer is known up front, resend last run's leftovers
 
-    join_thread(rx_thread);
     join_thread(tx_thread);
+    running = 0;
+    for (int i = 0; i < shard_count; i++) {
+        reactor_stop(rx_reactors[i]);
+        join_thread(rx_threads[i]);
+        reactor_free(rx_reactors[i]);
+    }
+    reactor_stop(rt_reactor);
     join_thread(rt_thread);
+    reactor_free(rt_reactor);
 
     if (peer_addr_known) {
         Packet fin_packet;
         fin_packet.type = PKT_FIN;
         fin_packet.seq_num = next_seq_num_to_send;
-        sendto(sock, (char*)&fin_packet, sizeof(Packet), 0, (struct sockaddr*)&peer_addr, sizeof(peer_addr));
+        fin_packet.epoch = tx_epoch;
+        fin_packet.una = next_seq_num_to_send;
+        fin_packet.payload_len = 0;
+        sendto(sock, (char*)&fin_packet, PACKET_HDR_LEN, 0, (struct sockaddr*)&peer_addr, peer_addr_len);
     }
 
-    close_socket(sock);
+    for (int i = 0; i < shard_count; i++) close_socket(shard_socks[i]);
+    printf("[INFO] %lu message(s) sent, %lu retransmission(s).\n",
+           (unsigned long)perf_counter(PERF_CTR_SENT), (unsigned long)perf_counter(PERF_CTR_RETRANSMIT));
+    perf_publish_close();
+    if (outbox) {
+        int left = outbox_count(outbox);
+        if (left > 0) printf("[INFO] %d undelivered message(s) kept in the outbox for next time.\n", left);
+        outbox_close(outbox);
+    }
 #ifdef _WIN32
     WSACleanup();
 #endif
@@ -11,6 +11,10 @@
  */
 
 #include "utils.h"
+#include "net.h"
+#include "probes.h"
+#include "hwcount.h"
+#include "statshm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +25,7 @@
     #include <windows.h>
 #else
     #include <sys/time.h>
+    #include <unistd.h>
 #endif
 
 /* Global performance statistics */
@@ -28,6 +33,48 @@ static perf_stats_t g_stats = {0};
 static pending_msg_t pending_messages[MAX_PENDING_MSGS];
 static int pending_count = 0;
 static uint32_t next_sequence = 1;
+static path_est_t g_path;
+
+/* Per-peer table; see peer_stats_t */
+static peer_stats_t g_peers[PERF_MAX_PEERS];
+static perf_peer_t g_cur_peer = -1;
+
+static peer_stats_t *peer_get(perf_peer_t p);
+static void peer_record_rtt(peer_stats_t *e, double latency_ms);
+
+#ifdef _WIN32
+    #define ring_next(p) ((uint32_t)InterlockedIncrement((volatile LONG*)(p)) - 1)
+    #define counter_add(p, n) InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(n))
+#else
+    #define ring_next(p) __sync_fetch_and_add((p), 1)
+    #define counter_add(p, n) __sync_fetch_and_add((p), (n))
+#endif
+
+static volatile uint64_t g_counters[PERF_CTR_COUNT];
+static statshm_t *g_shm = NULL;
+
+/* SLO watchdog state */
+typedef struct {
+    uint64_t ts_us;
+    double rtt_ms;
+} rtt_sample_t;
+
+typedef struct {
+    uint64_t ts_us;
+    const char *event;
+    uint32_t seq;
+    int64_t value;
+} trace_entry_t;
+
+static rtt_sample_t rtt_samples[SLO_MAX_SAMPLES];
+static volatile uint32_t rtt_next = 0;
+static trace_entry_t trace_ring[TRACE_RING_SIZE];
+static volatile uint32_t trace_next = 0;
+static int slo_p99_ms = 0;
+static int slo_window_s = 10;
+static int slo_max_pending = 0;
+static char slo_dump_dir[256] = ".";
+static uint64_t slo_last_alert_us = 0;
 
 /* Platform-specific high-resolution timer */
 static uint64_t get_timestamp_us(void) {
@@ -59,6 +106,9 @@ void perf_init(void) {
     memset(pending_messages, 0, sizeof(pending_messages));
     pending_count = 0;
     next_sequence = 1;
+    path_init(&g_path);
+    memset(g_peers, 0, sizeof(g_peers));
+    g_cur_peer = -1;
     
     printf("[PERF] Performance monitoring initialized\n");
 }
@@ -75,6 +125,12 @@ uint32_t perf_add_pending_message(const char *message) {
     pending_msg_t *msg = &pending_messages[pending_count++];
     msg->sequence = next_sequence++;
     msg->timestamp = get_timestamp_us();
+    msg->peer = g_cur_peer;
+    peer_stats_t *e = peer_get(g_cur_peer);
+    if (e) {
+        e->sent++;
+        e->last_us = msg->timestamp;
+    }
     strncpy(msg->content, message, MAX_MSG_LEN - 1);
     msg->content[MAX_MSG_LEN - 1] = '\0';
     
@@ -99,6 +155,18 @@ int perf_acknowledge_message(uint32_t sequence) {
             if (g_stats.min_latency == 0.0 || latency_ms < g_stats.min_latency) {
                 g_stats.min_latency = latency_ms;
             }
+            path_on_rtt(&g_path, latency_ms);
+            peer_stats_t *e = peer_get(pending_messages[i].peer);
+            if (e) {
+                peer_record_rtt(e, latency_ms);
+                e->last_us = now;
+            }
+
+            rtt_sample_t *sample = &rtt_samples[ring_next(&rtt_next) % SLO_MAX_SAMPLES];
+            sample->ts_us = now;
+            sample->rtt_ms = latency_ms;
+            perf_trace("ack", sequence, (int64_t)(latency_ms * 1000.0));
+            P2P_PROBE2(ack__recv, sequence, now - pending_messages[i].timestamp);
             
             /* Remove from pending list */
             memmove(&pending_messages[i], &pending_messages[i + 1],
@@ -126,6 +194,8 @@ void perf_display_stats(void) {
     printf("Max Latency: %.2f ms\n", g_stats.max_latency);
     printf("Pending Messages: %d\n", pending_count);
     printf("===============================\n\n");
+    perf_display_peers(PERF_WORST_N);
+    hw_report();
 }
 
 /* Reset performance statistics */
@@ -143,6 +213,8 @@ int perf_format_message(char *buffer, size_t buffer_size, const char *message) {
     
     if (ret >= (int)buffer_size) {
         /* Truncated, remove from pending */
+        peer_stats_t *e = peer_get(pending_messages[pending_count - 1].peer);
+        if (e) e->sent--;
         pending_count--;
         return -1;
     }
@@ -178,6 +250,7 @@ int perf_parse_message(const char *raw_message, char *clean_message,
 int perf_send_ack(sock_t socket, uint32_t sequence, const unsigned char *key) {
     char ack_msg[64];
     snprintf(ack_msg, sizeof(ack_msg), "ACK:%u", sequence);
+    P2P_PROBE1(ack__send, sequence);
     
     /* Encrypt and send acknowledgment */
     unsigned char encrypted[128];
@@ -189,13 +262,7 @@ int perf_send_ack(sock_t socket, uint32_t sequence, const unsigned char *key) {
         return -1;
     }
     
-#ifdef _WIN32
-    int sent = send(socket, (const char*)encrypted, enc_len, 0);
-    return (sent == SOCKET_ERROR) ? -1 : 0;
-#else
-    ssize_t sent = send(socket, (const char*)encrypted, enc_len, 0);
-    return (sent < 0) ? -1 : 0;
-#endif
+    return net_send_frame(socket, encrypted, enc_len);
 }
 
 /* Handle received acknowledgment */
@@ -218,6 +285,8 @@ void perf_cleanup_expired(uint64_t timeout_ms) {
             /* Message expired */
             printf("[PERF] Message #%u expired (timeout)\n", 
                    pending_messages[i].sequence);
+            peer_stats_t *e = peer_get(pending_messages[i].peer);
+            if (e) e->expired++;
             
             /* Remove from list */
             memmove(&pending_messages[i], &pending_messages[i + 1],
@@ -258,3 +327,463 @@ void perf_get_timestamp_str(char *buffer, size_t buffer_size) {
     strftime(buffer, buffer_size, "%H:%M:%S", &tm_);
 #endif
 }
+
+
+/* Per-thread CPU time, for comparing send strategies */
+double perf_thread_cpu_ms(void) {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) return 0.0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime; k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;   u.HighPart = user.dwHighDateTime;
+    return (double)(k.QuadPart + u.QuadPart) / 10000.0;   /* 100 ns units */
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0.0;
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+/* ---------- path estimator ---------- */
+
+void path_init(path_est_t *p) {
+    memset(p, 0, sizeof(*p));
+}
+
+void path_on_rtt(path_est_t *p, double rtt_ms) {
+    if (rtt_ms <= 0.0) return;
+    if (p->srtt_ms == 0.0) {
+        p->srtt_ms = rtt_ms;
+        p->rttvar_ms = rtt_ms / 2.0;
+    } else {
+        p->rttvar_ms = 0.75 * p->rttvar_ms + 0.25 * fabs(p->srtt_ms - rtt_ms);
+        p->srtt_ms = 0.875 * p->srtt_ms + 0.125 * rtt_ms;
+    }
+    if (p->min_rtt_ms == 0.0 || rtt_ms < p->min_rtt_ms) p->min_rtt_ms = rtt_ms;
+}
+
+void path_on_delivery(path_est_t *p, uint64_t bytes, double elapsed_ms) {
+    if (elapsed_ms <= 0.0 || bytes == 0) return;
+    p->bw_samples[p->bw_next] = bytes * 1000.0 / elapsed_ms;
+    p->bw_next = (p->bw_next + 1) % PATH_BW_SAMPLES;
+
+    /* Windowed max, as the bottleneck rate is what a full pipe achieves */
+    p->btl_bw = 0.0;
+    for (int i = 0; i < PATH_BW_SAMPLES; i++) {
+        if (p->bw_samples[i] > p->btl_bw) p->btl_bw = p->bw_samples[i];
+    }
+}
+
+double path_bdp_bytes(const path_est_t *p) {
+    double rtt = p->min_rtt_ms > 0.0 ? p->min_rtt_ms : p->srtt_ms;
+    if (p->btl_bw <= 0.0 || rtt <= 0.0) return PATH_DEFAULT_BDP;
+    return p->btl_bw * rtt / 1000.0;
+}
+
+int path_rto_ms(const path_est_t *p, int lo_ms, int hi_ms) {
+    if (p->srtt_ms == 0.0) return hi_ms;
+    double rto = p->srtt_ms + 4.0 * p->rttvar_ms;
+    if (rto < lo_ms) return lo_ms;
+    if (rto > hi_ms) return hi_ms;
+    return (int)rto;
+}
+
+size_t path_pick_chunk(const path_est_t *p, size_t lo, size_t hi) {
+    double want = p->btl_bw > 0.0 ? p->btl_bw * PATH_CHUNK_MS / 1000.0 : (double)(lo * 4);
+    size_t n = want < (double)lo ? lo : (want > (double)hi ? hi : (size_t)want);
+    return n & ~(size_t)15;   /* whole AES blocks, so padding stays one block */
+}
+
+path_est_t *perf_path(void) {
+    return &g_path;
+}
+
+/* ---------- token bucket ---------- */
+
+uint64_t perf_now_us(void) {
+    return get_timestamp_us();
+}
+
+static void tb_refill(token_bucket_t *tb) {
+    uint64_t now = get_timestamp_us();
+    if (tb->rate > 0.0 && now > tb->last_us) {
+        tb->tokens += (now - tb->last_us) * tb->rate / 1e6;
+        if (tb->tokens > tb->burst) tb->tokens = tb->burst;
+    }
+    tb->last_us = now;
+}
+
+void tb_init(token_bucket_t *tb, double rate, double burst) {
+    tb->rate = rate;
+    tb->burst = burst;
+    tb->tokens = burst;
+    tb->last_us = get_timestamp_us();
+}
+
+void tb_set_rate(token_bucket_t *tb, double rate, double burst) {
+    tb_refill(tb);
+    tb->rate = rate;
+    tb->burst = burst;
+    if (tb->tokens > burst) tb->tokens = burst;
+}
+
+uint64_t tb_reserve(token_bucket_t *tb, size_t bytes) {
+    if (tb->rate <= 0.0) return 0;
+    tb_refill(tb);
+    tb->tokens -= (double)bytes;
+    if (tb->tokens >= 0.0) return 0;
+    return (uint64_t)(-tb->tokens * 1e6 / tb->rate);
+}
+
+int tb_try_take(token_bucket_t *tb, size_t bytes) {
+    if (tb->rate <= 0.0) return 1;
+    tb_refill(tb);
+    if (tb->tokens < (double)bytes) return 0;
+    tb->tokens -= (double)bytes;
+    return 1;
+}
+
+/* ---------- SLO watchdog ---------- */
+
+void perf_trace(const char *event, uint32_t seq, int64_t value) {
+    trace_entry_t *e = &trace_ring[ring_next(&trace_next) % TRACE_RING_SIZE];
+    e->ts_us = get_timestamp_us();
+    e->event = event;
+    e->seq = seq;
+    e->value = value;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* RTTs of the last window_s seconds, sorted, in a static buffer: only
+ * the housekeeping thread (watchdog, publisher) calls this */
+static const double *window_sorted(int window_s, int *count) {
+    static double vals[SLO_MAX_SAMPLES];
+    uint64_t now = get_timestamp_us();
+    uint64_t horizon = (uint64_t)window_s * 1000000ULL;
+    int n = 0;
+    for (int i = 0; i < SLO_MAX_SAMPLES; i++) {
+        if (rtt_samples[i].ts_us != 0 && now - rtt_samples[i].ts_us <= horizon)
+            vals[n++] = rtt_samples[i].rtt_ms;
+    }
+    qsort(vals, n, sizeof(double), cmp_double);
+    *count = n;
+    return vals;
+}
+
+static double sorted_percentile(const double *vals, int n, double pct) {
+    if (n == 0) return 0.0;
+    double rank = pct / 100.0 * n;       /* nearest-rank: ceil(rank) - 1 */
+    int idx = (int)rank;
+    if (rank > idx) idx++;
+    idx--;
+    if (idx < 0) idx = 0;
+    if (idx >= n) idx = n - 1;
+    return vals[idx];
+}
+
+double perf_window_percentile(double pct, int window_s, int *count) {
+    int n;
+    const double *vals = window_sorted(window_s, &n);
+    if (count) *count = n;
+    return sorted_percentile(vals, n, pct);
+}
+
+void perf_slo_init(const char *dump_dir) {
+    slo_p99_ms = cfg_env_int("P2P_SLO_P99_MS", 0);
+    slo_window_s = cfg_env_int("P2P_SLO_WINDOW_S", 10);
+    slo_max_pending = cfg_env_int("P2P_SLO_MAX_PENDING", 0);
+    if (slo_window_s < 1) slo_window_s = 1;
+    snprintf(slo_dump_dir, sizeof(slo_dump_dir), "%s", dump_dir);
+    if (slo_p99_ms > 0)
+        printf("[PERF] SLO watchdog: p99 RTT <= %d ms over %d s\n", slo_p99_ms, slo_window_s);
+    if (slo_max_pending > 0)
+        printf("[PERF] SLO watchdog: at most %d messages awaiting ACK\n", slo_max_pending);
+}
+
+int perf_dump_diagnostics(const char *reason, char *path_out, size_t path_sz) {
+    time_t t = time(NULL);
+    struct tm tm_;
+#ifdef _WIN32
+    localtime_s(&tm_, &t);
+#else
+    localtime_r(&t, &tm_);
+#endif
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm_);
+    snprintf(path_out, path_sz, "%s/diag_%s.txt", slo_dump_dir, stamp);
+
+    FILE *f = fopen(path_out, "w");
+    if (!f) return -1;
+
+    uint64_t now = get_timestamp_us();
+    int n = 0;
+    const double *vals = window_sorted(slo_window_s, &n);
+    double p50 = sorted_percentile(vals, n, 50.0);
+    double p90 = sorted_percentile(vals, n, 90.0);
+    double p99 = sorted_percentile(vals, n, 99.0);
+    double pmax = sorted_percentile(vals, n, 100.0);
+
+    fprintf(f, "Reason: %s\n", reason);
+    fprintf(f, "\n== SLO ==\n");
+    fprintf(f, "p99 limit: %d ms, window: %d s, pending limit: %d\n", slo_p99_ms, slo_window_s, slo_max_pending);
+    fprintf(f, "window samples: %d  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f ms\n", n, p50, p90, p99, pmax);
+    fprintf(f, "\n== Stats ==\n");
+    fprintf(f, "total %u  avg %.3f  min %.3f  max %.3f ms  pending %d\n", g_stats.total_messages,
+            g_stats.avg_latency, g_stats.min_latency, g_stats.max_latency, pending_count);
+    fprintf(f, "path: srtt %.3f ms  rttvar %.3f ms  min_rtt %.3f ms  bw %.0f B/s\n",
+            g_path.srtt_ms, g_path.rttvar_ms, g_path.min_rtt_ms, g_path.btl_bw);
+    fprintf(f, "\n== Pending (seq, age ms) ==\n");
+    for (int i = 0; i < pending_count; i++) {
+        fprintf(f, "%u %.3f\n", pending_messages[i].sequence, (now - pending_messages[i].timestamp) / 1000.0);
+    }
+
+    /* Oldest first; times are relative to now */
+    fprintf(f, "\n== Trace (age ms, event, seq, value) ==\n");
+    uint32_t end = trace_next;
+    uint32_t start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+    for (uint32_t i = start; i < end; i++) {
+        const trace_entry_t *e = &trace_ring[i % TRACE_RING_SIZE];
+        if (!e->event) continue;
+        fprintf(f, "-%.3f %s %u %lld\n", (now - e->ts_us) / 1000.0, e->event, e->seq, (long long)e->value);
+    }
+    fclose(f);
+    return 0;
+}
+
+int perf_slo_check(void) {
+    if (slo_p99_ms <= 0 && slo_max_pending <= 0) return 0;
+
+    char reason[160];
+    reason[0] = '\0';
+    if (slo_p99_ms > 0) {
+        int n = 0;
+        double p99 = perf_window_percentile(99.0, slo_window_s, &n);
+        if (n >= SLO_MIN_SAMPLES && p99 > slo_p99_ms) {
+            snprintf(reason, sizeof(reason), "p99 RTT %.2f ms > %d ms over the last %d s (%d samples)",
+                     p99, slo_p99_ms, slo_window_s, n);
+        }
+    }
+    if (!reason[0] && slo_max_pending > 0 && pending_count > slo_max_pending) {
+        snprintf(reason, sizeof(reason), "%d messages awaiting ACK > %d", pending_count, slo_max_pending);
+    }
+    if (!reason[0]) return 0;
+
+    uint64_t now = get_timestamp_us();
+    if (slo_last_alert_us && now - slo_last_alert_us < SLO_ALERT_COOLDOWN_S * 1000000ULL) return 0;
+    slo_last_alert_us = now;
+    perf_count(PERF_CTR_SLO_ALERTS, 1);
+
+    char path[320];
+    if (perf_dump_diagnostics(reason, path, sizeof(path)) == 0)
+        printf("\n[ALERT] SLO breach: %s; diagnostics in %s\n", reason, path);
+    else
+        printf("\n[ALERT] SLO breach: %s (could not write diagnostics)\n", reason);
+    return 1;
+}
+
+/* ---------- per-peer stats ---------- */
+
+/* Handle = generation << 8 | slot */
+static peer_stats_t *peer_get(perf_peer_t p) {
+    if (p < 0) return NULL;
+    int slot = p & 0xff;
+    if (slot >= PERF_MAX_PEERS || g_peers[slot].gen != ((uint32_t)p >> 8)) return NULL;
+    return &g_peers[slot];
+}
+
+/* 0..15 us exact, then 4 buckets per power of two */
+static int hist_bucket(double ms) {
+    uint64_t us = ms <= 0 ? 0 : (uint64_t)(ms * 1000.0);
+    if (us < 16) return (int)us;
+    int msb = 0;
+    for (uint64_t v = us; v > 1; v >>= 1) msb++;
+    int idx = 16 + (msb - 4) * 4 + (int)((us >> (msb - 2)) & 3);
+    return idx < PERF_HIST_BUCKETS ? idx : PERF_HIST_BUCKETS - 1;
+}
+
+/* Upper edge of a bucket in ms */
+static double hist_upper_ms(int idx) {
+    if (idx < 16) return (idx + 1) / 1000.0;
+    int msb = 4 + (idx - 16) / 4;
+    int sub = (idx - 16) % 4;
+    return (double)((uint64_t)(5 + sub) << (msb - 2)) / 1000.0;
+}
+
+static void peer_record_rtt(peer_stats_t *e, double latency_ms) {
+    e->acked++;
+    e->hist[hist_bucket(latency_ms)]++;
+    if (latency_ms > e->max_ms) e->max_ms = latency_ms;
+}
+
+static double peer_percentile(const peer_stats_t *e, double pct) {
+    if (e->acked == 0) return 0.0;
+    double exact = pct / 100.0 * e->acked;   /* nearest rank: ceil */
+    uint64_t rank = (uint64_t)exact;
+    if (rank < exact || rank < 1) rank++;
+    uint64_t seen = 0;
+    for (int i = 0; i < PERF_HIST_BUCKETS; i++) {
+        seen += e->hist[i];
+        if (seen >= rank) {
+            double upper = hist_upper_ms(i);
+            return upper < e->max_ms ? upper : e->max_ms;
+        }
+    }
+    return e->max_ms;
+}
+
+/* Share of sent messages that expired or had to be retransmitted, in % */
+static double peer_loss_pct(const peer_stats_t *e) {
+    if (e->sent == 0) return 0.0;
+    return 100.0 * (double)(e->expired + e->retransmits) / (double)e->sent;
+}
+
+perf_peer_t perf_peer(const char *peer, const char *stream) {
+    int victim = 0;
+    for (int i = 0; i < PERF_MAX_PEERS; i++) {
+        peer_stats_t *e = &g_peers[i];
+        if (e->peer[0] && strcmp(e->peer, peer) == 0 && strcmp(e->stream, stream) == 0) {
+            e->last_us = get_timestamp_us();
+            return (perf_peer_t)(e->gen << 8 | (uint32_t)i);
+        }
+        /* Free slots first, then the least recently active */
+        if (g_peers[victim].peer[0] && (!e->peer[0] || e->last_us < g_peers[victim].last_us)) victim = i;
+    }
+
+    peer_stats_t *e = &g_peers[victim];
+    uint32_t gen = (e->gen + 1) & 0xffffff;
+    memset(e, 0, sizeof(*e));
+    e->gen = gen;
+    snprintf(e->peer, sizeof(e->peer), "%s", peer);
+    snprintf(e->stream, sizeof(e->stream), "%s", stream);
+    e->last_us = get_timestamp_us();
+    return (perf_peer_t)(gen << 8 | (uint32_t)victim);
+}
+
+void perf_set_peer(perf_peer_t p) {
+    g_cur_peer = p;
+}
+
+void perf_peer_note(perf_peer_t p, perf_counter_t c, uint64_t n) {
+    peer_stats_t *e = peer_get(p);
+    if (!e) return;
+    if (c == PERF_CTR_RETRANSMIT) e->retransmits += n;
+    else if (c == PERF_CTR_FILE_IN || c == PERF_CTR_FILE_OUT) e->bytes += n;
+    else if (c == PERF_CTR_SENT) e->sent += n;
+    e->last_us = get_timestamp_us();
+}
+
+static int cmp_p99_desc(const void *a, const void *b) {
+    double x = peer_percentile(*(peer_stats_t* const*)a, 99.0);
+    double y = peer_percentile(*(peer_stats_t* const*)b, 99.0);
+    return (x < y) - (x > y);
+}
+
+static int cmp_loss_desc(const void *a, const void *b) {
+    double x = peer_loss_pct(*(peer_stats_t* const*)a);
+    double y = peer_loss_pct(*(peer_stats_t* const*)b);
+    return (x < y) - (x > y);
+}
+
+static void print_peer_rows(peer_stats_t **rows, int count, int n) {
+    printf("%-40s %6s %6s %8s %8s %8s %6s %10s\n",
+           "peer / stream", "sent", "acked", "p50 ms", "p99 ms", "max ms", "loss%", "file bytes");
+    for (int i = 0; i < count && i < n; i++) {
+        peer_stats_t *e = rows[i];
+        char name[PERF_PEER_KEY_LEN + PERF_STREAM_LEN + 2];
+        snprintf(name, sizeof(name), "%s %s", e->peer, e->stream);
+        printf("%-40.40s %6llu %6llu %8.2f %8.2f %8.2f %6.1f %10llu\n", name,
+               (unsigned long long)e->sent, (unsigned long long)e->acked,
+               peer_percentile(e, 50.0), peer_percentile(e, 99.0), e->max_ms,
+               peer_loss_pct(e), (unsigned long long)e->bytes);
+    }
+}
+
+void perf_display_peers(int n) {
+    peer_stats_t *rows[PERF_MAX_PEERS];
+    int count = 0;
+    for (int i = 0; i < PERF_MAX_PEERS; i++) {
+        if (g_peers[i].peer[0]) rows[count++] = &g_peers[i];
+    }
+    if (count == 0) return;
+
+    printf("=== Worst Peers by p99 RTT ===\n");
+    qsort(rows, count, sizeof(rows[0]), cmp_p99_desc);
+    print_peer_rows(rows, count, n);
+    printf("\n=== Worst Peers by Loss ===\n");
+    qsort(rows, count, sizeof(rows[0]), cmp_loss_desc);
+    print_peer_rows(rows, count, n);
+    printf("===============================\n\n");
+}
+
+/* ---------- counters and the shared-memory view ---------- */
+
+void perf_count(perf_counter_t c, uint64_t n) {
+    counter_add(&g_counters[c], n);
+}
+
+uint64_t perf_counter(perf_counter_t c) {
+    return g_counters[c];
+}
+
+void perf_publish_init(const char *role) {
+    g_shm = statshm_create(role);
+    if (!g_shm) printf("[WARN] Stats segment unavailable; p2pchat_top will not see this process.\n");
+}
+
+void perf_publish(void) {
+    if (!g_shm) return;
+    int window_s = slo_window_s;
+    int n;
+    const double *vals = window_sorted(window_s, &n);
+
+    statshm_write_begin(g_shm);
+    g_shm->updated_unix = (uint64_t)time(NULL);
+    g_shm->stats = g_stats;
+    g_shm->pending = pending_count;
+    g_shm->window_s = window_s;
+    g_shm->window_samples = (uint32_t)n;
+    g_shm->p50_ms = sorted_percentile(vals, n, 50.0);
+    g_shm->p99_ms = sorted_percentile(vals, n, 99.0);
+    g_shm->srtt_ms = g_path.srtt_ms;
+    g_shm->rttvar_ms = g_path.rttvar_ms;
+    g_shm->min_rtt_ms = g_path.min_rtt_ms;
+    g_shm->btl_bw = g_path.btl_bw;
+    for (int i = 0; i < PERF_CTR_COUNT; i++) g_shm->counters[i] = g_counters[i];
+    statshm_write_end(g_shm);
+}
+
+void perf_publish_close(void) {
+    statshm_destroy(g_shm);
+    g_shm = NULL;
+}
+
+/* Read an integer tunable from the environment, falling back to default_value */
+int cfg_env_int(const char *name, int default_value) {
+    const char *v = getenv(name);
+    if (!v || !*v) return default_value;
+
+    char *end = NULL;
+    long n = strtol(v, &end, 10);
+    if (*end != '\0') {
+        fprintf(stderr, "[WARN] Ignoring invalid %s='%s'\n", name, v);
+        return default_value;
+    }
+    return (int)n;
+}
+
+/* Number of online CPUs (at least 1) */
+int cfg_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
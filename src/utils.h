@@ -35,13 +35,85 @@ typedef struct {
     double max_latency;         /* Maximum latency in ms */
 } perf_stats_t;
 
+/* Handle of a per-peer stats entry (see perf_peer); -1 = none */
+typedef int32_t perf_peer_t;
+
 /* Pending message structure for tracking */
 typedef struct {
     uint32_t sequence;          /* Unique sequence number */
     uint64_t timestamp;         /* Send timestamp in microseconds */
+    perf_peer_t peer;           /* Entry the RTT is charged to */
     char content[MAX_MSG_LEN];  /* Original message content */
 } pending_msg_t;
 
+/* Path estimator: RTT from ACK timing, bottleneck bandwidth from transfer
+ * progress. Like the perf_* state it is not locked; callers serialize. */
+#define PATH_BW_SAMPLES 10          /* Delivery-rate samples kept for the max filter */
+#define PATH_DEFAULT_BDP 65536      /* Assumed bandwidth-delay product before any samples */
+#define PATH_CHUNK_MS 2             /* Target serialization time of one transfer chunk */
+
+typedef struct {
+    double srtt_ms;                 /* Smoothed RTT (RFC 6298); 0 until the first sample */
+    double rttvar_ms;               /* RTT variation */
+    double min_rtt_ms;              /* Lowest RTT seen: the propagation delay */
+    double bw_samples[PATH_BW_SAMPLES]; /* Recent delivery rates, bytes/s */
+    int bw_next;
+    double btl_bw;                  /* Max of the recent samples, bytes/s; 0 if unknown */
+} path_est_t;
+
+/* Token bucket: rate bytes/s refilling up to burst bytes. Reservations may
+ * run the bucket negative, which turns into a wait for later callers, so
+ * concurrent senders are spread out instead of all passing at once. Not
+ * locked; callers serialize. */
+typedef struct {
+    double rate;                    /* Bytes per second; <= 0 means unlimited */
+    double burst;                   /* Bucket depth in bytes */
+    double tokens;
+    uint64_t last_us;
+} token_bucket_t;
+
+/* SLO watchdog: RTT samples for windowed percentiles, and a ring of recent
+ * hot-path events that is written out with the stats when an SLO breaks */
+#define SLO_MAX_SAMPLES 4096        /* RTT samples kept (oldest overwritten) */
+#define SLO_MIN_SAMPLES 10          /* Fewer samples in the window: no percentile verdict */
+#define SLO_ALERT_COOLDOWN_S 60     /* At most one capture per minute */
+#define TRACE_RING_SIZE 1024        /* Hot-path events kept for diagnostics */
+
+/* Counters kept next to perf_stats_t and published with it (perf_count) */
+typedef enum {
+    PERF_CTR_SENT,              /* Chat messages sent (first transmission) */
+    PERF_CTR_RECV,              /* Chat messages received */
+    PERF_CTR_RETRANSMIT,        /* UDP retransmissions */
+    PERF_CTR_FILE_OUT,          /* File payload bytes sent */
+    PERF_CTR_FILE_IN,           /* File payload bytes received */
+    PERF_CTR_SLO_ALERTS,        /* SLO breaches reported */
+    PERF_CTR_COUNT
+} perf_counter_t;
+
+/* Per-peer, per-stream stats: a fixed table, least recently active entry
+ * evicted when a new peer/stream needs a slot. RTTs go into a log-scale
+ * histogram (4 buckets per power of two, so percentiles are within 25%).
+ * Like the perf_* state it is not locked; callers serialize. */
+#define PERF_MAX_PEERS 64
+#define PERF_PEER_KEY_LEN 64
+#define PERF_STREAM_LEN 16
+#define PERF_HIST_BUCKETS 160
+#define PERF_WORST_N 5              /* Rows in each worst-peers table */
+
+typedef struct {
+    char peer[PERF_PEER_KEY_LEN];   /* e.g. "192.168.1.5:5000"; empty = free slot */
+    char stream[PERF_STREAM_LEN];   /* "chat", "file", ... */
+    uint32_t gen;                   /* Bumped on reuse so old handles miss */
+    uint64_t last_us;               /* Last activity, for LRU eviction */
+    uint64_t sent;
+    uint64_t acked;
+    uint64_t expired;               /* Never ACKed within the timeout */
+    uint64_t retransmits;
+    uint64_t bytes;                 /* File payload moved */
+    double max_ms;
+    uint32_t hist[PERF_HIST_BUCKETS];
+} peer_stats_t;
+
 /* Function prototypes */
 
 /* Initialize performance monitoring system */
@@ -87,4 +159,94 @@ void perf_auto_display_stats(int interval);
 /* Get formatted timestamp string */
 void perf_get_timestamp_str(char *buffer, size_t buffer_size);
 
+/* CPU time consumed so far by the calling thread, in milliseconds */
+double perf_thread_cpu_ms(void);
+
+/* Reset an estimator to "nothing known" */
+void path_init(path_est_t *p);
+
+/* Feed one RTT measurement (use only ACKs of packets sent once) */
+void path_on_rtt(path_est_t *p, double rtt_ms);
+
+/* Feed a delivery-rate sample: bytes confirmed delivered over elapsed_ms */
+void path_on_delivery(path_est_t *p, uint64_t bytes, double elapsed_ms);
+
+/* Bandwidth-delay product in bytes (PATH_DEFAULT_BDP while unknown) */
+double path_bdp_bytes(const path_est_t *p);
+
+/* Retransmission timeout: srtt + 4 * rttvar, clamped to [lo_ms, hi_ms] */
+int path_rto_ms(const path_est_t *p, int lo_ms, int hi_ms);
+
+/* Chunk size carrying PATH_CHUNK_MS of bandwidth, clamped to [lo, hi] */
+size_t path_pick_chunk(const path_est_t *p, size_t lo, size_t hi);
+
+/* Process-wide estimator fed by perf_acknowledge_message */
+path_est_t *perf_path(void);
+
+/* Start a full bucket */
+void tb_init(token_bucket_t *tb, double rate, double burst);
+
+/* Change rate and depth, keeping the current fill */
+void tb_set_rate(token_bucket_t *tb, double rate, double burst);
+
+/* Take bytes now; returns how many microseconds the caller should wait
+ * before actually sending them (0 if within the budget) */
+uint64_t tb_reserve(token_bucket_t *tb, size_t bytes);
+
+/* Take bytes only if they are available right now; 1 if taken */
+int tb_try_take(token_bucket_t *tb, size_t bytes);
+
+/* Monotonic microsecond clock used by the buckets */
+uint64_t perf_now_us(void);
+
+/* Configure the watchdog from P2P_SLO_P99_MS, P2P_SLO_WINDOW_S and
+ * P2P_SLO_MAX_PENDING; diagnostics are written under dump_dir */
+void perf_slo_init(const char *dump_dir);
+
+/* Evaluate the SLOs now (call about once a second). On a breach logs an
+ * alert and dumps diagnostics; returns 1 if it did. */
+int perf_slo_check(void);
+
+/* pct-th percentile (0..100) of RTTs acknowledged in the last window_s
+ * seconds; *count receives the sample count. 0 if there are none. */
+double perf_window_percentile(double pct, int window_s, int *count);
+
+/* Record a hot-path event (event must be a string literal) */
+void perf_trace(const char *event, uint32_t seq, int64_t value);
+
+/* Entry for peer + stream, created (evicting the least recently active
+ * one if the table is full) when missing */
+perf_peer_t perf_peer(const char *peer, const char *stream);
+
+/* Charge messages tracked from now on to p */
+void perf_set_peer(perf_peer_t p);
+
+/* Per-peer counterpart of perf_count: PERF_CTR_RETRANSMIT counts
+ * retransmissions, PERF_CTR_FILE_IN/OUT file bytes */
+void perf_peer_note(perf_peer_t p, perf_counter_t c, uint64_t n);
+
+/* Print the n worst peers/streams by p99 RTT and by loss */
+void perf_display_peers(int n);
+
+/* Add n to a counter; safe from any thread */
+void perf_count(perf_counter_t c, uint64_t n);
+uint64_t perf_counter(perf_counter_t c);
+
+/* Publish stats in a shared-memory segment for p2pchat_top (role is shown
+ * there, e.g. "tcp-server"). perf_publish refreshes it; call it from one
+ * housekeeping thread only. */
+void perf_publish_init(const char *role);
+void perf_publish(void);
+void perf_publish_close(void);
+
+/* Write stats, SLO state and the trace ring to a new file under the dump
+ * directory; returns 0 and the path in path_out on success */
+int perf_dump_diagnostics(const char *reason, char *path_out, size_t path_sz);
+
+/* Read an integer tunable from the environment, falling back to default_value */
+int cfg_env_int(const char *name, int default_value);
+
+/* Number of online CPUs (at least 1) */
+int cfg_cpu_count(void);
+
 #endif /* UTILS_H */
@@ -0,0 +1,385 @@
+/*
+ * wal.c - Append-only log file with group commit
+ *
+ * Tickets are logical byte counts that only ever grow (truncation resets
+ * file_size, not the counters): an append's ticket is written_upto just
+ * after it, and it is durable once synced_upto >= ticket. The committer
+ * snapshots written_upto before calling fdatasync, so every append that
+ * completed before the sync started is covered by it.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "wal.h"
+#include "probes.h"
+#include "hwcount.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
+    typedef CRITICAL_SECTION wal_mutex_t;
+    typedef CONDITION_VARIABLE wal_cond_t;
+    typedef HANDLE wal_thread_t;
+#else
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <errno.h>
+    #include <pthread.h>
+    #include <time.h>
+    #include <sys/stat.h>
+    typedef pthread_mutex_t wal_mutex_t;
+    typedef pthread_cond_t wal_cond_t;
+    typedef pthread_t wal_thread_t;
+#endif
+
+struct wal {
+    int fd;
+    char path[512];
+    int window_ms;
+
+    wal_mutex_t lock;
+    wal_cond_t work_cv;        /* committer: new appends or shutdown */
+    wal_cond_t done_cv;        /* waiters: synced_upto advanced */
+    wal_thread_t committer;
+    int stopping;
+    int syncing;               /* committer is in file_sync on fd, unlocked */
+    uint64_t last_batch;       /* appends the previous sync covered */
+
+    uint64_t written_upto;     /* bytes ever handed to the kernel */
+    uint64_t synced_upto;      /* bytes ever known durable */
+    uint64_t file_size;        /* current length of the file */
+    uint64_t appends_since_sync;
+    uint64_t syncs;
+    uint64_t synced_appends;
+    int io_error;
+};
+
+/* ---------- primitives ---------- */
+
+static void wl_init(wal_t *w) {
+#ifdef _WIN32
+    InitializeCriticalSection(&w->lock);
+    InitializeConditionVariable(&w->work_cv);
+    InitializeConditionVariable(&w->done_cv);
+#else
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work_cv, NULL);
+    pthread_cond_init(&w->done_cv, NULL);
+#endif
+}
+static void wl_destroy(wal_t *w) {
+#ifdef _WIN32
+    DeleteCriticalSection(&w->lock);
+#else
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->work_cv);
+    pthread_cond_destroy(&w->done_cv);
+#endif
+}
+static void wl_lock(wal_t *w) {
+#ifdef _WIN32
+    EnterCriticalSection(&w->lock);
+#else
+    pthread_mutex_lock(&w->lock);
+#endif
+}
+static void wl_unlock(wal_t *w) {
+#ifdef _WIN32
+    LeaveCriticalSection(&w->lock);
+#else
+    pthread_mutex_unlock(&w->lock);
+#endif
+}
+static void wl_wait(wal_t *w, wal_cond_t *cv) {
+#ifdef _WIN32
+    SleepConditionVariableCS(cv, &w->lock, INFINITE);
+#else
+    pthread_cond_wait(cv, &w->lock);
+#endif
+}
+static void wl_wait_ms(wal_t *w, wal_cond_t *cv, int ms) {
+#ifdef _WIN32
+    SleepConditionVariableCS(cv, &w->lock, (DWORD)ms);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    pthread_cond_timedwait(cv, &w->lock, &ts);
+#endif
+}
+static void wl_broadcast(wal_cond_t *cv) {
+#ifdef _WIN32
+    WakeAllConditionVariable(cv);
+#else
+    pthread_cond_broadcast(cv);
+#endif
+}
+
+static int file_sync(int fd) {
+#ifdef _WIN32
+    return _commit(fd);
+#elif defined(__APPLE__)
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+/* Make a rename into path's directory durable */
+static int dir_sync(const char *path) {
+#ifdef _WIN32
+    (void)path;                /* MOVEFILE_WRITE_THROUGH already flushed it */
+    return 0;
+#else
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (!slash) snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir) dir[1] = '\0';
+    else *slash = '\0';
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+#endif
+}
+
+static int file_open_append(const char *path) {
+#ifdef _WIN32
+    return _open(path, _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+#endif
+}
+
+static int file_write_all(int fd, const void *data, size_t len) {
+    const char *p = (const char*)data;
+    while (len > 0) {
+#ifdef _WIN32
+        int n = _write(fd, p, (unsigned int)len);
+#else
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+#endif
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* ---------- committer ---------- */
+
+#ifdef _WIN32
+static DWORD WINAPI committer_fn(LPVOID arg)
+#else
+static void *committer_fn(void *arg)
+#endif
+{
+    wal_t *w = (wal_t*)arg;
+    wl_lock(w);
+    for (;;) {
+        while (!w->stopping && w->synced_upto == w->written_upto)
+            wl_wait(w, &w->work_cv);
+        if (w->synced_upto == w->written_upto && w->stopping) break;
+
+        /* Let the batch fill for one window before paying for the sync,
+         * but only while appends arrive together: a lone appender would
+         * wait out the window with nobody to share the sync */
+        if (w->window_ms > 0 && !w->stopping && (w->appends_since_sync > 1 || w->last_batch > 1))
+            wl_wait_ms(w, &w->work_cv, w->window_ms);
+
+        uint64_t target = w->written_upto;
+        uint64_t batch = w->appends_since_sync;
+        w->appends_since_sync = 0;
+        int fd = w->fd;
+        w->syncing = 1;        /* wal_replace must not close fd under us */
+        wl_unlock(w);
+
+        int rc = file_sync(fd);
+
+        wl_lock(w);
+        w->syncing = 0;
+        if (rc != 0) w->io_error = 1;
+        if (target > w->synced_upto) w->synced_upto = target;
+        w->syncs++;
+        w->synced_appends += batch;
+        w->last_batch = batch;
+        wl_broadcast(&w->done_cv);
+    }
+    wl_unlock(w);
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+/* ---------- public API ---------- */
+
+wal_t *wal_open(const char *path, int window_ms) {
+    wal_t *w = (wal_t*)calloc(1, sizeof(*w));
+    if (!w) return NULL;
+
+    w->fd = file_open_append(path);
+    if (w->fd < 0) {
+        perror("[ERROR] wal open");
+        free(w);
+        return NULL;
+    }
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    w->window_ms = window_ms;
+
+    struct stat st;
+    if (fstat(w->fd, &st) == 0) w->file_size = (uint64_t)st.st_size;
+
+    wl_init(w);
+    if (window_ms != WAL_NO_SYNC) {
+#ifdef _WIN32
+        w->committer = CreateThread(NULL, 0, committer_fn, w, 0, NULL);
+#else
+        pthread_create(&w->committer, NULL, committer_fn, w);
+#endif
+    }
+    return w;
+}
+
+uint64_t wal_append(wal_t *w, const void *data, size_t len) {
+    hw_mark_t hw;
+    hw_begin(&hw);
+    wl_lock(w);
+    if (file_write_all(w->fd, data, len) != 0) {
+        w->io_error = 1;
+        wl_unlock(w);
+        hw_end(&hw, HW_STAGE_LOGGING);
+        return 0;
+    }
+    w->written_upto += len;
+    w->file_size += len;
+    w->appends_since_sync++;
+    uint64_t ticket = w->written_upto;
+    if (w->window_ms == WAL_NO_SYNC) w->synced_upto = w->written_upto;
+    else wl_broadcast(&w->work_cv);
+    wl_unlock(w);
+    hw_end(&hw, HW_STAGE_LOGGING);
+    P2P_PROBE2(wal__append, ticket, len);
+    return ticket;
+}
+
+int wal_wait(wal_t *w, uint64_t ticket) {
+    if (ticket == 0) return -1;
+    wl_lock(w);
+    while (w->synced_upto < ticket && !w->io_error)
+        wl_wait(w, &w->done_cv);
+    int rc = w->io_error ? -1 : 0;
+    wl_unlock(w);
+    return rc;
+}
+
+uint64_t wal_size(wal_t *w) {
+    wl_lock(w);
+    uint64_t n = w->file_size;
+    wl_unlock(w);
+    return n;
+}
+
+int wal_replace(wal_t *w, const void *data, size_t len) {
+    char tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", w->path);
+
+    wl_lock(w);
+    while (w->syncing) wl_wait(w, &w->done_cv);
+#ifdef _WIN32
+    int fd = _open(tmp, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+#endif
+    int rc = -1;
+    if (fd >= 0 && file_write_all(fd, data, len) == 0 && file_sync(fd) == 0) {
+#ifdef _WIN32
+        _close(fd);
+        fd = -1;
+        _close(w->fd);         /* Windows won't replace an open file */
+        w->fd = -1;
+        rc = MoveFileExA(tmp, w->path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+#else
+        rc = rename(tmp, w->path);
+        if (rc == 0) {
+            close(w->fd);
+            w->fd = -1;
+        }
+#endif
+        if (w->fd < 0) {
+            /* Reopen whichever file is in place now */
+            w->fd = file_open_append(w->path);
+            if (w->fd < 0) w->io_error = 1;
+        }
+        if (rc == 0) {
+            w->file_size = len;
+            w->synced_upto = w->written_upto; /* older appends are superseded */
+            w->appends_since_sync = 0;
+            /* The new file is in place, but not durably until its directory is */
+            if (dir_sync(w->path) != 0) rc = -1;
+        }
+    }
+#ifdef _WIN32
+    if (fd >= 0) _close(fd);
+#else
+    if (fd >= 0) close(fd);
+#endif
+    if (rc != 0) remove(tmp);
+    wl_broadcast(&w->done_cv);
+    wl_unlock(w);
+    return rc;
+}
+
+int wal_truncate(wal_t *w) {
+    wl_lock(w);
+#ifdef _WIN32
+    int rc = _chsize_s(w->fd, 0) == 0 ? 0 : -1;
+#else
+    int rc = ftruncate(w->fd, 0);
+#endif
+    if (rc == 0) w->file_size = 0;
+    wl_unlock(w);
+    return rc;
+}
+
+void wal_sync_stats(wal_t *w, uint64_t *syncs, uint64_t *appends) {
+    wl_lock(w);
+    if (syncs) *syncs = w->syncs;
+    if (appends) *appends = w->synced_appends;
+    wl_unlock(w);
+}
+
+void wal_close(wal_t *w) {
+    if (!w) return;
+    wl_lock(w);
+    w->stopping = 1;
+    wl_broadcast(&w->work_cv);
+    wl_unlock(w);
+
+    if (w->window_ms != WAL_NO_SYNC) {
+#ifdef _WIN32
+        WaitForSingleObject(w->committer, INFINITE);
+        CloseHandle(w->committer);
+#else
+        pthread_join(w->committer, NULL);
+#endif
+    }
+#ifdef _WIN32
+    _close(w->fd);
+#else
+    close(w->fd);
+#endif
+    wl_destroy(w);
+    free(w);
+}
@@ -0,0 +1,48 @@
+/*
+ * wal.h - Append-only log file with group commit
+ *
+ * Appends go straight to the file (and so to the page cache). A committer
+ * thread makes them durable in batches: it waits up to window_ms for more
+ * appends to arrive, then issues one fdatasync that covers all of them.
+ * Callers that need durability wait on the ticket their append returned.
+ */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAL_NO_SYNC (-1)   /* window_ms value: never fsync (page cache only) */
+
+typedef struct wal wal_t;
+
+/* Open (creating if needed) path for appending. window_ms is the group
+ * commit window, used only while appends come from more than one caller
+ * at a time; 0 syncs as soon as the committer wakes, WAL_NO_SYNC disables
+ * syncing. Returns NULL on error. */
+wal_t *wal_open(const char *path, int window_ms);
+
+/* Append len bytes as one write; returns a commit ticket, or 0 on error */
+uint64_t wal_append(wal_t *w, const void *data, size_t len);
+
+/* Block until the append that returned ticket is durable; 0 on success */
+int wal_wait(wal_t *w, uint64_t ticket);
+
+/* Current size of the log in bytes */
+uint64_t wal_size(wal_t *w);
+
+/* Atomically replace the whole log with data (temp file + rename), durably */
+int wal_replace(wal_t *w, const void *data, size_t len);
+
+/* Cut the log back to empty. Not synced: after a crash the old records may
+ * reappear, so only use this where replaying them is harmless. */
+int wal_truncate(wal_t *w);
+
+/* Number of fdatasync calls issued and appends they covered */
+void wal_sync_stats(wal_t *w, uint64_t *syncs, uint64_t *appends);
+
+/* Sync anything outstanding, stop the committer and close */
+void wal_close(wal_t *w);
+
+#endif /* WAL_H */